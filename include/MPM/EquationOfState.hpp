@@ -0,0 +1,41 @@
+#pragma once
+
+// Usable both in host code and in CUDA kernels
+#ifdef __CUDACC__
+	#define EOS_QUALIFIER __host__ __device__ inline
+#else
+	#define EOS_QUALIFIER inline
+#endif
+
+/*
+Simplified equation of state (by nialltl): p = stiffness * ((density / rest_density) ^ power - 1), shared by the P2G kernels of the simulation backends.
+The power is usually a small integer (7 for water): the kernels are specialized for integer powers up to EOS_MAX_INTEGER_POWER, where the power is a chain of multiplications.
+The specialization is picked at runtime from the material with get_eos_integer_power(), powf is the generic fallback.
+*/
+const int EOS_MAX_INTEGER_POWER = 8;
+
+// power if it is an integer in [1, EOS_MAX_INTEGER_POWER], else 0 for the generic powf
+EOS_QUALIFIER int get_eos_integer_power(const float power)
+{
+	return power >= 1.0f && power <= (float) EOS_MAX_INTEGER_POWER && power == (float) (int) power ? (int) power : 0;
+}
+
+// x ^ POWER by squaring, for POWER >= 1. T is float, or any type with * (such as the VFloat of the CPU transfer kernels).
+template <int POWER, typename T>
+EOS_QUALIFIER T pow_int(const T& x)
+{
+	if constexpr (POWER == 1) return x;
+	else if constexpr (POWER % 2 == 0) {
+		const T half = pow_int<POWER / 2>(x);
+		return half * half;
+	}
+	else return pow_int<POWER - 1>(x) * x;
+}
+
+// x ^ integer_power (from get_eos_integer_power()) by the multiplication chain of its specialization, or generic(x) if 0. For code that picks the specialization at each call rather than at compile time.
+template <int POWER = EOS_MAX_INTEGER_POWER, typename T, typename Generic>
+EOS_QUALIFIER T pow_eos(const T& x, const int integer_power, const Generic& generic)
+{
+	if constexpr (POWER == 0) return generic(x);
+	else return integer_power == POWER ? pow_int<POWER>(x) : pow_eos<POWER - 1>(x, integer_power, generic);
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+// Simulation limits, shared by every simulation backend
+const unsigned int MIN_GRID_SIZE = 40;
+const unsigned int MAX_GRID_SIZE = 1024;	// Per dimension. Limited by the 10 bits per axis of Morton sort keys: the sparse grid only allocates cells where particles are.
+const unsigned int MAX_DENSE_CELLS_NUM = 240 * 240 * 240;	// Largest grid expanded into a dense copy by get_cells() (~220 MB, plus as much for its OpenGL buffer). Larger grids can't be visualized.
+const unsigned int PARTICLES_SPAWN_CUBE_SIZE = 32;	// 32 is max: used as part of kernel configuration	
+const unsigned int PARTICLES_SPAWN_NUM = PARTICLES_SPAWN_CUBE_SIZE * PARTICLES_SPAWN_CUBE_SIZE * PARTICLES_SPAWN_CUBE_SIZE;
+const unsigned int MAX_PARTICLES_NUM = 32 * 32 * 32 * 64;	// ~2 mln particles
+const unsigned int MAX_WHITEWATER_NUM = MAX_PARTICLES_NUM / 4;	// ~524k whitewater
+const float MIN_TIMESTEP_SCALE = 1.0f / 16.0f;	// Smallest timestep reduction after blow-up rollbacks (see SimulationBackend::advance())
\ No newline at end of file
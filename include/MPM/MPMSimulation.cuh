@@ -1,9 +1,6 @@
 #pragma once
 
-#include <glad/glad.h>
-
 #include <cuda.h>
-#include <cuda_gl_interop.h>
 #include <curand_kernel.h>
 
 #define GLM_FORCE_CUDA
@@ -11,67 +8,72 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/type_aligned.hpp>
 
-#include <MPM/ParticleMaterial.hpp>
+#include <MPM/SimulationBackend.hpp>
+#include <MPM/SparseGrid.hpp>
 
-class MPMSimulation
+class MPMSimulation : public SimulationBackend
 {
 protected:
 
-	float _timestep;
-	glm::uvec3 _grid_size;
-	unsigned int _particles_count;
-	unsigned int _whitewater_count;
 	unsigned int _whitewater_start_idx;	// Active whitewater are actually ping-ponged each frame between two halves of a buffer of size 2 * MAX_WHITEWATER_NUM
-	float _water_level;
+	// Sparse grid (see SparseGrid.hpp). Cells are stored by block, in the pool order of the blocks allocated for the current step.
+	glm::uvec3 _grid_blocks_size;
+	unsigned int _grid_pool_capacity;	// In blocks. The cells pools are reallocated when a step needs more blocks.
+	unsigned int _cells_dirty_blocks;	// Leading blocks of the cells pool whose cells may be non-zero: all others are zero
+	unsigned int _next_cells_dirty_blocks;
+	// Dense copy of the grid for visualization, allocated and expanded on request by the view getter
+	mutable unsigned int _render_cells_capacity;
+	mutable glm::uvec3 _render_cells_grid_size;		// Grid size the dense copy is laid out for
+	mutable unsigned int _render_grid_blocks_count;
+	mutable bool _render_cells_dirty;
 	// CUDA resources
-	cudaGraphicsResource* _cells_velocities;
-	cudaGraphicsResource* _cells_masses;
-	cudaGraphicsResource* _particles_positions;
-	cudaGraphicsResource* _particles_velocities;
-	glm::aligned_mat3* _d_particles_velocity_gradients;
-	curandState* _d_curand_states;	// cudaState for random particle initialization and whitewater spawn chance
-	cudaGraphicsResource* _whitewater_positions;
-	glm::aligned_vec3* _d_whitewater_velocities;
-	cudaGraphicsResource* _whitewater_types;
-	cudaGraphicsResource* _whitewater_lifetimes;
-	unsigned int* _d_new_whitewater_counter;
-
-	// OpenGL resources
-	GLuint _cells_VAO; 
-	GLuint _cells_velocities_VBO; 
-	GLuint _cells_masses_VBO; 
-	GLuint _particles_VAO; 
-	GLuint _particles_positions_VBO; 
-	GLuint _particles_velocities_VBO; 
-	GLuint _whitewater_VAO; 
-	GLuint _whitewater_positions_VBO;
-	GLuint _whitewater_types_VBO;
-	GLuint _whitewater_lifetimes_VBO;
-	// Used in instanced rendering, not in simulation
-	GLuint _quad_VBO; 
-	glm::vec2 _quad_vertices[6] = {
-		{-0.5f, -0.5f},
-		{ 0.5f, -0.5f},
-		{-0.5f,  0.5f},
-
-		{ 0.5f, -0.5f},
-		{ 0.5f,  0.5f},
-		{-0.5f,  0.5f}
-	};
-
-	// Estimate water level at rest state (when reflections are more discernible), based on fluid properties and simulation dimension.
-	void _estimate_water_level();
+	unsigned int* _d_grid_block_table = nullptr;	// Pool index of each domain block, or GRID_BLOCK_NONE
+	unsigned int* _d_grid_blocks = nullptr;			// Key of each allocated block, in pool order. Sized for every domain block.
+	unsigned int* _d_grid_blocks_counter = nullptr;
+	GridCell* _d_cells = nullptr;		// Cells pool
+	GridCell* _d_next_cells = nullptr;	// Cells pool of the next step, cleared by the grid update of this one, then swapped in
+	glm::vec3* _d_cells_old_velocities = nullptr;	// PIC/FLIP grid velocities before forces, as large as the cells pools. Only allocated for PIC/FLIP.
+	mutable GridCell* _d_render_cells = nullptr;
+	mutable unsigned int* _d_render_grid_blocks = nullptr;	// Keys of the blocks expanded last time: the only non-zero cells of the dense copy
+	glm::aligned_vec3* _d_particles_positions = nullptr;
+	glm::aligned_vec3* _d_particles_velocities = nullptr;
+	glm::aligned_mat3* _d_particles_velocity_gradients = nullptr;
+	curandState* _d_curand_states = nullptr;	// cudaState for random particle initialization and whitewater spawn chance
+	glm::aligned_vec3* _d_whitewater_positions = nullptr;
+	glm::aligned_vec3* _d_whitewater_velocities = nullptr;
+	unsigned char* _d_whitewater_types = nullptr;
+	float* _d_whitewater_lifetimes = nullptr;
+	unsigned int* _d_new_whitewater_counter = nullptr;
+	// Particles sorting
+	unsigned int* _d_sort_keys = nullptr;
+	unsigned int* _d_sort_indices = nullptr;
+	void* _d_sort_scratch = nullptr;	// Sized for the largest particle attribute, reused to gather each one in sorted order
 
-public:
+	void _on_grid_size_change() override;
+
+	void _on_transfer_policies_change() override;
+
+	void _on_timestep_change() override;
+
+	// Keep particles and whitewater within the domain margin of the kernel, as its stencil must stay in the domain and its blocks in the table
+	void _clamp_to_domain();
+
+	float _get_max_particle_speed() const override;
+
+	void _save_buffers(SimulationState& state) const override;
+
+	void _load_buffers(const SimulationState& state) override;
+
+	// Expand the sparse grid into the dense render buffer, if changed since last call
+	void _pack_render_cells() const;
 
-	ParticleMaterial particles_material;
-	float boundary;
-	float boundary_elasticity;
-	glm::aligned_vec3 gravity;
-	glm::vec3 spawn_position;
-	float whitewater_chance_min;
-	float whitewater_chance_max;
-	unsigned int whitewater_spawn_num;
+	// Return the blocks allocated for the last step to the block table
+	void _grid_release_blocks();
+
+	// Swap in the cells pool cleared by the last grid update, reserve the blocks covered by the particles, and grow the cells pools if needed
+	void _grid_allocate();
+
+public:
 
 	MPMSimulation(
 		glm::uvec3 grid_size,
@@ -79,51 +81,36 @@ public:
 		const float timestep,
 		const float boundary = 0.0f,
 		const float boundary_elasticity = 0.3f,
-		const glm::aligned_vec3 gravity = glm::aligned_vec3(0.0f, -9.81f, 0.0f)
+		const glm::vec3 gravity = glm::vec3(0.0f, -9.81f, 0.0f)
 	);
 
-	void cleanup();
-
-	// Disable copy and move constructors and operators. They're not be used in this program, so they're disabled to ensure it and avoid problems with device resources management.
-	MPMSimulation(const MPMSimulation&) = delete;
-	MPMSimulation& operator=(const MPMSimulation&) = delete;
-	MPMSimulation(MPMSimulation&&) = delete;
-	MPMSimulation& operator=(MPMSimulation&&) = delete;
-
-	GLuint get_cells_VAO() const;
-
-	GLuint get_particles_VAO() const;
-
-	GLuint get_whitewater_VAO() const;
-
-	float get_timestep() const;
-
-	glm::uvec3 get_grid_size() const;
+	~MPMSimulation();
 
-	void set_grid_size(glm::uvec3 size);
+	SIMULATION_BACKEND get_backend_type() const override;
 
-	float get_estimated_water_level() const;
+	void cleanup() override;
 
-	unsigned int get_cells_count() const;
+	// Views are of device memory, with the whitewater ones already offset to the active half of the buffers. The grid view is of a dense copy, expanded when the grid has changed since the last call.
+	BufferView get_particles_positions() const override;
 
-	unsigned int get_particles_count() const;
+	BufferView get_particles_velocities() const override;
 
-	unsigned int get_particles_max() const;
+	BufferView get_whitewater_positions() const override;
 
-	bool can_spawn_particles() const;
+	BufferView get_whitewater_types() const override;
 
-	unsigned int get_whitewater_start_idx() const;
+	BufferView get_whitewater_lifetimes() const override;
 
-	unsigned int get_whitewater_count() const;
+	BufferView get_cells() const override;
 
-	unsigned int get_whitewater_max() const;
+	void reset_simulation() override;
 
-	void reset_simulation();
+	void sort_particles() override;
 
-	void spawn_particles_sphere();
+	void spawn_particles_sphere() override;
 
-	void spawn_particles_cube();
+	void spawn_particles_cube() override;
 
 	// The simulation always advances in steps of _timestep. If frametime il larger that _timestep, multiple iteration steps can be taken (set in main).
-	void step();
+	void step() override;
 };
\ No newline at end of file
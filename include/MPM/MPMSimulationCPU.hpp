@@ -0,0 +1,205 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include <MPM/SimulationBackend.hpp>
+#include <MPM/ParticlesSoA.hpp>
+#include <MPM/SparseGrid.hpp>
+#include <MPM/TransferKernelsCPU.hpp>
+#include <utils/ThreadPool.hpp>
+
+// How the CPU backend scatters particles to the grid, in both P2G stages
+enum P2G_SCATTER
+{
+	P2G_SCATTER_ATOMIC	= 0,	// Particles in parallel, with atomic adds to the cells
+	P2G_SCATTER_COLORED	= 1,	// Particles binned by grid block, blocks in 8 passes by color so that no two threads write the same cell, with plain adds
+};
+
+// How the CPU backend estimates particle densities for P2G
+enum P2G_MODE
+{
+	P2G_MODE_TWO_PASS	= 0,	// Mass scattered to the grid, then gathered back as density before momentum is scattered, as the CUDA backend
+	P2G_MODE_FUSED		= 1,	// Mass and momentum scattered in a single pass, with the density gathered by the previous step's G2P (one step late)
+	P2G_MODE_ONE_PASS	= 2,	// Fused P2G done by G2P, into a second grid swapped in by the next step: particles are read and written once per step. Parameter changes apply one step late.
+};
+
+// Lowercase name, as in command line options
+const char* get_p2g_mode_name(const P2G_MODE mode);
+
+// Multithreaded CPU implementation of the same MLS-MPM step as MPMSimulation (CUDA). Each stage of the step mirrors the CUDA kernel with the same name, with a ThreadPool parallel_for in place of the kernel launch.
+class MPMSimulationCPU : public SimulationBackend
+{
+protected:
+
+	mutable ThreadPool _thread_pool;	// Also used by the const view getters, to repack particles for rendering
+	// Sparse grid (see SparseGrid.hpp). Cells are stored by block, in the pool order of the blocks allocated for the current step.
+	glm::uvec3 _grid_blocks_size;
+	std::vector<unsigned int> _grid_block_table;	// Pool index of each domain block, or GRID_BLOCK_NONE
+	std::vector<unsigned int> _grid_blocks;			// Key of each allocated block, in pool order. Sized for every domain block.
+	std::atomic<unsigned int> _grid_blocks_counter;
+	std::vector<GridCell> _cells;					// Cells pool, grown as needed
+	unsigned int _cells_dirty_blocks;				// Leading blocks of the pool whose cells may be non-zero: all others are zero
+	std::vector<glm::vec3> _cells_old_velocities;	// Grid velocities before forces, indexed as _cells, for PIC/FLIP only (see TransferPolicies.hpp). Cleared by the grid reset.
+	// Grid of the next step, scattered to by one-pass G2P, then swapped with the current one. Its cells pool is swapped in every step, as the grid update clears it along the way.
+	std::vector<unsigned int> _next_grid_block_table;
+	std::vector<unsigned int> _next_grid_blocks;
+	unsigned int _next_grid_blocks_count;
+	std::vector<GridCell> _next_cells;
+	std::vector<glm::vec3> _next_cells_old_velocities;
+	unsigned int _next_cells_dirty_blocks;
+	bool _next_grid_ready;	// Whether the last G2P scattered every particle to the next grid
+	// Dense copy of the grid, expanded on request by the view getter
+	mutable std::vector<GridCell> _render_cells;
+	mutable std::vector<unsigned int> _render_grid_blocks;	// Keys of the blocks expanded last time: the only non-zero cells of the dense copy
+	mutable glm::uvec3 _render_cells_grid_size;				// Grid size the dense copy is laid out for
+	mutable bool _render_cells_dirty;
+	// Particles, as structure of arrays. RNG state is per-particle (xorshift32), so results don't depend on how particles are split between threads.
+	ParticlesSoA _particles;
+	ParticlesSoA _sorted_particles;				// Sorting scratch buffers, swapped with _particles
+	std::vector<unsigned long long> _sort_keys;	// Morton code in the high 32 bits, particle index in the low ones
+	std::vector<unsigned long long> _sorted_keys;	// Radix sort scratch, swapped with _sort_keys after each pass
+	// Colored P2G. Particles are binned by the pool index of their block, blocks are listed by color (parity of the block coords).
+	std::vector<unsigned int> _bin_particles;			// Particle indices, grouped by block, in particles order within each block
+	std::vector<unsigned int> _bin_offsets;				// Start of each block's particles in _bin_particles, plus the end
+	std::vector<unsigned int> _bin_chunk_offsets;		// Counting sort scratch (binning and sorting): per-chunk counts, then write offsets, of each bucket
+	std::vector<unsigned int> _color_blocks;			// Pool indices of the blocks with particles, grouped by color
+	unsigned int _color_blocks_offsets[8 + 1];
+	// Interleaved copies of positions and velocities, repacked on request by the view getters
+	mutable std::vector<glm::vec3> _render_particles_positions;
+	mutable std::vector<glm::vec3> _render_particles_velocities;
+	mutable bool _render_particles_dirty;
+	// Whitewater. Surviving whitewater is moved from the current to the next buffers each step, then the two are swapped (same as the ping-ponged halves of the CUDA buffers).
+	std::vector<glm::vec3> _whitewater_positions, _next_whitewater_positions;
+	std::vector<glm::vec3> _whitewater_velocities, _next_whitewater_velocities;
+	std::vector<unsigned char> _whitewater_types, _next_whitewater_types;
+	std::vector<float> _whitewater_lifetimes, _next_whitewater_lifetimes;
+	std::atomic<unsigned int> _new_whitewater_counter;
+	CPU_ISA _cpu_isa;	// Of the transfer kernels
+	GRID_CELL_ORDER _grid_cell_order;	// Of the cells within grid blocks, in the kernels and everywhere else
+	bool _particles_densities_valid;	// Whether the last G2P estimated every particle's density, as needed by fused P2G
+
+	void _on_grid_size_change() override;
+
+	void _on_transfer_policies_change() override;
+
+	void _on_timestep_change() override;
+
+	// Keep particles and whitewater within the domain margin of the kernel, as its stencil must stay in the domain and its blocks in the table
+	void _clamp_to_domain();
+
+	float _get_max_particle_speed() const override;
+
+	void _save_buffers(SimulationState& state) const override;
+
+	void _load_buffers(const SimulationState& state) override;
+
+	// Sparse grid indexing (see SparseGrid.hpp) in the current cell order
+	unsigned int _find_cell_idx(const glm::ivec3& cell_coords) const;
+	glm::uvec3 _get_block_cell_offset(const unsigned int block_cell_idx) const;
+	unsigned int _get_dense_cell_idx(const unsigned int block_key, const unsigned int block_cell_idx) const;
+
+	// Current grid and particles buffers, and parameters, for the transfer kernels
+	TransferKernelArgs _get_transfer_kernel_args();
+
+	// Transfer kernels of the current instruction set, cell order and transfer policies
+	const TransferKernelsCPU& _get_transfer_kernels() const;
+
+	// Interleave SoA positions and velocities into the render buffers, if changed since last call
+	void _pack_render_particles() const;
+
+	// Expand the sparse grid into the dense render buffer, if changed since last call
+	void _pack_render_cells() const;
+
+	// Return the blocks allocated for the last step to the block table
+	void _grid_release_blocks();
+
+	// Bin particles by block and list blocks by color, for colored P2G
+	void _bin_particles_by_block();
+
+	// Run job on the particles of every block, _bin_particles[begin, end), a color at a time: blocks of the same color are at least 2 blocks apart, so their particles' stencils never overlap
+	using BinJob = std::function<void(unsigned int begin, unsigned int end)>;
+	void _for_each_bin_colored(const BinJob& job);
+
+	// Run a P2G kernel on the particles of every block, with _for_each_bin_colored()
+	using P2GKernel = decltype(TransferKernelsCPU::p2g_mass);
+	void _scatter_colored(const P2GKernel scatter);
+
+	// Spawn whitewater behind particles particle_indices[begin, end), or [begin, end) if particle_indices is nullptr, from the G2P kernel outputs (indexed from begin)
+	void _spawn_whitewater(const unsigned int* const particle_indices, const unsigned int begin, const unsigned int end, const float* const spawn_chances, const float* const displacements[3]);
+
+	// Allocate, and reset, the blocks of the next grid for one-pass G2P
+	void _next_grid_allocate();
+	void _next_grid_reset();
+
+	// Step stages, one per CUDA kernel
+	void _grid_allocate();
+	void _grid_reset();
+	void _p2g_init();
+	void _p2g();
+	void _p2g_fused();	// _p2g_init() and _p2g() in one pass, see P2G_MODE_FUSED
+	void _grid_update();
+	void _g2p();
+	bool _g2p_p2g();	// _g2p() and the next step's _p2g_fused() in one pass, see P2G_MODE_ONE_PASS. Returns whether every particle was scattered.
+	template <typename Kernel>
+	void _advect_whitewater();	// Instantiated for each interpolation kernel policy
+
+public:
+
+	P2G_SCATTER p2g_scatter;
+	P2G_MODE p2g_mode;	// Steps right after a switch to fused or one-pass, or a spawn, are still two-pass: particles need a density first
+
+	MPMSimulationCPU(
+		glm::uvec3 grid_size,
+		const ParticleMaterial& particles_material,
+		const float timestep,
+		const float boundary = 0.0f,
+		const float boundary_elasticity = 0.3f,
+		const glm::vec3 gravity = glm::vec3(0.0f, -9.81f, 0.0f),
+		const unsigned int threads_count = 0	// 0 = one per hardware thread
+	);
+
+	~MPMSimulationCPU();
+
+	SIMULATION_BACKEND get_backend_type() const override;
+
+	void cleanup() override;
+
+	unsigned int get_threads_count() const;
+
+	// Instruction set of the transfer kernels. Defaults to the best supported one, and is lowered to it if set higher.
+	CPU_ISA get_cpu_isa() const;
+
+	void set_cpu_isa(const CPU_ISA isa);
+
+	// Order of the cells within grid blocks, linear by default. Only changes the memory layout, not the results.
+	GRID_CELL_ORDER get_grid_cell_order() const;
+
+	void set_grid_cell_order(const GRID_CELL_ORDER cell_order);
+
+	// Particles and grid views are of interleaved or dense copies, repacked when the simulation has changed since the last call.
+	BufferView get_particles_positions() const override;
+
+	BufferView get_particles_velocities() const override;
+
+	BufferView get_whitewater_positions() const override;
+
+	BufferView get_whitewater_types() const override;
+
+	BufferView get_whitewater_lifetimes() const override;
+
+	BufferView get_cells() const override;
+
+	void reset_simulation() override;
+
+	void sort_particles() override;
+
+	void spawn_particles_sphere() override;
+
+	void spawn_particles_cube() override;
+
+	void step() override;
+};
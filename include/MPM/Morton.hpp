@@ -0,0 +1,25 @@
+#pragma once
+
+// Usable both in host code and in CUDA kernels
+#ifdef __CUDACC__
+	#define MORTON_QUALIFIER __host__ __device__ inline
+#else
+	#define MORTON_QUALIFIER inline
+#endif
+
+// Spread the lower 10 bits of v so that there are two zero bits between each of them
+MORTON_QUALIFIER unsigned int morton_expand_bits(unsigned int v)
+{
+	v &= 0x000003FFu;
+	v = (v | (v << 16)) & 0x030000FFu;
+	v = (v | (v << 8)) & 0x0300F00Fu;
+	v = (v | (v << 4)) & 0x030C30C3u;
+	v = (v | (v << 2)) & 0x09249249u;
+	return v;
+}
+
+// 30-bit Morton code (Z-order) of cell coordinates up to 1023. x takes the most significant bit, as in the grid linear index.
+MORTON_QUALIFIER unsigned int morton_encode(const unsigned int x, const unsigned int y, const unsigned int z)
+{
+	return (morton_expand_bits(x) << 2) | (morton_expand_bits(y) << 1) | morton_expand_bits(z);
+}
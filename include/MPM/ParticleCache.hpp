@@ -0,0 +1,177 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include <MPM/SimulationBackend.hpp>
+#include <utils/MappedFile.hpp>
+
+/*
+Particle cache: the particles and whitewater of a simulation, recorded every few steps to be played back or rendered offline without simulating again.
+Layout, in native byte order (little-endian on every supported platform):
+	Header: magic, version, grid size
+	Chunks, one per frame: chunk header (step, time, counts, encoding, payload size) and the encoded payload
+	Index footer: offset, step and time of every chunk, then a trailer pointing at it
+Caches that were never closed (e.g. a crashed run) have no footer: the reader then rebuilds the index by walking the chunks.
+*/
+
+// Payload encoding of a frame chunk
+enum CACHE_ENCODING
+{
+	CACHE_ENCODING_RAW			= 0,	// Tightly packed arrays, in ParticleCacheFrame order
+	CACHE_ENCODING_QUANTIZED	= 1,	// Lossy: quantized, delta-coded against keyframes and bit-packed (see ParticleCacheCodec.hpp)
+	CACHE_ENCODING_NUM			= 2,
+};
+
+class QuantizedFrameEncoder;
+class ThreadPool;
+struct QuantizedParticles;
+
+// One recorded frame, in host memory. Vectors are tightly packed.
+struct ParticleCacheFrame
+{
+	unsigned long long step = 0;	// SimulationBackend::get_steps_count() when recorded
+	double time = 0.0;				// Simulated seconds when recorded
+	std::vector<glm::vec3> particles_positions;
+	std::vector<glm::vec3> particles_velocities;
+	std::vector<glm::vec3> whitewater_positions;
+	std::vector<unsigned char> whitewater_types;	// 1 = Spray, 2 = Bubble, 3 = Foam
+	std::vector<float> whitewater_lifetimes;
+};
+
+// Index entry of a frame chunk
+struct ParticleCacheFrameInfo
+{
+	unsigned long long offset = 0;	// Of the chunk, from the start of the file
+	unsigned long long size = 0;	// Of the chunk, header included
+	unsigned long long step = 0;
+	double time = 0.0;
+};
+
+// Streams frames to a cache file from a background thread. write_frame() only copies the simulation buffers into a queued frame: encoding and disk
+// writes happen on the writer thread, so the simulation doesn't wait for the disk unless the queue is full.
+class ParticleCacheWriter
+{
+private:
+
+	std::ofstream _file;
+	unsigned long long _file_offset = 0;
+	std::vector<ParticleCacheFrameInfo> _index;	// Written frames, writer thread only until close()
+	std::vector<unsigned char> _chunk;			// Writer thread scratch buffer
+	std::unique_ptr<QuantizedFrameEncoder> _encoder;
+	unsigned int _position_levels = 0;	// Quantized encoding: steps per cell of positions, from position_error
+	// Bounded queue of captured frames, and the pool of frames it reuses
+	std::thread _writer;
+	std::mutex _mutex;
+	std::condition_variable _queue_cv;	// Signaled when a frame is queued, or on close
+	std::condition_variable _free_cv;	// Signaled when a frame is written and back in the pool
+	std::deque<std::unique_ptr<ParticleCacheFrame>> _queue;
+	std::vector<std::unique_ptr<ParticleCacheFrame>> _free_frames;
+	unsigned int _frames_allocated = 0;
+	unsigned int _frames_queued_total = 0;
+	unsigned int _frames_dropped = 0;
+	bool _closing = false;
+	bool _failed = false;	// A write failed: later frames are discarded
+
+	void _writer_loop();
+
+	// Encode frame into _chunk, chunk header included
+	void _encode_frame(const ParticleCacheFrame& frame);
+
+public:
+
+	unsigned int max_queued_frames = 4;	// Frames captured but not yet written, each the size of the simulation buffers
+	bool drop_when_full = false;		// When the queue is full, drop the frame rather than wait for the writer thread
+	// Encoding settings, read by open()
+	CACHE_ENCODING encoding = CACHE_ENCODING_RAW;
+	float position_error = 1.0f / 512.0f;	// Quantized encoding: maximum error of decoded positions, in cells. At least float precision at the far end of the domain.
+	unsigned int keyframe_interval = 16;	// Quantized encoding: frames from a keyframe to the next
+	unsigned int encoder_threads_count = 0;	// Quantized encoding: threads encoding each frame, besides the writer thread (0 = one per hardware thread)
+
+	ParticleCacheWriter();
+
+	~ParticleCacheWriter();
+
+	// Disable copy and move constructors and operators: the writer thread holds a pointer to the writer.
+	ParticleCacheWriter(const ParticleCacheWriter&) = delete;
+	ParticleCacheWriter& operator=(const ParticleCacheWriter&) = delete;
+	ParticleCacheWriter(ParticleCacheWriter&&) = delete;
+	ParticleCacheWriter& operator=(ParticleCacheWriter&&) = delete;
+
+	// Create the cache at path, for frames of sim, and start the writer thread. Returns false (and reports to std::cerr) on failure.
+	bool open(const std::string& path, const SimulationBackend& sim);
+
+	// Queue the current particles and whitewater of sim, recorded at simulated time. Returns false if the frame was dropped or the cache failed.
+	bool write_frame(const SimulationBackend& sim, const double time);
+
+	// Write the queued frames and the index footer, and close the file. Returns false if any write failed.
+	bool close();
+
+	bool is_open() const;
+
+	// Frames queued so far, written or not, and frames dropped by drop_when_full
+	unsigned int get_frames_count() const;
+
+	unsigned int get_dropped_frames_count() const;
+};
+
+// Random access to the frames of a cache, memory mapped. read_frame() is const and can be called from several threads at once.
+class ParticleCacheReader
+{
+private:
+
+	MappedFile _file;
+	glm::uvec3 _grid_size = glm::uvec3(0);
+	std::vector<ParticleCacheFrameInfo> _index;
+	// Quantized encoding: decoder threads, used by one read_frame() at a time (the others decode on their calling thread),
+	// and the last decoded keyframe, the reference of the frames that follow it
+	std::unique_ptr<ThreadPool> _decoder_pool;
+	mutable std::mutex _decoder_pool_mutex;
+	mutable std::shared_ptr<const QuantizedParticles> _keyframe;
+	mutable unsigned int _keyframe_idx = 0;
+	mutable std::mutex _keyframe_mutex;
+
+	// Quantized particles of keyframe keyframe_idx, from the last one decoded or decoded now. Null if invalid.
+	std::shared_ptr<const QuantizedParticles> _get_keyframe(const unsigned int keyframe_idx) const;
+
+	// read_frame(), also returning the quantized particles in decoded_keyframe if not null and the frame is a keyframe
+	bool _read_frame(const unsigned int frame_idx, ParticleCacheFrame& frame, std::shared_ptr<const QuantizedParticles>* decoded_keyframe) const;
+
+	// Rebuild the index of a cache without footer by walking its chunks
+	void _scan_chunks();
+
+public:
+
+	ParticleCacheReader();
+
+	~ParticleCacheReader();
+
+	// Map the cache at path and load its index. decoder_threads_count threads decode quantized frames (0 = one per hardware thread).
+	// Returns false (and reports to std::cerr) on failure.
+	bool open(const std::string& path, const unsigned int decoder_threads_count = 0);
+
+	void close();
+
+	bool is_open() const;
+
+	// Grid size of the simulation that recorded the cache
+	glm::uvec3 get_grid_size() const;
+
+	unsigned int get_frames_count() const;
+
+	const ParticleCacheFrameInfo& get_frame_info(const unsigned int frame_idx) const;
+
+	// Last frame recorded at or before time, 0 if none
+	unsigned int find_frame(const double time) const;
+
+	// Decode frame frame_idx into frame, reusing its buffers. Returns false if the chunk is invalid.
+	bool read_frame(const unsigned int frame_idx, ParticleCacheFrame& frame) const;
+};
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include <MPM/ParticleCache.hpp>
+#include <utils/ThreadPool.hpp>
+
+/*
+CACHE_ENCODING_QUANTIZED payloads: lossy, about 3 to 4 times smaller than raw frames when recorded every step, depending on the position error bound.
+Positions are quantized relative to their grid cell (the grid spacing is always 1): the cell index, and the position within the cell in fixed point,
+with levels steps per cell, quantized and decoded in double precision. Decoded positions are floats, whose rounding adds up to half a float ulp at the far
+end of the domain (7.6e-6 cells in domains up to 256 cells, 3.1e-5 up to 1024) to the 0.5 / levels of the quantization: levels is picked so that both stay within
+position_error cells, which can't be smaller than that rounding. Velocities and whitewater lifetimes are stored as fp16. Whitewater types are exact.
+Keyframes are delta-coded within the frame, each particle against the previous one (neighbors once particles are sorted). Frames between keyframes
+are delta-coded against the particles of the same index in their keyframe, so any frame decodes from itself and its keyframe only.
+Differences are zigzag-coded and bit-packed in groups of BIT_PACK_GROUP values at the width of the largest one (see BitPacking.hpp).
+Particles and whitewater are split in blocks of CACHE_BLOCK_PARTICLES, encoded and decoded independently by a thread pool.
+*/
+
+const unsigned int CACHE_BLOCK_PARTICLES = 16384;
+
+// Quantized particles of a keyframe, the reference of the frames delta-coded against it. Positions in fixed point steps, velocities as fp16 bits.
+struct QuantizedParticles
+{
+	unsigned int levels = 0;
+	std::vector<int32_t> positions[3];
+	std::vector<uint16_t> velocities[3];
+};
+
+// Encoder of CACHE_ENCODING_QUANTIZED payloads, keeping the last keyframe as the reference of the next frames
+class QuantizedFrameEncoder
+{
+private:
+
+	ThreadPool _thread_pool;
+	QuantizedParticles _keyframe;
+	QuantizedParticles _quantized;	// Of the frame being encoded, swapped with _keyframe on keyframes
+	unsigned int _keyframe_idx = 0;
+	unsigned int _frames_since_keyframe = 0;
+	bool _has_keyframe = false;
+	std::vector<std::vector<unsigned char>> _blocks;	// Encoded blocks, reused
+
+public:
+
+	// threads_count: 0 = one per hardware thread
+	explicit QuantizedFrameEncoder(const unsigned int threads_count = 0);
+
+	// Forget the last keyframe: the next frame is a keyframe
+	void reset();
+
+	// Append the encoding of frame, the frame_idx-th of its cache, to payload, with positions in levels steps per cell (see
+	// get_quantized_position_levels()). A keyframe is written every keyframe_interval frames, and whenever the particles count or levels change.
+	void encode(const ParticleCacheFrame& frame, const unsigned int frame_idx, const unsigned int levels, const unsigned int keyframe_interval, std::vector<unsigned char>& payload);
+};
+
+// Steps per cell of quantized positions, so that positions in a domain of grid_size cells decode within position_error cells. Clamped to the finest
+// levels supported: see get_quantized_position_error() for the bound they actually reach.
+unsigned int get_quantized_position_levels(const float position_error, const glm::uvec3 grid_size);
+
+// Largest error of positions decoded from levels steps per cell, in a domain of grid_size cells
+float get_quantized_position_error(const unsigned int levels, const glm::uvec3 grid_size);
+
+// Index of the keyframe a payload is delta-coded against (its own index for keyframes). Returns false if the payload is invalid.
+bool get_quantized_frame_keyframe(const unsigned char* payload, const uint64_t payload_size, unsigned int& keyframe_idx, bool& is_keyframe);
+
+// Decode payload into frame (step and time excluded), with particles_count particles and whitewater_count whitewater. keyframe is the reference of
+// delta frames, ignored for keyframes. If quantized isn't null and the payload is a keyframe, it receives the quantized particles, to decode the next frames.
+// thread_pool can be null, to decode on the calling thread only. Returns false if the payload is invalid.
+bool decode_quantized_frame(
+	const unsigned char* payload,
+	const uint64_t payload_size,
+	const unsigned int particles_count,
+	const unsigned int whitewater_count,
+	const QuantizedParticles* keyframe,
+	ParticleCacheFrame& frame,
+	QuantizedParticles* quantized,
+	ThreadPool* thread_pool
+);
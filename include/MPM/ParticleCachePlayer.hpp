@@ -0,0 +1,74 @@
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <MPM/ParticleCache.hpp>
+
+// Plays a particle cache back. A worker thread decodes the frames from the playback position onward, in the playback direction, into a ring of
+// frames, so that the viewer only copies decoded frames and never waits on the disk or the decoder. Seeking retargets the worker at once.
+class ParticleCachePlayer
+{
+private:
+
+	struct Slot
+	{
+		ParticleCacheFrame frame;
+		unsigned int frame_idx = 0;
+		bool decoding = false;	// Written by the worker, outside the lock
+		bool decoded = false;
+		bool valid = false;		// Decoded without error
+	};
+
+	ParticleCacheReader _reader;
+	std::vector<Slot> _slots;
+	std::thread _worker;
+	std::mutex _mutex;
+	std::condition_variable _cv;	// Signaled when the playback position moves, a frame is unlocked, or on close
+	unsigned int _target_idx = 0;
+	int _direction = 1;
+	int _locked_slot = -1;
+	bool _closing = false;
+
+	void _worker_loop();
+
+	// Whether frame_idx is among the frames to keep decoded: the target and the next ones in the playback direction
+	bool _is_in_window(const unsigned int frame_idx) const;
+
+	// The first frame of the window not decoded yet, and the slot to decode it into. Returns false if there is none, or no slot is free.
+	bool _next_decode(unsigned int& slot_idx, unsigned int& frame_idx) const;
+
+public:
+
+	ParticleCachePlayer() = default;
+
+	~ParticleCachePlayer();
+
+	// Disable copy and move constructors and operators: the worker thread holds a pointer to the player.
+	ParticleCachePlayer(const ParticleCachePlayer&) = delete;
+	ParticleCachePlayer& operator=(const ParticleCachePlayer&) = delete;
+	ParticleCachePlayer(ParticleCachePlayer&&) = delete;
+	ParticleCachePlayer& operator=(ParticleCachePlayer&&) = delete;
+
+	// Open the cache at path and start the worker, keeping up to ring_size frames decoded. Returns false (and reports to std::cerr) on failure.
+	bool open(const std::string& path, const unsigned int ring_size = 8);
+
+	void close();
+
+	bool is_open() const;
+
+	// Frames count, times and grid size of the cache
+	const ParticleCacheReader& get_reader() const;
+
+	// Move the playback position to frame frame_idx, then prefetch the next frames in direction (1 forward, -1 backward)
+	void seek(const unsigned int frame_idx, const int direction);
+
+	// The decoded frame nearest to frame_idx (frame_idx itself once decoded), its index in locked_idx. It isn't reused by the worker until
+	// unlock_frame(). Null if no frame is decoded yet.
+	const ParticleCacheFrame* lock_frame(const unsigned int frame_idx, unsigned int& locked_idx);
+
+	void unlock_frame();
+};
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <utils/AlignedAllocator.hpp>
+
+// Structure-of-arrays particles storage for the CPU backend: one contiguous, cache line aligned stream per scalar component.
+// Transfer stages only pay for the components they read, with no aligned_vec3 / aligned_mat3 padding.
+struct ParticlesSoA
+{
+	AlignedVector<float> positions[3];				// x, y, z
+	AlignedVector<float> velocities[3];				// x, y, z
+	AlignedVector<float> velocity_gradients[9];		// Column-major as glm::mat3: [column * 3 + row]
+	AlignedVector<float> densities;					// Estimated by G2P for fused P2G, only valid while it's in use
+	AlignedVector<unsigned int> random_states;
+
+	void reserve(const size_t count)
+	{
+		for (AlignedVector<float>& stream : positions) stream.reserve(count);
+		for (AlignedVector<float>& stream : velocities) stream.reserve(count);
+		for (AlignedVector<float>& stream : velocity_gradients) stream.reserve(count);
+		densities.reserve(count);
+		random_states.reserve(count);
+	}
+
+	// New particles are at rest: zero velocity and velocity gradient
+	void resize(const size_t count)
+	{
+		for (AlignedVector<float>& stream : positions) stream.resize(count);
+		for (AlignedVector<float>& stream : velocities) stream.resize(count, 0.0f);
+		for (AlignedVector<float>& stream : velocity_gradients) stream.resize(count, 0.0f);
+		densities.resize(count);
+		random_states.resize(count);
+	}
+
+	void clear() { resize(0); }
+
+	// Release memory, not just clear
+	void release()
+	{
+		for (AlignedVector<float>& stream : positions) AlignedVector<float>().swap(stream);
+		for (AlignedVector<float>& stream : velocities) AlignedVector<float>().swap(stream);
+		for (AlignedVector<float>& stream : velocity_gradients) AlignedVector<float>().swap(stream);
+		AlignedVector<float>().swap(densities);
+		AlignedVector<unsigned int>().swap(random_states);
+	}
+
+	glm::vec3 get_position(const unsigned int idx) const { return glm::vec3(positions[0][idx], positions[1][idx], positions[2][idx]); }
+
+	void set_position(const unsigned int idx, const glm::vec3& position)
+	{
+		positions[0][idx] = position.x;
+		positions[1][idx] = position.y;
+		positions[2][idx] = position.z;
+	}
+
+	glm::vec3 get_velocity(const unsigned int idx) const { return glm::vec3(velocities[0][idx], velocities[1][idx], velocities[2][idx]); }
+
+	void set_velocity(const unsigned int idx, const glm::vec3& velocity)
+	{
+		velocities[0][idx] = velocity.x;
+		velocities[1][idx] = velocity.y;
+		velocities[2][idx] = velocity.z;
+	}
+
+	glm::mat3 get_velocity_gradient(const unsigned int idx) const
+	{
+		glm::mat3 gradient;
+		for (int i = 0; i < 9; ++i) gradient[i / 3][i % 3] = velocity_gradients[i][idx];
+		return gradient;
+	}
+
+	void set_velocity_gradient(const unsigned int idx, const glm::mat3& gradient)
+	{
+		for (int i = 0; i < 9; ++i) velocity_gradients[i][idx] = gradient[i / 3][i % 3];
+	}
+};
@@ -0,0 +1,298 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include <MPM/ParticleMaterial.hpp>
+#include <MPM/TransferPolicies.hpp>
+#include <MPM/SimulationState.hpp>
+
+enum SIMULATION_BACKEND
+{
+	CPU		= 0,
+	CUDA	= 1,
+};
+
+// Stages of a simulation step, in execution order
+enum STEP_STAGE
+{
+	SORT_PARTICLES		= 0,
+	GRID_ALLOCATE		= 1,
+	GRID_RESET			= 2,
+	P2G_MASS			= 3,
+	P2G_MOMENTUM		= 4,
+	GRID_UPDATE			= 5,
+	G2P					= 6,
+	ADVECT_WHITEWATER	= 7,
+	STEP_STAGES_NUM		= 8,
+};
+
+// snake_case stage name, e.g. for benchmark reports
+const char* get_stage_name(const STEP_STAGE stage);
+
+// Where the data referenced by a BufferView lives
+enum MEMORY_SPACE
+{
+	HOST	= 0,
+	DEVICE	= 1,
+};
+
+// Read-only view of a simulation buffer: count elements, each stride bytes apart. Only valid until the next call to a non-const simulation method.
+struct BufferView
+{
+	const void* data = nullptr;
+	unsigned int count = 0;
+	unsigned int stride = 0;
+	MEMORY_SPACE memory_space = HOST;
+};
+
+// Copy the elements of view to values, tightly packed, element_size bytes each. Device views are copied with cudaMemcpy2D, which drops the padding of
+// aligned types.
+void copy_buffer_view(const BufferView& view, void* values, const size_t element_size);
+
+// Interface shared by the simulation backends. Backends know nothing about rendering: see SimulationGLAdapter to upload their buffers to OpenGL.
+class SimulationBackend
+{
+protected:
+
+	float _timestep;		// Of the next step
+	float _fixed_timestep;	// Constructor timestep, when not adaptive
+	glm::uvec3 _grid_size;
+	unsigned int _grid_blocks_count;	// Sparse grid blocks allocated for the last step
+	unsigned int _particles_count;
+	unsigned int _whitewater_count;
+	float _water_level;
+	// Stage profiling
+	bool _stage_profiling;
+	float _stage_times[STEP_STAGES_NUM];
+	std::chrono::steady_clock::time_point _stage_start;
+	unsigned int _steps_since_sort;
+	unsigned long long _steps_count;	// Steps taken since construction or the last reset
+	// Blow-up detection and rollback (see advance())
+	std::vector<SimulationState> _snapshots;	// Ring of the last snapshots_num known-good states, buffers reused
+	std::vector<double> _snapshots_times;		// Of each snapshot, on the _advanced_time clock
+	unsigned int _snapshots_count;				// Valid snapshots in the ring
+	unsigned int _newest_snapshot;
+	unsigned int _steps_since_health_check;
+	unsigned int _steps_since_snapshot;
+	float _timestep_scale;						// Timestep reduction after rollbacks, in [MIN_TIMESTEP_SCALE, 1]
+	unsigned int _rollbacks_count;
+	unsigned long long _advanced_steps_count;	// Steps taken by advance(), rolled back ones included
+	double _advanced_time;						// Simulated time gained by advance(), net of rollbacks
+	double _lost_time;							// Simulated time of the steps rolled back
+	// Transfer policies (see TransferPolicies.hpp)
+	INTERPOLATION_KERNEL _interpolation_kernel;
+	TRANSFER_SCHEME _transfer_scheme;
+
+	// Estimate water level at rest state (when reflections are more discernible), based on fluid properties and simulation dimension.
+	void _estimate_water_level();
+
+	// Radius of a sphere spawn of PARTICLES_SPAWN_NUM particles at rest density, shrunk to fit in the grid.
+	float _get_spawn_sphere_radius() const;
+
+	// Particles spacing of a cube spawn of PARTICLES_SPAWN_NUM particles at rest density, shrunk to fit in the grid.
+	float _get_spawn_cube_step() const;
+
+	// Stage timing helpers for step(). No-ops unless stage profiling is enabled. The stage must be complete (e.g. device synchronized) before _end_stage(). A stage timed more than once in a step adds up.
+	void _clear_stage_times();
+	void _begin_stage();
+	void _end_stage(const STEP_STAGE stage);
+
+	// Counts steps, and returns true when particles are due to be sorted according to sort_interval.
+	bool _is_sort_due();
+
+	// Called by set_grid_size() once the new size is enforced, to update backend-specific grid resources.
+	virtual void _on_grid_size_change() = 0;
+
+	// Called by set_interpolation_kernel() and set_transfer_scheme() on change, to update backend-specific resources and keep particles within the domain margin of the new kernel.
+	virtual void _on_transfer_policies_change() = 0;
+
+	// Set the timestep of the next steps, calling _on_timestep_change() on change
+	void _set_timestep(const float timestep);
+
+	// Called by _set_timestep() on change, for backends that prepare the next step with the current timestep.
+	virtual void _on_timestep_change() = 0;
+
+	// Largest particle speed, in cells per second, by a parallel reduction over the particles velocities. For the adaptive timestep and blow-up detection.
+	// Infinity if any particle position or velocity isn't finite.
+	virtual float _get_max_particle_speed() const = 0;
+
+	// Copy the particles and whitewater buffers to state, for save_state(), and back for load_state(). Counts are already set on both sides.
+	virtual void _save_buffers(SimulationState& state) const = 0;
+	virtual void _load_buffers(const SimulationState& state) = 0;
+
+	// Health check of advance(), after each step: every health_check_interval steps, roll back if the particles blew up, else snapshot the state if due.
+	// Returns false if rolled back.
+	bool _check_health();
+
+public:
+
+	ParticleMaterial particles_material;
+	float boundary;
+	float boundary_elasticity;
+	glm::vec3 gravity;
+	glm::vec3 spawn_position;
+	float whitewater_chance_min;
+	float whitewater_chance_max;
+	unsigned int whitewater_spawn_num;
+	unsigned int sort_interval;	// Particles are sorted every sort_interval steps (0 = never)
+	float flip_ratio;			// PIC/FLIP transfer scheme only: 0 = pure PIC, 1 = pure FLIP
+	// Adaptive timestep (see advance()). Disabled by default: steps are then always the constructor timestep.
+	bool adaptive_timestep;
+	float cfl_number;			// Fraction of a cell that particles and pressure waves may travel in a step
+	float min_timestep;			// Adaptive timestep bounds. Default: 1/8 and 2 times the constructor timestep.
+	float max_timestep;
+	// Blow-up detection (see advance()). Health checks are a reduction over the particles, snapshots a copy of the whole state to host memory.
+	unsigned int health_check_interval;	// Check particles every health_check_interval steps (0 = never)
+	unsigned int snapshot_interval;		// Snapshot the state every snapshot_interval steps, at passing health checks
+	unsigned int snapshots_num;			// Snapshots kept for rollback
+	float blowup_cfl;					// Particles moving more cells than this in a step are a blow-up, as are non-finite positions and velocities
+
+	// Derived constructors must call set_grid_size(), as it can't dispatch to them from here.
+	SimulationBackend(
+		const ParticleMaterial& particles_material,
+		const float timestep,
+		const float boundary,
+		const float boundary_elasticity,
+		const glm::vec3 gravity
+	);
+
+	virtual ~SimulationBackend() = default;
+
+	// Disable copy and move constructors and operators. Backends own device or large host resources.
+	SimulationBackend(const SimulationBackend&) = delete;
+	SimulationBackend& operator=(const SimulationBackend&) = delete;
+	SimulationBackend(SimulationBackend&&) = delete;
+	SimulationBackend& operator=(SimulationBackend&&) = delete;
+
+	virtual SIMULATION_BACKEND get_backend_type() const = 0;
+
+	virtual void cleanup() = 0;
+
+	// Timestep of the next step: the fixed one, or the one of the last adaptive step
+	float get_timestep() const;
+
+	// Timestep of the steps when not adaptive, the constructor timestep by default. min_timestep and max_timestep are left unchanged.
+	float get_fixed_timestep() const;
+
+	void set_fixed_timestep(const float timestep);
+
+	// Largest stable timestep for the current particles and material: particles and pressure waves (the speed of sound of the equation of state) travel
+	// at most cfl_number cells, and viscosity diffuses less than a cell. Clamped to [min_timestep, max_timestep]. Costs a reduction over the particles.
+	float get_stable_timestep() const;
+
+	glm::uvec3 get_grid_size() const;
+
+	void set_grid_size(glm::uvec3 size);
+
+	float get_estimated_water_level() const;
+
+	// Steps taken since construction or the last reset_simulation()
+	unsigned long long get_steps_count() const;
+
+	unsigned int get_cells_count() const;
+
+	// Blocks of GRID_BLOCK_CELLS_NUM cells allocated by the sparse grid for the last step (see SparseGrid.hpp).
+	unsigned int get_grid_blocks_count() const;
+
+	unsigned int get_particles_count() const;
+
+	unsigned int get_particles_max() const;
+
+	bool can_spawn_particles() const;
+
+	unsigned int get_whitewater_count() const;
+
+	unsigned int get_whitewater_max() const;
+
+	// When enabled, step() records the wall-clock time of each stage. Disabled by default, as it adds a timer read per stage.
+	void set_stage_profiling(const bool enabled);
+
+	bool get_stage_profiling() const;
+
+	// Milliseconds spent in stage during the last step (0 if the stage didn't run or profiling is disabled).
+	float get_stage_time(const STEP_STAGE stage) const;
+
+	// Particle-grid transfer policies, quadratic APIC by default. Can be changed between steps.
+	INTERPOLATION_KERNEL get_interpolation_kernel() const;
+
+	void set_interpolation_kernel(const INTERPOLATION_KERNEL kernel);
+
+	TRANSFER_SCHEME get_transfer_scheme() const;
+
+	void set_transfer_scheme(const TRANSFER_SCHEME scheme);
+
+	// Read-only views. Vectors are 3 floats, with backend-dependent stride.
+	virtual BufferView get_particles_positions() const = 0;
+
+	virtual BufferView get_particles_velocities() const = 0;
+
+	virtual BufferView get_whitewater_positions() const = 0;
+
+	virtual BufferView get_whitewater_types() const = 0;	// unsigned char: 1 = Spray, 2 = Bubble, 3 = Foam
+
+	virtual BufferView get_whitewater_lifetimes() const = 0;
+
+	// Dense grid of GridCell (see SparseGrid.hpp): get_cells_count() elements, x-major, with unallocated cells set to zero. Expanded from the sparse grid on request, so it's meant for visualization only.
+	// Empty for grids of more than MAX_DENSE_CELLS_NUM cells.
+	virtual BufferView get_cells() const = 0;
+
+	virtual void reset_simulation() = 0;
+
+	// Reorder all particle attributes by the Morton code of their enclosing cell, so that particles close in space are close in memory.
+	// Improves cache locality of the transfer stages and spreads atomic conflicts. Called automatically by step(), see sort_interval.
+	virtual void sort_particles() = 0;
+
+	virtual void spawn_particles_sphere() = 0;
+
+	virtual void spawn_particles_cube() = 0;
+
+	// The simulation always advances in steps of _timestep. If frametime il larger that _timestep, multiple iteration steps can be taken (set in main).
+	virtual void step() = 0;
+
+	// Advance the simulation by up to duration seconds, and return the time actually advanced.
+	// With adaptive_timestep, sub-steps by get_stable_timestep(), shortening the last steps to end exactly at duration (unless less than min_timestep is left).
+	// Otherwise takes as many steps of the fixed timestep as fit in duration.
+	// Unless health_check_interval is 0, particles are checked for blow-ups along the way. On blow-up, the state is rolled back to the last snapshot, and steps
+	// are retried with a halved timestep (down to MIN_TIMESTEP_SCALE, then from older snapshots). The timestep recovers by doubling at each new snapshot.
+	// The returned time includes the steps rolled back, as they aren't taken again: the simulation then falls behind by the time they covered
+	// (see get_lost_time()).
+	float advance(const float duration);
+
+	// Copy the dynamic state (particles, whitewater, step counters) to state, reusing its buffers.
+	void save_state(SimulationState& state) const;
+
+	// Restore a state from save_state(), of this backend or another one. Also restores the grid size and transfer policies the state was saved with.
+	void load_state(const SimulationState& state);
+
+	// Forget the rollback snapshots of advance() and reset the timestep scale, e.g. after loading a state from another point in time, which the
+	// snapshots would otherwise roll back past.
+	void discard_snapshots();
+
+	// Rollbacks of advance() since construction
+	unsigned int get_rollbacks_count() const;
+
+	// Steps taken by advance() since construction, rolled back ones included. Unlike get_steps_count(), never goes back.
+	unsigned long long get_advanced_steps_count() const;
+
+	// Simulated time of the steps rolled back by advance() since construction
+	double get_lost_time() const;
+
+	// Timestep reduction of advance() after rollbacks, in [MIN_TIMESTEP_SCALE, 1]
+	float get_timestep_scale() const;
+};
+
+// threads_count is only used by the CPU backend (0 = one per hardware thread).
+std::unique_ptr<SimulationBackend> create_simulation(
+	const SIMULATION_BACKEND backend,
+	glm::uvec3 grid_size,
+	const ParticleMaterial& particles_material,
+	const float timestep,
+	const float boundary = 0.0f,
+	const float boundary_elasticity = 0.3f,
+	const glm::vec3 gravity = glm::vec3(0.0f, -9.81f, 0.0f),
+	const unsigned int threads_count = 0
+);
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <glad/glad.h>
+
+#include <cuda.h>
+#include <cuda_gl_interop.h>
+
+#include <glm/glm.hpp>
+
+#include <MPM/ParticleCache.hpp>
+#include <MPM/SimulationBackend.hpp>
+#include <MPM/SparseGrid.hpp>
+
+// Regions of the persistent-mapped stream buffer, written in turn so that the CPU fills one while the GPU may still draw from the others
+const unsigned int STREAM_REGIONS_NUM = 3;
+
+// Owns the OpenGL buffers the Renderer draws the simulation from, and copies a SimulationBackend's state into them.
+// Host buffers are uploaded with glNamedBufferSubData, device buffers are copied on the GPU through CUDA-GL interop.
+// Cached frames are streamed through a persistent-mapped buffer instead, the particles VAOs then pointing into it.
+class SimulationGLAdapter
+{
+protected:
+
+	// OpenGL resources. Vectors are tightly packed (3 floats), whatever the backend stride. Cells are GridCell, as the backends lay them out.
+	GLuint _cells_VAO;
+	GLuint _cells_VBO;
+	unsigned int _cells_capacity;	// Grid buffers are resized when the grid grows
+	GLuint _particles_VAO;
+	GLuint _particles_positions_VBO;
+	GLuint _particles_velocities_VBO;
+	GLuint _whitewater_VAO;
+	GLuint _whitewater_positions_VBO;
+	GLuint _whitewater_types_VBO;
+	GLuint _whitewater_lifetimes_VBO;
+	// Used in instanced rendering, not in simulation
+	GLuint _quad_VBO;
+	glm::vec2 _quad_vertices[6] = {
+		{-0.5f, -0.5f},
+		{ 0.5f, -0.5f},
+		{-0.5f,  0.5f},
+
+		{ 0.5f, -0.5f},
+		{ 0.5f,  0.5f},
+		{-0.5f,  0.5f}
+	};
+	// CUDA resources, registered on first device upload
+	cudaGraphicsResource* _cells;
+	cudaGraphicsResource* _particles_positions;
+	cudaGraphicsResource* _particles_velocities;
+	cudaGraphicsResource* _whitewater_positions;
+	cudaGraphicsResource* _whitewater_types;
+	cudaGraphicsResource* _whitewater_lifetimes;
+	// Stream buffer of cached frames: STREAM_REGIONS_NUM regions, each holding the particles and whitewater arrays of a frame.
+	// Persistently and coherently mapped, so writes need no flush. Each region is fenced once drawn from, and waited for before reuse.
+	GLuint _stream_buffer;
+	char* _stream_data;
+	unsigned int _stream_particles_capacity;
+	unsigned int _stream_whitewater_capacity;
+	unsigned int _stream_region;
+	GLsync _stream_fences[STREAM_REGIONS_NUM];
+	bool _streaming;	// Whether the particles VAOs point into the stream buffer
+
+	unsigned int _particles_count;
+	unsigned int _whitewater_count;
+	unsigned int _cells_count;
+
+	void _allocate_cells_buffers(const unsigned int cells_count);
+
+	// (Re)allocate the stream buffer for frames of up to particles_count particles and whitewater_count whitewater
+	void _allocate_stream_buffer(const unsigned int particles_count, const unsigned int whitewater_count);
+
+	void _delete_stream_buffer();
+
+	// Bytes of a stream region, and offsets of its arrays from the start of the region
+	size_t _get_stream_region_size() const;
+
+	void _get_stream_offsets(size_t& particles_velocities, size_t& whitewater_positions, size_t& whitewater_lifetimes, size_t& whitewater_types) const;
+
+	// Point the particles and whitewater VAOs back to their own buffers, after streaming
+	void _unbind_stream_buffer();
+
+	// Copy view into the packed buffer, element_size bytes per element. resource is registered if needed.
+	void _upload(const BufferView& view, const unsigned int element_size, const GLuint VBO, cudaGraphicsResource*& resource);
+
+public:
+
+	// Particles and whitewater buffers are sized for the backend maximums. Requires a current OpenGL context.
+	SimulationGLAdapter(const SimulationBackend& sim);
+
+	~SimulationGLAdapter();
+
+	// Disable copy and move constructors and operators. Owns OpenGL resources.
+	SimulationGLAdapter(const SimulationGLAdapter&) = delete;
+	SimulationGLAdapter& operator=(const SimulationGLAdapter&) = delete;
+	SimulationGLAdapter(SimulationGLAdapter&&) = delete;
+	SimulationGLAdapter& operator=(SimulationGLAdapter&&) = delete;
+
+	void cleanup();
+
+	// Particles and whitewater
+	void upload_particles(const SimulationBackend& sim);
+
+	// Particles and whitewater of a cached frame, through the stream buffer. Waits only if the GPU still draws from the region being reused.
+	void upload_particles(const ParticleCacheFrame& frame);
+
+	// Grid cells. Only needed when drawing the grid.
+	void upload_grid(const SimulationBackend& sim);
+
+	GLuint get_particles_VAO() const;
+
+	unsigned int get_particles_count() const;
+
+	GLuint get_whitewater_VAO() const;
+
+	unsigned int get_whitewater_count() const;
+
+	GLuint get_cells_VAO() const;
+
+	unsigned int get_cells_count() const;
+};
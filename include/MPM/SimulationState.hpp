@@ -0,0 +1,37 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include <MPM/TransferPolicies.hpp>
+
+/*
+Dynamic state of a simulation, in host memory: everything a step reads and writes, as opposed to the parameters (material, gravity...) of SimulationBackend.
+Filled by SimulationBackend::save_state() and restored by load_state(). Buffers are resized to their counts, so saving into the same state again doesn't reallocate.
+Vectors are tightly packed, whatever the backend stride.
+*/
+struct SimulationState
+{
+	// Domain the particles positions are valid in: within the domain margin of the interpolation kernel
+	glm::uvec3 grid_size = glm::uvec3(0);
+	INTERPOLATION_KERNEL interpolation_kernel = INTERPOLATION_KERNEL_QUADRATIC;
+	TRANSFER_SCHEME transfer_scheme = TRANSFER_SCHEME_APIC;
+	float timestep = 0.0f;
+	unsigned long long steps_count = 0;
+	unsigned int steps_since_sort = 0;
+	// Particles
+	unsigned int particles_count = 0;
+	std::vector<glm::vec3> particles_positions;
+	std::vector<glm::vec3> particles_velocities;
+	std::vector<glm::mat3> particles_velocity_gradients;
+	// Backend-specific random number generator state of each particle, random_state_size bytes each. Reseeded when loaded into a backend with another size.
+	unsigned int random_state_size = 0;
+	std::vector<unsigned char> particles_random_states;
+	// Whitewater
+	unsigned int whitewater_count = 0;
+	std::vector<glm::vec3> whitewater_positions;
+	std::vector<glm::vec3> whitewater_velocities;
+	std::vector<unsigned char> whitewater_types;
+	std::vector<float> whitewater_lifetimes;
+};
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <MPM/SimulationBackend.hpp>
+#include <MPM/SimulationState.hpp>
+#include <utils/ThreadPool.hpp>
+
+/*
+In-memory history of a simulation, to rewind to an earlier step and simulate again from there, e.g. with another material.
+The state is recorded every record_interval steps, compressed: keyframes on their own, the records between them as differences to their
+keyframe. A keyframe and the records that depend on it form a segment. When the history grows past memory_budget, the least recently recorded or
+rewound to segments are evicted whole, except the one being recorded.
+Values are stored as the difference of their bits to a prediction (for floats of the same sign, their distance in units of least precision),
+zigzag-coded and bit-packed (see BitPacking.hpp). Keyframes predict a value from the previous particle (its neighbor once particles are sorted),
+other records from the same particle in their keyframe. Sorting reorders the particles, so the record after a sort is a keyframe. Whitewater
+isn't kept in order from a step to the next and is always predicted from the previous whitewater.
+Floats can be rounded to fewer mantissa bits first (mantissa_bits), which are then left out: a rewind is then no longer exact, but keeps
+about twice the history at 14 bits.
+Particles and whitewater are split in blocks of TIMELINE_BLOCK_ELEMENTS, encoded and decoded independently by a thread pool.
+update() only copies the state of the simulation into a queued state: encoding happens on the encoder thread, so the simulation doesn't wait for it
+unless it is rolled back, reset or rewound while records are still being encoded.
+*/
+
+const unsigned int TIMELINE_BLOCK_ELEMENTS = 16384;
+
+class SimulationTimeline
+{
+private:
+
+	struct Record
+	{
+		unsigned long long step = 0;
+		std::vector<unsigned char> data;	// Exactly sized, so that the memory budget accounts for it
+	};
+
+	struct Segment
+	{
+		Record keyframe;
+		std::vector<Record> deltas;	// In step order
+		unsigned long long last_use = 0;
+		size_t size = 0;			// Bytes of the records
+	};
+
+	// A state captured by update(), waiting for the encoder thread
+	struct QueuedState
+	{
+		std::unique_ptr<SimulationState> state;
+		unsigned long long step = 0;
+		bool sort_enabled = false;	// The simulation sorts its particles
+	};
+
+	ThreadPool _thread_pool;
+	std::vector<Segment> _segments;	// In step order
+	size_t _size = 0;
+	unsigned long long _uses = 0;	// Clock of the least recently used eviction
+	unsigned long long _last_record_step = 0;	// Queued or recorded, calling thread only
+	// Keyframe of the last segment, the reference of its next records. Only valid if _recording.
+	SimulationState _keyframe_state;
+	bool _recording = false;
+	SimulationState _state;						// Scratch state, restored
+	std::vector<unsigned char> _data;			// Encoder thread scratch encoding, copied to exactly sized records
+	std::vector<std::vector<unsigned char>> _blocks;	// Encoded blocks, reused
+	// Bounded queue of captured states, and the pool of states it reuses. _mutex guards them and the records: the encoder thread appends records
+	// while the calling thread reads them, and the calling thread only changes them while the encoder thread is idle.
+	std::thread _encoder;
+	mutable std::mutex _mutex;
+	std::condition_variable _queue_cv;	// Signaled when a state is queued, or on destruction
+	std::condition_variable _idle_cv;	// Signaled when a state is recorded
+	std::deque<QueuedState> _queue;
+	std::vector<std::unique_ptr<SimulationState>> _free_states;
+	bool _encoding = false;	// The encoder thread is recording a state taken from the queue
+	bool _closing = false;
+
+	void _encoder_loop();
+
+	// Wait until every queued state is recorded. lock holds _mutex.
+	void _wait_idle(std::unique_lock<std::mutex>& lock);
+
+	// Encode state into data, as differences to reference, or on its own if null
+	void _encode(SimulationState& state, const SimulationState* reference, std::vector<unsigned char>& data);
+
+	// Decode data into state, with the reference it was encoded with. Returns false if data is invalid.
+	bool _decode(const std::vector<unsigned char>& data, const SimulationState* reference, SimulationState& state);
+
+	// Discard the records from step on, e.g. of a simulation that was rolled back or reset. The encoder thread must be idle.
+	void _truncate(const unsigned long long step);
+
+	// Evict least recently used segments until within memory_budget
+	void _evict();
+
+public:
+
+	unsigned int record_interval = 10;		// Steps from a record to the next
+	unsigned int keyframe_interval = 10;	// Records from a keyframe to the next, at most
+	size_t memory_budget = (size_t) 1 << 30;	// Bytes of records
+	unsigned int mantissa_bits = 23;		// Mantissa bits kept of recorded floats: 23 is lossless, fewer trade precision for history
+	unsigned int max_queued_records = 2;	// States captured but not yet encoded, each the size of the simulation state. When full, records are delayed.
+
+	// threads_count: 0 = one per hardware thread
+	explicit SimulationTimeline(const unsigned int threads_count = 0);
+
+	~SimulationTimeline();
+
+	// Disable copy and move constructors and operators: the encoder thread holds a pointer to the timeline.
+	SimulationTimeline(const SimulationTimeline&) = delete;
+	SimulationTimeline& operator=(const SimulationTimeline&) = delete;
+	SimulationTimeline(SimulationTimeline&&) = delete;
+	SimulationTimeline& operator=(SimulationTimeline&&) = delete;
+
+	void clear();
+
+	// Record the state of sim if record_interval steps passed since the last record. Call after each step or advance(). Records after the current
+	// step, of a simulation rolled back or reset since, are discarded. Only copies the state: it is encoded on the encoder thread. If
+	// max_queued_records are already waiting for it, the record is left to the next call instead.
+	void update(const SimulationBackend& sim);
+
+	// Restore the last record at or before step into sim, and step it up to step (more steps when records around step were evicted). The records
+	// after it are discarded: the simulation goes on from there. Returns false (and reports to std::cerr) if there is no such record.
+	bool rewind(SimulationBackend& sim, const unsigned long long step);
+
+	bool is_empty() const;
+
+	// Steps of the first and last records
+	unsigned long long get_first_step() const;
+
+	unsigned long long get_last_step() const;
+
+	unsigned int get_records_count() const;
+
+	// Bytes of the records
+	size_t get_size() const;
+};
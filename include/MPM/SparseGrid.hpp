@@ -0,0 +1,145 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+// Usable both in host code and in CUDA kernels
+#ifdef __CUDACC__
+	#define SPARSE_GRID_QUALIFIER __host__ __device__ inline
+#else
+	#define SPARSE_GRID_QUALIFIER inline
+#endif
+
+/*
+Sparse grid layout, shared by the simulation backends.
+The domain is split in blocks of GRID_BLOCK_SIZE^3 cells. Each step, only the blocks covered by the stencil of some particle (STENCIL_SIZE^3 cells of the interpolation kernel, see TransferPolicies.hpp) are allocated, from a pool of blocks.
+The block table has one entry per domain block, indexed by the block key (x-major linear index of the block coords, as the dense grid), holding the pool index of the block or GRID_BLOCK_NONE.
+The cells of a block are contiguous in the pool, in the order of a cell order policy: x-major as well by default (GridCellOrderLinear).
+*/
+const unsigned int GRID_BLOCK_SIZE_LOG2 = 2;
+const unsigned int GRID_BLOCK_SIZE = 1 << GRID_BLOCK_SIZE_LOG2;
+const unsigned int GRID_BLOCK_CELLS_NUM = GRID_BLOCK_SIZE * GRID_BLOCK_SIZE * GRID_BLOCK_SIZE;
+const unsigned int GRID_BLOCK_NONE = 0xFFFFFFFFu;	// Block table entry of unallocated blocks
+const unsigned int GRID_BLOCK_MARKED = 0xFFFFFFFEu;	// Block table entry of blocks reserved for this step, until they get their pool index
+
+// Grid cell, with the mass in the fourth lane of the velocity: a cell is a single 16-byte load, and a whole cell is in the same cache line. Velocity holds the momentum until the grid update.
+struct alignas(16) GridCell
+{
+	glm::vec3 velocity;
+	float mass;
+};
+static_assert(sizeof(GridCell) == 4 * sizeof(float), "GridCell must be a single 16-byte vector");
+
+/*
+Orders of the cells within a block, as policies for the CellOrder template parameter of the functions and kernels that index cells.
+The index of a cell within its block is the OR of the bits of each of its coords relative to the block origin, so that kernels can build it one axis at a time.
+get_axis_bits() takes unsigned int, or a vector of them with &, | and << (such as the VInt of the CPU transfer kernels).
+*/
+
+// x-major, as the dense grid: each row of GRID_BLOCK_SIZE cells along z is 64 consecutive bytes
+struct GridCellOrderLinear
+{
+	// Bits of the block cell index of the coord along axis
+	template <typename T>
+	static SPARSE_GRID_QUALIFIER T get_axis_bits(const T& block_coord, const unsigned int axis)
+	{
+		return block_coord << ((2 - axis) * GRID_BLOCK_SIZE_LOG2);
+	}
+
+	// Coord along axis of the cell with the given block cell index
+	static SPARSE_GRID_QUALIFIER unsigned int get_block_coord(const unsigned int block_cell_idx, const unsigned int axis)
+	{
+		return (block_cell_idx >> ((2 - axis) * GRID_BLOCK_SIZE_LOG2)) & (GRID_BLOCK_SIZE - 1);
+	}
+};
+
+// Morton (Z-order) with x as the most significant axis: every aligned 2x2x2 octant is 128 consecutive bytes
+struct GridCellOrderMorton
+{
+	template <typename T>
+	static SPARSE_GRID_QUALIFIER T get_axis_bits(const T& block_coord, const unsigned int axis)
+	{
+		// Bit b of the coord goes to bit 3 * b + 2 - axis
+		T bits = (block_coord & 1u) << (2 - axis);
+		for (unsigned int b = 1; b < GRID_BLOCK_SIZE_LOG2; ++b) bits = bits | ((block_coord & (1u << b)) << (2 * b + 2 - axis));
+		return bits;
+	}
+
+	static SPARSE_GRID_QUALIFIER unsigned int get_block_coord(const unsigned int block_cell_idx, const unsigned int axis)
+	{
+		unsigned int block_coord = 0;
+		for (unsigned int b = 0; b < GRID_BLOCK_SIZE_LOG2; ++b) block_coord |= ((block_cell_idx >> (3 * b + 2 - axis)) & 1u) << b;
+		return block_coord;
+	}
+};
+
+// Domain size in blocks, rounded up
+SPARSE_GRID_QUALIFIER glm::uvec3 get_grid_blocks_size(const glm::uvec3& grid_size)
+{
+	return glm::uvec3(
+		(grid_size.x + GRID_BLOCK_SIZE - 1) >> GRID_BLOCK_SIZE_LOG2,
+		(grid_size.y + GRID_BLOCK_SIZE - 1) >> GRID_BLOCK_SIZE_LOG2,
+		(grid_size.z + GRID_BLOCK_SIZE - 1) >> GRID_BLOCK_SIZE_LOG2
+	);
+}
+
+// Coords of the block enclosing cell_coords
+SPARSE_GRID_QUALIFIER glm::uvec3 get_grid_block_coords(const glm::ivec3& cell_coords)
+{
+	return glm::uvec3(cell_coords.x >> GRID_BLOCK_SIZE_LOG2, cell_coords.y >> GRID_BLOCK_SIZE_LOG2, cell_coords.z >> GRID_BLOCK_SIZE_LOG2);
+}
+
+// Block table index of the block at block_coords
+SPARSE_GRID_QUALIFIER unsigned int get_grid_block_key(const glm::uvec3& block_coords, const glm::uvec3& blocks_size)
+{
+	return block_coords.x * blocks_size.y * blocks_size.z + block_coords.y * blocks_size.z + block_coords.z;
+}
+
+// Coords of the first cell of the block with the given key
+SPARSE_GRID_QUALIFIER glm::uvec3 get_grid_block_origin(const unsigned int block_key, const glm::uvec3& blocks_size)
+{
+	const unsigned int blocks_size_yz = blocks_size.y * blocks_size.z;
+	return glm::uvec3(
+		(block_key / blocks_size_yz) << GRID_BLOCK_SIZE_LOG2,
+		((block_key % blocks_size_yz) / blocks_size.z) << GRID_BLOCK_SIZE_LOG2,
+		((block_key % blocks_size_yz) % blocks_size.z) << GRID_BLOCK_SIZE_LOG2
+	);
+}
+
+// Index of the cell at cell_coords within its block
+template <typename CellOrder = GridCellOrderLinear>
+SPARSE_GRID_QUALIFIER unsigned int get_grid_block_cell_idx(const glm::ivec3& cell_coords)
+{
+	const unsigned int mask = GRID_BLOCK_SIZE - 1;
+	return CellOrder::get_axis_bits(cell_coords.x & mask, 0) | CellOrder::get_axis_bits(cell_coords.y & mask, 1) | CellOrder::get_axis_bits(cell_coords.z & mask, 2);
+}
+
+// Coords of a cell relative to its block origin, from its index within the block
+template <typename CellOrder = GridCellOrderLinear>
+SPARSE_GRID_QUALIFIER glm::uvec3 get_grid_block_cell_offset(const unsigned int block_cell_idx)
+{
+	return glm::uvec3(CellOrder::get_block_coord(block_cell_idx, 0), CellOrder::get_block_coord(block_cell_idx, 1), CellOrder::get_block_coord(block_cell_idx, 2));
+}
+
+// Pool index of the cell at cell_coords. Its block must be allocated.
+template <typename CellOrder = GridCellOrderLinear>
+SPARSE_GRID_QUALIFIER unsigned int get_grid_cell_idx(const unsigned int* const block_table, const glm::uvec3& blocks_size, const glm::ivec3& cell_coords)
+{
+	return block_table[get_grid_block_key(get_grid_block_coords(cell_coords), blocks_size)] * GRID_BLOCK_CELLS_NUM + get_grid_block_cell_idx<CellOrder>(cell_coords);
+}
+
+// Pool index of the cell at cell_coords, or GRID_BLOCK_NONE if its block isn't allocated (i.e. the cell is empty).
+template <typename CellOrder = GridCellOrderLinear>
+SPARSE_GRID_QUALIFIER unsigned int find_grid_cell_idx(const unsigned int* const block_table, const glm::uvec3& blocks_size, const glm::ivec3& cell_coords)
+{
+	const unsigned int block_idx = block_table[get_grid_block_key(get_grid_block_coords(cell_coords), blocks_size)];
+	return block_idx == GRID_BLOCK_NONE ? GRID_BLOCK_NONE : block_idx * GRID_BLOCK_CELLS_NUM + get_grid_block_cell_idx<CellOrder>(cell_coords);
+}
+
+// Index in the dense (x-major) grid of a cell given by block key and index within the block, or GRID_BLOCK_NONE if the block overhangs the domain edge there
+template <typename CellOrder = GridCellOrderLinear>
+SPARSE_GRID_QUALIFIER unsigned int get_grid_dense_cell_idx(const unsigned int block_key, const unsigned int block_cell_idx, const glm::uvec3& blocks_size, const glm::uvec3& grid_size)
+{
+	const glm::uvec3 cell_coords = get_grid_block_origin(block_key, blocks_size) + get_grid_block_cell_offset<CellOrder>(block_cell_idx);
+	if (cell_coords.x >= grid_size.x || cell_coords.y >= grid_size.y || cell_coords.z >= grid_size.z) return GRID_BLOCK_NONE;
+	return cell_coords.x * grid_size.y * grid_size.z + cell_coords.y * grid_size.z + cell_coords.z;
+}
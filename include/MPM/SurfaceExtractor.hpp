@@ -0,0 +1,126 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include <MPM/ParticleMaterial.hpp>
+#include <MPM/SimulationBackend.hpp>
+#include <MPM/SparseGrid.hpp>
+#include <utils/ThreadPool.hpp>
+
+/*
+Fluid surface extraction for offline output: a triangle mesh of the iso-surface of a density field, by marching cubes.
+The field is either the mass of the simulation grid cells, one sample per cell center (cheap, but as coarse as the grid), or a density splatted from
+the particles at resolution samples per cell. Both are in rest densities, and the surface is where they cross iso_density. The field has a layer of
+empty samples around the domain, so that the surface is closed where the fluid touches the domain boundary.
+The field is split in blocks of SURFACE_BLOCK_SIZE^3 cubes (the cells between 8 samples), processed independently by a thread pool. The particles are
+binned by block and splatted in 8 passes over the blocks of a color, as the colored P2G scatter of the CPU backend: particles reach at most half a
+block away, so that blocks of a color never write the same sample.
+Marching cubes then runs in two passes over the blocks:
+	1. Each block computes the vertices of the cube edges it owns, those starting at one of its samples, into a table of its edges.
+	2. Each block emits the triangles of its cubes, looking up the vertices of the edges on its upper faces in the tables of its neighbors.
+Vertices on edges shared by cubes, within a block or across blocks, are thus computed once: the mesh is indexed and watertight.
+Cube cases are triangulated from the contours of the surface on the cube faces, with ambiguous faces always separating their inside corners, so
+that neighbor cubes agree on the contour of their shared face.
+*/
+
+const unsigned int SURFACE_BLOCK_SIZE = 16;	// Cubes per block along each axis
+const uint32_t SURFACE_VERTEX_NONE = 0xFFFFFFFFu;	// Edge table entry of edges the surface doesn't cross
+
+// Density field of the surface
+enum SURFACE_FIELD
+{
+	SURFACE_FIELD_GRID_MASS	= 0,	// Mass of the simulation grid cells
+	SURFACE_FIELD_PARTICLES	= 1,	// Particles splatted by a smoothing kernel of smoothing_radius
+};
+
+// Indexed triangle mesh, in grid cells as the particles
+struct SurfaceMesh
+{
+	std::vector<glm::vec3> positions;
+	std::vector<glm::vec3> normals;	// Unit, pointing out of the fluid
+	std::vector<uint32_t> indices;	// 3 per triangle, counter-clockwise seen from outside the fluid
+};
+
+class SurfaceExtractor
+{
+private:
+
+	struct Block
+	{
+		glm::uvec3 origin;			// First sample
+		glm::uvec3 size;			// Cubes along each axis
+		bool active = false;		// Some of its samples are on each side of the surface
+		std::vector<uint32_t> edge_vertices;	// Vertex in the block of each owned edge (3 per sample of its cubes), or SURFACE_VERTEX_NONE. Empty if inactive.
+		std::vector<glm::vec3> positions;
+		std::vector<glm::vec3> normals;
+		std::vector<uint32_t> indices;	// Into the mesh
+		uint32_t vertices_offset = 0;	// Of its first vertex in the mesh
+		size_t indices_offset = 0;
+	};
+
+	ThreadPool _thread_pool;
+	glm::uvec3 _field_size;		// Samples along each axis
+	glm::vec3 _field_origin;	// Position of the first sample
+	float _field_spacing;		// Cells between samples
+	std::vector<float> _field;	// x-major, as the dense grid
+	glm::uvec3 _blocks_size;
+	std::vector<Block> _blocks;		// x-major, buffers reused
+	std::vector<GridCell> _cells;	// Scratch copy of the simulation grid
+	std::vector<glm::vec3> _particles_positions;	// Scratch copy of the simulation particles
+	std::vector<glm::vec3> _binned_positions;		// Particles sorted by block
+	std::vector<uint32_t> _bins;	// Offset of the particles of each block in _binned_positions, and their total
+	std::vector<unsigned int> _color_blocks;	// Keys of the blocks with particles, by color (the parity of their coords)
+	unsigned int _color_blocks_offsets[9];
+
+	// Size the field and its blocks, for samples spacing cells apart from origin
+	void _resize_field(const glm::uvec3 size, const glm::vec3 origin, const float spacing);
+
+	size_t _get_sample_idx(const glm::uvec3& sample) const;
+
+	unsigned int _get_block_key(const glm::uvec3& block_coords) const;
+
+	// Block owning sample: the one of the cube starting at it, or of the last cube along axes where it's the last sample
+	unsigned int _get_sample_block_key(const glm::uvec3& sample) const;
+
+	// Samples of block written by it: those starting its cubes, and the last samples of the field along axes where the block is the last one
+	glm::uvec3 _get_owned_samples_end(const Block& block) const;
+
+	void _fill_field_grid_mass(const float rest_density);
+
+	void _fill_field_particles(const std::vector<glm::vec3>& positions, const float particle_mass, const float rest_density);
+
+	// Unnormalized gradient of the field at sample, by central differences (one-sided at the field bounds)
+	glm::vec3 _get_field_gradient(const glm::uvec3& sample) const;
+
+	// Marching cubes over the field, in the two passes described above, then gathered into mesh
+	void _polygonize(SurfaceMesh& mesh);
+
+	void _compute_block_vertices(Block& block);
+
+	void _compute_block_triangles(Block& block);
+
+public:
+
+	float iso_density = 0.5f;		// Surface level, in rest densities
+	float resolution = 2.0f;		// SURFACE_FIELD_PARTICLES only: samples per cell along each axis
+	float smoothing_radius = 1.0f;	// SURFACE_FIELD_PARTICLES only: splat radius of a particle in cells, at most SURFACE_BLOCK_SIZE / 2 samples
+
+	// threads_count: 0 = one per hardware thread
+	explicit SurfaceExtractor(const unsigned int threads_count = 0);
+
+	// Extract the fluid surface of sim from field into mesh. Copies the simulation buffers, so it also works on the CUDA backend.
+	// Returns false (and reports to std::cerr) for SURFACE_FIELD_GRID_MASS on grids of more than MAX_DENSE_CELLS_NUM cells.
+	bool extract(const SimulationBackend& sim, const SURFACE_FIELD field, SurfaceMesh& mesh);
+
+	// Extract the surface of particles in a domain of grid_size cells from their splatted density, e.g. of a particle cache frame
+	void extract_particles(const std::vector<glm::vec3>& positions, const glm::uvec3 grid_size, const ParticleMaterial& material, SurfaceMesh& mesh);
+};
+
+// Write mesh to path: Wavefront OBJ (text) if path ends with .obj, binary little-endian PLY otherwise.
+// Returns false (and reports to std::cerr) on failure.
+bool save_surface_mesh(const SurfaceMesh& mesh, const std::string& path);
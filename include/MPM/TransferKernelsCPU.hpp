@@ -0,0 +1,96 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <MPM/SparseGrid.hpp>
+#include <MPM/TransferPolicies.hpp>
+
+/*
+Particle-grid transfer kernels of the CPU backend, on SoA particles in batches of one SIMD vector.
+The same source (TransferKernelsCPUImpl.hpp) is compiled once per instruction set, and the best one supported by the running CPU is picked at runtime.
+Each build is instantiated for every cell order policy (see SparseGrid.hpp), interpolation kernel and transfer scheme (see TransferPolicies.hpp), also picked at runtime.
+*/
+
+// Instruction sets of the transfer kernels, from the baseline of the target architecture up
+enum CPU_ISA
+{
+	CPU_ISA_SCALAR	= 0,
+	CPU_ISA_AVX2	= 1,	// AVX2 + FMA
+	CPU_ISA_AVX512	= 2,	// AVX-512 F, VL, DQ
+	CPU_ISA_NUM		= 3,
+};
+
+// Orders of the cells within grid blocks, one per cell order policy
+enum GRID_CELL_ORDER
+{
+	GRID_CELL_ORDER_LINEAR	= 0,	// GridCellOrderLinear
+	GRID_CELL_ORDER_MORTON	= 1,	// GridCellOrderMorton
+	GRID_CELL_ORDER_NUM		= 2,
+};
+
+// Simulation state read and written by the kernels
+struct TransferKernelArgs
+{
+	// Sparse grid (see SparseGrid.hpp), with cells in the order the kernels were instantiated for
+	const unsigned int* grid_block_table;
+	glm::uvec3 grid_blocks_size;
+	glm::uvec3 grid_size;
+	GridCell* cells;
+	// Grid of the next step, laid out as the current one, only written by g2p_p2g
+	const unsigned int* next_grid_block_table;
+	GridCell* next_cells;
+	// Grid velocities before forces, pool indexed as the cells, only with PIC/FLIP (nullptr otherwise): P2G scatters momentum without stress to them, normalized by the grid update
+	glm::vec3* cells_old_velocities;
+	glm::vec3* next_cells_old_velocities;
+	// Particles, SoA streams (see ParticlesSoA)
+	float* positions[3];
+	float* velocities[3];
+	float* velocity_gradients[9];
+	float* densities;
+	// Material and step parameters
+	float particle_mass;
+	float rest_density;
+	float dynamic_viscosity;
+	float EOS_stiffness;
+	float EOS_power;
+	int EOS_integer_power;	// get_eos_integer_power(EOS_power)
+	float max_negative_pressure;
+	float timestep;
+	float boundary;
+	float boundary_elasticity;
+	float whitewater_chance_min;
+	float whitewater_chance_max;
+	float flip_ratio;	// PIC/FLIP only
+};
+
+// Kernels compiled for one instruction set, cell order, interpolation kernel and transfer scheme
+struct TransferKernelsCPU
+{
+	// Scatter the mass of particles particle_indices[begin, end) to the grid, or of particles [begin, end) if particle_indices is nullptr. Indices must be increasing. Atomic adds unless the caller guarantees no other thread writes the same cells.
+	void (*p2g_mass)(const TransferKernelArgs& args, const unsigned int* particle_indices, const unsigned int begin, const unsigned int end, const bool atomic);
+
+	// Same as p2g_mass, for momentum and stress. Needs the grid masses.
+	void (*p2g_momentum)(const TransferKernelArgs& args, const unsigned int* particle_indices, const unsigned int begin, const unsigned int end, const bool atomic);
+
+	// p2g_mass and p2g_momentum in a single pass, with the particle densities estimated by the previous g2p in place of the grid masses
+	void (*p2g_fused)(const TransferKernelArgs& args, const unsigned int* particle_indices, const unsigned int begin, const unsigned int end, const bool atomic);
+
+	// Gather new velocities and velocity gradients of particles [begin, end) from the grid, and advect them. Particle densities are also estimated from the grid masses, unless args.densities is nullptr.
+	// Whitewater is left to the caller: the spawn chance and displacement of each particle are written to spawn_chances and displacements, indexed from begin. If spawn_chances is nullptr, no whitewater is spawned and its estimate is skipped.
+	void (*g2p)(const TransferKernelArgs& args, const unsigned int begin, const unsigned int end, float* const spawn_chances, float* const displacements[3]);
+
+	// g2p of particles particle_indices[begin, end) (or [begin, end), as p2g_mass), each directly followed by its p2g_fused into the next grid. Densities are always estimated.
+	// Particles whose stencil moved more than 1 cell along an axis are not scattered: returns whether every particle was. Atomic adds, and whitewater outputs, as p2g_mass and g2p.
+	bool (*g2p_p2g)(const TransferKernelArgs& args, const unsigned int* particle_indices, const unsigned int begin, const unsigned int end, const bool atomic, float* const spawn_chances, float* const displacements[3]);
+};
+
+// Best instruction set supported by the CPU and OS
+CPU_ISA get_supported_cpu_isa();
+
+// Kernels for isa, which must be supported, cell_order, interpolation kernel and transfer scheme
+const TransferKernelsCPU& get_transfer_kernels(const CPU_ISA isa, const GRID_CELL_ORDER cell_order, const INTERPOLATION_KERNEL kernel, const TRANSFER_SCHEME scheme);
+
+// Lowercase name, e.g. for benchmark reports and command line options
+const char* get_cpu_isa_name(const CPU_ISA isa);
+
+const char* get_grid_cell_order_name(const GRID_CELL_ORDER cell_order);
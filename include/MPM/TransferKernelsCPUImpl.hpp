@@ -0,0 +1,711 @@
+#pragma once
+
+/*
+Body of the CPU transfer kernels (see TransferKernelsCPU.hpp). Only included by the TransferKernelsCPU sources, once each: they define TRANSFER_KERNELS_NAMESPACE and TRANSFER_KERNELS_ISA (a CPU_ISA value), and are compiled with the flags of that instruction set.
+Kernels are written once, on the VFloat, VInt and VMask vector types of the instruction set: a batch of W particles is processed one particle per lane, with the same math as the CUDA kernels.
+Everything but the kernels table has internal linkage, and the kernels call no inline std functions (std::min, std::pow, std::atomic_ref...): unless inlined, each build
+would emit a weak copy of them, and the linker could keep the one built for a wider instruction set than the running CPU's. They use the helpers below instead.
+*/
+
+#include <cmath>
+#include <cstring>
+
+#if TRANSFER_KERNELS_ISA != 0
+	#include <immintrin.h>
+#endif
+#ifdef _MSC_VER
+	#include <intrin.h>
+#endif
+
+#include <MPM/TransferKernelsCPU.hpp>
+#include <MPM/SparseGrid.hpp>
+#include <MPM/EquationOfState.hpp>
+#include <MPM/TransferPolicies.hpp>
+
+namespace TRANSFER_KERNELS_NAMESPACE
+{
+namespace
+{
+	//// Vector types: VFloat and VInt hold W floats and unsigned ints, VMask the result of a comparison ////
+
+#if TRANSFER_KERNELS_ISA == 2	// CPU_ISA_AVX512
+
+	const unsigned int W = 16;
+
+	struct VMask { __mmask16 v; };
+
+	struct VInt
+	{
+		__m512i v;
+		static VInt set(const unsigned int x) { return { _mm512_set1_epi32((int) x) }; }
+		static VInt load(const unsigned int* const p) { return { _mm512_loadu_si512(p) }; }
+		static VInt gather(const unsigned int* const base, const VInt& indices) { return { _mm512_i32gather_epi32(indices.v, base, 4) }; }
+		void store(unsigned int* const p) const { _mm512_storeu_si512(p, v); }
+	};
+	inline VInt operator+(const VInt& a, const VInt& b) { return { _mm512_add_epi32(a.v, b.v) }; }
+	inline VInt operator*(const VInt& a, const VInt& b) { return { _mm512_mullo_epi32(a.v, b.v) }; }
+	inline VInt operator&(const VInt& a, const VInt& b) { return { _mm512_and_si512(a.v, b.v) }; }
+	inline VInt operator|(const VInt& a, const VInt& b) { return { _mm512_or_si512(a.v, b.v) }; }
+	inline VInt operator>>(const VInt& a, const unsigned int n) { return { _mm512_srl_epi32(a.v, _mm_cvtsi32_si128((int) n)) }; }
+	inline VInt operator<<(const VInt& a, const unsigned int n) { return { _mm512_sll_epi32(a.v, _mm_cvtsi32_si128((int) n)) }; }
+	inline VMask operator==(const VInt& a, const VInt& b) { return { _mm512_cmpeq_epi32_mask(a.v, b.v) }; }
+	inline VMask operator|(const VMask& a, const VMask& b) { return { (__mmask16) (a.v | b.v) }; }
+	inline VInt select(const VMask& mask, const VInt& if_true, const VInt& if_false) { return { _mm512_mask_blend_epi32(mask.v, if_false.v, if_true.v) }; }
+
+	struct VFloat
+	{
+		__m512 v;
+		static VFloat set(const float x) { return { _mm512_set1_ps(x) }; }
+		static VFloat load(const float* const p) { return { _mm512_loadu_ps(p) }; }
+		static VFloat gather(const float* const base, const VInt& indices) { return { _mm512_i32gather_ps(indices.v, base, 4) }; }
+		void store(float* const p) const { _mm512_storeu_ps(p, v); }
+	};
+	inline VFloat operator+(const VFloat& a, const VFloat& b) { return { _mm512_add_ps(a.v, b.v) }; }
+	inline VFloat operator-(const VFloat& a, const VFloat& b) { return { _mm512_sub_ps(a.v, b.v) }; }
+	inline VFloat operator*(const VFloat& a, const VFloat& b) { return { _mm512_mul_ps(a.v, b.v) }; }
+	inline VFloat operator/(const VFloat& a, const VFloat& b) { return { _mm512_div_ps(a.v, b.v) }; }
+	inline VMask operator<(const VFloat& a, const VFloat& b) { return { _mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ) }; }
+	inline VMask operator>(const VFloat& a, const VFloat& b) { return { _mm512_cmp_ps_mask(a.v, b.v, _CMP_GT_OQ) }; }
+	inline VFloat select(const VMask& mask, const VFloat& if_true, const VFloat& if_false) { return { _mm512_mask_blend_ps(mask.v, if_false.v, if_true.v) }; }
+	inline VFloat sqrt(const VFloat& a) { return { _mm512_sqrt_ps(a.v) }; }
+	inline VInt truncate(const VFloat& a) { return { _mm512_cvttps_epi32(a.v) }; }
+	inline VFloat to_float(const VInt& a) { return { _mm512_cvtepi32_ps(a.v) }; }
+
+#elif TRANSFER_KERNELS_ISA == 1	// CPU_ISA_AVX2
+
+	const unsigned int W = 8;
+
+	struct VMask { __m256i v; };	// All bits set in true lanes
+
+	struct VInt
+	{
+		__m256i v;
+		static VInt set(const unsigned int x) { return { _mm256_set1_epi32((int) x) }; }
+		static VInt load(const unsigned int* const p) { return { _mm256_loadu_si256((const __m256i*) p) }; }
+		static VInt gather(const unsigned int* const base, const VInt& indices) { return { _mm256_i32gather_epi32((const int*) base, indices.v, 4) }; }
+		void store(unsigned int* const p) const { _mm256_storeu_si256((__m256i*) p, v); }
+	};
+	inline VInt operator+(const VInt& a, const VInt& b) { return { _mm256_add_epi32(a.v, b.v) }; }
+	inline VInt operator*(const VInt& a, const VInt& b) { return { _mm256_mullo_epi32(a.v, b.v) }; }
+	inline VInt operator&(const VInt& a, const VInt& b) { return { _mm256_and_si256(a.v, b.v) }; }
+	inline VInt operator|(const VInt& a, const VInt& b) { return { _mm256_or_si256(a.v, b.v) }; }
+	inline VInt operator>>(const VInt& a, const unsigned int n) { return { _mm256_srl_epi32(a.v, _mm_cvtsi32_si128((int) n)) }; }
+	inline VInt operator<<(const VInt& a, const unsigned int n) { return { _mm256_sll_epi32(a.v, _mm_cvtsi32_si128((int) n)) }; }
+	inline VMask operator==(const VInt& a, const VInt& b) { return { _mm256_cmpeq_epi32(a.v, b.v) }; }
+	inline VMask operator|(const VMask& a, const VMask& b) { return { _mm256_or_si256(a.v, b.v) }; }
+	inline VInt select(const VMask& mask, const VInt& if_true, const VInt& if_false) { return { _mm256_blendv_epi8(if_false.v, if_true.v, mask.v) }; }
+
+	struct VFloat
+	{
+		__m256 v;
+		static VFloat set(const float x) { return { _mm256_set1_ps(x) }; }
+		static VFloat load(const float* const p) { return { _mm256_loadu_ps(p) }; }
+		static VFloat gather(const float* const base, const VInt& indices) { return { _mm256_i32gather_ps(base, indices.v, 4) }; }
+		void store(float* const p) const { _mm256_storeu_ps(p, v); }
+	};
+	inline VFloat operator+(const VFloat& a, const VFloat& b) { return { _mm256_add_ps(a.v, b.v) }; }
+	inline VFloat operator-(const VFloat& a, const VFloat& b) { return { _mm256_sub_ps(a.v, b.v) }; }
+	inline VFloat operator*(const VFloat& a, const VFloat& b) { return { _mm256_mul_ps(a.v, b.v) }; }
+	inline VFloat operator/(const VFloat& a, const VFloat& b) { return { _mm256_div_ps(a.v, b.v) }; }
+	inline VMask operator<(const VFloat& a, const VFloat& b) { return { _mm256_castps_si256(_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ)) }; }
+	inline VMask operator>(const VFloat& a, const VFloat& b) { return { _mm256_castps_si256(_mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ)) }; }
+	inline VFloat select(const VMask& mask, const VFloat& if_true, const VFloat& if_false) { return { _mm256_blendv_ps(if_false.v, if_true.v, _mm256_castsi256_ps(mask.v)) }; }
+	inline VFloat sqrt(const VFloat& a) { return { _mm256_sqrt_ps(a.v) }; }
+	inline VInt truncate(const VFloat& a) { return { _mm256_cvttps_epi32(a.v) }; }
+	inline VFloat to_float(const VInt& a) { return { _mm256_cvtepi32_ps(a.v) }; }
+
+#else	// CPU_ISA_SCALAR: one lane
+
+	const unsigned int W = 1;
+
+	struct VMask { bool v; };
+
+	struct VInt
+	{
+		unsigned int v;
+		static VInt set(const unsigned int x) { return { x }; }
+		static VInt load(const unsigned int* const p) { return { *p }; }
+		static VInt gather(const unsigned int* const base, const VInt& indices) { return { base[indices.v] }; }
+		void store(unsigned int* const p) const { *p = v; }
+	};
+	inline VInt operator+(const VInt& a, const VInt& b) { return { a.v + b.v }; }
+	inline VInt operator*(const VInt& a, const VInt& b) { return { a.v * b.v }; }
+	inline VInt operator&(const VInt& a, const VInt& b) { return { a.v & b.v }; }
+	inline VInt operator|(const VInt& a, const VInt& b) { return { a.v | b.v }; }
+	inline VInt operator>>(const VInt& a, const unsigned int n) { return { a.v >> n }; }
+	inline VInt operator<<(const VInt& a, const unsigned int n) { return { a.v << n }; }
+	inline VMask operator==(const VInt& a, const VInt& b) { return { a.v == b.v }; }
+	inline VMask operator|(const VMask& a, const VMask& b) { return { a.v || b.v }; }
+	inline VInt select(const VMask& mask, const VInt& if_true, const VInt& if_false) { return mask.v ? if_true : if_false; }
+
+	struct VFloat
+	{
+		float v;
+		static VFloat set(const float x) { return { x }; }
+		static VFloat load(const float* const p) { return { *p }; }
+		static VFloat gather(const float* const base, const VInt& indices) { return { base[indices.v] }; }
+		void store(float* const p) const { *p = v; }
+	};
+	inline VFloat operator+(const VFloat& a, const VFloat& b) { return { a.v + b.v }; }
+	inline VFloat operator-(const VFloat& a, const VFloat& b) { return { a.v - b.v }; }
+	inline VFloat operator*(const VFloat& a, const VFloat& b) { return { a.v * b.v }; }
+	inline VFloat operator/(const VFloat& a, const VFloat& b) { return { a.v / b.v }; }
+	inline VMask operator<(const VFloat& a, const VFloat& b) { return { a.v < b.v }; }
+	inline VMask operator>(const VFloat& a, const VFloat& b) { return { a.v > b.v }; }
+	inline VFloat select(const VMask& mask, const VFloat& if_true, const VFloat& if_false) { return mask.v ? if_true : if_false; }
+	inline VFloat sqrt(const VFloat& a) { return { ::sqrtf(a.v) }; }
+	inline VInt truncate(const VFloat& a) { return { (unsigned int) (int) a.v }; }
+	inline VFloat to_float(const VInt& a) { return { (float) (int) a.v }; }
+
+#endif
+
+	inline VFloat operator+(const VFloat& a, const float b) { return a + VFloat::set(b); }
+	inline VFloat operator-(const VFloat& a, const float b) { return a - VFloat::set(b); }
+	inline VFloat operator+(const float a, const VFloat& b) { return VFloat::set(a) + b; }
+	inline VFloat operator-(const float a, const VFloat& b) { return VFloat::set(a) - b; }
+	inline VFloat operator*(const VFloat& a, const float b) { return a * VFloat::set(b); }
+	inline VFloat operator*(const float a, const VFloat& b) { return VFloat::set(a) * b; }
+	inline VMask operator<(const VFloat& a, const float b) { return a < VFloat::set(b); }
+	inline VMask operator>(const VFloat& a, const float b) { return a > VFloat::set(b); }
+	inline VInt operator+(const VInt& a, const unsigned int b) { return a + VInt::set(b); }
+	inline VInt operator*(const VInt& a, const unsigned int b) { return a * VInt::set(b); }
+	inline VInt operator&(const VInt& a, const unsigned int b) { return a & VInt::set(b); }
+
+	// a < b ? a : b. Returns b if a is NaN, as fmin and CUDA's min on floats.
+	inline VFloat min(const VFloat& a, const VFloat& b) { return select(a < b, a, b); }
+
+	inline unsigned int min(const unsigned int a, const unsigned int b) { return a < b ? a : b; }
+
+	// Relaxed atomic add, as atomicAdd in CUDA kernels: a compare-exchange loop on the bits of target, with compiler intrinsics
+	inline void atomic_add(float& target, const float value)
+	{
+#ifdef _MSC_VER
+		volatile long* const bits = reinterpret_cast<volatile long*>(&target);
+		long expected = *bits;
+		for (;;) {
+			float sum;
+			std::memcpy(&sum, &expected, sizeof(float));
+			sum += value;
+			long desired;
+			std::memcpy(&desired, &sum, sizeof(float));
+			const long previous = _InterlockedCompareExchange(bits, desired, expected);
+			if (previous == expected) return;
+			expected = previous;
+		}
+#else
+		unsigned int* const bits = reinterpret_cast<unsigned int*>(&target);
+		unsigned int expected = __atomic_load_n(bits, __ATOMIC_RELAXED);
+		for (;;) {
+			float sum;
+			std::memcpy(&sum, &expected, sizeof(float));
+			sum += value;
+			unsigned int desired;
+			std::memcpy(&desired, &sum, sizeof(float));
+			if (__atomic_compare_exchange_n(bits, &expected, desired, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) return;
+		}
+#endif
+	}
+
+
+	//// Kernels ////
+
+	// Up to W particles, with their stencils (see TransferPolicies.hpp). Lanes past count repeat the last particle, so that only stores and scatters need to skip them.
+	template <typename Kernel>
+	struct Batch
+	{
+		static const unsigned int STENCIL_SIZE = Kernel::STENCIL_SIZE;
+		static const unsigned int STENCIL_NUM = STENCIL_SIZE * STENCIL_SIZE * STENCIL_SIZE;
+
+		unsigned int count;
+		bool contiguous;						// Consecutive particles, from particle_indices[0]: attributes can be loaded instead of gathered
+		unsigned int particle_indices[W];
+		VFloat positions[3];
+		VFloat weights[3][STENCIL_SIZE];		// Interpolation weights, per axis and stencil offset
+		VFloat cells_dists[3][STENCIL_SIZE];	// Distance from the particle to the center of the stencil cells, per axis and stencil offset
+		VInt cells_indices[STENCIL_NUM];		// Pool index of the stencil cells, x-major
+	};
+
+	template <bool ATOMIC>
+	void scatter_add(float& target, const float value)
+	{
+		if constexpr (ATOMIC) atomic_add(target, value);
+		else target += value;
+	}
+
+	// Index in Batch::cells_indices of the stencil cell at offsets [0, STENCIL_SIZE) per axis
+	template <typename Kernel>
+	unsigned int get_stencil_idx(const unsigned int x, const unsigned int y, const unsigned int z)
+	{
+		return (x * Kernel::STENCIL_SIZE + y) * Kernel::STENCIL_SIZE + z;
+	}
+
+	// Interpolation weight of the stencil cell at offsets [0, STENCIL_SIZE) per axis
+	template <typename Kernel>
+	VFloat get_stencil_weight(const Batch<Kernel>& batch, const unsigned int x, const unsigned int y, const unsigned int z)
+	{
+		return batch.weights[0][x] * batch.weights[1][y] * batch.weights[2][z];
+	}
+
+	// Attribute of the batch particles, from one of the SoA streams
+	template <typename Kernel>
+	VFloat load_particles(const Batch<Kernel>& batch, const float* const stream)
+	{
+		return batch.contiguous ? VFloat::load(stream + batch.particle_indices[0]) : VFloat::gather(stream, VInt::load(batch.particle_indices));
+	}
+
+	// Write the batch lanes to an attribute of their particles
+	template <typename Kernel>
+	void store_particles(const Batch<Kernel>& batch, const VFloat& value, float* const stream)
+	{
+		if (batch.contiguous) {
+			value.store(stream + batch.particle_indices[0]);
+			return;
+		}
+		float lanes[W];
+		value.store(lanes);
+		for (unsigned int l = 0; l < batch.count; ++l) stream[batch.particle_indices[l]] = lanes[l];
+	}
+
+	// Write the first count lanes of value to stream[start, start + count)
+	void store_lanes(const VFloat& value, float* const stream, const unsigned int start, const unsigned int count)
+	{
+		if (count == W) {
+			value.store(stream + start);
+			return;
+		}
+		float lanes[W];
+		value.store(lanes);
+		for (unsigned int l = 0; l < count; ++l) stream[start + l] = lanes[l];
+	}
+
+	// Origin cells of the stencils of the batch positions along axis. Positions are at least Kernel::DOMAIN_MARGIN, so they don't wrap.
+	template <typename Kernel>
+	VInt get_stencil_origin(const Batch<Kernel>& batch, const unsigned int axis)
+	{
+		return truncate(batch.positions[axis] - Kernel::ORIGIN_OFFSET);
+	}
+
+	// Interpolation weights and stencil cells of the batch positions, in the grid of grid_block_table
+	template <typename CellOrder, typename Kernel>
+	void set_stencil(Batch<Kernel>& batch, const unsigned int* const grid_block_table, const glm::uvec3& grid_blocks_size)
+	{
+		const unsigned int S = Kernel::STENCIL_SIZE;
+		// Along each axis the stencil is at most a block wide, so it spans the blocks of its first and last cells, which can be the same: keys of both, and index within the block of each stencil cell.
+		// The first stencil cell is always in the first block and the last one in the last block, the others can be in either.
+		static_assert(S <= GRID_BLOCK_SIZE, "Stencils must be at most a grid block wide");
+		const unsigned int blocks_strides[3] = { grid_blocks_size.y * grid_blocks_size.z, grid_blocks_size.z, 1 };
+		VInt blocks_keys[3][2];
+		VMask in_last_block[3][S];	// Only set for the offsets in between
+		VInt block_cells[3][S];
+		for (unsigned int axis = 0; axis < 3; ++axis) {
+			const VFloat position = batch.positions[axis];
+			const VInt origin = get_stencil_origin(batch, axis);
+			Kernel::get_weights(position - to_float(origin) - Kernel::CENTER_OFFSET, batch.weights[axis]);
+			for (unsigned int offset = 0; offset < S; ++offset) {
+				batch.cells_dists[axis][offset] = to_float(origin) + ((float) offset + 0.5f) - position;
+				block_cells[axis][offset] = CellOrder::get_axis_bits((origin + offset) & (GRID_BLOCK_SIZE - 1), axis);
+			}
+			const VInt last_block = (origin + (S - 1)) >> GRID_BLOCK_SIZE_LOG2;
+			blocks_keys[axis][0] = (origin >> GRID_BLOCK_SIZE_LOG2) * blocks_strides[axis];
+			blocks_keys[axis][1] = last_block * blocks_strides[axis];
+			for (unsigned int offset = 1; offset + 1 < S; ++offset) in_last_block[axis][offset] = ((origin + offset) >> GRID_BLOCK_SIZE_LOG2) == last_block;
+		}
+
+		// Pool index of the stencil cells: the 8 combinations of first and last blocks are looked up, then selected one axis at a time. Stencil blocks are always allocated.
+		VInt blocks[2][2][2];
+		for (unsigned int x = 0; x < 2; ++x) {
+			for (unsigned int y = 0; y < 2; ++y) {
+				for (unsigned int z = 0; z < 2; ++z) blocks[x][y][z] = VInt::gather(grid_block_table, blocks_keys[0][x] + blocks_keys[1][y] + blocks_keys[2][z]) << (3 * GRID_BLOCK_SIZE_LOG2);
+			}
+		}
+		// Block of the stencil cell at offset along axis, between the first and last ones
+		const auto select_block = [&in_last_block](const unsigned int axis, const unsigned int offset, const VInt& first_block, const VInt& last_block) {
+			if (offset == 0) return first_block;
+			if (offset == S - 1) return last_block;
+			return select(in_last_block[axis][offset], last_block, first_block);
+		};
+		for (unsigned int x = 0; x < S; ++x) {
+			VInt blocks_x[2][2];
+			for (unsigned int y = 0; y < 2; ++y) {
+				for (unsigned int z = 0; z < 2; ++z) blocks_x[y][z] = select_block(0, x, blocks[0][y][z], blocks[1][y][z]);
+			}
+			for (unsigned int y = 0; y < S; ++y) {
+				VInt blocks_xy[2];
+				for (unsigned int z = 0; z < 2; ++z) blocks_xy[z] = select_block(1, y, blocks_x[0][z], blocks_x[1][z]);
+				const VInt block_cells_xy = block_cells[0][x] | block_cells[1][y];
+				for (unsigned int z = 0; z < S; ++z) batch.cells_indices[get_stencil_idx<Kernel>(x, y, z)] = select_block(2, z, blocks_xy[0], blocks_xy[1]) + (block_cells_xy | block_cells[2][z]);
+			}
+		}
+	}
+
+	// Particles particle_indices[start, start + count), or [start, start + count) if particle_indices is nullptr, with their stencils in the current grid
+	template <typename CellOrder, typename Kernel>
+	void load_batch(Batch<Kernel>& batch, const TransferKernelArgs& args, const unsigned int* const particle_indices, const unsigned int start, const unsigned int count)
+	{
+		batch.count = count;
+		for (unsigned int l = 0; l < W; ++l) {
+			const unsigned int i = start + min(l, count - 1);
+			batch.particle_indices[l] = particle_indices ? particle_indices[i] : i;
+		}
+		// Indices are increasing, so a full batch spanning W indices is contiguous
+		batch.contiguous = count == W && batch.particle_indices[W - 1] - batch.particle_indices[0] == W - 1;
+		for (unsigned int axis = 0; axis < 3; ++axis) batch.positions[axis] = load_particles(batch, args.positions[axis]);
+		set_stencil<CellOrder>(batch, args.grid_block_table, args.grid_blocks_size);
+	}
+
+
+	template <typename CellOrder, typename Kernel, bool ATOMIC>
+	void p2g_mass(const TransferKernelArgs& args, const unsigned int* const particle_indices, const unsigned int begin, const unsigned int end)
+	{
+		const unsigned int S = Kernel::STENCIL_SIZE, STENCIL_NUM = Batch<Kernel>::STENCIL_NUM;
+		Batch<Kernel> batch;
+		unsigned int cells_indices[STENCIL_NUM][W];
+		float masses[STENCIL_NUM][W];
+		for (unsigned int start = begin; start < end; start += W) {
+			load_batch<CellOrder>(batch, args, particle_indices, start, min(W, end - start));
+
+			// Particle's mass, weighted by the cell's interpolation weight
+			for (unsigned int x = 0; x < S; ++x) {
+				for (unsigned int y = 0; y < S; ++y) {
+					for (unsigned int z = 0; z < S; ++z) {
+						const unsigned int n = get_stencil_idx<Kernel>(x, y, z);
+						(get_stencil_weight(batch, x, y, z) * args.particle_mass).store(masses[n]);
+						batch.cells_indices[n].store(cells_indices[n]);
+					}
+				}
+			}
+			// Scatter, particle by particle: lanes can share cells
+			for (unsigned int l = 0; l < batch.count; ++l) {
+				for (unsigned int n = 0; n < STENCIL_NUM; ++n) scatter_add<ATOMIC>(args.cells[cells_indices[n][l]].mass, masses[n][l]);
+			}
+		}
+	}
+
+
+	// Scatter the momentum and stress of the batch particles to the cells of their stencil, and their mass if MASS. Lanes flagged in skipped_lanes are left out, unless it is nullptr.
+	// With PIC/FLIP, the momentum without stress is also scattered to cells_old_velocities.
+	template <typename Kernel, typename Scheme, bool ATOMIC, bool MASS>
+	void scatter_momentum(const TransferKernelArgs& args, GridCell* const cells, glm::vec3* const cells_old_velocities, const Batch<Kernel>& batch, const VFloat velocity[3], const VFloat velocity_gradient[9], const VFloat& density, const unsigned int* const skipped_lanes)
+	{
+		const unsigned int S = Kernel::STENCIL_SIZE, STENCIL_NUM = Batch<Kernel>::STENCIL_NUM;
+
+		// Simplified eq. of state (see EquationOfState.hpp): generic powers are a lane at a time, as there's no vector pow.
+		// Clamped to avoid greatly negative pressure, hacky solution to particles collapsing (by nialltl).
+		const VFloat density_power = pow_eos(density / VFloat::set(args.rest_density), args.EOS_integer_power, [&args](const VFloat& density_ratio) {
+			float lanes[W];
+			density_ratio.store(lanes);
+			for (unsigned int l = 0; l < W; ++l) lanes[l] = ::powf(lanes[l], args.EOS_power);
+			return VFloat::load(lanes);
+		});
+		VFloat pressure = args.EOS_stiffness * (density_power - 1.0f);
+		pressure = select(pressure < args.max_negative_pressure, VFloat::set(args.max_negative_pressure), pressure);
+
+		// Stress_contribution = -V * D^-1 * (-p * I + viscosity * (velocity_gradient + transpose(velocity_gradient))) * dt, column-major
+		const VFloat volume_factor = VFloat::set(-args.particle_mass) / density * Kernel::D_INVERSE;
+		VFloat stress_contribution[9];
+		for (unsigned int column = 0; column < 3; ++column) {
+			for (unsigned int row = 0; row < 3; ++row) {
+				const VFloat strain = args.dynamic_viscosity * (velocity_gradient[column * 3 + row] + velocity_gradient[row * 3 + column]);
+				const VFloat stress = column == row ? strain - pressure : strain;
+				stress_contribution[column * 3 + row] = volume_factor * stress * args.timestep;
+			}
+		}
+
+		// Fused force + momentum update from MLS-MPM
+		unsigned int cells_indices[STENCIL_NUM][W];
+		float momentums[STENCIL_NUM][3][W];
+		float masses[MASS ? STENCIL_NUM : 1][W];
+		float old_momentums[Scheme::FLIP ? STENCIL_NUM : 1][3][W];
+		for (unsigned int x = 0; x < S; ++x) {
+			for (unsigned int y = 0; y < S; ++y) {
+				for (unsigned int z = 0; z < S; ++z) {
+					const unsigned int n = get_stencil_idx<Kernel>(x, y, z);
+					const VFloat weight = get_stencil_weight(batch, x, y, z);
+					const VFloat weighted_mass = weight * args.particle_mass;
+					const VFloat cell_dist[3] = { batch.cells_dists[0][x], batch.cells_dists[1][y], batch.cells_dists[2][z] };
+					for (unsigned int i = 0; i < 3; ++i) {
+						// Affine velocity (APIC only): cell_dist * velocity_gradient. Stress: stress_contribution * weight * cell_dist.
+						const VFloat stress = (stress_contribution[0 * 3 + i] * cell_dist[0] + stress_contribution[1 * 3 + i] * cell_dist[1] + stress_contribution[2 * 3 + i] * cell_dist[2]) * weight;
+						if constexpr (Scheme::AFFINE) {
+							const VFloat affine_velocity = cell_dist[0] * velocity_gradient[i * 3 + 0] + cell_dist[1] * velocity_gradient[i * 3 + 1] + cell_dist[2] * velocity_gradient[i * 3 + 2];
+							(weighted_mass * (velocity[i] + affine_velocity) + stress).store(momentums[n][i]);
+						}
+						else (weighted_mass * velocity[i] + stress).store(momentums[n][i]);
+						if constexpr (Scheme::FLIP) (weighted_mass * velocity[i]).store(old_momentums[n][i]);
+					}
+					if constexpr (MASS) weighted_mass.store(masses[n]);
+					batch.cells_indices[n].store(cells_indices[n]);
+				}
+			}
+		}
+		// Scatter, particle by particle: lanes can share cells
+		for (unsigned int l = 0; l < batch.count; ++l) {
+			if (skipped_lanes && skipped_lanes[l]) continue;
+			for (unsigned int n = 0; n < STENCIL_NUM; ++n) {
+				GridCell& cell = cells[cells_indices[n][l]];
+				scatter_add<ATOMIC>(cell.velocity.x, momentums[n][0][l]);
+				scatter_add<ATOMIC>(cell.velocity.y, momentums[n][1][l]);
+				scatter_add<ATOMIC>(cell.velocity.z, momentums[n][2][l]);
+				if constexpr (MASS) scatter_add<ATOMIC>(cell.mass, masses[n][l]);
+				if constexpr (Scheme::FLIP) {
+					glm::vec3& old_momentum = cells_old_velocities[cells_indices[n][l]];
+					scatter_add<ATOMIC>(old_momentum.x, old_momentums[n][0][l]);
+					scatter_add<ATOMIC>(old_momentum.y, old_momentums[n][1][l]);
+					scatter_add<ATOMIC>(old_momentum.z, old_momentums[n][2][l]);
+				}
+			}
+		}
+	}
+
+
+	// FUSED also scatters the particles mass, and takes their density from args.densities instead of gathering it from the grid masses
+	template <typename CellOrder, typename Kernel, typename Scheme, bool ATOMIC, bool FUSED>
+	void p2g_momentum(const TransferKernelArgs& args, const unsigned int* const particle_indices, const unsigned int begin, const unsigned int end)
+	{
+		const unsigned int S = Kernel::STENCIL_SIZE;
+		Batch<Kernel> batch;
+		for (unsigned int start = begin; start < end; start += W) {
+			load_batch<CellOrder>(batch, args, particle_indices, start, min(W, end - start));
+			VFloat velocity[3], velocity_gradient[9];
+			for (unsigned int i = 0; i < 3; ++i) velocity[i] = load_particles(batch, args.velocities[i]);
+			for (unsigned int i = 0; i < 9; ++i) velocity_gradient[i] = load_particles(batch, args.velocity_gradients[i]);
+
+			// Estimate per-particle density
+			VFloat density = VFloat::set(0.0f);
+			if constexpr (FUSED) density = load_particles(batch, args.densities);
+			else {
+				const float* const cells_masses = &args.cells[0].mass;
+				for (unsigned int x = 0; x < S; ++x) {
+					for (unsigned int y = 0; y < S; ++y) {
+						for (unsigned int z = 0; z < S; ++z) density = density + get_stencil_weight(batch, x, y, z) * VFloat::gather(cells_masses, batch.cells_indices[get_stencil_idx<Kernel>(x, y, z)] << 2);
+					}
+				}
+			}
+			scatter_momentum<Kernel, Scheme, ATOMIC, FUSED>(args, args.cells, args.cells_old_velocities, batch, velocity, velocity_gradient, density, nullptr);
+		}
+	}
+
+
+	// New velocity and velocity gradient of the batch particles from the grid, and their advected positions in batch.positions (stencils are left as they were).
+	// Also the displacement of each particle, their whitewater spawn chance if WHITEWATER, and their density if DENSITIES.
+	template <typename Kernel, typename Scheme, bool DENSITIES, bool WHITEWATER>
+	void g2p_batch(const TransferKernelArgs& args, Batch<Kernel>& batch, VFloat velocity[3], VFloat velocity_gradient[9], VFloat dx[3], VFloat& spawn_chance, VFloat& density)
+	{
+		const unsigned int S = Kernel::STENCIL_SIZE;
+		// Cells as floats, 4 per cell: velocity then mass. Old velocities are 3 floats per cell.
+		const float* const cells = &args.cells[0].velocity.x;
+		const float* const cells_old_velocities = Scheme::FLIP ? &args.cells_old_velocities[0].x : nullptr;
+		const float grid_size[3] = { (float) args.grid_size.x, (float) args.grid_size.y, (float) args.grid_size.z };
+		VFloat old_velocity[3];
+		if constexpr (WHITEWATER || Scheme::FLIP) {
+			for (unsigned int i = 0; i < 3; ++i) old_velocity[i] = load_particles(batch, args.velocities[i]);
+		}
+
+		// 4.3: Calculate new particle velocities
+		VFloat turbulence = VFloat::set(0.0f);
+		VFloat old_grid_velocity[3];	// Of the grid before forces, for FLIP
+		density = VFloat::set(0.0f);
+		for (unsigned int i = 0; i < 3; ++i) velocity[i] = old_grid_velocity[i] = VFloat::set(0.0f);
+		for (unsigned int i = 0; i < 9; ++i) velocity_gradient[i] = VFloat::set(0.0f);
+		for (unsigned int x = 0; x < S; ++x) {
+			for (unsigned int y = 0; y < S; ++y) {
+				for (unsigned int z = 0; z < S; ++z) {
+					const VFloat weight = get_stencil_weight(batch, x, y, z);
+					const VFloat cell_dist[3] = { batch.cells_dists[0][x], batch.cells_dists[1][y], batch.cells_dists[2][z] };
+					const VInt cell_idx = batch.cells_indices[get_stencil_idx<Kernel>(x, y, z)];
+					const VInt cell_offset = cell_idx << 2;
+					const VFloat cell_velocity[3] = { VFloat::gather(cells, cell_offset), VFloat::gather(cells + 1, cell_offset), VFloat::gather(cells + 2, cell_offset) };
+
+					// 4.3.1: Get this cell's weighted contribution to our particle's new velocity, and velocity gradient by outer multiplication
+					for (unsigned int i = 0; i < 3; ++i) {
+						const VFloat weighted_velocity = weight * cell_velocity[i];
+						velocity[i] = velocity[i] + weighted_velocity;
+						for (unsigned int column = 0; column < 3; ++column) velocity_gradient[column * 3 + i] = velocity_gradient[column * 3 + i] + Kernel::D_INVERSE * (weighted_velocity * cell_dist[column]);
+					}
+					if constexpr (Scheme::FLIP) {
+						const VInt old_velocity_offset = cell_idx * 3u;
+						for (unsigned int i = 0; i < 3; ++i) old_grid_velocity[i] = old_grid_velocity[i] + weight * VFloat::gather(cells_old_velocities + i, old_velocity_offset);
+					}
+
+					// Calculate turbulence for whitewater spawn: amount of trapped air, 2.0 for particles colliding, 0.0 for particles moving away. From "Unified Spray, Foam, and whitewater for Particle-Based Fluids" (Ihmsen et al.)
+					if constexpr (WHITEWATER) {
+						const VFloat relative_velocity[3] = { old_velocity[0] - cell_velocity[0], old_velocity[1] - cell_velocity[1], old_velocity[2] - cell_velocity[2] };
+						const VFloat relative_velocity_magnitude = sqrt(relative_velocity[0] * relative_velocity[0] + relative_velocity[1] * relative_velocity[1] + relative_velocity[2] * relative_velocity[2]);
+						const VFloat cell_dist_magnitude = sqrt(cell_dist[0] * cell_dist[0] + cell_dist[1] * cell_dist[1] + cell_dist[2] * cell_dist[2]);
+						// Dot product of the normalized vectors, with a single division. Zero relative velocity gives NaN, as normalize() in the CUDA kernel.
+						const VFloat cos_angle = (relative_velocity[0] * cell_dist[0] + relative_velocity[1] * cell_dist[1] + relative_velocity[2] * cell_dist[2]) / (relative_velocity_magnitude * cell_dist_magnitude);
+						turbulence = turbulence + weight * relative_velocity_magnitude * (1.0f - cos_angle);
+					}
+
+					// Same estimate as P2G, before the particle moves: the grid masses are those of this step
+					if constexpr (DENSITIES) density = density + weight * VFloat::gather(cells + 3, cell_offset);
+				}
+			}
+		}
+
+		// 4.4: Advect particle positions by their velocity (explicit integration), clamped to simulation domain [margin, gridSize - 1 - margin].
+		// NaN positions (a blow-up) fail the lower bound test, and stay in the domain until the health check rolls back.
+		for (unsigned int i = 0; i < 3; ++i) {
+			dx[i] = velocity[i] * args.timestep;
+			const VFloat position = batch.positions[i] + dx[i];
+			const VFloat clamped_position = select(position > Kernel::DOMAIN_MARGIN, position, VFloat::set(Kernel::DOMAIN_MARGIN));
+			batch.positions[i] = select(clamped_position > grid_size[i] - 1.0f - Kernel::DOMAIN_MARGIN, VFloat::set(grid_size[i] - 1.0f - Kernel::DOMAIN_MARGIN), clamped_position);
+		}
+
+		// FLIP: the particle velocity plus the grid velocity change, blended with the grid velocity (PIC) used for advection
+		if constexpr (Scheme::FLIP) {
+			for (unsigned int i = 0; i < 3; ++i) velocity[i] = velocity[i] + args.flip_ratio * (old_velocity[i] - old_grid_velocity[i]);
+		}
+
+		// Additional predictive boundary conditions to soften velocities near edges.
+		// Taken from nialltl's implementation, but added timestep scaling and boundary elasticity.
+		// Might look unnatural but should improve stability.
+		if (args.boundary > 0.0f && args.boundary_elasticity > 0.0f) {
+			for (unsigned int i = 0; i < 3; ++i) {
+				const float upper_boundary = grid_size[i] - 1.0f - args.boundary;
+				const VFloat predicted_position = batch.positions[i] + dx[i];
+				velocity[i] = select(predicted_position < args.boundary, velocity[i] + (args.boundary - predicted_position) * args.boundary_elasticity, velocity[i]);
+				velocity[i] = select(predicted_position > upper_boundary, velocity[i] + (upper_boundary - predicted_position) * args.boundary_elasticity, velocity[i]);
+			}
+		}
+
+		// Whitewater spawn chance, depending on kinetic energy and turbulence, normalized on min and max.
+		// min() ignores NaNs (e.g. turbulence with zero relative velocity), as CUDA's min on floats.
+		if constexpr (WHITEWATER) {
+			const VFloat chance_min = VFloat::set(args.whitewater_chance_min), chance_max = VFloat::set(args.whitewater_chance_max);
+			const VFloat kinetic_energy = velocity[0] * velocity[0] + velocity[1] * velocity[1] + velocity[2] * velocity[2];
+			const VFloat kinetic_energy_factor = (min(kinetic_energy, chance_max) - min(kinetic_energy, chance_min)) / (chance_max - chance_min);
+			const VFloat trapped_air_factor = (min(turbulence, chance_max) - min(turbulence, chance_min)) / (chance_max - chance_min);
+			spawn_chance = kinetic_energy_factor * trapped_air_factor * args.timestep;
+		}
+
+		if constexpr (DENSITIES) {
+			// Carried to the new position by the continuity equation, as the density of the grid before the particle moves is a step late for the next P2G.
+			// The volume change is clamped to [0.5, 2]: past it the first order estimate is meaningless, and at -1 it flips the density's sign.
+			const VFloat divergence = velocity_gradient[0] + velocity_gradient[4] + velocity_gradient[8];
+			const VFloat volume_change = 1.0f + divergence * args.timestep;
+			const VFloat clamped_volume_change = select(volume_change < 0.5f, VFloat::set(0.5f), volume_change);
+			density = density / select(clamped_volume_change > 2.0f, VFloat::set(2.0f), clamped_volume_change);
+		}
+	}
+
+	// Write the new state of the batch particles, and if WHITEWATER their whitewater spawn outputs at [start, start + count) of spawn_chances and displacements
+	template <typename Kernel, bool DENSITIES, bool WHITEWATER>
+	void store_g2p_batch(const TransferKernelArgs& args, const Batch<Kernel>& batch, const VFloat velocity[3], const VFloat velocity_gradient[9], const VFloat dx[3], const VFloat& spawn_chance, const VFloat& density, float* const spawn_chances, float* const displacements[3], const unsigned int start)
+	{
+		for (unsigned int i = 0; i < 3; ++i) {
+			store_particles(batch, batch.positions[i], args.positions[i]);
+			store_particles(batch, velocity[i], args.velocities[i]);
+			if constexpr (WHITEWATER) store_lanes(dx[i], displacements[i], start, batch.count);
+		}
+		for (unsigned int i = 0; i < 9; ++i) store_particles(batch, velocity_gradient[i], args.velocity_gradients[i]);
+		if constexpr (WHITEWATER) store_lanes(spawn_chance, spawn_chances, start, batch.count);
+		if constexpr (DENSITIES) store_particles(batch, density, args.densities);
+	}
+
+
+	// DENSITIES also estimates the particles density, from the grid masses. WHITEWATER outputs the whitewater spawn chances and displacements.
+	template <typename CellOrder, typename Kernel, typename Scheme, bool DENSITIES, bool WHITEWATER>
+	void g2p(const TransferKernelArgs& args, const unsigned int begin, const unsigned int end, float* const spawn_chances, float* const displacements[3])
+	{
+		Batch<Kernel> batch;
+		for (unsigned int start = begin; start < end; start += W) {
+			load_batch<CellOrder>(batch, args, nullptr, start, min(W, end - start));
+			VFloat velocity[3], velocity_gradient[9], dx[3], spawn_chance, density;
+			g2p_batch<Kernel, Scheme, DENSITIES, WHITEWATER>(args, batch, velocity, velocity_gradient, dx, spawn_chance, density);
+			store_g2p_batch<Kernel, DENSITIES, WHITEWATER>(args, batch, velocity, velocity_gradient, dx, spawn_chance, density, spawn_chances, displacements, start - begin);
+		}
+	}
+
+
+	// G2P, then the fused P2G of the next step from the new particle state, before it leaves the registers. Returns whether every particle was scattered.
+	template <typename CellOrder, typename Kernel, typename Scheme, bool ATOMIC, bool WHITEWATER>
+	bool g2p_p2g(const TransferKernelArgs& args, const unsigned int* const particle_indices, const unsigned int begin, const unsigned int end, float* const spawn_chances, float* const displacements[3])
+	{
+		bool all_scattered = true;
+		Batch<Kernel> batch;
+		for (unsigned int start = begin; start < end; start += W) {
+			load_batch<CellOrder>(batch, args, particle_indices, start, min(W, end - start));
+			VInt old_origins[3];
+			for (unsigned int axis = 0; axis < 3; ++axis) old_origins[axis] = get_stencil_origin(batch, axis);
+			VFloat velocity[3], velocity_gradient[9], dx[3], spawn_chance, density;
+			g2p_batch<Kernel, Scheme, true, WHITEWATER>(args, batch, velocity, velocity_gradient, dx, spawn_chance, density);
+			store_g2p_batch<Kernel, true, WHITEWATER>(args, batch, velocity, velocity_gradient, dx, spawn_chance, density, spawn_chances, displacements, start - begin);
+
+			// The next grid only covers the blocks around the particles' old stencils, and the caller's coloring is by old block: particles whose stencil origin moved
+			// more than 1 cell along an axis are skipped, as their stencil could fall outside either. Cell differences are exact as floats.
+			VMask moved_far;
+			for (unsigned int axis = 0; axis < 3; ++axis) {
+				const VFloat moved_cells = to_float(get_stencil_origin(batch, axis)) - to_float(old_origins[axis]);
+				const VMask axis_moved_far = (moved_cells > 1.5f) | (moved_cells < -1.5f);
+				moved_far = axis == 0 ? axis_moved_far : moved_far | axis_moved_far;
+			}
+			unsigned int skipped_lanes[W];
+			select(moved_far, VInt::set(1), VInt::set(0)).store(skipped_lanes);
+			for (unsigned int l = 0; l < batch.count; ++l) all_scattered = all_scattered && !skipped_lanes[l];
+
+			set_stencil<CellOrder>(batch, args.next_grid_block_table, args.grid_blocks_size);
+			scatter_momentum<Kernel, Scheme, ATOMIC, true>(args, args.next_cells, args.next_cells_old_velocities, batch, velocity, velocity_gradient, density, skipped_lanes);
+		}
+		return all_scattered;
+	}
+
+
+	template <typename CellOrder, typename Kernel, typename Scheme>
+	void p2g_mass_dispatch(const TransferKernelArgs& args, const unsigned int* const particle_indices, const unsigned int begin, const unsigned int end, const bool atomic)
+	{
+		if (atomic) p2g_mass<CellOrder, Kernel, true>(args, particle_indices, begin, end);
+		else p2g_mass<CellOrder, Kernel, false>(args, particle_indices, begin, end);
+	}
+
+	template <typename CellOrder, typename Kernel, typename Scheme>
+	void p2g_momentum_dispatch(const TransferKernelArgs& args, const unsigned int* const particle_indices, const unsigned int begin, const unsigned int end, const bool atomic)
+	{
+		if (atomic) p2g_momentum<CellOrder, Kernel, Scheme, true, false>(args, particle_indices, begin, end);
+		else p2g_momentum<CellOrder, Kernel, Scheme, false, false>(args, particle_indices, begin, end);
+	}
+
+	template <typename CellOrder, typename Kernel, typename Scheme>
+	void p2g_fused_dispatch(const TransferKernelArgs& args, const unsigned int* const particle_indices, const unsigned int begin, const unsigned int end, const bool atomic)
+	{
+		if (atomic) p2g_momentum<CellOrder, Kernel, Scheme, true, true>(args, particle_indices, begin, end);
+		else p2g_momentum<CellOrder, Kernel, Scheme, false, true>(args, particle_indices, begin, end);
+	}
+
+	template <typename CellOrder, typename Kernel, typename Scheme>
+	void g2p_dispatch(const TransferKernelArgs& args, const unsigned int begin, const unsigned int end, float* const spawn_chances, float* const displacements[3])
+	{
+		if (args.densities && spawn_chances) g2p<CellOrder, Kernel, Scheme, true, true>(args, begin, end, spawn_chances, displacements);
+		else if (args.densities) g2p<CellOrder, Kernel, Scheme, true, false>(args, begin, end, spawn_chances, displacements);
+		else if (spawn_chances) g2p<CellOrder, Kernel, Scheme, false, true>(args, begin, end, spawn_chances, displacements);
+		else g2p<CellOrder, Kernel, Scheme, false, false>(args, begin, end, spawn_chances, displacements);
+	}
+
+	template <typename CellOrder, typename Kernel, typename Scheme>
+	bool g2p_p2g_dispatch(const TransferKernelArgs& args, const unsigned int* const particle_indices, const unsigned int begin, const unsigned int end, const bool atomic, float* const spawn_chances, float* const displacements[3])
+	{
+		if (atomic && spawn_chances) return g2p_p2g<CellOrder, Kernel, Scheme, true, true>(args, particle_indices, begin, end, spawn_chances, displacements);
+		if (atomic) return g2p_p2g<CellOrder, Kernel, Scheme, true, false>(args, particle_indices, begin, end, spawn_chances, displacements);
+		if (spawn_chances) return g2p_p2g<CellOrder, Kernel, Scheme, false, true>(args, particle_indices, begin, end, spawn_chances, displacements);
+		return g2p_p2g<CellOrder, Kernel, Scheme, false, false>(args, particle_indices, begin, end, spawn_chances, displacements);
+	}
+
+	template <typename CellOrder, typename Kernel, typename Scheme>
+	constexpr TransferKernelsCPU get_kernels() { return { p2g_mass_dispatch<CellOrder, Kernel, Scheme>, p2g_momentum_dispatch<CellOrder, Kernel, Scheme>, p2g_fused_dispatch<CellOrder, Kernel, Scheme>, g2p_dispatch<CellOrder, Kernel, Scheme>, g2p_p2g_dispatch<CellOrder, Kernel, Scheme> }; }
+
+}
+
+	// Indexed by GRID_CELL_ORDER, INTERPOLATION_KERNEL and TRANSFER_SCHEME
+	extern const TransferKernelsCPU kernels[GRID_CELL_ORDER_NUM][INTERPOLATION_KERNEL_NUM][TRANSFER_SCHEME_NUM] = {
+		{
+			{ get_kernels<GridCellOrderLinear, InterpolationKernelLinear, TransferSchemeAPIC>(), get_kernels<GridCellOrderLinear, InterpolationKernelLinear, TransferSchemePICFLIP>() },
+			{ get_kernels<GridCellOrderLinear, InterpolationKernelQuadratic, TransferSchemeAPIC>(), get_kernels<GridCellOrderLinear, InterpolationKernelQuadratic, TransferSchemePICFLIP>() },
+			{ get_kernels<GridCellOrderLinear, InterpolationKernelCubic, TransferSchemeAPIC>(), get_kernels<GridCellOrderLinear, InterpolationKernelCubic, TransferSchemePICFLIP>() },
+		},
+		{
+			{ get_kernels<GridCellOrderMorton, InterpolationKernelLinear, TransferSchemeAPIC>(), get_kernels<GridCellOrderMorton, InterpolationKernelLinear, TransferSchemePICFLIP>() },
+			{ get_kernels<GridCellOrderMorton, InterpolationKernelQuadratic, TransferSchemeAPIC>(), get_kernels<GridCellOrderMorton, InterpolationKernelQuadratic, TransferSchemePICFLIP>() },
+			{ get_kernels<GridCellOrderMorton, InterpolationKernelCubic, TransferSchemeAPIC>(), get_kernels<GridCellOrderMorton, InterpolationKernelCubic, TransferSchemePICFLIP>() },
+		},
+	};
+}
@@ -0,0 +1,152 @@
+#pragma once
+
+// Usable both in host code and in CUDA kernels
+#ifdef __CUDACC__
+	#define TRANSFER_POLICY_QUALIFIER __host__ __device__ inline
+#else
+	#define TRANSFER_POLICY_QUALIFIER inline
+#endif
+
+/*
+Particle-grid transfer policies, shared by the simulation backends: the interpolation kernel (the B-spline weighting particles and cells) and the transfer scheme.
+Every transfer stage is instantiated for each, as its Kernel and Scheme template parameters, and the backends pick the instantiation at runtime from their settings.
+Along each axis, the stencil of a particle at x is the STENCIL_SIZE cells from its origin cell floor(x - ORIGIN_OFFSET), with ORIGIN_OFFSET = (STENCIL_SIZE - 1) / 2: every cell whose center is in the kernel support.
+Particles are kept DOMAIN_MARGIN cells off the domain edges, [DOMAIN_MARGIN, grid_size - 1 - DOMAIN_MARGIN], so that their stencils stay in the domain.
+*/
+
+// Interpolation kernels, one per kernel policy
+enum INTERPOLATION_KERNEL
+{
+	INTERPOLATION_KERNEL_LINEAR		= 0,	// InterpolationKernelLinear
+	INTERPOLATION_KERNEL_QUADRATIC	= 1,	// InterpolationKernelQuadratic
+	INTERPOLATION_KERNEL_CUBIC		= 2,	// InterpolationKernelCubic
+	INTERPOLATION_KERNEL_NUM		= 3,
+};
+
+// Transfer schemes, one per scheme policy
+enum TRANSFER_SCHEME
+{
+	TRANSFER_SCHEME_APIC		= 0,	// TransferSchemeAPIC
+	TRANSFER_SCHEME_PIC_FLIP	= 1,	// TransferSchemePICFLIP
+	TRANSFER_SCHEME_NUM			= 2,
+};
+
+/*
+Interpolation kernel policies. get_weights() takes the distance d in [-0.5, 0.5) of the particle from the stencil center, origin + CENTER_OFFSET along each axis, and works on
+float, glm vectors, or any type with arithmetic operators against floats (such as the VFloat of the CPU transfer kernels).
+D_INVERSE is the inverse of the MLS-MPM inertia tensor D of the kernel, a multiple of the identity: it scales the velocity gradient gathered by G2P, and the stress scattered by P2G.
+*/
+
+// Linear (tent): 2x2x2 stencil, much cheaper than the others but not smooth, e.g. for quick previews.
+// D is d(1 - d) per axis, varying with the particle position: its inverse is taken at the minimum, 4, so that the affine velocity is damped rather than amplified.
+struct InterpolationKernelLinear
+{
+	static const unsigned int STENCIL_SIZE = 2;
+	static constexpr float ORIGIN_OFFSET = 0.5f;
+	static constexpr float CENTER_OFFSET = 1.0f;
+	static constexpr float DOMAIN_MARGIN = 1.0f;
+	static constexpr float D_INVERSE = 4.0f;
+
+	template <typename T>
+	static TRANSFER_POLICY_QUALIFIER void get_weights(const T& d, T weights[STENCIL_SIZE])
+	{
+		weights[0] = 0.5f - d;
+		weights[1] = 0.5f + d;
+	}
+};
+
+// Quadratic B-spline: 3x3x3 stencil, the usual MLS-MPM kernel
+struct InterpolationKernelQuadratic
+{
+	static const unsigned int STENCIL_SIZE = 3;
+	static constexpr float ORIGIN_OFFSET = 1.0f;
+	static constexpr float CENTER_OFFSET = 1.5f;
+	static constexpr float DOMAIN_MARGIN = 1.0f;
+	static constexpr float D_INVERSE = 4.0f;
+
+	template <typename T>
+	static TRANSFER_POLICY_QUALIFIER void get_weights(const T& d, T weights[STENCIL_SIZE])
+	{
+		weights[0] = 0.5f * (0.5f - d) * (0.5f - d);	// 0.5 * (0.5 - d)^2
+		weights[1] = 0.75f - d * d;						// 0.75 - d^2
+		weights[2] = 0.5f * (0.5f + d) * (0.5f + d);	// 0.5 * (0.5 + d)^2
+	}
+};
+
+// Cubic B-spline: 4x4x4 stencil, smoothest and most expensive. Its stencil reaches 2 cells away, so particles are kept 2 cells off the domain edges.
+struct InterpolationKernelCubic
+{
+	static const unsigned int STENCIL_SIZE = 4;
+	static constexpr float ORIGIN_OFFSET = 1.5f;
+	static constexpr float CENTER_OFFSET = 2.0f;
+	static constexpr float DOMAIN_MARGIN = 2.0f;
+	static constexpr float D_INVERSE = 3.0f;
+
+	template <typename T>
+	static TRANSFER_POLICY_QUALIFIER void get_weights(const T& d, T weights[STENCIL_SIZE])
+	{
+		// In t = d + 0.5, the distance from the center of the second cell
+		const T t = 0.5f + d;
+		const T u = 0.5f - d;	// 1 - t
+		weights[0] = (1.0f / 6.0f) * u * u * u;				// (1 - t)^3 / 6
+		weights[1] = 0.5f * t * t * t - t * t + 2.0f / 3.0f;	// t^3 / 2 - t^2 + 2/3
+		weights[2] = 0.5f * u * u * u - u * u + 2.0f / 3.0f;	// (1 - t)^3 / 2 - (1 - t)^2 + 2/3
+		weights[3] = (1.0f / 6.0f) * t * t * t;				// t^3 / 6
+	}
+};
+
+/*
+Transfer scheme policies.
+APIC scatters the particles' affine velocity (velocity gradient times distance to the cell) along with their velocity, which preserves angular momentum.
+PIC/FLIP scatters velocities only, and G2P blends the grid velocity (PIC, stable but dissipative) with the particle velocity plus the grid velocity change (FLIP, energetic but noisy) by flip_ratio.
+Grid velocity changes need the grid velocity before forces, kept in a second cells pool of the same layout. Particles are advected by the grid velocity in both.
+*/
+
+struct TransferSchemeAPIC
+{
+	static const bool AFFINE = true;
+	static const bool FLIP = false;
+};
+
+struct TransferSchemePICFLIP
+{
+	static const bool AFFINE = false;
+	static const bool FLIP = true;
+};
+
+// Call f with a policy object of kernel, e.g. f(InterpolationKernelQuadratic()), to instantiate a template on it at runtime. Host code only.
+template <typename F>
+decltype(auto) visit_interpolation_kernel(const INTERPOLATION_KERNEL kernel, F&& f)
+{
+	switch (kernel) {
+		case INTERPOLATION_KERNEL_LINEAR: return f(InterpolationKernelLinear());
+		case INTERPOLATION_KERNEL_CUBIC: return f(InterpolationKernelCubic());
+		default: return f(InterpolationKernelQuadratic());
+	}
+}
+
+// Same as visit_interpolation_kernel, for a transfer scheme
+template <typename F>
+decltype(auto) visit_transfer_scheme(const TRANSFER_SCHEME scheme, F&& f)
+{
+	switch (scheme) {
+		case TRANSFER_SCHEME_PIC_FLIP: return f(TransferSchemePICFLIP());
+		default: return f(TransferSchemeAPIC());
+	}
+}
+
+// Stencil size and domain margin of kernel, for host code that isn't instantiated on it
+inline unsigned int get_interpolation_stencil_size(const INTERPOLATION_KERNEL kernel)
+{
+	return visit_interpolation_kernel(kernel, [](const auto policy) { return decltype(policy)::STENCIL_SIZE; });
+}
+
+inline float get_interpolation_domain_margin(const INTERPOLATION_KERNEL kernel)
+{
+	return visit_interpolation_kernel(kernel, [](const auto policy) { return decltype(policy)::DOMAIN_MARGIN; });
+}
+
+// Lowercase names, as in command line options
+const char* get_interpolation_kernel_name(const INTERPOLATION_KERNEL kernel);
+
+const char* get_transfer_scheme_name(const TRANSFER_SCHEME scheme);
@@ -32,7 +32,13 @@ public:
 
 	void show_simulation_info(const glm::uvec3 grid_size, const int particles_num, const int particles_max, const int whitewater_num, const int whitewater_max) const;
 
-	void show_time_buttons(bool& pause, float& time_scale) const;
+	void show_time_buttons(bool& pause, float& time_scale, bool& adaptive_timestep) const;
+
+	// Cached playback: time slider to scrub, playback speed (negative plays backward) and looping
+	void show_playback_controls(double& time, const double start_time, const double end_time, float& speed, bool& loop, const unsigned int frame_idx, const unsigned int frames_count) const;
+
+	// Simulation timeline: step slider over the recorded history and its memory use. Returns true when rewinding to step is clicked.
+	bool show_timeline_controls(unsigned long long& step, const unsigned long long first_step, const unsigned long long last_step, const unsigned int records_count, const size_t size, const size_t memory_budget) const;
 
 	bool show_reset_simulation_button() const;
 
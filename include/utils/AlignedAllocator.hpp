@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+// Allocator for std::vector with over-aligned storage, e.g. to cache-line align data streams processed in SIMD-width blocks.
+template <typename T, std::size_t Alignment>
+struct AlignedAllocator
+{
+	using value_type = T;
+
+	template <typename U>
+	struct rebind { using other = AlignedAllocator<U, Alignment>; };
+
+	AlignedAllocator() noexcept = default;
+
+	template <typename U>
+	AlignedAllocator(const AlignedAllocator<U, Alignment>&) noexcept { }
+
+	T* allocate(const std::size_t count) { return static_cast<T*>(::operator new(count * sizeof(T), std::align_val_t(Alignment))); }
+
+	void deallocate(T* const ptr, const std::size_t) noexcept { ::operator delete(ptr, std::align_val_t(Alignment)); }
+
+	template <typename U>
+	bool operator==(const AlignedAllocator<U, Alignment>&) const noexcept { return true; }
+
+	template <typename U>
+	bool operator!=(const AlignedAllocator<U, Alignment>&) const noexcept { return false; }
+};
+
+// Cache line aligned vector
+template <typename T>
+using AlignedVector = std::vector<T, AlignedAllocator<T, 64>>;
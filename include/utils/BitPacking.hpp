@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Values packed by pack_values() share a bit width per group of BIT_PACK_GROUP values: small values (e.g. zigzag-coded differences) take few bits,
+// and an outlier only widens its own group.
+const unsigned int BIT_PACK_GROUP = 64;
+
+// Signed to unsigned, small magnitudes to small values: 0, -1, 1, -2... to 0, 1, 2, 3...
+inline uint32_t zigzag_encode(const int32_t value) { return ((uint32_t) value << 1) ^ (uint32_t) (value >> 31); }
+
+inline int32_t zigzag_decode(const uint32_t value) { return (int32_t) (value >> 1) ^ -(int32_t) (value & 1); }
+
+// Append count values to bytes in groups of BIT_PACK_GROUP: a byte of bit width, then the values packed at that width, padded to a byte.
+void pack_values(const uint32_t* values, const size_t count, std::vector<unsigned char>& bytes);
+
+// Read count values packed by pack_values() from bytes, advanced past them. Returns false if past end.
+bool unpack_values(const unsigned char*& bytes, const unsigned char* const end, uint32_t* values, const size_t count);
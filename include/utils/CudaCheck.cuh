@@ -7,7 +7,7 @@
 
 #define CUDA_CHECK(val) { cuda_check_error((val), __FILE__, #val, __LINE__); }
 
-void cuda_check_error(cudaError_t error_code, const char* const file, const char* const function, const int line)
+inline void cuda_check_error(cudaError_t error_code, const char* const file, const char* const function, const int line)
 {
 	if (error_code == cudaSuccess) return;
 
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// Read-only memory mapping of a whole file. Pages are read from disk (or the page cache) on first access, with no copy through a read buffer.
+class MappedFile
+{
+private:
+
+	const unsigned char* _data = nullptr;
+	size_t _size = 0;
+#ifdef _WIN32
+	void* _file = nullptr;		// HANDLE
+	void* _mapping = nullptr;	// HANDLE
+#else
+	int _file = -1;
+#endif
+
+public:
+
+	MappedFile() = default;
+
+	~MappedFile();
+
+	// Disable copy and move constructors and operators: the mapping is owned.
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	MappedFile(MappedFile&&) = delete;
+	MappedFile& operator=(MappedFile&&) = delete;
+
+	// Map path, closing any previous mapping. sequential hints the OS to read ahead, for files read front to back. Returns false on failure.
+	bool open(const std::string& path, const bool sequential = true);
+
+	void close();
+
+	bool is_open() const;
+
+	// Mapped bytes, valid until close(). Null for empty files.
+	const unsigned char* get_data() const;
+
+	size_t get_size() const;
+};
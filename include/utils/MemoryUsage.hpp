@@ -0,0 +1,9 @@
+#pragma once
+
+#include <cstddef>
+
+// Peak resident memory of the process so far, in bytes (0 if unavailable).
+size_t get_peak_host_memory();
+
+// Device memory currently in use on the active CUDA device, in bytes. Includes other processes' allocations.
+size_t get_used_device_memory();
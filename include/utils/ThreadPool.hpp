@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool
+{
+public:
+
+	// Job signature: processes indices [begin, end). thread_idx is in [0, get_threads_count()) and is stable for the job's duration, so it can index per-thread scratch data.
+	using Job = std::function<void(unsigned int begin, unsigned int end, unsigned int thread_idx)>;
+
+private:
+
+	std::vector<std::thread> _workers;
+	std::mutex _mutex;
+	std::condition_variable _job_cv;
+	std::condition_variable _done_cv;
+	const Job* _job = nullptr;
+	unsigned int _job_end = 0;
+	unsigned int _job_chunk = 0;
+	std::atomic<unsigned int> _job_next_idx {0};
+	unsigned int _pending_workers = 0;
+	unsigned long long _generation = 0;	// Incremented for each job, so that workers can tell a new job from a spurious wakeup
+	bool _stop = false;
+
+	void _worker_loop(const unsigned int thread_idx);
+
+	void _run_chunks(const unsigned int thread_idx);
+
+public:
+
+	// 0 threads means one per hardware thread. The calling thread always takes part in the work, so only (threads_count - 1) workers are spawned.
+	explicit ThreadPool(unsigned int threads_count = 0);
+
+	~ThreadPool();
+
+	// Disable copy and move constructors and operators: workers hold a pointer to the pool.
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+	ThreadPool(ThreadPool&&) = delete;
+	ThreadPool& operator=(ThreadPool&&) = delete;
+
+	unsigned int get_threads_count() const;
+
+	// Splits [begin, end) in chunks of at least min_chunk indices, dynamically distributed between all threads. Blocks until every chunk is done.
+	void parallel_for(const unsigned int begin, const unsigned int end, const Job& job, const unsigned int min_chunk = 256);
+};
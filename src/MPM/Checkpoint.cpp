@@ -0,0 +1,273 @@
+#include <MPM/Checkpoint.hpp>
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <type_traits>
+
+#include <utils/MappedFile.hpp>
+
+namespace
+{
+	const char CHECKPOINT_MAGIC[8] = { 'M', 'P', 'M', 'C', 'K', 'P', 'T', '\0' };
+	const uint64_t CHECKPOINT_ALIGNMENT = 64;	// Section offsets, for aligned copies out of the mapping
+
+	// Arrays of SimulationState, in file order
+	enum CHECKPOINT_SECTION
+	{
+		CHECKPOINT_SECTION_PARTICLES_POSITIONS				= 0,
+		CHECKPOINT_SECTION_PARTICLES_VELOCITIES				= 1,
+		CHECKPOINT_SECTION_PARTICLES_VELOCITY_GRADIENTS		= 2,
+		CHECKPOINT_SECTION_PARTICLES_RANDOM_STATES			= 3,
+		CHECKPOINT_SECTION_WHITEWATER_POSITIONS				= 4,
+		CHECKPOINT_SECTION_WHITEWATER_VELOCITIES			= 5,
+		CHECKPOINT_SECTION_WHITEWATER_TYPES					= 6,
+		CHECKPOINT_SECTION_WHITEWATER_LIFETIMES				= 7,
+		CHECKPOINT_SECTIONS_NUM								= 8,
+	};
+
+	struct CheckpointSection
+	{
+		uint64_t offset;	// From the start of the file
+		uint64_t size;		// Bytes
+	};
+
+	// Fixed-size types only, so that the layout doesn't depend on the platform
+	struct CheckpointHeader
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t header_size;
+		uint32_t backend;	// SIMULATION_BACKEND that saved the checkpoint, for information
+		// Material
+		float mass;
+		float rest_density;
+		float dynamic_viscosity;
+		float EOS_stiffness;
+		float EOS_power;
+		float max_negative_pressure;
+		float color[3];
+		// Parameters
+		float fixed_timestep;
+		float boundary;
+		float boundary_elasticity;
+		float gravity[3];
+		float whitewater_chance_min;
+		float whitewater_chance_max;
+		uint32_t whitewater_spawn_num;
+		uint32_t sort_interval;
+		float flip_ratio;
+		uint32_t adaptive_timestep;
+		float cfl_number;
+		float min_timestep;
+		float max_timestep;
+		// State
+		uint32_t grid_size[3];
+		uint32_t interpolation_kernel;
+		uint32_t transfer_scheme;
+		float timestep;
+		uint64_t steps_count;
+		uint32_t steps_since_sort;
+		uint32_t particles_count;
+		uint32_t random_state_size;
+		uint32_t whitewater_count;
+		CheckpointSection sections[CHECKPOINT_SECTIONS_NUM];
+	};
+	static_assert(std::is_trivially_copyable_v<CheckpointHeader>);
+
+	uint64_t align_offset(const uint64_t offset) { return (offset + CHECKPOINT_ALIGNMENT - 1) / CHECKPOINT_ALIGNMENT * CHECKPOINT_ALIGNMENT; }
+
+	// Copy a section out of the mapping into values, sized to count elements. The section size must match.
+	// The first of the two copies of a load, see Checkpoint.hpp.
+	template <typename T>
+	bool read_section(const MappedFile& file, const CheckpointSection& section, const uint64_t count, std::vector<T>& values)
+	{
+		if (section.size != count * sizeof(T)) return false;
+		values.resize(count);
+		if (count > 0) std::memcpy(values.data(), file.get_data() + section.offset, section.size);
+		return true;
+	}
+}
+
+
+bool save_checkpoint(const SimulationBackend& simulation, const std::string& path)
+{
+	SimulationState state;
+	simulation.save_state(state);
+
+	CheckpointHeader header = {};
+	std::memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+	header.version = CHECKPOINT_VERSION;
+	header.header_size = sizeof(CheckpointHeader);
+	header.backend = simulation.get_backend_type();
+	const ParticleMaterial& material = simulation.particles_material;
+	header.mass = material.mass;
+	header.rest_density = material.rest_density;
+	header.dynamic_viscosity = material.dynamic_viscosity;
+	header.EOS_stiffness = material.EOS_stiffness;
+	header.EOS_power = material.EOS_power;
+	header.max_negative_pressure = material.max_negative_pressure;
+	for (int i = 0; i < 3; ++i) header.color[i] = material.color[i];
+	header.fixed_timestep = simulation.get_fixed_timestep();
+	header.boundary = simulation.boundary;
+	header.boundary_elasticity = simulation.boundary_elasticity;
+	for (int i = 0; i < 3; ++i) header.gravity[i] = simulation.gravity[i];
+	header.whitewater_chance_min = simulation.whitewater_chance_min;
+	header.whitewater_chance_max = simulation.whitewater_chance_max;
+	header.whitewater_spawn_num = simulation.whitewater_spawn_num;
+	header.sort_interval = simulation.sort_interval;
+	header.flip_ratio = simulation.flip_ratio;
+	header.adaptive_timestep = simulation.adaptive_timestep;
+	header.cfl_number = simulation.cfl_number;
+	header.min_timestep = simulation.min_timestep;
+	header.max_timestep = simulation.max_timestep;
+	for (int i = 0; i < 3; ++i) header.grid_size[i] = state.grid_size[i];
+	header.interpolation_kernel = state.interpolation_kernel;
+	header.transfer_scheme = state.transfer_scheme;
+	header.timestep = state.timestep;
+	header.steps_count = state.steps_count;
+	header.steps_since_sort = state.steps_since_sort;
+	header.particles_count = state.particles_count;
+	header.random_state_size = state.random_state_size;
+	header.whitewater_count = state.whitewater_count;
+
+	// Sections, in file order
+	const void* sections_data[CHECKPOINT_SECTIONS_NUM] = {
+		state.particles_positions.data(),
+		state.particles_velocities.data(),
+		state.particles_velocity_gradients.data(),
+		state.particles_random_states.data(),
+		state.whitewater_positions.data(),
+		state.whitewater_velocities.data(),
+		state.whitewater_types.data(),
+		state.whitewater_lifetimes.data(),
+	};
+	const uint64_t sections_sizes[CHECKPOINT_SECTIONS_NUM] = {
+		state.particles_positions.size() * sizeof(glm::vec3),
+		state.particles_velocities.size() * sizeof(glm::vec3),
+		state.particles_velocity_gradients.size() * sizeof(glm::mat3),
+		state.particles_random_states.size(),
+		state.whitewater_positions.size() * sizeof(glm::vec3),
+		state.whitewater_velocities.size() * sizeof(glm::vec3),
+		state.whitewater_types.size(),
+		state.whitewater_lifetimes.size() * sizeof(float),
+	};
+	uint64_t offset = sizeof(CheckpointHeader);
+	for (int section = 0; section < CHECKPOINT_SECTIONS_NUM; ++section) {
+		offset = align_offset(offset);
+		header.sections[section] = { offset, sections_sizes[section] };
+		offset += sections_sizes[section];
+	}
+
+	std::ofstream file (path, std::ios::binary | std::ios::trunc);
+	if (!file) {
+		std::cerr << "ERROR::CHECKPOINT::SAVE::FILE_NOT_OPENED: " << path << std::endl;
+		return false;
+	}
+	file.write((const char*) &header, sizeof(header));
+	const char padding[CHECKPOINT_ALIGNMENT] = {};
+	offset = sizeof(CheckpointHeader);
+	for (int section = 0; section < CHECKPOINT_SECTIONS_NUM; ++section) {
+		file.write(padding, header.sections[section].offset - offset);
+		file.write((const char*) sections_data[section], header.sections[section].size);
+		offset = header.sections[section].offset + header.sections[section].size;
+	}
+	file.close();
+	if (!file) {
+		std::cerr << "ERROR::CHECKPOINT::SAVE::WRITE_FAILED: " << path << std::endl;
+		return false;
+	}
+	return true;
+}
+
+
+bool load_checkpoint(SimulationBackend& simulation, const std::string& path)
+{
+	MappedFile file;
+	if (!file.open(path)) {
+		std::cerr << "ERROR::CHECKPOINT::LOAD::FILE_NOT_OPENED: " << path << std::endl;
+		return false;
+	}
+
+	// Validate everything before touching the simulation
+	CheckpointHeader header;
+	if (file.get_size() < sizeof(header)) {
+		std::cerr << "ERROR::CHECKPOINT::LOAD::TRUNCATED: " << path << std::endl;
+		return false;
+	}
+	std::memcpy(&header, file.get_data(), sizeof(header));
+	if (std::memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0) {
+		std::cerr << "ERROR::CHECKPOINT::LOAD::NOT_A_CHECKPOINT: " << path << std::endl;
+		return false;
+	}
+	if (header.version != CHECKPOINT_VERSION || header.header_size != sizeof(CheckpointHeader)) {
+		std::cerr << "ERROR::CHECKPOINT::LOAD::UNSUPPORTED_VERSION: " << path << " is version " << header.version << ", expected " << CHECKPOINT_VERSION << std::endl;
+		return false;
+	}
+	for (int section = 0; section < CHECKPOINT_SECTIONS_NUM; ++section) {
+		const CheckpointSection& bounds = header.sections[section];
+		if (bounds.offset > file.get_size() || bounds.size > file.get_size() - bounds.offset) {
+			std::cerr << "ERROR::CHECKPOINT::LOAD::TRUNCATED: " << path << std::endl;
+			return false;
+		}
+	}
+	if (header.interpolation_kernel >= INTERPOLATION_KERNEL_NUM || header.transfer_scheme >= TRANSFER_SCHEME_NUM) {
+		std::cerr << "ERROR::CHECKPOINT::LOAD::INVALID_PARAMETERS: " << path << std::endl;
+		return false;
+	}
+
+	SimulationState state;
+	state.grid_size = glm::uvec3(header.grid_size[0], header.grid_size[1], header.grid_size[2]);
+	state.interpolation_kernel = (INTERPOLATION_KERNEL) header.interpolation_kernel;
+	state.transfer_scheme = (TRANSFER_SCHEME) header.transfer_scheme;
+	state.timestep = header.timestep;
+	state.steps_count = header.steps_count;
+	state.steps_since_sort = header.steps_since_sort;
+	state.particles_count = header.particles_count;
+	state.random_state_size = header.random_state_size;
+	state.whitewater_count = header.whitewater_count;
+	const CheckpointSection* sections = header.sections;
+	const bool sections_valid =
+		read_section(file, sections[CHECKPOINT_SECTION_PARTICLES_POSITIONS], state.particles_count, state.particles_positions) &&
+		read_section(file, sections[CHECKPOINT_SECTION_PARTICLES_VELOCITIES], state.particles_count, state.particles_velocities) &&
+		read_section(file, sections[CHECKPOINT_SECTION_PARTICLES_VELOCITY_GRADIENTS], state.particles_count, state.particles_velocity_gradients) &&
+		read_section(file, sections[CHECKPOINT_SECTION_PARTICLES_RANDOM_STATES], (uint64_t) state.particles_count * state.random_state_size, state.particles_random_states) &&
+		read_section(file, sections[CHECKPOINT_SECTION_WHITEWATER_POSITIONS], state.whitewater_count, state.whitewater_positions) &&
+		read_section(file, sections[CHECKPOINT_SECTION_WHITEWATER_VELOCITIES], state.whitewater_count, state.whitewater_velocities) &&
+		read_section(file, sections[CHECKPOINT_SECTION_WHITEWATER_TYPES], state.whitewater_count, state.whitewater_types) &&
+		read_section(file, sections[CHECKPOINT_SECTION_WHITEWATER_LIFETIMES], state.whitewater_count, state.whitewater_lifetimes);
+	if (!sections_valid) {
+		std::cerr << "ERROR::CHECKPOINT::LOAD::INVALID_SECTIONS: " << path << std::endl;
+		return false;
+	}
+	file.close();
+	if (state.particles_count > simulation.get_particles_max() || state.whitewater_count > simulation.get_whitewater_max()) {
+		std::cerr << "WARNING::CHECKPOINT::LOAD::TOO_MANY_PARTICLES: " << path << " is truncated to the simulation capacity" << std::endl;
+	}
+
+	simulation.particles_material = ParticleMaterial(
+		header.mass,
+		header.rest_density,
+		header.dynamic_viscosity,
+		header.EOS_stiffness,
+		header.EOS_power,
+		header.max_negative_pressure,
+		glm::vec3(header.color[0], header.color[1], header.color[2])
+	);
+	simulation.boundary = header.boundary;
+	simulation.boundary_elasticity = header.boundary_elasticity;
+	simulation.gravity = glm::vec3(header.gravity[0], header.gravity[1], header.gravity[2]);
+	simulation.whitewater_chance_min = header.whitewater_chance_min;
+	simulation.whitewater_chance_max = header.whitewater_chance_max;
+	simulation.whitewater_spawn_num = header.whitewater_spawn_num;
+	simulation.sort_interval = header.sort_interval;
+	simulation.flip_ratio = header.flip_ratio;
+	simulation.adaptive_timestep = header.adaptive_timestep != 0;
+	simulation.cfl_number = header.cfl_number;
+	simulation.min_timestep = header.min_timestep;
+	simulation.max_timestep = header.max_timestep;
+	simulation.set_fixed_timestep(header.fixed_timestep);
+	simulation.load_state(state);
+	return true;
+}
@@ -1,24 +1,20 @@
 #include <MPM/MPMSimulation.cuh>
 #include <glm/gtc/random.hpp>
 #include <utils/CudaCheck.cuh>
-
-const unsigned int MIN_GRID_SIZE = 40;
-const unsigned int MAX_CELLS_NUM = 240 * 240 * 240;
-const unsigned int PARTICLES_SPAWN_CUBE_SIZE = 32;	// 32 is max: used as part of kernel configuration	
-const unsigned int PARTICLES_SPAWN_NUM = PARTICLES_SPAWN_CUBE_SIZE * PARTICLES_SPAWN_CUBE_SIZE * PARTICLES_SPAWN_CUBE_SIZE;
-const unsigned int MAX_PARTICLES_NUM = 32 * 32 * 32 * 64;	// ~2 mln particles
-const unsigned int MAX_WHITEWATER_NUM = MAX_PARTICLES_NUM / 4;	// ~524k whitewater
-
-void MPMSimulation::_estimate_water_level()
-{
-	float mass = _particles_count * particles_material.mass;
-	float density = particles_material.rest_density * (particles_material.EOS_stiffness / 1000.0f);	// Arbitrarily scaled by stiffness/1000, as simulation isn't actually incompressible
-	_water_level = mass / (_grid_size.x * _grid_size.z * density);
-}
+#include <MPM/MPMConstants.hpp>
+#include <MPM/Morton.hpp>
+#include <MPM/SparseGrid.hpp>
+#include <MPM/EquationOfState.hpp>
+#include <algorithm>
+#include <cmath>
+#include <thrust/execution_policy.h>
+#include <thrust/sort.h>
+#include <thrust/transform_reduce.h>
+#include <thrust/functional.h>
+#include <thrust/iterator/counting_iterator.h>
 
 // CUDA kernels configuration
 unsigned int block_dim = 128;
-unsigned int cells_grid_dim = 0;
 unsigned int particles_grid_dim = 0;
 unsigned int whitewater_grid_dim = 0;
 
@@ -32,6 +28,8 @@ __global__ void initialize_particles_sphere(
 	const unsigned int end_idx,
 	const glm::aligned_vec3 spawn_center,
 	const float radius,
+	const glm::uvec3 grid_size,
+	const float domain_margin,
 	curandState* curand_states,
 	unsigned long long seed
 );
@@ -43,51 +41,123 @@ __global__ void initialize_particles_cube(
 	const unsigned int end_idx,
 	const glm::aligned_vec3 spawn_origin,
 	const float step,
+	const glm::uvec3 grid_size,
+	const float domain_margin,
+	curandState* curand_states,
+	unsigned long long seed
+);
+
+__global__ void initialize_random_states(
 	curandState* curand_states,
+	const unsigned int particles_count,
 	unsigned long long seed
 );
 
+__global__ void compute_sort_keys(
+	const glm::aligned_vec3* const particles_positions,
+	const unsigned int particles_count,
+	unsigned int* const sort_keys,
+	unsigned int* const sort_indices
+);
+
+template <typename T>
+__global__ void gather_particles_attribute(
+	const T* const attribute,
+	T* const sorted_attribute,
+	const unsigned int* const sort_indices,
+	const unsigned int particles_count
+);
+
+__global__ void grid_release_blocks(
+	unsigned int* const grid_block_table,
+	const unsigned int* const grid_blocks,
+	const unsigned int grid_blocks_count
+);
+
+__global__ void grid_reserve_blocks(
+	const glm::aligned_vec3* const particles_positions,
+	const unsigned int particles_count,
+	unsigned int* const grid_block_table,
+	const glm::uvec3 grid_blocks_size,
+	unsigned int* const grid_blocks,
+	unsigned int* const grid_blocks_counter,
+	const unsigned int stencil_size
+);
+
+__global__ void expand_grid(
+	const unsigned int* const grid_blocks,
+	const unsigned int grid_blocks_count,
+	const glm::uvec3 grid_blocks_size,
+	const GridCell* const cells,
+	const glm::uvec3 grid_size,
+	GridCell* const dense_cells
+);
+
+__global__ void clear_dense_grid_blocks(
+	const unsigned int* const grid_blocks,
+	const unsigned int grid_blocks_count,
+	const glm::uvec3 grid_blocks_size,
+	const glm::uvec3 grid_size,
+	GridCell* const dense_cells
+);
+
 __global__ void grid_reset(
-	glm::aligned_vec3* const cells_velocities, 
-	float* const cells_masses,
-	const unsigned int cells_count
+	unsigned int* const grid_block_table,
+	const unsigned int* const grid_blocks,
+	const unsigned int grid_blocks_count
 );
 
+// Transfer kernels are instantiated for each interpolation kernel and transfer scheme policy (see TransferPolicies.hpp)
+template <typename Kernel>
 __global__ void p2g_init(
 	glm::aligned_vec3* const particles_positions,
 	const unsigned int particles_count, 
 	const ParticleMaterial particles_material,
-	float* const cells_masses, 
-	const glm::uvec3 grid_size
+	GridCell* const cells, 
+	const unsigned int* const grid_block_table,
+	const glm::uvec3 grid_blocks_size
 );
 
+// EOS_POWER is the integer power of the eq. of state the kernel is specialized for, or 0 for the generic one (see EquationOfState.hpp)
+template <typename Kernel, typename Scheme, int EOS_POWER>
 __global__ void p2g(
 	glm::aligned_vec3* const particles_positions, 
 	glm::aligned_vec3* const particles_velocities, 
 	glm::aligned_mat3* const particles_velocity_gradients,
 	const unsigned int particles_count,
 	const ParticleMaterial particles_material, 
-	glm::aligned_vec3* const cells_velocities,
-	float* const cells_masses, 
-	const glm::uvec3 grid_size, 
+	GridCell* const cells,
+	glm::vec3* const cells_old_velocities,
+	const unsigned int* const grid_block_table,
+	const glm::uvec3 grid_blocks_size,
 	const float timestep
 );
 
 __global__ void grid_update(
-	glm::aligned_vec3* const cells_velocities, 
-	float* const cells_masses, 
+	GridCell* const cells, 
+	const unsigned int* const grid_blocks,
+	const unsigned int grid_blocks_count,
+	const glm::uvec3 grid_blocks_size,
 	const glm::uvec3 grid_size, 
 	const float timestep, 
-	const glm::aligned_vec3 gravity
+	const glm::aligned_vec3 gravity,
+	GridCell* const next_cells,
+	const unsigned int next_dirty_cells_count,
+	glm::vec3* const cells_old_velocities
 );
 
+// Without WHITEWATER, the turbulence estimate and whitewater spawn are compiled out
+template <typename Kernel, typename Scheme, bool WHITEWATER>
 __global__ void g2p(
 	glm::aligned_vec3* const particles_positions, 
 	glm::aligned_vec3* const particles_velocities, 
 	glm::aligned_mat3* const particles_velocity_gradients, 
 	curandState* curand_states,
 	const unsigned int particles_count, 
-	glm::aligned_vec3* const cells_velocities,
+	const GridCell* const cells,
+	const glm::vec3* const cells_old_velocities,
+	const unsigned int* const grid_block_table,
+	const glm::uvec3 grid_blocks_size,
 	const glm::uvec3 grid_size,
 	glm::aligned_vec3* const whitewater_positions,
 	glm::aligned_vec3* const whitewater_velocities,
@@ -98,23 +168,26 @@ __global__ void g2p(
 	const float whitewater_chance_min,
 	const float whitewater_chance_max,
 	const unsigned int whitewater_spawn_num,
+	const float flip_ratio,
 	const float timestep, 
 	const float boundary, 
 	const float boundary_elasticity
 );
 
+template <typename Kernel>
 __global__ void advect_whitewater(
 	glm::aligned_vec3* const whitewater_positions,
 	glm::aligned_vec3* const whitewater_velocities,
-	GLubyte* const whitewater_types,
+	unsigned char* const whitewater_types,
 	float* const whitewater_lifetimes,
 	const unsigned int whitewater_start_idx,
 	const unsigned int whitewater_end_idx,
 	const unsigned int moved_whitewater_start_idx,
 	const unsigned int moved_whitewater_max_idx,
 	unsigned int* const moved_whitewater_counter,
-	const glm::aligned_vec3* const cells_velocities, 
-	const float* const cells_masses, 
+	const GridCell* const cells, 
+	const unsigned int* const grid_block_table,
+	const glm::uvec3 grid_blocks_size,
 	const glm::uvec3 grid_size,
 	const ParticleMaterial particles_material, 
 	const float timestep,
@@ -123,6 +196,24 @@ __global__ void advect_whitewater(
 	const float boundary_elasticity
 );
 
+__global__ void clamp_positions(
+	glm::aligned_vec3* const positions,
+	const unsigned int start_idx,
+	const unsigned int end_idx,
+	const glm::uvec3 grid_size,
+	const float domain_margin
+);
+
+
+// Launch the p2g specialization for integer_power (from get_eos_integer_power()), trying each from POWER down to the generic one
+template <typename Kernel, typename Scheme, int POWER = EOS_MAX_INTEGER_POWER, typename... Args>
+void launch_p2g(const int integer_power, const unsigned int grid_dim, const Args... args)
+{
+	if constexpr (POWER == 0) p2g<Kernel, Scheme, 0><<<grid_dim, block_dim>>>(args...);
+	else if (integer_power == POWER) p2g<Kernel, Scheme, POWER><<<grid_dim, block_dim>>>(args...);
+	else launch_p2g<Kernel, Scheme, POWER - 1>(integer_power, grid_dim, args...);
+}
+
 
 MPMSimulation::MPMSimulation(
 	/* 
@@ -133,69 +224,29 @@ MPMSimulation::MPMSimulation(
 	const float timestep,
 	const float boundary,
 	const float boundary_elasticity,
-	const glm::aligned_vec3 gravity)
+	const glm::vec3 gravity)
 	:
-	particles_material(particles_material),
-	_particles_count(0),
-	_whitewater_count(0),
+	SimulationBackend(particles_material, timestep, boundary, boundary_elasticity, gravity),
 	_whitewater_start_idx(MAX_WHITEWATER_NUM),	// Will be flipped to 0 at first step()
-	whitewater_chance_min(0.5f),
-	whitewater_chance_max(1.0f),
-	whitewater_spawn_num(10),
-	_timestep(timestep),
-	boundary(boundary),
-	boundary_elasticity(boundary_elasticity),
-	gravity(gravity)
+	_grid_pool_capacity(0),
+	_cells_dirty_blocks(0),
+	_next_cells_dirty_blocks(0),
+	_render_cells_capacity(0),
+	_render_cells_grid_size(0),
+	_render_grid_blocks_count(0),
+	_render_cells_dirty(true)
 {
-	// Initialize MPM grid cells data structures
-	set_grid_size(grid_size);	// Ensure that MPM grid size at least allows for interpolation kernel size
+	// Initialize MPM grid data structures. The block table is allocated by set_grid_size(), the cells pool by the first step().
 	spawn_position = floor(glm::vec3(grid_size) / 2.0f);
-	glGenVertexArrays(1, &_cells_VAO);
-	glBindVertexArray(_cells_VAO);
-
-	glGenBuffers(1, &_cells_velocities_VBO);
-	glBindBuffer(GL_ARRAY_BUFFER, _cells_velocities_VBO);
-	glBufferData(GL_ARRAY_BUFFER, MAX_CELLS_NUM * sizeof(glm::aligned_vec3), NULL, GL_DYNAMIC_DRAW);
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::aligned_vec3), (void*) 0);
-	glEnableVertexAttribArray(0);
-	CUDA_CHECK( cudaGraphicsGLRegisterBuffer(&_cells_velocities, _cells_velocities_VBO, cudaGraphicsRegisterFlagsNone) );
-	CUDA_CHECK( cudaGetLastError() );
-
-	glGenBuffers(1, &_cells_masses_VBO);
-	glBindBuffer(GL_ARRAY_BUFFER, _cells_masses_VBO);
-	glBufferData(GL_ARRAY_BUFFER, MAX_CELLS_NUM * sizeof(float), NULL, GL_DYNAMIC_DRAW);
-	glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, 0, (void*) 0);
-	glEnableVertexAttribArray(1);
-	CUDA_CHECK( cudaGraphicsGLRegisterBuffer(&_cells_masses, _cells_masses_VBO, cudaGraphicsRegisterFlagsNone) );
+	set_grid_size(grid_size);	// Ensure that MPM grid size at least allows for interpolation kernel size
+	CUDA_CHECK( cudaMalloc(&_d_grid_blocks_counter, sizeof(unsigned int)) );
 	CUDA_CHECK( cudaGetLastError() );
 	
 	// Initialize particles data structures
-	glGenVertexArrays(1, &_particles_VAO);
-	glBindVertexArray(_particles_VAO);
-
-	// Used in instanced quad rendering, not in simulation
-	glGenBuffers(1, &_quad_VBO);
-	glBindBuffer(GL_ARRAY_BUFFER, _quad_VBO);
-	glBufferData(GL_ARRAY_BUFFER, 6 * sizeof(glm::vec2), &_quad_vertices[0], GL_DYNAMIC_DRAW);
-	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, (void*) 0);
-	glEnableVertexAttribArray(0);
-
-	glGenBuffers(1, &_particles_positions_VBO);
-	glBindBuffer(GL_ARRAY_BUFFER, _particles_positions_VBO);
-	glBufferData(GL_ARRAY_BUFFER, MAX_PARTICLES_NUM * sizeof(glm::aligned_vec3), NULL, GL_DYNAMIC_DRAW);
-	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(glm::aligned_vec3), (void*) 0);
-	glVertexAttribDivisor(1, 1);	// For instanced drawing
-	glEnableVertexAttribArray(1);
-	CUDA_CHECK( cudaGraphicsGLRegisterBuffer(&_particles_positions, _particles_positions_VBO, cudaGraphicsRegisterFlagsNone) );
+	CUDA_CHECK( cudaMalloc(&_d_particles_positions, MAX_PARTICLES_NUM * sizeof(glm::aligned_vec3)) );
 	CUDA_CHECK( cudaGetLastError() );
 
-	glGenBuffers(1, &_particles_velocities_VBO);
-	glBindBuffer(GL_ARRAY_BUFFER, _particles_velocities_VBO);
-	glBufferData(GL_ARRAY_BUFFER, MAX_PARTICLES_NUM * sizeof(glm::aligned_vec3), NULL, GL_DYNAMIC_DRAW);
-	glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(glm::aligned_vec3), (void*) 0);
-	glVertexAttribDivisor(2, 1);	// For instanced drawing
-	glEnableVertexAttribArray(2);
-	CUDA_CHECK( cudaGraphicsGLRegisterBuffer(&_particles_velocities, _particles_velocities_VBO, cudaGraphicsRegisterFlagsNone) );
+	CUDA_CHECK( cudaMalloc(&_d_particles_velocities, MAX_PARTICLES_NUM * sizeof(glm::aligned_vec3)) );
 	CUDA_CHECK( cudaGetLastError() );
 
 	CUDA_CHECK( cudaMalloc(&_d_particles_velocity_gradients, MAX_PARTICLES_NUM * sizeof(glm::aligned_mat3)) );
@@ -204,129 +255,416 @@ MPMSimulation::MPMSimulation(
 	CUDA_CHECK( cudaMalloc(&_d_curand_states, MAX_PARTICLES_NUM * sizeof(curandState)) );
 	CUDA_CHECK( cudaGetLastError() );
 
+	CUDA_CHECK( cudaMalloc(&_d_sort_keys, MAX_PARTICLES_NUM * sizeof(unsigned int)) );
+	CUDA_CHECK( cudaGetLastError() );
+
+	CUDA_CHECK( cudaMalloc(&_d_sort_indices, MAX_PARTICLES_NUM * sizeof(unsigned int)) );
+	CUDA_CHECK( cudaGetLastError() );
+
+	CUDA_CHECK( cudaMalloc(&_d_sort_scratch, MAX_PARTICLES_NUM * std::max(sizeof(glm::aligned_mat3), sizeof(curandState))) );
+	CUDA_CHECK( cudaGetLastError() );
+
 	// Initialize whitewater data structures
 	CUDA_CHECK( cudaMalloc(&_d_new_whitewater_counter, sizeof(unsigned int)) );
 	CUDA_CHECK( cudaGetLastError() );
 	// Note: whitewater buffers are actually DOUBLE MAX_WHITEWATER_NUM, as we ping-pong between the two halves of the buffers each frame.
-	glGenVertexArrays(1, &_whitewater_VAO);
-	glBindVertexArray(_whitewater_VAO);
-
-	// Used in instanced quad rendering, not in simulation. Already initialized for particles, only needs binding.
-	glBindBuffer(GL_ARRAY_BUFFER, _quad_VBO);
-	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, (void*) 0);
-	glEnableVertexAttribArray(0);
-
-	glGenBuffers(1, &_whitewater_positions_VBO);
-	glBindBuffer(GL_ARRAY_BUFFER, _whitewater_positions_VBO);
-	glBufferData(GL_ARRAY_BUFFER, 2 * MAX_WHITEWATER_NUM * sizeof(glm::aligned_vec3), NULL, GL_DYNAMIC_DRAW);
-	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(glm::aligned_vec3), (void*) 0);
-	glVertexAttribDivisor(1, 1);	// For instanced drawing
-	glEnableVertexAttribArray(1);
-	CUDA_CHECK( cudaGraphicsGLRegisterBuffer(&_whitewater_positions, _whitewater_positions_VBO, cudaGraphicsRegisterFlagsNone) );
+	CUDA_CHECK( cudaMalloc(&_d_whitewater_positions, 2 * MAX_WHITEWATER_NUM * sizeof(glm::aligned_vec3)) );
 	CUDA_CHECK( cudaGetLastError() );
 
 	CUDA_CHECK( cudaMalloc(&_d_whitewater_velocities, 2 * MAX_WHITEWATER_NUM * sizeof(glm::aligned_vec3)) );
 	CUDA_CHECK( cudaGetLastError() );
 
-	glGenBuffers(1, &_whitewater_types_VBO);
-	glBindBuffer(GL_ARRAY_BUFFER, _whitewater_types_VBO);
-	glBufferData(GL_ARRAY_BUFFER, 2 * MAX_WHITEWATER_NUM * sizeof(GLubyte), NULL, GL_DYNAMIC_DRAW);
-	glVertexAttribIPointer(2, 1, GL_UNSIGNED_BYTE, sizeof(GLubyte), (void*) 0);
-	glVertexAttribDivisor(2, 1);	// For instanced drawing
-	glEnableVertexAttribArray(2);
-	CUDA_CHECK( cudaGraphicsGLRegisterBuffer(&_whitewater_types, _whitewater_types_VBO, cudaGraphicsRegisterFlagsNone) );
+	CUDA_CHECK( cudaMalloc(&_d_whitewater_types, 2 * MAX_WHITEWATER_NUM * sizeof(unsigned char)) );
 	CUDA_CHECK( cudaGetLastError() );
 
-	glGenBuffers(1, &_whitewater_lifetimes_VBO);
-	glBindBuffer(GL_ARRAY_BUFFER, _whitewater_lifetimes_VBO);
-	glBufferData(GL_ARRAY_BUFFER, 2 * MAX_WHITEWATER_NUM * sizeof(float), NULL, GL_DYNAMIC_DRAW);
-	glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, sizeof(float), (void*) 0);
-	glVertexAttribDivisor(3, 1);	// For instanced drawing
-	glEnableVertexAttribArray(3);
-	CUDA_CHECK( cudaGraphicsGLRegisterBuffer(&_whitewater_lifetimes, _whitewater_lifetimes_VBO, cudaGraphicsRegisterFlagsNone) );
+	CUDA_CHECK( cudaMalloc(&_d_whitewater_lifetimes, 2 * MAX_WHITEWATER_NUM * sizeof(float)) );
 	CUDA_CHECK( cudaGetLastError() );
 
-	glBindVertexArray(0);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	// Start from an empty grid
+	reset_simulation();
 }
 
 
+MPMSimulation::~MPMSimulation() { cleanup(); }
+
+
 void MPMSimulation::cleanup()
 {
-	CUDA_CHECK( cudaFree(_d_curand_states) );
+	// cudaFree on nullptr is a no-op, so cleanup can be called more than once
+	CUDA_CHECK( cudaFree(_d_grid_block_table) );
 	CUDA_CHECK( cudaGetLastError() );
-	CUDA_CHECK( cudaGraphicsUnregisterResource(_cells_velocities) )
+	CUDA_CHECK( cudaFree(_d_grid_blocks) );
 	CUDA_CHECK( cudaGetLastError() );
-	CUDA_CHECK( cudaGraphicsUnregisterResource(_cells_masses) )
+	CUDA_CHECK( cudaFree(_d_grid_blocks_counter) );
 	CUDA_CHECK( cudaGetLastError() );
-	CUDA_CHECK( cudaGraphicsUnregisterResource(_particles_positions) )
+	CUDA_CHECK( cudaFree(_d_cells) );
 	CUDA_CHECK( cudaGetLastError() );
-	CUDA_CHECK( cudaGraphicsUnregisterResource(_particles_velocities) )
+	CUDA_CHECK( cudaFree(_d_next_cells) );
 	CUDA_CHECK( cudaGetLastError() );
-	CUDA_CHECK( cudaGraphicsUnregisterResource(_whitewater_positions) );
+	CUDA_CHECK( cudaFree(_d_cells_old_velocities) );
 	CUDA_CHECK( cudaGetLastError() );
-	CUDA_CHECK( cudaGraphicsUnregisterResource(_whitewater_types) );
+	CUDA_CHECK( cudaFree(_d_render_cells) );
 	CUDA_CHECK( cudaGetLastError() );
-	CUDA_CHECK( cudaGraphicsUnregisterResource(_whitewater_lifetimes) );
+	CUDA_CHECK( cudaFree(_d_render_grid_blocks) );
+	CUDA_CHECK( cudaGetLastError() );
+	CUDA_CHECK( cudaFree(_d_particles_positions) );
+	CUDA_CHECK( cudaGetLastError() );
+	CUDA_CHECK( cudaFree(_d_particles_velocities) );
+	CUDA_CHECK( cudaGetLastError() );
+	CUDA_CHECK( cudaFree(_d_particles_velocity_gradients) );
+	CUDA_CHECK( cudaGetLastError() );
+	CUDA_CHECK( cudaFree(_d_curand_states) );
+	CUDA_CHECK( cudaGetLastError() );
+	CUDA_CHECK( cudaFree(_d_whitewater_positions) );
+	CUDA_CHECK( cudaGetLastError() );
+	CUDA_CHECK( cudaFree(_d_whitewater_velocities) );
+	CUDA_CHECK( cudaGetLastError() );
+	CUDA_CHECK( cudaFree(_d_whitewater_types) );
+	CUDA_CHECK( cudaGetLastError() );
+	CUDA_CHECK( cudaFree(_d_whitewater_lifetimes) );
 	CUDA_CHECK( cudaGetLastError() );
 	CUDA_CHECK( cudaFree(_d_new_whitewater_counter) );
 	CUDA_CHECK( cudaGetLastError() );
-	CUDA_CHECK( cudaDeviceReset() );
-
-	glDeleteBuffers(1, &_cells_velocities_VBO);
-	glDeleteBuffers(1, &_cells_masses_VBO);
-	glDeleteBuffers(1, &_particles_positions_VBO);
-	glDeleteBuffers(1, &_particles_velocities_VBO);
-	glDeleteBuffers(1, &_whitewater_positions_VBO);
-	glDeleteBuffers(1, &_whitewater_types_VBO);
-	glDeleteBuffers(1, &_whitewater_lifetimes_VBO);
+	CUDA_CHECK( cudaFree(_d_sort_keys) );
+	CUDA_CHECK( cudaGetLastError() );
+	CUDA_CHECK( cudaFree(_d_sort_indices) );
+	CUDA_CHECK( cudaGetLastError() );
+	CUDA_CHECK( cudaFree(_d_sort_scratch) );
+	CUDA_CHECK( cudaGetLastError() );
+
+	_d_grid_block_table = nullptr;
+	_d_grid_blocks = nullptr;
+	_d_grid_blocks_counter = nullptr;
+	_d_cells = nullptr;
+	_d_next_cells = nullptr;
+	_d_cells_old_velocities = nullptr;
+	_d_render_cells = nullptr;
+	_d_render_grid_blocks = nullptr;
+	_d_particles_positions = nullptr;
+	_d_particles_velocities = nullptr;
+	_d_particles_velocity_gradients = nullptr;
+	_d_curand_states = nullptr;
+	_d_whitewater_positions = nullptr;
+	_d_whitewater_velocities = nullptr;
+	_d_whitewater_types = nullptr;
+	_d_whitewater_lifetimes = nullptr;
+	_d_new_whitewater_counter = nullptr;
+	_d_sort_keys = nullptr;
+	_d_sort_indices = nullptr;
+	_d_sort_scratch = nullptr;
+	_grid_pool_capacity = 0;
+	_cells_dirty_blocks = 0;
+	_next_cells_dirty_blocks = 0;
+	_render_cells_capacity = 0;
+	_render_cells_grid_size = glm::uvec3(0);
+	_render_grid_blocks_count = 0;
+	_grid_blocks_count = 0;
+	_particles_count = 0;
+	_whitewater_count = 0;
 }
 
 
-GLuint MPMSimulation::get_cells_VAO() const { return _cells_VAO; }
+void MPMSimulation::_on_grid_size_change()
+{
+	// Reallocate block table, with every block unallocated. The cells pool is reallocated by each step as needed.
+	_grid_blocks_size = get_grid_blocks_size(_grid_size);
+	const unsigned int blocks_num = _grid_blocks_size.x * _grid_blocks_size.y * _grid_blocks_size.z;
+	CUDA_CHECK( cudaFree(_d_grid_block_table) );
+	CUDA_CHECK( cudaGetLastError() );
+	CUDA_CHECK( cudaFree(_d_grid_blocks) );
+	CUDA_CHECK( cudaGetLastError() );
+	CUDA_CHECK( cudaMalloc(&_d_grid_block_table, blocks_num * sizeof(unsigned int)) );
+	CUDA_CHECK( cudaGetLastError() );
+	CUDA_CHECK( cudaMemset(_d_grid_block_table, 0xFF, blocks_num * sizeof(unsigned int)) );	// All bytes set: GRID_BLOCK_NONE
+	CUDA_CHECK( cudaGetLastError() );
+	CUDA_CHECK( cudaMalloc(&_d_grid_blocks, blocks_num * sizeof(unsigned int)) );
+	CUDA_CHECK( cudaGetLastError() );
+	_grid_blocks_count = 0;
+	_render_cells_dirty = true;
+	// Particles past the end of a smaller domain would reserve blocks past the end of the table
+	_clamp_to_domain();
+}
 
-GLuint MPMSimulation::get_particles_VAO() const { return _particles_VAO; }
 
-GLuint MPMSimulation::get_whitewater_VAO() const { return _whitewater_VAO; }
+void MPMSimulation::_clamp_to_domain()
+{
+	const float domain_margin = get_interpolation_domain_margin(_interpolation_kernel);
+	if (_particles_count > 0) {
+		clamp_positions<<<particles_grid_dim, block_dim>>>(
+			_d_particles_positions,
+			0,
+			_particles_count,
+			_grid_size,
+			domain_margin);
+		CUDA_CHECK( cudaGetLastError() );
+	}
+	if (_whitewater_count > 0) {
+		clamp_positions<<<whitewater_grid_dim, block_dim>>>(
+			_d_whitewater_positions,
+			_whitewater_start_idx,
+			_whitewater_start_idx + _whitewater_count,
+			_grid_size,
+			domain_margin);
+		CUDA_CHECK( cudaGetLastError() );
+	}
+}
+
 
-float MPMSimulation::get_timestep() const { return _timestep; }
+void MPMSimulation::_pack_render_cells() const
+{
+	if (!_render_cells_dirty || get_cells_count() > MAX_DENSE_CELLS_NUM) return;
+
+	if (_render_cells_grid_size != _grid_size) {
+		// Laid out for another grid size: reallocate if needed, and clear everything
+		const unsigned int cells_count = get_cells_count();
+		if (cells_count > _render_cells_capacity) {
+			CUDA_CHECK( cudaFree(_d_render_cells) );
+			CUDA_CHECK( cudaGetLastError() );
+			CUDA_CHECK( cudaMalloc(&_d_render_cells, cells_count * sizeof(GridCell)) );
+			CUDA_CHECK( cudaGetLastError() );
+			_render_cells_capacity = cells_count;
+		}
+		CUDA_CHECK( cudaMemset(_d_render_cells, 0, cells_count * sizeof(GridCell)) );
+		CUDA_CHECK( cudaGetLastError() );
+		CUDA_CHECK( cudaFree(_d_render_grid_blocks) );
+		CUDA_CHECK( cudaGetLastError() );
+		CUDA_CHECK( cudaMalloc(&_d_render_grid_blocks, _grid_blocks_size.x * _grid_blocks_size.y * _grid_blocks_size.z * sizeof(unsigned int)) );
+		CUDA_CHECK( cudaGetLastError() );
+		_render_grid_blocks_count = 0;
+		_render_cells_grid_size = _grid_size;
+	}
+	else if (_render_grid_blocks_count > 0) {
+		// Only the blocks expanded last time can be non-zero, so clearing scales with the fluid rather than the domain
+		clear_dense_grid_blocks<<<(_render_grid_blocks_count * GRID_BLOCK_CELLS_NUM + block_dim - 1) / block_dim, block_dim>>>(
+			_d_render_grid_blocks,
+			_render_grid_blocks_count,
+			_grid_blocks_size,
+			_grid_size,
+			_d_render_cells);
+		CUDA_CHECK( cudaGetLastError() );
+	}
 
-glm::uvec3 MPMSimulation::get_grid_size() const { return _grid_size; }
+	if (_grid_blocks_count > 0) {
+		expand_grid<<<(_grid_blocks_count * GRID_BLOCK_CELLS_NUM + block_dim - 1) / block_dim, block_dim>>>(
+			_d_grid_blocks,
+			_grid_blocks_count,
+			_grid_blocks_size,
+			_d_cells,
+			_grid_size,
+			_d_render_cells);
+		CUDA_CHECK( cudaGetLastError() );
+		CUDA_CHECK( cudaMemcpy(_d_render_grid_blocks, _d_grid_blocks, _grid_blocks_count * sizeof(unsigned int), cudaMemcpyDeviceToDevice) );
+		CUDA_CHECK( cudaGetLastError() );
+	}
+	_render_grid_blocks_count = _grid_blocks_count;
+	CUDA_CHECK( cudaDeviceSynchronize() );
+	_render_cells_dirty = false;
+}
 
-void MPMSimulation::set_grid_size(glm::uvec3 size)
+
+void MPMSimulation::_grid_release_blocks()
 {
-	_grid_size = size;
-	// Enforce minimum grid size
-	if (_grid_size.x < MIN_GRID_SIZE) _grid_size.x = MIN_GRID_SIZE;
-	if (_grid_size.y < MIN_GRID_SIZE) _grid_size.y = MIN_GRID_SIZE;
-	if (_grid_size.z < MIN_GRID_SIZE) _grid_size.z = MIN_GRID_SIZE;
+	if (_grid_blocks_count == 0) return;
 
-	// Update cells kernels configuration
-	cells_grid_dim = (get_cells_count() + block_dim - 1) / block_dim;
+	grid_release_blocks<<<(_grid_blocks_count + block_dim - 1) / block_dim, block_dim>>>(
+		_d_grid_block_table,
+		_d_grid_blocks,
+		_grid_blocks_count);
+	CUDA_CHECK( cudaGetLastError() );
+	_grid_blocks_count = 0;
+}
 
-	if (spawn_position.x > _grid_size.x - 20.0f) spawn_position.x = _grid_size.x - 20.0f;
-	if (spawn_position.y > _grid_size.y - 20.0f) spawn_position.y = _grid_size.y - 20.0f;
-	if (spawn_position.z > _grid_size.z - 20.0f) spawn_position.z = _grid_size.z - 20.0f;
 
-	// Update water level estimate
-	_estimate_water_level();
+void MPMSimulation::_grid_allocate()
+{
+	_grid_release_blocks();
+
+	// Swap in the cells pool cleared by the last grid update. The pool of the last step is cleared by this step's.
+	std::swap(_d_cells, _d_next_cells);
+	std::swap(_cells_dirty_blocks, _next_cells_dirty_blocks);
+
+	// Reserve every block covered by a particle's stencil
+	CUDA_CHECK( cudaMemset(_d_grid_blocks_counter, 0, sizeof(unsigned int)) );
+	CUDA_CHECK( cudaGetLastError() );
+	grid_reserve_blocks<<<particles_grid_dim, block_dim>>>(
+		_d_particles_positions,
+		_particles_count,
+		_d_grid_block_table,
+		_grid_blocks_size,
+		_d_grid_blocks,
+		_d_grid_blocks_counter,
+		get_interpolation_stencil_size(_interpolation_kernel));
+	CUDA_CHECK( cudaGetLastError() );
+	// The blocks count configures the following cells kernels
+	CUDA_CHECK( cudaMemcpy(&_grid_blocks_count, _d_grid_blocks_counter, sizeof(unsigned int), cudaMemcpyDeviceToHost) );
+	CUDA_CHECK( cudaGetLastError() );
+
+	// Grow both cells pools if needed, with some slack so that spreading fluid doesn't reallocate them every step. Their content doesn't need preserving, as the new pools start zeroed.
+	if (_grid_blocks_count > _grid_pool_capacity) {
+		const unsigned int blocks_num = _grid_blocks_size.x * _grid_blocks_size.y * _grid_blocks_size.z;
+		_grid_pool_capacity = std::min(_grid_blocks_count + _grid_blocks_count / 4, blocks_num);
+		const size_t cells_num = (size_t) _grid_pool_capacity * GRID_BLOCK_CELLS_NUM;
+		CUDA_CHECK( cudaFree(_d_cells) );
+		CUDA_CHECK( cudaGetLastError() );
+		CUDA_CHECK( cudaFree(_d_next_cells) );
+		CUDA_CHECK( cudaGetLastError() );
+		CUDA_CHECK( cudaMalloc(&_d_cells, cells_num * sizeof(GridCell)) );
+		CUDA_CHECK( cudaGetLastError() );
+		CUDA_CHECK( cudaMalloc(&_d_next_cells, cells_num * sizeof(GridCell)) );
+		CUDA_CHECK( cudaGetLastError() );
+		CUDA_CHECK( cudaMemset(_d_cells, 0, cells_num * sizeof(GridCell)) );
+		CUDA_CHECK( cudaGetLastError() );
+		CUDA_CHECK( cudaMemset(_d_next_cells, 0, cells_num * sizeof(GridCell)) );
+		CUDA_CHECK( cudaGetLastError() );
+		CUDA_CHECK( cudaFree(_d_cells_old_velocities) );
+		CUDA_CHECK( cudaGetLastError() );
+		_d_cells_old_velocities = nullptr;
+		_cells_dirty_blocks = 0;
+		_next_cells_dirty_blocks = 0;
+	}
+	// PIC/FLIP grid velocities before forces, as large as the cells pools. Cleared every step, in grid reset.
+	if (_transfer_scheme == TRANSFER_SCHEME_PIC_FLIP && _d_cells_old_velocities == nullptr) {
+		CUDA_CHECK( cudaMalloc(&_d_cells_old_velocities, (size_t) _grid_pool_capacity * GRID_BLOCK_CELLS_NUM * sizeof(glm::vec3)) );
+		CUDA_CHECK( cudaGetLastError() );
+	}
+}
+
+
+void MPMSimulation::_on_transfer_policies_change()
+{
+	_clamp_to_domain();	// The margin of the new kernel may be wider
+	_render_cells_dirty = true;
+
+	// Old grid velocities are only used by PIC/FLIP: allocated again at the next grid allocation if needed
+	if (_transfer_scheme != TRANSFER_SCHEME_PIC_FLIP) {
+		CUDA_CHECK( cudaFree(_d_cells_old_velocities) );
+		CUDA_CHECK( cudaGetLastError() );
+		_d_cells_old_velocities = nullptr;
+	}
+	CUDA_CHECK( cudaDeviceSynchronize() );
 }
 
-float MPMSimulation::get_estimated_water_level() const { return _water_level; }
 
-unsigned int MPMSimulation::get_cells_count() const { return _grid_size.x * _grid_size.y * _grid_size.z; }
+void MPMSimulation::_on_timestep_change() { }	// Every step scatters with its own timestep
 
-unsigned int MPMSimulation::get_particles_count() const { return _particles_count; }
 
-unsigned int MPMSimulation::get_particles_max() const { return MAX_PARTICLES_NUM; }
+// Squared speed of a particle, for the max speed reduction. Infinite if its position or velocity isn't finite.
+struct ParticleSquaredSpeed
+{
+	const glm::aligned_vec3* positions;
+	const glm::aligned_vec3* velocities;
+
+	__device__ float operator()(const unsigned int particle_idx) const
+	{
+		const glm::aligned_vec3 position = positions[particle_idx];
+		const glm::aligned_vec3 velocity = velocities[particle_idx];
+		const float speed2 = glm::dot(velocity, velocity);
+		// Any non-finite position or velocity component makes the sum non-finite
+		return isfinite(speed2 + position.x + position.y + position.z) ? speed2 : INFINITY;
+	}
+};
+
+float MPMSimulation::_get_max_particle_speed() const
+{
+	if (_particles_count == 0) return 0.0f;
+	const float max_speed2 = thrust::transform_reduce(
+		thrust::device,
+		thrust::counting_iterator<unsigned int>(0),
+		thrust::counting_iterator<unsigned int>(_particles_count),
+		ParticleSquaredSpeed{ _d_particles_positions, _d_particles_velocities },
+		0.0f,
+		thrust::maximum<float>());
+	CUDA_CHECK( cudaGetLastError() );
+	return std::sqrt(max_speed2);
+}
 
-unsigned int MPMSimulation::get_whitewater_start_idx() const { return _whitewater_start_idx; }
 
-unsigned int MPMSimulation::get_whitewater_count() const { return _whitewater_count; }
+// Copy count vectors between a device buffer of aligned_vec3 (or columns of aligned_mat3) and a tightly packed host one, skipping the padding
+void copy_vec3s(void* const dst, const size_t dst_stride, const void* const src, const size_t src_stride, const size_t count, const cudaMemcpyKind kind)
+{
+	if (count == 0) return;
+	CUDA_CHECK( cudaMemcpy2D(dst, dst_stride, src, src_stride, sizeof(glm::vec3), count, kind) );
+	CUDA_CHECK( cudaGetLastError() );
+}
 
-unsigned int MPMSimulation::get_whitewater_max() const { return MAX_WHITEWATER_NUM; }
 
-bool MPMSimulation::can_spawn_particles() const { return _particles_count + PARTICLES_SPAWN_NUM <= MAX_PARTICLES_NUM; }
+void MPMSimulation::_save_buffers(SimulationState& state) const
+{
+	state.particles_positions.resize(_particles_count);
+	state.particles_velocities.resize(_particles_count);
+	state.particles_velocity_gradients.resize(_particles_count);
+	copy_vec3s(state.particles_positions.data(), sizeof(glm::vec3), _d_particles_positions, sizeof(glm::aligned_vec3), _particles_count, cudaMemcpyDeviceToHost);
+	copy_vec3s(state.particles_velocities.data(), sizeof(glm::vec3), _d_particles_velocities, sizeof(glm::aligned_vec3), _particles_count, cudaMemcpyDeviceToHost);
+	copy_vec3s(state.particles_velocity_gradients.data(), sizeof(glm::vec3), _d_particles_velocity_gradients, sizeof(glm::aligned_vec3), _particles_count * 3, cudaMemcpyDeviceToHost);
+	state.random_state_size = sizeof(curandState);
+	state.particles_random_states.resize((size_t) _particles_count * sizeof(curandState));
+	CUDA_CHECK( cudaMemcpy(state.particles_random_states.data(), _d_curand_states, state.particles_random_states.size(), cudaMemcpyDeviceToHost) );
+	CUDA_CHECK( cudaGetLastError() );
+
+	// Active whitewater half
+	state.whitewater_positions.resize(_whitewater_count);
+	state.whitewater_velocities.resize(_whitewater_count);
+	state.whitewater_types.resize(_whitewater_count);
+	state.whitewater_lifetimes.resize(_whitewater_count);
+	copy_vec3s(state.whitewater_positions.data(), sizeof(glm::vec3), &_d_whitewater_positions[_whitewater_start_idx], sizeof(glm::aligned_vec3), _whitewater_count, cudaMemcpyDeviceToHost);
+	copy_vec3s(state.whitewater_velocities.data(), sizeof(glm::vec3), &_d_whitewater_velocities[_whitewater_start_idx], sizeof(glm::aligned_vec3), _whitewater_count, cudaMemcpyDeviceToHost);
+	CUDA_CHECK( cudaMemcpy(state.whitewater_types.data(), &_d_whitewater_types[_whitewater_start_idx], _whitewater_count * sizeof(unsigned char), cudaMemcpyDeviceToHost) );
+	CUDA_CHECK( cudaGetLastError() );
+	CUDA_CHECK( cudaMemcpy(state.whitewater_lifetimes.data(), &_d_whitewater_lifetimes[_whitewater_start_idx], _whitewater_count * sizeof(float), cudaMemcpyDeviceToHost) );
+	CUDA_CHECK( cudaGetLastError() );
+}
+
+
+void MPMSimulation::_load_buffers(const SimulationState& state)
+{
+	copy_vec3s(_d_particles_positions, sizeof(glm::aligned_vec3), state.particles_positions.data(), sizeof(glm::vec3), _particles_count, cudaMemcpyHostToDevice);
+	copy_vec3s(_d_particles_velocities, sizeof(glm::aligned_vec3), state.particles_velocities.data(), sizeof(glm::vec3), _particles_count, cudaMemcpyHostToDevice);
+	copy_vec3s(_d_particles_velocity_gradients, sizeof(glm::aligned_vec3), state.particles_velocity_gradients.data(), sizeof(glm::vec3), _particles_count * 3, cudaMemcpyHostToDevice);
+	particles_grid_dim = (_particles_count + block_dim - 1) / block_dim;
+	if (state.random_state_size == sizeof(curandState)) {
+		CUDA_CHECK( cudaMemcpy(_d_curand_states, state.particles_random_states.data(), (size_t) _particles_count * sizeof(curandState), cudaMemcpyHostToDevice) );
+		CUDA_CHECK( cudaGetLastError() );
+	}
+	else if (_particles_count > 0) {
+		// Saved by another backend
+		initialize_random_states<<<particles_grid_dim, block_dim>>>(
+			_d_curand_states,
+			_particles_count,
+			0);
+		CUDA_CHECK( cudaGetLastError() );
+	}
+
+	// Into the active whitewater half
+	copy_vec3s(&_d_whitewater_positions[_whitewater_start_idx], sizeof(glm::aligned_vec3), state.whitewater_positions.data(), sizeof(glm::vec3), _whitewater_count, cudaMemcpyHostToDevice);
+	copy_vec3s(&_d_whitewater_velocities[_whitewater_start_idx], sizeof(glm::aligned_vec3), state.whitewater_velocities.data(), sizeof(glm::vec3), _whitewater_count, cudaMemcpyHostToDevice);
+	CUDA_CHECK( cudaMemcpy(&_d_whitewater_types[_whitewater_start_idx], state.whitewater_types.data(), _whitewater_count * sizeof(unsigned char), cudaMemcpyHostToDevice) );
+	CUDA_CHECK( cudaGetLastError() );
+	CUDA_CHECK( cudaMemcpy(&_d_whitewater_lifetimes[_whitewater_start_idx], state.whitewater_lifetimes.data(), _whitewater_count * sizeof(float), cudaMemcpyHostToDevice) );
+	CUDA_CHECK( cudaGetLastError() );
+	whitewater_grid_dim = (_whitewater_count + block_dim - 1) / block_dim;
+	_render_cells_dirty = true;
+	CUDA_CHECK( cudaDeviceSynchronize() );
+}
+
+
+SIMULATION_BACKEND MPMSimulation::get_backend_type() const { return SIMULATION_BACKEND::CUDA; }
+
+BufferView MPMSimulation::get_particles_positions() const { return { _d_particles_positions, _particles_count, sizeof(glm::aligned_vec3), DEVICE }; }
+
+BufferView MPMSimulation::get_particles_velocities() const { return { _d_particles_velocities, _particles_count, sizeof(glm::aligned_vec3), DEVICE }; }
+
+BufferView MPMSimulation::get_whitewater_positions() const { return { &_d_whitewater_positions[_whitewater_start_idx], _whitewater_count, sizeof(glm::aligned_vec3), DEVICE }; }
+
+BufferView MPMSimulation::get_whitewater_types() const { return { &_d_whitewater_types[_whitewater_start_idx], _whitewater_count, sizeof(unsigned char), DEVICE }; }
+
+BufferView MPMSimulation::get_whitewater_lifetimes() const { return { &_d_whitewater_lifetimes[_whitewater_start_idx], _whitewater_count, sizeof(float), DEVICE }; }
+
+BufferView MPMSimulation::get_cells() const
+{
+	if (get_cells_count() > MAX_DENSE_CELLS_NUM) return {};
+	_pack_render_cells();
+	return { _d_render_cells, get_cells_count(), sizeof(GridCell), DEVICE };
+}
 
 
 void MPMSimulation::reset_simulation()
@@ -334,33 +672,53 @@ void MPMSimulation::reset_simulation()
 	// No need to delete particles: reset particle counter, and old data in the particles buffers will be overwritten when new ones are initialized.
 	_particles_count = 0;
 	_whitewater_count = 0;
+	_steps_count = 0;
+	_snapshots_count = 0;
 	_estimate_water_level();
 
-	// Reset grid cells. These DO need to be reset, or they won't be until new particles are spawned (as the simulation doesn't run if there are zero particles).
-	glm::aligned_vec3* d_cells_velocities;
-	float* d_cells_masses;
-	
-	CUDA_CHECK( cudaGraphicsMapResources(1, &_cells_velocities) );
-	CUDA_CHECK( cudaGetLastError() );
-	CUDA_CHECK( cudaGraphicsResourceGetMappedPointer((void**) &d_cells_velocities, NULL, _cells_velocities) );
-	CUDA_CHECK( cudaGetLastError() );
-	
-	CUDA_CHECK( cudaGraphicsMapResources(1, &_cells_masses) );
+	// Empty the grid. This DOES need to be done, or it won't be until new particles are spawned (as the simulation doesn't run if there are zero particles).
+	_grid_release_blocks();
+	_render_cells_dirty = true;
+	CUDA_CHECK( cudaDeviceSynchronize() );
+}
+
+
+// Gather attribute in sorted order into the scratch buffer, then copy it back
+template <typename T>
+void gather_sorted(T* const d_attribute, void* const d_scratch, const unsigned int* const d_sort_indices, const unsigned int particles_count)
+{
+	gather_particles_attribute<<<particles_grid_dim, block_dim>>>(
+		d_attribute,
+		(T*) d_scratch,
+		d_sort_indices,
+		particles_count);
 	CUDA_CHECK( cudaGetLastError() );
-	CUDA_CHECK( cudaGraphicsResourceGetMappedPointer((void**) &d_cells_masses, NULL, _cells_masses) );
+	CUDA_CHECK( cudaMemcpy(d_attribute, d_scratch, particles_count * sizeof(T), cudaMemcpyDeviceToDevice) );
 	CUDA_CHECK( cudaGetLastError() );
+}
 
-	grid_reset<<<cells_grid_dim, block_dim>>>(
-		d_cells_velocities, 
-		d_cells_masses,
-		get_cells_count());
-	CUDA_CHECK( cudaGetLastError() );
-	CUDA_CHECK( cudaDeviceSynchronize() );
 
-	CUDA_CHECK( cudaGraphicsUnmapResources(1, &_cells_velocities) );
+void MPMSimulation::sort_particles()
+{
+	if (_particles_count < 2) return;
+
+	compute_sort_keys<<<particles_grid_dim, block_dim>>>(
+		_d_particles_positions,
+		_particles_count,
+		_d_sort_keys,
+		_d_sort_indices);
 	CUDA_CHECK( cudaGetLastError() );
-	CUDA_CHECK( cudaGraphicsUnmapResources(1, &_cells_masses) );
+
+	// Radix sort of the particle indices by Morton code
+	thrust::sort_by_key(thrust::device, _d_sort_keys, _d_sort_keys + _particles_count, _d_sort_indices);
 	CUDA_CHECK( cudaGetLastError() );
+
+	// Every attribute, RNG state included, so that sorting doesn't change particles behaviour
+	gather_sorted(_d_particles_positions, _d_sort_scratch, _d_sort_indices, _particles_count);
+	gather_sorted(_d_particles_velocities, _d_sort_scratch, _d_sort_indices, _particles_count);
+	gather_sorted(_d_particles_velocity_gradients, _d_sort_scratch, _d_sort_indices, _particles_count);
+	gather_sorted(_d_curand_states, _d_sort_scratch, _d_sort_indices, _particles_count);
+	CUDA_CHECK( cudaDeviceSynchronize() );
 }
 
 
@@ -369,48 +727,24 @@ void MPMSimulation::spawn_particles_sphere()
 	if (!can_spawn_particles()) return;
 
 	const unsigned int new_particles_count = _particles_count + PARTICLES_SPAWN_NUM;
-	// Find sphere volume to spawn particles in rest state
-	float volume = ((PARTICLES_SPAWN_NUM * particles_material.mass) / particles_material.rest_density);		// V = m/d
-	float radius = std::cbrtf( (3.0f / 4.0f) * (volume / 3.14159265358979323846f));	// r = cbrtf(3/4 * V/pi)
-
-	// Ensure spawn volume is within bounds. If not, shrink. Particles won't spawn in rest state anymore.
-	if (radius > (_grid_size.x / 2.0f) - 1.0f) radius = (_grid_size.x / 2.0f) - 1.0f;
-	if (radius > (_grid_size.y / 2.0f) - 1.0f) radius = (_grid_size.y / 2.0f) - 1.0f;
-	if (radius > (_grid_size.z / 2.0f) - 1.0f) radius = (_grid_size.z / 2.0f) - 1.0f;
-
-	// Map CUDA resources
-	CUDA_CHECK( cudaGraphicsMapResources(1, &_particles_positions) );
-	CUDA_CHECK( cudaGetLastError() );
-	CUDA_CHECK( cudaGraphicsMapResources(1, &_particles_velocities) );
-	CUDA_CHECK( cudaGetLastError() );
-	// Get pointers
-	glm::aligned_vec3* d_particles_positions;
-	glm::aligned_vec3* d_particles_velocities;
-	CUDA_CHECK( cudaGraphicsResourceGetMappedPointer((void**) &d_particles_positions, NULL, _particles_positions) );
-	CUDA_CHECK( cudaGetLastError() );
-	CUDA_CHECK( cudaGraphicsResourceGetMappedPointer((void**) &d_particles_velocities, NULL, _particles_velocities) );
-	CUDA_CHECK( cudaGetLastError() );
+	const float radius = _get_spawn_sphere_radius();
 
 	// Initialise particles with kernel
 	// TODO: Change configurations if spawning a different number or shape of particles
 	initialize_particles_sphere<<<PARTICLES_SPAWN_CUBE_SIZE, dim3(PARTICLES_SPAWN_CUBE_SIZE, PARTICLES_SPAWN_CUBE_SIZE, 1)>>>(
-		&d_particles_positions[_particles_count],			// Pointer to first element of array to initialize
-		&d_particles_velocities[_particles_count],			// Pointer to first element of array to initialize
+		&_d_particles_positions[_particles_count],			// Pointer to first element of array to initialize
+		&_d_particles_velocities[_particles_count],			// Pointer to first element of array to initialize
 		&_d_particles_velocity_gradients[_particles_count],	// Pointer to first element of array to initialize
 		new_particles_count,								// Index to stop at
 		spawn_position,
 		radius,
+		_grid_size,
+		get_interpolation_domain_margin(_interpolation_kernel),
 		&_d_curand_states[_particles_count],				// Pointer to first element of array to initialize
 		0);
 	CUDA_CHECK( cudaGetLastError() );
 	CUDA_CHECK( cudaDeviceSynchronize() );
 
-	// Unmap
-	CUDA_CHECK( cudaGraphicsUnmapResources(1, &_particles_positions) );
-	CUDA_CHECK( cudaGetLastError() );
-	CUDA_CHECK( cudaGraphicsUnmapResources(1, &_particles_velocities) );
-	CUDA_CHECK( cudaGetLastError() );
-
 	// Update particles count;
 	_particles_count = new_particles_count;
 	particles_grid_dim = (_particles_count + block_dim - 1) / block_dim;
@@ -424,46 +758,25 @@ void MPMSimulation::spawn_particles_cube()
 
 	const unsigned int new_particles_count = _particles_count + PARTICLES_SPAWN_NUM;
 
-	// Ensure spawn volume is within bounds
-	float step = 1.0f / std::cbrtf(particles_material.rest_density / particles_material.mass);
-	if (step * PARTICLES_SPAWN_CUBE_SIZE > _grid_size.x - 2.0f) step = (_grid_size.x - 2.0f) / PARTICLES_SPAWN_CUBE_SIZE;
-	if (step * PARTICLES_SPAWN_CUBE_SIZE > _grid_size.y - 2.0f) step = (_grid_size.y - 2.0f) / PARTICLES_SPAWN_CUBE_SIZE;
-	if (step * PARTICLES_SPAWN_CUBE_SIZE > _grid_size.z - 2.0f) step = (_grid_size.z - 2.0f) / PARTICLES_SPAWN_CUBE_SIZE;
+	const float step = _get_spawn_cube_step();
 	glm::aligned_vec3 spawn_origin = spawn_position - floor(PARTICLES_SPAWN_CUBE_SIZE * step / 2.0f);
 
-	// Map CUDA resources
-	CUDA_CHECK( cudaGraphicsMapResources(1, &_particles_positions) );
-	CUDA_CHECK( cudaGetLastError() );
-	CUDA_CHECK( cudaGraphicsMapResources(1, &_particles_velocities) );
-	CUDA_CHECK( cudaGetLastError() );
-	// Get pointers
-	glm::aligned_vec3* d_particles_positions;
-	glm::aligned_vec3* d_particles_velocities;
-	CUDA_CHECK( cudaGraphicsResourceGetMappedPointer((void**) &d_particles_positions, NULL, _particles_positions) );
-	CUDA_CHECK( cudaGetLastError() );
-	CUDA_CHECK( cudaGraphicsResourceGetMappedPointer((void**) &d_particles_velocities, NULL, _particles_velocities) );
-	CUDA_CHECK( cudaGetLastError() );
-
 	// Initialise particles with kernel
 	// TODO: Change configurations if spawning a different number or shape of particles
 	initialize_particles_cube<<<PARTICLES_SPAWN_CUBE_SIZE, dim3(PARTICLES_SPAWN_CUBE_SIZE, PARTICLES_SPAWN_CUBE_SIZE, 1)>>>(
-		&d_particles_positions[_particles_count],			// Pointer to first element of array to initialize
-		&d_particles_velocities[_particles_count],			// Pointer to first element of array to initialize
+		&_d_particles_positions[_particles_count],			// Pointer to first element of array to initialize
+		&_d_particles_velocities[_particles_count],			// Pointer to first element of array to initialize
 		&_d_particles_velocity_gradients[_particles_count],	// Pointer to first element of array to initialize
 		new_particles_count,								// Index to stop at
 		spawn_origin,
 		step,
+		_grid_size,
+		get_interpolation_domain_margin(_interpolation_kernel),
 		&_d_curand_states[_particles_count],				// Pointer to first element of array to initialize
 		0);
 	CUDA_CHECK( cudaGetLastError() );
 	CUDA_CHECK( cudaDeviceSynchronize() );
 
-	// Unmap
-	CUDA_CHECK( cudaGraphicsUnmapResources(1, &_particles_positions) );
-	CUDA_CHECK( cudaGetLastError() );
-	CUDA_CHECK( cudaGraphicsUnmapResources(1, &_particles_velocities) );
-	CUDA_CHECK( cudaGetLastError() );
-
 	// Update particles count;
 	_particles_count = new_particles_count;
 	particles_grid_dim = (_particles_count + block_dim - 1) / block_dim;
@@ -474,133 +787,168 @@ void MPMSimulation::spawn_particles_cube()
 void MPMSimulation::step()
 {
 	if (_particles_count == 0) return;
+	++_steps_count;
+	_clear_stage_times();
+	_render_cells_dirty = true;
+
+	// Every stage ends with a device synchronization, so host-side stage timing is accurate.
+	// Keep particles in grid order, for cache-friendly transfers and fewer atomic conflicts
+	if (_is_sort_due()) {
+		_begin_stage();
+		sort_particles();
+		_end_stage(SORT_PARTICLES);
+	}
 
-	// Map OpenGL resources to CUDA
-	glm::aligned_vec3 *d_particles_positions, *d_particles_velocities, *d_cells_velocities, *d_whitewater_positions;
-	GLubyte *d_whitewater_types;
-	float *d_cells_masses, *d_whitewater_lifetimes;
-
-	cudaGraphicsResource* cuda_resources[] = {
-		_cells_velocities,
-		_cells_masses,
-		_particles_positions,
-		_particles_velocities,
-		_whitewater_positions,
-		_whitewater_types,
-		_whitewater_lifetimes,
-	};
-	CUDA_CHECK( cudaGraphicsMapResources(sizeof(cuda_resources) / sizeof(*cuda_resources), cuda_resources) );
-	CUDA_CHECK( cudaGetLastError() );
-	CUDA_CHECK( cudaGraphicsResourceGetMappedPointer((void**) &d_cells_velocities, NULL, _cells_velocities) );
-	CUDA_CHECK( cudaGetLastError() );
-	CUDA_CHECK( cudaGraphicsResourceGetMappedPointer((void**) &d_cells_masses, NULL, _cells_masses) );
-	CUDA_CHECK( cudaGetLastError() );
-	CUDA_CHECK( cudaGraphicsResourceGetMappedPointer((void**) &d_particles_positions, NULL, _particles_positions) );
-	CUDA_CHECK( cudaGetLastError() );
-	CUDA_CHECK( cudaGraphicsResourceGetMappedPointer((void**) &d_particles_velocities, NULL, _particles_velocities) );
-	CUDA_CHECK( cudaGetLastError() );
-	CUDA_CHECK( cudaGraphicsResourceGetMappedPointer((void**) &d_whitewater_positions, NULL, _whitewater_positions) );
-	CUDA_CHECK( cudaGetLastError() );
-	CUDA_CHECK( cudaGraphicsResourceGetMappedPointer((void**) &d_whitewater_types, NULL, _whitewater_types) );
-	CUDA_CHECK( cudaGetLastError() );
-	CUDA_CHECK( cudaGraphicsResourceGetMappedPointer((void**) &d_whitewater_lifetimes, NULL, _whitewater_lifetimes) );
-	CUDA_CHECK( cudaGetLastError() );
-	
-	// 1. Reset scratch-pad grid completely, zero out mass and velocity for each cell
-	grid_reset<<<cells_grid_dim, block_dim>>>(
-		d_cells_velocities,
-		d_cells_masses,
-		get_cells_count());
+	// Allocate the grid blocks covered by the particles
+	_begin_stage();
+	_grid_allocate();
+	CUDA_CHECK( cudaDeviceSynchronize() );
+	_end_stage(GRID_ALLOCATE);
+
+	// 1. Reset scratch-pad grid: give allocated blocks their pool index. Cells were zeroed by the last grid update, unless the pool grew dirty blocks since.
+	_begin_stage();
+	grid_reset<<<(_grid_blocks_count + block_dim - 1) / block_dim, block_dim>>>(
+		_d_grid_block_table,
+		_d_grid_blocks,
+		_grid_blocks_count);
 	CUDA_CHECK( cudaGetLastError() );
+	const unsigned int dirty_blocks_count = std::min(_cells_dirty_blocks, _grid_blocks_count);
+	if (dirty_blocks_count > 0) {
+		CUDA_CHECK( cudaMemset(_d_cells, 0, (size_t) dirty_blocks_count * GRID_BLOCK_CELLS_NUM * sizeof(GridCell)) );
+		CUDA_CHECK( cudaGetLastError() );
+	}
+	_cells_dirty_blocks = std::max(_cells_dirty_blocks, _grid_blocks_count);
+	// Scattered to by P2G like the cells, for PIC/FLIP only
+	glm::vec3* const d_cells_old_velocities = _transfer_scheme == TRANSFER_SCHEME_PIC_FLIP ? _d_cells_old_velocities : nullptr;
+	if (d_cells_old_velocities) {
+		CUDA_CHECK( cudaMemset(d_cells_old_velocities, 0, (size_t) _grid_blocks_count * GRID_BLOCK_CELLS_NUM * sizeof(glm::vec3)) );
+		CUDA_CHECK( cudaGetLastError() );
+	}
 	CUDA_CHECK( cudaDeviceSynchronize() );
+	_end_stage(GRID_RESET);
+
+	// The two halves of the whitewater buffer are ping-ponged: spawn new ones in inactive half, and advect ones in active half (then move them to inactive half)
+	unsigned int moved_whitewater_start_idx = _whitewater_start_idx == 0 ? MAX_WHITEWATER_NUM : 0;
+	CUDA_CHECK( cudaMemset(_d_new_whitewater_counter, 0, sizeof(unsigned int)) );
+	CUDA_CHECK( cudaGetLastError() );
+
+	// Transfers are instantiated on the interpolation kernel and transfer scheme (see TransferPolicies.hpp)
+	visit_interpolation_kernel(_interpolation_kernel, [&](const auto kernel_policy) {
+	visit_transfer_scheme(_transfer_scheme, [&](const auto scheme_policy) {
+	using Kernel = decltype(kernel_policy);
+	using Scheme = decltype(scheme_policy);
 
 	// P2G 1 (init): Scatter particle mass to the grid
-	p2g_init<<<particles_grid_dim, block_dim>>>(
-		d_particles_positions,
+	_begin_stage();
+	p2g_init<Kernel><<<particles_grid_dim, block_dim>>>(
+		_d_particles_positions,
 		_particles_count, 
 		particles_material, 
-		d_cells_masses, 
-		_grid_size);
+		_d_cells, 
+		_d_grid_block_table,
+		_grid_blocks_size);
 	CUDA_CHECK( cudaGetLastError() );
 	CUDA_CHECK( cudaDeviceSynchronize() );
+	_end_stage(P2G_MASS);
 
 	// 2. P2G 2: transfer data from particles to our grid
-	p2g<<<particles_grid_dim, block_dim>>>(
-		d_particles_positions, 
-		d_particles_velocities, 
+	_begin_stage();
+	launch_p2g<Kernel, Scheme>(
+		get_eos_integer_power(particles_material.EOS_power),
+		particles_grid_dim,
+		_d_particles_positions, 
+		_d_particles_velocities, 
 		_d_particles_velocity_gradients, 
 		_particles_count, 
 		particles_material, 
-		d_cells_velocities,
-		d_cells_masses,
-		_grid_size, 
+		_d_cells,
+		d_cells_old_velocities,
+		_d_grid_block_table,
+		_grid_blocks_size,
 		_timestep);
 	CUDA_CHECK( cudaGetLastError() );
 	CUDA_CHECK( cudaDeviceSynchronize() );
-
-	 // 3. Calculate grid velocities
-	grid_update<<<cells_grid_dim, block_dim>>>(
-		d_cells_velocities, 
-		d_cells_masses, 
+	_end_stage(P2G_MOMENTUM);
+
+	 // 3. Calculate grid velocities, and clear the other cells pool for the next step
+	const unsigned int update_cells_count = std::max(_grid_blocks_count, _next_cells_dirty_blocks) * GRID_BLOCK_CELLS_NUM;
+	_begin_stage();
+	grid_update<<<(update_cells_count + block_dim - 1) / block_dim, block_dim>>>(
+		_d_cells, 
+		_d_grid_blocks,
+		_grid_blocks_count,
+		_grid_blocks_size,
 		_grid_size, 
 		_timestep, 
-		gravity);
+		glm::aligned_vec3(gravity),
+		_d_next_cells,
+		_next_cells_dirty_blocks * GRID_BLOCK_CELLS_NUM,
+		d_cells_old_velocities);
 	CUDA_CHECK( cudaGetLastError() );
+	_next_cells_dirty_blocks = 0;
 	CUDA_CHECK( cudaDeviceSynchronize() );
-
-	// The two halves of the whitewater buffer are ping-ponged: spawn new ones in inactive half, and advect ones in active half (then move them to inactive half)
-	unsigned int moved_whitewater_start_idx = _whitewater_start_idx == 0 ? MAX_WHITEWATER_NUM : 0;
-	CUDA_CHECK( cudaMemset(_d_new_whitewater_counter, 0, sizeof(unsigned int)) );
-	CUDA_CHECK( cudaGetLastError() );
-
-	// 4. Grid-to-particle (G2P). Transfer cells velocity data to particles and advect. Spawn new whitewater.
-	g2p<<<particles_grid_dim, block_dim>>>(
-		d_particles_positions, 
-		d_particles_velocities, 
+	_end_stage(GRID_UPDATE);
+
+	// 4. Grid-to-particle (G2P). Transfer cells velocity data to particles and advect. Spawn new whitewater, unless disabled.
+	_begin_stage();
+	const auto g2p_kernel = whitewater_spawn_num > 0 ? g2p<Kernel, Scheme, true> : g2p<Kernel, Scheme, false>;
+	g2p_kernel<<<particles_grid_dim, block_dim>>>(
+		_d_particles_positions, 
+		_d_particles_velocities, 
 		_d_particles_velocity_gradients, 
 		_d_curand_states,
 		_particles_count, 
-		d_cells_velocities,
+		_d_cells,
+		d_cells_old_velocities,
+		_d_grid_block_table,
+		_grid_blocks_size,
 		_grid_size,
-		d_whitewater_positions,
+		_d_whitewater_positions,
 		_d_whitewater_velocities,
-		d_whitewater_lifetimes,
+		_d_whitewater_lifetimes,
 		moved_whitewater_start_idx,
 		moved_whitewater_start_idx + MAX_WHITEWATER_NUM,
 		_d_new_whitewater_counter,
 		whitewater_chance_min,
 		whitewater_chance_max,
 		whitewater_spawn_num,
+		flip_ratio,
 		_timestep,
 		boundary,
 		boundary_elasticity);
 	CUDA_CHECK( cudaGetLastError() );
 	CUDA_CHECK( cudaDeviceSynchronize() );
+	_end_stage(G2P);
 
 	// Advect whitewater and move surviving ones to other buffer
 	if (_whitewater_count > 0) {
-		advect_whitewater<<<whitewater_grid_dim, block_dim>>>(
-			d_whitewater_positions,
+		_begin_stage();
+		advect_whitewater<Kernel><<<whitewater_grid_dim, block_dim>>>(
+			_d_whitewater_positions,
 			_d_whitewater_velocities,
-			d_whitewater_types,
-			d_whitewater_lifetimes,
+			_d_whitewater_types,
+			_d_whitewater_lifetimes,
 			_whitewater_start_idx,
 			_whitewater_start_idx + _whitewater_count,
 			moved_whitewater_start_idx,
 			moved_whitewater_start_idx + MAX_WHITEWATER_NUM,
 			_d_new_whitewater_counter,
-			d_cells_velocities,
-			d_cells_masses,
+			_d_cells,
+			_d_grid_block_table,
+			_grid_blocks_size,
 			_grid_size,
 			particles_material,
 			_timestep,
-			gravity,
+			glm::aligned_vec3(gravity),
 			boundary,
 			boundary_elasticity
 		);
 		CUDA_CHECK( cudaGetLastError() );
 		CUDA_CHECK( cudaDeviceSynchronize() );
+		_end_stage(ADVECT_WHITEWATER);
 	}
+	});
+	});
 	// Update whitewater count and kernel configuration
 	CUDA_CHECK( cudaMemcpy(&_whitewater_count, _d_new_whitewater_counter, sizeof(unsigned int), cudaMemcpyDeviceToHost) );
 	CUDA_CHECK( cudaGetLastError() );
@@ -608,10 +956,6 @@ void MPMSimulation::step()
 	whitewater_grid_dim = (_whitewater_count + block_dim - 1) / block_dim;
 	// Flip active and inactive whitewater buffer half fir rendering
 	_whitewater_start_idx = moved_whitewater_start_idx;
-	
-	// Unmap CUDA resources
-	CUDA_CHECK( cudaGraphicsUnmapResources(sizeof(cuda_resources) / sizeof(*cuda_resources), cuda_resources) );
-	CUDA_CHECK( cudaGetLastError() );
 }
 
 
@@ -625,6 +969,8 @@ __global__ void initialize_particles_sphere(
 	const unsigned int end_idx,
 	const glm::aligned_vec3 spawn_center,
 	const float radius,
+	const glm::uvec3 grid_size,
+	const float domain_margin,
 	curandState* curand_states,
 	unsigned long long seed)
 {
@@ -644,7 +990,8 @@ __global__ void initialize_particles_sphere(
 		z = radius * (curand_uniform(state) * 2.0f - 1.0f);
 	} while (x * x + y * y + z * z  > radius * radius);
 
-	new_particles_positions[particle_idx] = spawn_center + glm::aligned_vec3(x, y, z);
+	// Clamp particle to simulation domain [margin, gridSize - 1 - margin], as the grid stencil must stay in the domain
+	new_particles_positions[particle_idx] = glm::clamp(spawn_center + glm::aligned_vec3(x, y, z), glm::aligned_vec3(domain_margin), glm::aligned_vec3(grid_size) - 1.0f - domain_margin);
 }
 
 
@@ -655,13 +1002,15 @@ __global__ void initialize_particles_cube(
 	const unsigned int end_idx,
 	const glm::aligned_vec3 spawn_origin,
 	const float step,
+	const glm::uvec3 grid_size,
+	const float domain_margin,
 	curandState* curand_states,
 	unsigned long long seed)
 {
 	unsigned int particle_idx = threadIdx.x + threadIdx.y * blockDim.x + blockIdx.x * (blockDim.x * blockDim.y);
 	if (particle_idx >= end_idx) return;
 	
-	new_particles_positions[particle_idx] = spawn_origin + glm::aligned_vec3(threadIdx.x * step, threadIdx.y * step, blockIdx.x * step);
+	new_particles_positions[particle_idx] = glm::clamp(spawn_origin + glm::aligned_vec3(threadIdx.x * step, threadIdx.y * step, blockIdx.x * step), glm::aligned_vec3(domain_margin), glm::aligned_vec3(grid_size) - 1.0f - domain_margin);	// Clamped to simulation domain, as in sphere spawn
 	new_particles_velocities[particle_idx] = glm::aligned_vec3(0.0f);
 	new_particles_velocity_gradients[particle_idx] = glm::aligned_mat3(0.0f);
 
@@ -669,68 +1018,180 @@ __global__ void initialize_particles_cube(
 }
 
 
-__global__ void grid_reset(
-	glm::aligned_vec3* const cells_velocities, 
-	float* const cells_masses,
-	const unsigned int cells_count)
+__global__ void initialize_random_states(
+	curandState* curand_states,
+	const unsigned int particles_count,
+	unsigned long long seed)
+{
+	unsigned int particle_idx = threadIdx.x + blockIdx.x * blockDim.x;
+	if (particle_idx >= particles_count) return;
+
+	curand_init(seed, particle_idx, 0, &curand_states[particle_idx]);
+}
+
+
+__global__ void compute_sort_keys(
+	const glm::aligned_vec3* const particles_positions,
+	const unsigned int particles_count,
+	unsigned int* const sort_keys,
+	unsigned int* const sort_indices)
+{
+	unsigned int particle_idx = threadIdx.x + blockIdx.x * blockDim.x;
+	if (particle_idx >= particles_count) return;
+
+	const glm::uvec3 cell_coords = particles_positions[particle_idx];	// Truncated Particle position is the grid coords of the enclosing Cell
+	sort_keys[particle_idx] = morton_encode(cell_coords.x, cell_coords.y, cell_coords.z);
+	sort_indices[particle_idx] = particle_idx;
+}
+
+
+template <typename T>
+__global__ void gather_particles_attribute(
+	const T* const attribute,
+	T* const sorted_attribute,
+	const unsigned int* const sort_indices,
+	const unsigned int particles_count)
+{
+	unsigned int particle_idx = threadIdx.x + blockIdx.x * blockDim.x;
+	if (particle_idx >= particles_count) return;
+
+	sorted_attribute[particle_idx] = attribute[sort_indices[particle_idx]];
+}
+
+
+__global__ void grid_release_blocks(
+	unsigned int* const grid_block_table,
+	const unsigned int* const grid_blocks,
+	const unsigned int grid_blocks_count)
+{
+	unsigned int block_idx = threadIdx.x + blockIdx.x * blockDim.x;
+	if (block_idx >= grid_blocks_count) return;
+
+	grid_block_table[grid_blocks[block_idx]] = GRID_BLOCK_NONE;
+}
+
+
+__global__ void grid_reserve_blocks(
+	const glm::aligned_vec3* const particles_positions,
+	const unsigned int particles_count,
+	unsigned int* const grid_block_table,
+	const glm::uvec3 grid_blocks_size,
+	unsigned int* const grid_blocks,
+	unsigned int* const grid_blocks_counter,
+	const unsigned int stencil_size)
+{
+	unsigned int particle_idx = threadIdx.x + blockIdx.x * blockDim.x;
+	if (particle_idx >= particles_count) return;
+
+	// The stencil spans cells [stencil_origin, stencil_origin + stencil_size - 1]: at most 2 blocks per axis (see TransferPolicies.hpp)
+	const glm::ivec3 stencil_origin = glm::aligned_vec3(particles_positions[particle_idx]) - (stencil_size - 1) * 0.5f;
+	const glm::uvec3 first_block = get_grid_block_coords(stencil_origin);
+	const glm::uvec3 last_block = glm::min(get_grid_block_coords(stencil_origin + (int) stencil_size - 1), grid_blocks_size - 1u);	// Stay in the table
+	for (unsigned int x = first_block.x; x <= last_block.x; ++x) {
+		for (unsigned int y = first_block.y; y <= last_block.y; ++y) {
+			for (unsigned int z = first_block.z; z <= last_block.z; ++z) {
+				const unsigned int block_key = get_grid_block_key(glm::uvec3(x, y, z), grid_blocks_size);
+				if (grid_block_table[block_key] != GRID_BLOCK_NONE) continue;	// Already reserved, skip the atomic
+				// The thread that reserves a block appends it to the allocated blocks
+				if (atomicCAS(&grid_block_table[block_key], GRID_BLOCK_NONE, GRID_BLOCK_MARKED) == GRID_BLOCK_NONE) grid_blocks[atomicAdd(grid_blocks_counter, 1)] = block_key;
+			}
+		}
+	}
+}
+
+
+__global__ void expand_grid(
+	const unsigned int* const grid_blocks,
+	const unsigned int grid_blocks_count,
+	const glm::uvec3 grid_blocks_size,
+	const GridCell* const cells,
+	const glm::uvec3 grid_size,
+	GridCell* const dense_cells)
 {
 	unsigned int cell_idx = threadIdx.x + blockIdx.x * blockDim.x;
-	if (cell_idx >= cells_count) return;
-	
-	cells_velocities[cell_idx] = glm::aligned_vec3(0.0f);
-	cells_masses[cell_idx] = 0.0f;
+	if (cell_idx >= grid_blocks_count * GRID_BLOCK_CELLS_NUM) return;
+
+	const unsigned int dense_cell_idx = get_grid_dense_cell_idx(grid_blocks[cell_idx / GRID_BLOCK_CELLS_NUM], cell_idx % GRID_BLOCK_CELLS_NUM, grid_blocks_size, grid_size);
+	if (dense_cell_idx == GRID_BLOCK_NONE) return;	// Blocks on the domain edge can overhang
+	dense_cells[dense_cell_idx] = cells[cell_idx];
+}
+
+
+__global__ void clear_dense_grid_blocks(
+	const unsigned int* const grid_blocks,
+	const unsigned int grid_blocks_count,
+	const glm::uvec3 grid_blocks_size,
+	const glm::uvec3 grid_size,
+	GridCell* const dense_cells)
+{
+	unsigned int cell_idx = threadIdx.x + blockIdx.x * blockDim.x;
+	if (cell_idx >= grid_blocks_count * GRID_BLOCK_CELLS_NUM) return;
+
+	const unsigned int dense_cell_idx = get_grid_dense_cell_idx(grid_blocks[cell_idx / GRID_BLOCK_CELLS_NUM], cell_idx % GRID_BLOCK_CELLS_NUM, grid_blocks_size, grid_size);
+	if (dense_cell_idx == GRID_BLOCK_NONE) return;
+	dense_cells[dense_cell_idx] = GridCell{ glm::vec3(0.0f), 0.0f };
 }
 
 
+__global__ void grid_reset(
+	unsigned int* const grid_block_table,
+	const unsigned int* const grid_blocks,
+	const unsigned int grid_blocks_count)
+{
+	unsigned int block_idx = threadIdx.x + blockIdx.x * blockDim.x;
+	if (block_idx >= grid_blocks_count) return;
+
+	// Give reserved blocks their pool index
+	grid_block_table[grid_blocks[block_idx]] = block_idx;
+}
+
+
+template <typename Kernel>
 __global__ void p2g_init(
 	glm::aligned_vec3* const particles_positions,
 	const unsigned int particles_count, 
 	const ParticleMaterial particles_material,
-	float* const cells_masses, 
-	const glm::uvec3 grid_size)
+	GridCell* const cells, 
+	const unsigned int* const grid_block_table,
+	const glm::uvec3 grid_blocks_size)
 {
 	unsigned int particle_idx = threadIdx.x + blockIdx.x * blockDim.x;
 	if (particle_idx >= particles_count) return;
 	const glm::aligned_vec3 particle_position = particles_positions[particle_idx];
 
-	// Calculate weights for the neighbouring cells surrounding the particle's position on the grid using an interpolation function
-	const glm::ivec3 cell_coords = particle_position;								// Truncated Particle position is the grid coords of the enclosing Cell
-	const glm::aligned_vec3 cell_dist = particle_position - glm::aligned_vec3(cell_coords) -0.5f;	// Particle distance to enclosing Cell's center (because Cell dimension is always 1)
-
-	// Quadratic interpolation weights
-	const glm::aligned_vec3 weights[3] = {
-		0.5f * (0.5f - cell_dist) * (0.5f - cell_dist),		// 0.5 * (0.5 - d)^2
-		0.75f - cell_dist * cell_dist,						// 0.75 - d^2
-		0.5f * (0.5f + cell_dist) * (0.5f + cell_dist)		// 0.5 * (0.5 + d)^2
-	};
+	// Calculate weights for the cells of the particle's stencil on the grid using an interpolation function (see TransferPolicies.hpp)
+	const glm::ivec3 stencil_origin = particle_position - Kernel::ORIGIN_OFFSET;
+	glm::aligned_vec3 weights[Kernel::STENCIL_SIZE];
+	Kernel::get_weights(particle_position - glm::aligned_vec3(stencil_origin) - Kernel::CENTER_OFFSET, weights);
 
-	unsigned int grid_size_yz = grid_size.y * grid_size.z;
 	// Scatter Particle's mass to the grid, using the cell's interpolation weights
 	// Particle's grid neighbourhood
 	#pragma unroll
-	for (int x = 0; x < 3; ++x) {
+	for (int x = 0; x < Kernel::STENCIL_SIZE; ++x) {
 		#pragma unroll
-		for (int y = 0; y < 3; ++y) {
+		for (int y = 0; y < Kernel::STENCIL_SIZE; ++y) {
 			#pragma unroll
-			for (int z = 0; z < 3; ++z) {
-				glm::ivec3 n_cell_coords (cell_coords + glm::ivec3(x, y, z) - 1);
+			for (int z = 0; z < Kernel::STENCIL_SIZE; ++z) {
+				glm::ivec3 n_cell_coords (stencil_origin + glm::ivec3(x, y, z));
 				float weight = weights[x].x * weights[y].y * weights[z].z;
-				atomicAdd(&cells_masses[n_cell_coords.x * grid_size_yz + n_cell_coords.y * grid_size.z + n_cell_coords.z], weight * particles_material.mass);
+				atomicAdd(&cells[get_grid_cell_idx(grid_block_table, grid_blocks_size, n_cell_coords)].mass, weight * particles_material.mass);
 			}
 		}
 	}
 }
 
 
+template <typename Kernel, typename Scheme, int EOS_POWER>
 __global__ void p2g(
 	glm::aligned_vec3* const particles_positions, 
 	glm::aligned_vec3* const particles_velocities, 
 	glm::aligned_mat3* const particles_velocity_gradients,
 	const unsigned int particles_count, 
 	const ParticleMaterial particles_material, 
-	glm::aligned_vec3* const cells_velocities,
-	float* const cells_masses,
-	const glm::uvec3 grid_size, 
+	GridCell* const cells,
+	glm::vec3* const cells_old_velocities,
+	const unsigned int* const grid_block_table,
+	const glm::uvec3 grid_blocks_size,
 	const float timestep)
 {
 	unsigned int particle_idx = threadIdx.x + blockIdx.x * blockDim.x;
@@ -740,64 +1201,74 @@ __global__ void p2g(
 	const glm::aligned_vec3 particle_velocity = particles_velocities[particle_idx];
 	const glm::aligned_mat3 particle_velocity_gradient = particles_velocity_gradients[particle_idx];
 
-	const glm::ivec3 cell_coords = particle_position;									// Truncated Particle position is the index of the enclosing grid Cell
-	const glm::aligned_vec3 cell_dist = particle_position - glm::aligned_vec3(cell_coords) - 0.5f;	// Particle distance to enclosing Cell's center (because Cell dimension is always 1)
-
-	// Quadratic interpolation weights for the neighbouring cells surrounding the particle
-	const glm::aligned_vec3 weights[3] = {
-		0.5f * (0.5f - cell_dist) * (0.5f - cell_dist),		// 0.5 * (0.5 - d)^2
-		0.75f - cell_dist * cell_dist,						// 0.75 - d^2
-		0.5f * (0.5f + cell_dist) * (0.5f + cell_dist)		// 0.5 * (0.5 + d)^2
-	};
+	// Interpolation weights for the cells of the particle's stencil
+	const glm::ivec3 stencil_origin = particle_position - Kernel::ORIGIN_OFFSET;
+	glm::aligned_vec3 weights[Kernel::STENCIL_SIZE];
+	Kernel::get_weights(particle_position - glm::aligned_vec3(stencil_origin) - Kernel::CENTER_OFFSET, weights);
 
 	// Estimate per-particle density
 	float density = 0.0f;
-	unsigned int grid_size_yz = grid_size.y * grid_size.z;
 	// Particle's grid neighbourhood
 	#pragma unroll
-	for (int x = 0; x < 3; ++x) {
+	for (int x = 0; x < Kernel::STENCIL_SIZE; ++x) {
 		#pragma unroll
-		for (int y = 0; y < 3; ++y) {
+		for (int y = 0; y < Kernel::STENCIL_SIZE; ++y) {
 			#pragma unroll
-			for (int z = 0; z < 3; ++z) {
-				glm::ivec3 n_cell_coords = cell_coords + glm::ivec3(x, y, z) - 1;
+			for (int z = 0; z < Kernel::STENCIL_SIZE; ++z) {
+				glm::ivec3 n_cell_coords = stencil_origin + glm::ivec3(x, y, z);
 				float weight = weights[x].x * weights[y].y * weights[z].z;
-				density += weight * cells_masses[n_cell_coords.x * grid_size_yz + n_cell_coords.y * grid_size.z + n_cell_coords.z];
+				density += weight * cells[get_grid_cell_idx(grid_block_table, grid_blocks_size, n_cell_coords)].mass;
 			}
 		}
 	}
 	// 2.2: Calculate quantities like e.g. stress based on constitutive equation
 	// Simplified eq. of state (by nialltl)
-	// p = stiffness * ((density / rest_density) ^ pow) - 1)
-	float pressure = particles_material.EOS_stiffness * (powf(density / particles_material.rest_density, particles_material.EOS_power) - 1.0f);
+	// p = stiffness * ((density / rest_density) ^ pow) - 1), with the power as a multiplication chain in integer specializations
+	const float density_ratio = density / particles_material.rest_density;
+	float density_power;
+	if constexpr (EOS_POWER > 0) density_power = pow_int<EOS_POWER>(density_ratio);
+	else density_power = powf(density_ratio, particles_material.EOS_power);
+	float pressure = particles_material.EOS_stiffness * (density_power - 1.0f);
 	pressure = pressure < particles_material.max_negative_pressure ? particles_material.max_negative_pressure : pressure;	// Clamped to avoid greatly negative pressure, hacky solution to particles collapsing (by nialltl).
 
 	// Strain rate tensor = viscosity * (velocity_gradient + transpose(velocity_gradient))
 	const glm::aligned_mat3 strain = particles_material.dynamic_viscosity * (particle_velocity_gradient + glm::transpose(particle_velocity_gradient));	
 	// Stress = -p * I + strain
 	const glm::aligned_mat3 stress = glm::aligned_mat3(-pressure) + strain;
-	// Stress_contribution = -V * 4 * stress * dt
-	const glm::aligned_mat3 stress_contribution = -(particles_material.mass / density) * 4.0f * stress * timestep;
+	// Stress_contribution = -V * D^-1 * stress * dt
+	const glm::aligned_mat3 stress_contribution = -(particles_material.mass / density) * Kernel::D_INVERSE * stress * timestep;
 
 	// 2.3: Scatter particle's momentum to the grid, using the cell's interpolation weight calculated in 2.1
 	// Particle's grid neighbourhood. 
 	#pragma unroll
-	for (int x = 0; x < 3; ++x) {
+	for (int x = 0; x < Kernel::STENCIL_SIZE; ++x) {
 		#pragma unroll
-		for (int y = 0; y < 3; ++y) {
+		for (int y = 0; y < Kernel::STENCIL_SIZE; ++y) {
 			#pragma unroll
-			for (int z = 0; z < 3; ++z) {
-				glm::ivec3 n_cell_coords = cell_coords + glm::ivec3(x, y, z) - 1;
+			for (int z = 0; z < Kernel::STENCIL_SIZE; ++z) {
+				glm::ivec3 n_cell_coords = stencil_origin + glm::ivec3(x, y, z);
 				glm::aligned_vec3 n_cell_dist = glm::aligned_vec3(n_cell_coords) + 0.5f - particle_position;	// Particle distance to neighbouring Cell's center
 
 				float weight = weights[x].x * weights[y].y * weights[z].z;
-
-				// Fused force + momentum update from MLS-MPM
-				glm::aligned_vec3 affine_velocity = n_cell_dist * particle_velocity_gradient;
-				glm::aligned_vec3 n_cell_momentum = weight * particles_material.mass * (particle_velocity + affine_velocity);
+				const unsigned int n_cell_idx = get_grid_cell_idx(grid_block_table, grid_blocks_size, n_cell_coords);
+
+				// Fused force + momentum update from MLS-MPM, with the affine velocity for APIC only
+				glm::aligned_vec3 n_cell_momentum;
+				if constexpr (Scheme::AFFINE) {
+					glm::aligned_vec3 affine_velocity = n_cell_dist * particle_velocity_gradient;
+					n_cell_momentum = weight * particles_material.mass * (particle_velocity + affine_velocity);
+				}
+				else n_cell_momentum = weight * particles_material.mass * particle_velocity;
+				// PIC/FLIP: momentum without forces, for the grid velocity change
+				if constexpr (Scheme::FLIP) {
+					glm::vec3& n_cell_old_velocity = cells_old_velocities[n_cell_idx];
+					atomicAdd(&n_cell_old_velocity.x, n_cell_momentum.x);
+					atomicAdd(&n_cell_old_velocity.y, n_cell_momentum.y);
+					atomicAdd(&n_cell_old_velocity.z, n_cell_momentum.z);
+				}
 				n_cell_momentum += stress_contribution * weight * n_cell_dist;
 
-				glm::aligned_vec3& n_cell_velocity = cells_velocities[n_cell_coords.x * grid_size_yz + n_cell_coords.y * grid_size.z + n_cell_coords.z];
+				glm::vec3& n_cell_velocity = cells[n_cell_idx].velocity;
 				atomicAdd(&n_cell_velocity.x, n_cell_momentum.x);
 				atomicAdd(&n_cell_velocity.y, n_cell_momentum.y);
 				atomicAdd(&n_cell_velocity.z, n_cell_momentum.z);
@@ -808,38 +1279,52 @@ __global__ void p2g(
 
 
 __global__ void grid_update(
-	glm::aligned_vec3* const cells_velocities, 
-	float* const cells_masses, 
+	GridCell* const cells, 
+	const unsigned int* const grid_blocks,
+	const unsigned int grid_blocks_count,
+	const glm::uvec3 grid_blocks_size,
 	const glm::uvec3 grid_size, 
 	const float timestep, 
-	const glm::aligned_vec3 gravity)
+	const glm::aligned_vec3 gravity,
+	GridCell* const next_cells,
+	const unsigned int next_dirty_cells_count,
+	glm::vec3* const cells_old_velocities)
 {
 	unsigned int cell_idx = threadIdx.x + blockIdx.x * blockDim.x;
-	if (cell_idx >= grid_size.x * grid_size.y * grid_size.z) return;
-	if (cells_masses[cell_idx] <= 0) return;	// Skip irrelevant cells
+
+	// Clear the other cells pool along the way, for the next step to scatter to
+	if (cell_idx < next_dirty_cells_count) next_cells[cell_idx] = GridCell{ glm::vec3(0.0f), 0.0f };
+
+	if (cell_idx >= grid_blocks_count * GRID_BLOCK_CELLS_NUM) return;
+	GridCell cell = cells[cell_idx];	// Single 16-byte load, and store below
+	if (cell.mass <= 0) return;	// Skip irrelevant cells
 
 	// 3.1: Calculate grid velocity based on momentum found in the P2G stage
-	glm::aligned_vec3& cell_velocity = cells_velocities[cell_idx];
-	cell_velocity /= cells_masses[cell_idx];	// Convert momentum to velocity
+	glm::aligned_vec3 cell_velocity = glm::aligned_vec3(cell.velocity) / cell.mass;	// Convert momentum to velocity
+	if (cells_old_velocities) cells_old_velocities[cell_idx] /= cell.mass;			// PIC/FLIP: velocity before forces
 	cell_velocity += gravity * timestep;		// Apply gravity
 
 	// 3.2: Enforce grid boundary conditions
-	unsigned int cell_x = cell_idx / (grid_size.y * grid_size.z);
-	unsigned int cell_y = (cell_idx % (grid_size.y * grid_size.z)) / grid_size.z;
-	unsigned int cell_z = (cell_idx % (grid_size.y * grid_size.z)) % grid_size.z; 
-	if (cell_x < 2 || cell_x > grid_size.x - 3) cell_velocity.x = 0.0f;
-	if (cell_y < 2 || cell_y > grid_size.y - 3) cell_velocity.y = 0.0f;
-	if (cell_z < 2 || cell_z > grid_size.z - 3) cell_velocity.z = 0.0f;
+	const glm::uvec3 cell_coords = get_grid_block_origin(grid_blocks[cell_idx / GRID_BLOCK_CELLS_NUM], grid_blocks_size) + get_grid_block_cell_offset(cell_idx % GRID_BLOCK_CELLS_NUM);
+	if (cell_coords.x < 2 || cell_coords.x > grid_size.x - 3) cell_velocity.x = 0.0f;
+	if (cell_coords.y < 2 || cell_coords.y > grid_size.y - 3) cell_velocity.y = 0.0f;
+	if (cell_coords.z < 2 || cell_coords.z > grid_size.z - 3) cell_velocity.z = 0.0f;
+	cell.velocity = glm::vec3(cell_velocity);
+	cells[cell_idx] = cell;
 }
 
 
+template <typename Kernel, typename Scheme, bool WHITEWATER>
 __global__ void g2p(
 	glm::aligned_vec3* const particles_positions, 
 	glm::aligned_vec3* const particles_velocities, 
 	glm::aligned_mat3* const particles_velocity_gradients, 
 	curandState* curand_states,
 	const unsigned int particles_count, 
-	glm::aligned_vec3* const cells_velocities,
+	const GridCell* const cells,
+	const glm::vec3* const cells_old_velocities,
+	const unsigned int* const grid_block_table,
+	const glm::uvec3 grid_blocks_size,
 	const glm::uvec3 grid_size,
 	glm::aligned_vec3* const whitewater_positions,
 	glm::aligned_vec3* const whitewater_velocities,
@@ -850,6 +1335,7 @@ __global__ void g2p(
 	const float whitewater_chance_min,
 	const float whitewater_chance_max,
 	const unsigned int whitewater_spawn_num,
+	const float flip_ratio,
 	const float timestep, 
 	const float boundary, 
 	const float boundary_elasticity)
@@ -860,52 +1346,50 @@ __global__ void g2p(
 	glm::aligned_vec3 particle_position = particles_positions[particle_idx];
 	const glm::aligned_vec3 old_particle_velocity = particles_velocities[particle_idx];
 
-	// Calculate weights for the neighbouring cells surrounding the particle's position on the grid using an interpolation function
-	const glm::ivec3 cell_coords = particle_position;								// Truncated Particle position is the grid coords of the enclosing Cell
-	const glm::aligned_vec3 cell_dist = particle_position - glm::aligned_vec3(cell_coords) - 0.5f;	// Particle distance to enclosing Cell's center (because Cell dimension is always 1)
-
-	// Quadratic interpolation weights
-	const glm::aligned_vec3 weights[3] = {
-		0.5f * (0.5f - cell_dist) * (0.5f - cell_dist),		// 0.5 * (0.5 - d)^2
-		0.75f - cell_dist * cell_dist,						// 0.75 - d^2
-		0.5f * (0.5f + cell_dist) * (0.5f + cell_dist)		// 0.5 * (0.5 + d)^2
-	};
+	// Calculate weights for the cells of the particle's stencil on the grid using an interpolation function (see TransferPolicies.hpp)
+	const glm::ivec3 stencil_origin = particle_position - Kernel::ORIGIN_OFFSET;
+	glm::aligned_vec3 weights[Kernel::STENCIL_SIZE];
+	Kernel::get_weights(particle_position - glm::aligned_vec3(stencil_origin) - Kernel::CENTER_OFFSET, weights);
 
 	// 4.3: Calculate new particle velocities
 	// Reset particle velocity and velocity gradient
 	glm::aligned_vec3 new_particle_velocity (0.0f);	
 	glm::aligned_mat3 new_particle_velocity_gradient (0.0f);
+	glm::aligned_vec3 old_grid_velocity (0.0f);	// Of the grid before forces, for FLIP
 	float turbulence = 0.0f;
 	
-	unsigned int grid_size_yz = grid_size.y * grid_size.z;
 	// Particle's grid neighbourhood. 
 	#pragma unroll
-	for (int x = 0; x < 3; ++x) {
+	for (int x = 0; x < Kernel::STENCIL_SIZE; ++x) {
 		#pragma unroll
-		for (int y = 0; y < 3; ++y) {
+		for (int y = 0; y < Kernel::STENCIL_SIZE; ++y) {
 			#pragma unroll
-			for (int z = 0; z < 3; ++z) {
-				glm::ivec3 n_cell_coords (cell_coords + glm::ivec3(x, y, z) - 1);
+			for (int z = 0; z < Kernel::STENCIL_SIZE; ++z) {
+				glm::ivec3 n_cell_coords (stencil_origin + glm::ivec3(x, y, z));
 				glm::aligned_vec3 n_cell_dist = glm::aligned_vec3(n_cell_coords) + 0.5f - particle_position;	// Particle distance to neighbouring Cell's center
 
 				// 4.3.1: Get this cell's weighted contribution to our particle's new velocity
 				float weight = weights[x].x * weights[y].y * weights[z].z;
-				glm::aligned_vec3 n_cell_velocity = cells_velocities[n_cell_coords.x * grid_size_yz + n_cell_coords.y * grid_size.z + n_cell_coords.z];
+				const unsigned int n_cell_idx = get_grid_cell_idx(grid_block_table, grid_blocks_size, n_cell_coords);
+				glm::aligned_vec3 n_cell_velocity = glm::aligned_vec3(cells[n_cell_idx].velocity);
 				glm::aligned_vec3 weighted_velocity = weight * n_cell_velocity;
 
 				new_particle_velocity += weighted_velocity;
 				// Outer multiplication
-				new_particle_velocity_gradient += 4.0f * glm::aligned_mat3(		// 4 is a constant resulting from interpolation weights
+				new_particle_velocity_gradient += Kernel::D_INVERSE * glm::aligned_mat3(		// Inverse of the inertia tensor of the interpolation weights
 					weighted_velocity * n_cell_dist.x,
 					weighted_velocity * n_cell_dist.y,
 					weighted_velocity * n_cell_dist.z
 				);
+				if constexpr (Scheme::FLIP) old_grid_velocity += weight * glm::aligned_vec3(cells_old_velocities[n_cell_idx]);
 				// Calculate turbulence for whitewater spawn
-				glm::aligned_vec3 relative_vel = old_particle_velocity - n_cell_velocity;
-				glm::aligned_vec3 relative_vel_direction = glm::normalize(relative_vel);
-				float relative_vel_magnitude = glm::length(relative_vel);
-				// Measures the amount of trapped air: 2.0 for particles colliding, 0.0 for particles moving away. From "Unified Spray, Foam, and whitewater for Particle-Based Fluids" (Ihmsen et al.)
-				turbulence += weight * relative_vel_magnitude * (1.0f - glm::dot(relative_vel_direction, glm::normalize(n_cell_dist)));
+				if constexpr (WHITEWATER) {
+					glm::aligned_vec3 relative_vel = old_particle_velocity - n_cell_velocity;
+					glm::aligned_vec3 relative_vel_direction = glm::normalize(relative_vel);
+					float relative_vel_magnitude = glm::length(relative_vel);
+					// Measures the amount of trapped air: 2.0 for particles colliding, 0.0 for particles moving away. From "Unified Spray, Foam, and whitewater for Particle-Based Fluids" (Ihmsen et al.)
+					turbulence += weight * relative_vel_magnitude * (1.0f - glm::dot(relative_vel_direction, glm::normalize(n_cell_dist)));
+				}
 			}
 		}
 	}
@@ -913,8 +1397,11 @@ __global__ void g2p(
 	// 4.4: Advect particle positions by their velocity (explicit integration)
 	glm::aligned_vec3 dx = new_particle_velocity * timestep;
 	particle_position += dx;
-	// Clamp particle to simulation domain [1, gridSize - 2]
-	particle_position = glm::clamp(particle_position, glm::aligned_vec3(1.0f), glm::aligned_vec3(grid_size) - 2.0f);
+	// Clamp particle to simulation domain [margin, gridSize - 1 - margin]. Lower bound first: max(margin, NaN) is the margin, so a blow-up stays in the domain until the health check.
+	particle_position = glm::min(glm::max(glm::aligned_vec3(Kernel::DOMAIN_MARGIN), particle_position), glm::aligned_vec3(grid_size) - 1.0f - Kernel::DOMAIN_MARGIN);
+
+	// FLIP: the particle velocity plus the grid velocity change, blended with the grid velocity (PIC) used for advection
+	if constexpr (Scheme::FLIP) new_particle_velocity += flip_ratio * (old_particle_velocity - old_grid_velocity);
 	
 	// Additional predictive boundary conditions to soften velocities near edges.
 	// Taken from nialltl's implementation, but added timestep scaling and boundary elasticity.
@@ -942,42 +1429,46 @@ __global__ void g2p(
 	#endif
 
 	// Spawn whitewater, with increased likeliness and amount depending on kinetic energy and turbulence
-	float kinetic_energy = dot(new_particle_velocity, new_particle_velocity); 
-	float kinetic_energy_factor = (min(kinetic_energy, whitewater_chance_max) - min(kinetic_energy, whitewater_chance_min)) / (whitewater_chance_max - whitewater_chance_min);	// Normalized on min and max
-	float trapped_air_factor = (min(turbulence, whitewater_chance_max) - min(turbulence, whitewater_chance_min)) / (whitewater_chance_max - whitewater_chance_min);				// Normalized on min and max
-	float spawn_chance = kinetic_energy_factor * trapped_air_factor * timestep;
-	// Spawn 8 whitewater particles max, depending on spawn chance
-	float c = curand_uniform(&curand_states[particle_idx]);	// Random in [0.0, 1.0)
-	if (c < spawn_chance) {									// If spawned at all
-		unsigned int n = ceilf(c * whitewater_spawn_num);	// Map to [1, spawn_num]
-		unsigned int idx_0 = new_whitewater_start_idx + atomicAdd(spawned_whitewater_counter, n);	// Start idx is buffer start + current spawn counter (pre-add)
-		for(int i = 0; i < n; ++i) {
-			if (idx_0 + i >= new_whitewater_max_idx) break;				// Don't spawn particles beyond max
-			// Spawn whitewater trailing the fluid particle
-			glm::aligned_vec3 position = particle_position - dx * (i + 1.0f);
-			position = clamp(position, glm::aligned_vec3(1.0f), glm::aligned_vec3(grid_size) - 2.0f);
-			whitewater_positions[idx_0 + i] = position;
-			whitewater_velocities[idx_0 + i] = new_particle_velocity;
-			// Make lifetime longer for clumps of whitewater, but randomize it a little (min: 1s, max: ~8s)
-			whitewater_lifetimes[idx_0 + i] = n * 2.0f + c * i;
+	if constexpr (WHITEWATER) {
+		float kinetic_energy = dot(new_particle_velocity, new_particle_velocity); 
+		float kinetic_energy_factor = (min(kinetic_energy, whitewater_chance_max) - min(kinetic_energy, whitewater_chance_min)) / (whitewater_chance_max - whitewater_chance_min);	// Normalized on min and max
+		float trapped_air_factor = (min(turbulence, whitewater_chance_max) - min(turbulence, whitewater_chance_min)) / (whitewater_chance_max - whitewater_chance_min);				// Normalized on min and max
+		float spawn_chance = kinetic_energy_factor * trapped_air_factor * timestep;
+		// Spawn 8 whitewater particles max, depending on spawn chance
+		float c = curand_uniform(&curand_states[particle_idx]);	// Random in [0.0, 1.0)
+		if (c < spawn_chance) {									// If spawned at all
+			unsigned int n = ceilf(c * whitewater_spawn_num);	// Map to [1, spawn_num]
+			unsigned int idx_0 = new_whitewater_start_idx + atomicAdd(spawned_whitewater_counter, n);	// Start idx is buffer start + current spawn counter (pre-add)
+			for(int i = 0; i < n; ++i) {
+				if (idx_0 + i >= new_whitewater_max_idx) break;				// Don't spawn particles beyond max
+				// Spawn whitewater trailing the fluid particle
+				glm::aligned_vec3 position = particle_position - dx * (i + 1.0f);
+				position = glm::min(glm::max(glm::aligned_vec3(Kernel::DOMAIN_MARGIN), position), glm::aligned_vec3(grid_size) - 1.0f - Kernel::DOMAIN_MARGIN);	// NaN-safe, as in G2P
+				whitewater_positions[idx_0 + i] = position;
+				whitewater_velocities[idx_0 + i] = new_particle_velocity;
+				// Make lifetime longer for clumps of whitewater, but randomize it a little (min: 1s, max: ~8s)
+				whitewater_lifetimes[idx_0 + i] = n * 2.0f + c * i;
+			}
 		}
 	}
 }
 
 
 // Identical to particles G2P, except for no velocity and velocity gradient update - just uses velocity directly
+template <typename Kernel>
 __global__ void advect_whitewater(
 	glm::aligned_vec3* const whitewater_positions,
 	glm::aligned_vec3* const whitewater_velocities,
-	GLubyte* const whitewater_types,
+	unsigned char* const whitewater_types,
 	float* const whitewater_lifetimes,
 	const unsigned int whitewater_start_idx,
 	const unsigned int whitewater_end_idx,
 	const unsigned int moved_whitewater_start_idx,
 	const unsigned int moved_whitewater_max_idx,
 	unsigned int* const moved_whitewater_counter,
-	const glm::aligned_vec3* const cells_velocities, 
-	const float* const cells_masses, 
+	const GridCell* const cells, 
+	const unsigned int* const grid_block_table,
+	const glm::uvec3 grid_blocks_size,
 	const glm::uvec3 grid_size,
 	const ParticleMaterial particles_material, 
 	const float timestep,
@@ -992,37 +1483,34 @@ __global__ void advect_whitewater(
 	glm::aligned_vec3 whitewater_velocity = whitewater_velocities[whitewater_idx];
 	float whitewater_lifetime = whitewater_lifetimes[whitewater_idx];
 
-	// Calculate weights for the neighbouring cells surrounding the whitewater's position on the grid using an interpolation function
-	const glm::ivec3 cell_coords = whitewater_position;								// Truncated whitewater position is the grid coords of the enclosing Cell
-	const glm::aligned_vec3 cell_dist = whitewater_position - glm::aligned_vec3(cell_coords) - 0.5f;	// whitewater distance to enclosing Cell's center (because Cell dimension is always 1)
-
-	// Quadratic interpolation weights
-	const glm::aligned_vec3 weights[3] = {
-		0.5f * (0.5f - cell_dist) * (0.5f - cell_dist),		// 0.5 * (0.5 - d)^2
-		0.75f - cell_dist * cell_dist,						// 0.75 - d^2
-		0.5f * (0.5f + cell_dist) * (0.5f + cell_dist)		// 0.5 * (0.5 + d)^2
-	};
+	// Calculate weights for the cells of the whitewater's stencil on the grid using an interpolation function (see TransferPolicies.hpp)
+	const glm::ivec3 stencil_origin = whitewater_position - Kernel::ORIGIN_OFFSET;
+	glm::aligned_vec3 weights[Kernel::STENCIL_SIZE];
+	Kernel::get_weights(whitewater_position - glm::aligned_vec3(stencil_origin) - Kernel::CENTER_OFFSET, weights);
 
 	// 4.3: Calculate new whitewater type and (if foam) velocity
 	float density = 0.0f;
-	GLubyte whitewater_type = 0;
+	unsigned char whitewater_type = 0;
 	glm::aligned_vec3 fluid_velocity (0.0f);
-	unsigned int grid_size_yz = grid_size.y * grid_size.z;
 	// whitewater's grid neighbourhood. 
 	#pragma unroll
-	for (int x = 0; x < 3; ++x) {
+	for (int x = 0; x < Kernel::STENCIL_SIZE; ++x) {
 		#pragma unroll
-		for (int y = 0; y < 3; ++y) {
+		for (int y = 0; y < Kernel::STENCIL_SIZE; ++y) {
 			#pragma unroll
-			for (int z = 0; z < 3; ++z) {
-				glm::ivec3 n_cell_coords (cell_coords + glm::ivec3(x, y, z) - 1);
+			for (int z = 0; z < Kernel::STENCIL_SIZE; ++z) {
+				glm::ivec3 n_cell_coords (stencil_origin + glm::ivec3(x, y, z));
 				glm::aligned_vec3 n_cell_dist = glm::aligned_vec3(n_cell_coords) + 0.5f - whitewater_position;	// whitewater distance to neighbouring Cell's center
+				// Whitewater can be away from the fluid: unallocated cells are empty
+				const unsigned int n_cell_idx = find_grid_cell_idx(grid_block_table, grid_blocks_size, n_cell_coords);
+				if (n_cell_idx == GRID_BLOCK_NONE) continue;
 
 				// 4.3.1: Get this cell's weighted contribution to our whitewater's new velocity
 				float weight = weights[x].x * weights[y].y * weights[z].z;
-				glm::aligned_vec3 weighted_velocity = weight * cells_velocities[n_cell_coords.x * grid_size_yz + n_cell_coords.y * grid_size.z + n_cell_coords.z];
+				const GridCell n_cell = cells[n_cell_idx];
+				glm::aligned_vec3 weighted_velocity = weight * glm::aligned_vec3(n_cell.velocity);
 				fluid_velocity += weighted_velocity;
-				density += weight * cells_masses[n_cell_coords.x * grid_size_yz + n_cell_coords.y * grid_size.z + n_cell_coords.z];
+				density += weight * n_cell.mass;
 			}
 		}
 	}
@@ -1050,9 +1538,9 @@ __global__ void advect_whitewater(
 	
 	// 4.4: Advect whitewater positions by their velocity (explicit integration)
 	whitewater_position += whitewater_velocity * timestep;
-	// Clamp whitewater to simulation domain [1, gridSize - 2], or a bit less if bubbles
-	if (whitewater_type == 2) whitewater_position = glm::clamp(whitewater_position, glm::aligned_vec3(1.3f), glm::aligned_vec3(grid_size) - 2.3f);
-	else whitewater_position = glm::clamp(whitewater_position, glm::aligned_vec3(1.0f), glm::aligned_vec3(grid_size) - 2.0f);
+	// Clamp whitewater to simulation domain [margin, gridSize - 1 - margin], or a bit less if bubbles
+	const float margin = whitewater_type == 2 ? Kernel::DOMAIN_MARGIN + 0.3f : Kernel::DOMAIN_MARGIN;
+	whitewater_position = glm::min(glm::max(glm::aligned_vec3(margin), whitewater_position), glm::aligned_vec3(grid_size) - 1.0f - margin);	// NaN-safe, as for particles
 	
 	// Additional predictive boundary conditions to soften velocities near edges.
 	// Taken from nialltl's implementation, but added timestep scaling and boundary elasticity.
@@ -1081,3 +1569,17 @@ __global__ void advect_whitewater(
 		assert(whitewater_position.z == whitewater_position.z);
 	#endif
 }
+
+
+__global__ void clamp_positions(
+	glm::aligned_vec3* const positions,
+	const unsigned int start_idx,
+	const unsigned int end_idx,
+	const glm::uvec3 grid_size,
+	const float domain_margin)
+{
+	unsigned int idx = start_idx + threadIdx.x + blockIdx.x * blockDim.x;
+	if (idx >= end_idx) return;
+
+	positions[idx] = glm::clamp(positions[idx], glm::aligned_vec3(domain_margin), glm::aligned_vec3(grid_size) - 1.0f - domain_margin);
+}
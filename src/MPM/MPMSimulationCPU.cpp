@@ -0,0 +1,1127 @@
+#include <MPM/MPMSimulationCPU.hpp>
+#include <MPM/MPMConstants.hpp>
+#include <MPM/Morton.hpp>
+#include <MPM/EquationOfState.hpp>
+#include <MPM/SparseGrid.hpp>
+#include <MPM/TransferKernelsCPU.hpp>
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+// Per-particle random numbers. Equivalent in use to the curandState of the CUDA implementation, not in the generated sequences.
+namespace
+{
+	// Hash of (seed, index), never 0 as xorshift would get stuck
+	unsigned int random_init(const unsigned long long seed, const unsigned int idx)
+	{
+		unsigned int h = (unsigned int) (seed ^ (seed >> 32)) ^ (idx * 0x9E3779B9u);
+		h ^= h >> 16;
+		h *= 0x85EBCA6Bu;
+		h ^= h >> 13;
+		h *= 0xC2B2AE35u;
+		h ^= h >> 16;
+		return h != 0 ? h : 1u;
+	}
+
+	// xorshift32, mapped to [0.0, 1.0)
+	float random_uniform(unsigned int& state)
+	{
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return (state >> 8) * (1.0f / 16777216.0f);
+	}
+
+	// Reserve a block of a sparse grid, if not already. The call that reserves it appends it to the allocated blocks.
+	void reserve_grid_block(std::vector<unsigned int>& block_table, std::vector<unsigned int>& blocks, std::atomic<unsigned int>& blocks_counter, const unsigned int block_key)
+	{
+		std::atomic_ref<unsigned int> block_entry (block_table[block_key]);
+		if (block_entry.load(std::memory_order_relaxed) != GRID_BLOCK_NONE) return;	// Already reserved, skip the more expensive exchange
+		unsigned int expected = GRID_BLOCK_NONE;
+		if (block_entry.compare_exchange_strong(expected, GRID_BLOCK_MARKED, std::memory_order_relaxed)) {
+			blocks[blocks_counter.fetch_add(1, std::memory_order_relaxed)] = block_key;
+		}
+	}
+
+	// Stable parallel counting sort of [0, count) into buckets_count buckets: each thread bins a contiguous chunk, so buckets keep the order of [0, count).
+	// place(i, position) is called once for each i with its sorted position. bucket_offsets, if not null, gets the start of each bucket, plus the end.
+	template <typename GetBucket, typename Place>
+	void counting_sort(ThreadPool& thread_pool, const unsigned int count, const unsigned int buckets_count, const GetBucket& get_bucket, const Place& place, std::vector<unsigned int>& chunk_offsets, std::vector<unsigned int>* const bucket_offsets)
+	{
+		const unsigned int chunks_count = thread_pool.get_threads_count();
+		const unsigned int chunk_size = (count + chunks_count - 1) / chunks_count;
+		chunk_offsets.assign((size_t) chunks_count * buckets_count, 0);
+		thread_pool.parallel_for(0, chunks_count, [&](unsigned int begin, unsigned int end, unsigned int) {
+			for (unsigned int chunk = begin; chunk < end; ++chunk) {
+				unsigned int* const chunk_counts = &chunk_offsets[(size_t) chunk * buckets_count];
+				for (unsigned int i = chunk * chunk_size; i < std::min((chunk + 1) * chunk_size, count); ++i) ++chunk_counts[get_bucket(i)];
+			}
+		}, 1);
+
+		// Counts to offsets, bucket-major then chunk-major
+		if (bucket_offsets) bucket_offsets->resize(buckets_count + 1);
+		unsigned int offset = 0;
+		for (unsigned int bucket = 0; bucket < buckets_count; ++bucket) {
+			if (bucket_offsets) (*bucket_offsets)[bucket] = offset;
+			for (unsigned int chunk = 0; chunk < chunks_count; ++chunk) {
+				unsigned int& chunk_offset = chunk_offsets[(size_t) chunk * buckets_count + bucket];
+				const unsigned int bucket_count = chunk_offset;
+				chunk_offset = offset;
+				offset += bucket_count;
+			}
+		}
+		if (bucket_offsets) (*bucket_offsets)[buckets_count] = offset;
+
+		thread_pool.parallel_for(0, chunks_count, [&](unsigned int begin, unsigned int end, unsigned int) {
+			for (unsigned int chunk = begin; chunk < end; ++chunk) {
+				unsigned int* const offsets = &chunk_offsets[(size_t) chunk * buckets_count];
+				for (unsigned int i = chunk * chunk_size; i < std::min((chunk + 1) * chunk_size, count); ++i) place(i, offsets[get_bucket(i)]++);
+			}
+		}, 1);
+	}
+
+}
+
+
+const char* get_p2g_mode_name(const P2G_MODE mode)
+{
+	switch (mode) {
+		case P2G_MODE_FUSED: return "fused";
+		case P2G_MODE_ONE_PASS: return "one-pass";
+		default: return "two-pass";
+	}
+}
+
+
+unsigned int MPMSimulationCPU::_find_cell_idx(const glm::ivec3& cell_coords) const
+{
+	if (_grid_cell_order == GRID_CELL_ORDER_MORTON) return find_grid_cell_idx<GridCellOrderMorton>(_grid_block_table.data(), _grid_blocks_size, cell_coords);
+	return find_grid_cell_idx<GridCellOrderLinear>(_grid_block_table.data(), _grid_blocks_size, cell_coords);
+}
+
+
+glm::uvec3 MPMSimulationCPU::_get_block_cell_offset(const unsigned int block_cell_idx) const
+{
+	if (_grid_cell_order == GRID_CELL_ORDER_MORTON) return get_grid_block_cell_offset<GridCellOrderMorton>(block_cell_idx);
+	return get_grid_block_cell_offset<GridCellOrderLinear>(block_cell_idx);
+}
+
+
+unsigned int MPMSimulationCPU::_get_dense_cell_idx(const unsigned int block_key, const unsigned int block_cell_idx) const
+{
+	if (_grid_cell_order == GRID_CELL_ORDER_MORTON) return get_grid_dense_cell_idx<GridCellOrderMorton>(block_key, block_cell_idx, _grid_blocks_size, _grid_size);
+	return get_grid_dense_cell_idx<GridCellOrderLinear>(block_key, block_cell_idx, _grid_blocks_size, _grid_size);
+}
+
+
+TransferKernelArgs MPMSimulationCPU::_get_transfer_kernel_args()
+{
+	TransferKernelArgs args;
+	args.grid_block_table = _grid_block_table.data();
+	args.grid_blocks_size = _grid_blocks_size;
+	args.grid_size = _grid_size;
+	args.cells = _cells.data();
+	args.next_grid_block_table = _next_grid_block_table.data();
+	args.next_cells = _next_cells.data();
+	const bool flip = _transfer_scheme == TRANSFER_SCHEME_PIC_FLIP;
+	args.cells_old_velocities = flip ? _cells_old_velocities.data() : nullptr;
+	args.next_cells_old_velocities = flip ? _next_cells_old_velocities.data() : nullptr;
+	for (int i = 0; i < 3; ++i) args.positions[i] = _particles.positions[i].data();
+	for (int i = 0; i < 3; ++i) args.velocities[i] = _particles.velocities[i].data();
+	for (int i = 0; i < 9; ++i) args.velocity_gradients[i] = _particles.velocity_gradients[i].data();
+	args.densities = _particles.densities.data();
+	args.particle_mass = particles_material.mass;
+	args.rest_density = particles_material.rest_density;
+	args.dynamic_viscosity = particles_material.dynamic_viscosity;
+	args.EOS_stiffness = particles_material.EOS_stiffness;
+	args.EOS_power = particles_material.EOS_power;
+	args.EOS_integer_power = get_eos_integer_power(particles_material.EOS_power);
+	args.max_negative_pressure = particles_material.max_negative_pressure;
+	args.timestep = _timestep;
+	args.boundary = boundary;
+	args.boundary_elasticity = boundary_elasticity;
+	args.whitewater_chance_min = whitewater_chance_min;
+	args.whitewater_chance_max = whitewater_chance_max;
+	args.flip_ratio = flip_ratio;
+	return args;
+}
+
+
+const TransferKernelsCPU& MPMSimulationCPU::_get_transfer_kernels() const { return get_transfer_kernels(_cpu_isa, _grid_cell_order, _interpolation_kernel, _transfer_scheme); }
+
+
+MPMSimulationCPU::MPMSimulationCPU(
+	/*
+	Grid cells are always spaced by 1, and the whole simulation is scaled in rendering if needed. This way the world position -> grid index mapping can be done simply by truncating the particle local position.
+	*/
+	glm::uvec3 grid_size,
+	const ParticleMaterial& particles_material,
+	const float timestep,
+	const float boundary,
+	const float boundary_elasticity,
+	const glm::vec3 gravity,
+	const unsigned int threads_count)
+	:
+	SimulationBackend(particles_material, timestep, boundary, boundary_elasticity, gravity),
+	_thread_pool(threads_count),
+	_grid_blocks_counter(0),
+	_cells_dirty_blocks(0),
+	_next_grid_blocks_count(0),
+	_next_cells_dirty_blocks(0),
+	_next_grid_ready(false),
+	_render_cells_grid_size(0),
+	_render_cells_dirty(true),
+	_color_blocks_offsets(),
+	_render_particles_dirty(true),
+	_new_whitewater_counter(0),
+	_cpu_isa(get_supported_cpu_isa()),
+	_grid_cell_order(GRID_CELL_ORDER_LINEAR),
+	_particles_densities_valid(false),
+	p2g_scatter(P2G_SCATTER_COLORED),
+	p2g_mode(P2G_MODE_TWO_PASS)
+{
+	spawn_position = floor(glm::vec3(grid_size) / 2.0f);
+	set_grid_size(grid_size);	// Ensure that MPM grid size at least allows for interpolation kernel size
+
+	// Particles buffers grow with spawns, up to MAX_PARTICLES_NUM
+	_particles.reserve(MAX_PARTICLES_NUM);
+
+	_whitewater_positions.resize(MAX_WHITEWATER_NUM);
+	_whitewater_velocities.resize(MAX_WHITEWATER_NUM);
+	_whitewater_types.resize(MAX_WHITEWATER_NUM);
+	_whitewater_lifetimes.resize(MAX_WHITEWATER_NUM);
+	_next_whitewater_positions.resize(MAX_WHITEWATER_NUM);
+	_next_whitewater_velocities.resize(MAX_WHITEWATER_NUM);
+	_next_whitewater_types.resize(MAX_WHITEWATER_NUM);
+	_next_whitewater_lifetimes.resize(MAX_WHITEWATER_NUM);
+}
+
+
+MPMSimulationCPU::~MPMSimulationCPU() { cleanup(); }
+
+
+void MPMSimulationCPU::cleanup()
+{
+	// Release memory, not just clear
+	std::vector<unsigned int>().swap(_grid_block_table);
+	std::vector<unsigned int>().swap(_grid_blocks);
+	std::vector<GridCell>().swap(_cells);
+	std::vector<glm::vec3>().swap(_cells_old_velocities);
+	std::vector<unsigned int>().swap(_next_grid_block_table);
+	std::vector<unsigned int>().swap(_next_grid_blocks);
+	std::vector<GridCell>().swap(_next_cells);
+	std::vector<glm::vec3>().swap(_next_cells_old_velocities);
+	std::vector<GridCell>().swap(_render_cells);
+	std::vector<unsigned int>().swap(_render_grid_blocks);
+	_render_cells_grid_size = glm::uvec3(0);
+	_particles.release();
+	_sorted_particles.release();
+	std::vector<unsigned long long>().swap(_sort_keys);
+	std::vector<unsigned long long>().swap(_sorted_keys);
+	std::vector<unsigned int>().swap(_bin_particles);
+	std::vector<unsigned int>().swap(_bin_offsets);
+	std::vector<unsigned int>().swap(_bin_chunk_offsets);
+	std::vector<unsigned int>().swap(_color_blocks);
+	std::vector<glm::vec3>().swap(_render_particles_positions);
+	std::vector<glm::vec3>().swap(_render_particles_velocities);
+	std::vector<glm::vec3>().swap(_whitewater_positions);
+	std::vector<glm::vec3>().swap(_next_whitewater_positions);
+	std::vector<glm::vec3>().swap(_whitewater_velocities);
+	std::vector<glm::vec3>().swap(_next_whitewater_velocities);
+	std::vector<unsigned char>().swap(_whitewater_types);
+	std::vector<unsigned char>().swap(_next_whitewater_types);
+	std::vector<float>().swap(_whitewater_lifetimes);
+	std::vector<float>().swap(_next_whitewater_lifetimes);
+	_grid_blocks_count = 0;
+	_next_grid_blocks_count = 0;
+	_next_grid_ready = false;
+	_cells_dirty_blocks = 0;
+	_next_cells_dirty_blocks = 0;
+	_particles_count = 0;
+	_whitewater_count = 0;
+}
+
+
+void MPMSimulationCPU::_on_grid_size_change()
+{
+	// Resize block table, with every block unallocated. The cells pool is resized by each step as needed.
+	_grid_blocks_size = get_grid_blocks_size(_grid_size);
+	const unsigned int blocks_num = _grid_blocks_size.x * _grid_blocks_size.y * _grid_blocks_size.z;
+	_grid_block_table.assign(blocks_num, GRID_BLOCK_NONE);
+	_grid_blocks.resize(blocks_num);
+	_grid_blocks_count = 0;
+	_next_grid_block_table.assign(blocks_num, GRID_BLOCK_NONE);
+	_next_grid_blocks.resize(blocks_num);
+	_next_grid_blocks_count = 0;
+	_next_grid_ready = false;
+	_render_cells_dirty = true;
+	// Particles past the end of a smaller domain would reserve blocks past the end of the table
+	_clamp_to_domain();
+}
+
+
+void MPMSimulationCPU::_on_transfer_policies_change()
+{
+	_clamp_to_domain();	// The margin of the new kernel may be wider
+	_next_grid_ready = false;	// Scattered to with the previous policies
+}
+
+
+void MPMSimulationCPU::_on_timestep_change() { _next_grid_ready = false; }	// Scattered to with the stress of the previous timestep
+
+
+void MPMSimulationCPU::_clamp_to_domain()
+{
+	const float margin = get_interpolation_domain_margin(_interpolation_kernel);
+	const glm::vec3 max_position = glm::vec3(_grid_size) - 1.0f - margin;
+	_thread_pool.parallel_for(0, _particles_count, [this, margin, max_position](unsigned int begin, unsigned int end, unsigned int) {
+		for (unsigned int particle_idx = begin; particle_idx < end; ++particle_idx) _particles.set_position(particle_idx, glm::clamp(_particles.get_position(particle_idx), glm::vec3(margin), max_position));
+	}, 4096);
+	for (unsigned int whitewater_idx = 0; whitewater_idx < _whitewater_count; ++whitewater_idx) _whitewater_positions[whitewater_idx] = glm::clamp(_whitewater_positions[whitewater_idx], glm::vec3(margin), max_position);
+	_render_particles_dirty = true;
+}
+
+
+float MPMSimulationCPU::_get_max_particle_speed() const
+{
+	// Per-thread maximum of the squared speeds, as thread_idx is stable within the job
+	std::vector<float> threads_max_speed2(_thread_pool.get_threads_count(), 0.0f);
+	_thread_pool.parallel_for(0, _particles_count, [this, &threads_max_speed2](unsigned int begin, unsigned int end, unsigned int thread_idx) {
+		float max_speed2 = threads_max_speed2[thread_idx];
+		for (unsigned int particle_idx = begin; particle_idx < end; ++particle_idx) {
+			const float vx = _particles.velocities[0][particle_idx];
+			const float vy = _particles.velocities[1][particle_idx];
+			const float vz = _particles.velocities[2][particle_idx];
+			const float speed2 = vx * vx + vy * vy + vz * vz;
+			// Any non-finite position or velocity component makes the sum non-finite
+			const float sum = speed2 + _particles.positions[0][particle_idx] + _particles.positions[1][particle_idx] + _particles.positions[2][particle_idx];
+			max_speed2 = std::isfinite(sum) ? std::max(max_speed2, speed2) : std::numeric_limits<float>::infinity();
+		}
+		threads_max_speed2[thread_idx] = max_speed2;
+	}, 4096);
+	return std::sqrt(*std::max_element(threads_max_speed2.begin(), threads_max_speed2.end()));
+}
+
+
+void MPMSimulationCPU::_save_buffers(SimulationState& state) const
+{
+	state.particles_positions.resize(_particles_count);
+	state.particles_velocities.resize(_particles_count);
+	state.particles_velocity_gradients.resize(_particles_count);
+	_thread_pool.parallel_for(0, _particles_count, [this, &state](unsigned int begin, unsigned int end, unsigned int) {
+		for (unsigned int particle_idx = begin; particle_idx < end; ++particle_idx) {
+			state.particles_positions[particle_idx] = _particles.get_position(particle_idx);
+			state.particles_velocities[particle_idx] = _particles.get_velocity(particle_idx);
+			state.particles_velocity_gradients[particle_idx] = _particles.get_velocity_gradient(particle_idx);
+		}
+	}, 4096);
+	state.random_state_size = sizeof(unsigned int);
+	state.particles_random_states.resize((size_t) _particles_count * sizeof(unsigned int));
+	std::memcpy(state.particles_random_states.data(), _particles.random_states.data(), state.particles_random_states.size());
+
+	state.whitewater_positions.assign(_whitewater_positions.begin(), _whitewater_positions.begin() + _whitewater_count);
+	state.whitewater_velocities.assign(_whitewater_velocities.begin(), _whitewater_velocities.begin() + _whitewater_count);
+	state.whitewater_types.assign(_whitewater_types.begin(), _whitewater_types.begin() + _whitewater_count);
+	state.whitewater_lifetimes.assign(_whitewater_lifetimes.begin(), _whitewater_lifetimes.begin() + _whitewater_count);
+}
+
+
+void MPMSimulationCPU::_load_buffers(const SimulationState& state)
+{
+	_particles.resize(_particles_count);
+	const bool same_random_states = state.random_state_size == sizeof(unsigned int);
+	_thread_pool.parallel_for(0, _particles_count, [this, &state, same_random_states](unsigned int begin, unsigned int end, unsigned int) {
+		for (unsigned int particle_idx = begin; particle_idx < end; ++particle_idx) {
+			_particles.set_position(particle_idx, state.particles_positions[particle_idx]);
+			_particles.set_velocity(particle_idx, state.particles_velocities[particle_idx]);
+			_particles.set_velocity_gradient(particle_idx, state.particles_velocity_gradients[particle_idx]);
+			if (!same_random_states) _particles.random_states[particle_idx] = random_init(0, particle_idx);	// Saved by another backend
+		}
+	}, 4096);
+	if (same_random_states) std::memcpy(_particles.random_states.data(), state.particles_random_states.data(), (size_t) _particles_count * sizeof(unsigned int));
+
+	std::copy(state.whitewater_positions.begin(), state.whitewater_positions.begin() + _whitewater_count, _whitewater_positions.begin());
+	std::copy(state.whitewater_velocities.begin(), state.whitewater_velocities.begin() + _whitewater_count, _whitewater_velocities.begin());
+	std::copy(state.whitewater_types.begin(), state.whitewater_types.begin() + _whitewater_count, _whitewater_types.begin());
+	std::copy(state.whitewater_lifetimes.begin(), state.whitewater_lifetimes.begin() + _whitewater_count, _whitewater_lifetimes.begin());
+
+	// Densities and the next grid weren't saved: recomputed by the next step
+	_particles_densities_valid = false;
+	_next_grid_ready = false;
+	_render_particles_dirty = true;
+	_render_cells_dirty = true;
+}
+
+
+SIMULATION_BACKEND MPMSimulationCPU::get_backend_type() const { return SIMULATION_BACKEND::CPU; }
+
+unsigned int MPMSimulationCPU::get_threads_count() const { return _thread_pool.get_threads_count(); }
+
+CPU_ISA MPMSimulationCPU::get_cpu_isa() const { return _cpu_isa; }
+
+void MPMSimulationCPU::set_cpu_isa(const CPU_ISA isa) { _cpu_isa = std::min(isa, get_supported_cpu_isa()); }
+
+GRID_CELL_ORDER MPMSimulationCPU::get_grid_cell_order() const { return _grid_cell_order; }
+
+void MPMSimulationCPU::set_grid_cell_order(const GRID_CELL_ORDER cell_order)
+{
+	if (cell_order == _grid_cell_order) return;
+	_pack_render_cells();		// While the cells are still in the order they were scattered in
+	_grid_cell_order = cell_order;
+	_next_grid_ready = false;	// Scattered to in the previous order
+}
+
+BufferView MPMSimulationCPU::get_particles_positions() const
+{
+	_pack_render_particles();
+	return { _render_particles_positions.data(), _particles_count, sizeof(glm::vec3), HOST };
+}
+
+BufferView MPMSimulationCPU::get_particles_velocities() const
+{
+	_pack_render_particles();
+	return { _render_particles_velocities.data(), _particles_count, sizeof(glm::vec3), HOST };
+}
+
+BufferView MPMSimulationCPU::get_whitewater_positions() const { return { _whitewater_positions.data(), _whitewater_count, sizeof(glm::vec3), HOST }; }
+
+BufferView MPMSimulationCPU::get_whitewater_types() const { return { _whitewater_types.data(), _whitewater_count, sizeof(unsigned char), HOST }; }
+
+BufferView MPMSimulationCPU::get_whitewater_lifetimes() const { return { _whitewater_lifetimes.data(), _whitewater_count, sizeof(float), HOST }; }
+
+BufferView MPMSimulationCPU::get_cells() const
+{
+	if (get_cells_count() > MAX_DENSE_CELLS_NUM) return {};
+	_pack_render_cells();
+	return { _render_cells.data(), get_cells_count(), sizeof(GridCell), HOST };
+}
+
+
+void MPMSimulationCPU::_pack_render_particles() const
+{
+	if (!_render_particles_dirty) return;
+
+	_render_particles_positions.resize(_particles_count);
+	_render_particles_velocities.resize(_particles_count);
+	_thread_pool.parallel_for(0, _particles_count, [this](unsigned int begin, unsigned int end, unsigned int) {
+		for (unsigned int particle_idx = begin; particle_idx < end; ++particle_idx) {
+			_render_particles_positions[particle_idx] = _particles.get_position(particle_idx);
+			_render_particles_velocities[particle_idx] = _particles.get_velocity(particle_idx);
+		}
+	}, 4096);
+	_render_particles_dirty = false;
+}
+
+
+void MPMSimulationCPU::_pack_render_cells() const
+{
+	if (!_render_cells_dirty || get_cells_count() > MAX_DENSE_CELLS_NUM) return;
+
+	if (_render_cells_grid_size != _grid_size) {
+		// Laid out for another grid size: clear everything
+		_render_cells.assign(get_cells_count(), GridCell{ glm::vec3(0.0f), 0.0f });
+		_render_grid_blocks.clear();
+		_render_cells_grid_size = _grid_size;
+	}
+	else {
+		// Only the blocks expanded last time can be non-zero, so clearing scales with the fluid rather than the domain
+		_thread_pool.parallel_for(0, (unsigned int) _render_grid_blocks.size(), [this](unsigned int begin, unsigned int end, unsigned int) {
+			for (unsigned int block_idx = begin; block_idx < end; ++block_idx) {
+				for (unsigned int block_cell_idx = 0; block_cell_idx < GRID_BLOCK_CELLS_NUM; ++block_cell_idx) {
+					const unsigned int dense_cell_idx = _get_dense_cell_idx(_render_grid_blocks[block_idx], block_cell_idx);
+					if (dense_cell_idx == GRID_BLOCK_NONE) continue;
+					_render_cells[dense_cell_idx] = GridCell{ glm::vec3(0.0f), 0.0f };
+				}
+			}
+		}, 16);
+	}
+
+	_thread_pool.parallel_for(0, _grid_blocks_count, [this](unsigned int begin, unsigned int end, unsigned int) {
+		for (unsigned int block_idx = begin; block_idx < end; ++block_idx) {
+			for (unsigned int block_cell_idx = 0; block_cell_idx < GRID_BLOCK_CELLS_NUM; ++block_cell_idx) {
+				const unsigned int dense_cell_idx = _get_dense_cell_idx(_grid_blocks[block_idx], block_cell_idx);
+				if (dense_cell_idx == GRID_BLOCK_NONE) continue;
+				_render_cells[dense_cell_idx] = _cells[block_idx * GRID_BLOCK_CELLS_NUM + block_cell_idx];
+			}
+		}
+	}, 16);
+	_render_grid_blocks.assign(_grid_blocks.begin(), _grid_blocks.begin() + _grid_blocks_count);
+	_render_cells_dirty = false;
+}
+
+
+void MPMSimulationCPU::reset_simulation()
+{
+	_particles_count = 0;
+	_whitewater_count = 0;
+	_steps_count = 0;
+	_snapshots_count = 0;
+	_particles.clear();
+	_particles_densities_valid = false;
+	_next_grid_ready = false;
+	_render_particles_dirty = true;
+	_estimate_water_level();
+
+	// Empty the grid, or it won't be until new particles are spawned (as the simulation doesn't run if there are zero particles).
+	_grid_release_blocks();
+	_render_cells_dirty = true;
+}
+
+
+void MPMSimulationCPU::sort_particles()
+{
+	if (_particles_count < 2) return;
+
+	// Sorting (code, index) pairs gives the permutation directly
+	_sort_keys.resize(_particles_count);
+	_sorted_keys.resize(_particles_count);
+	_thread_pool.parallel_for(0, _particles_count, [this](unsigned int begin, unsigned int end, unsigned int) {
+		for (unsigned int particle_idx = begin; particle_idx < end; ++particle_idx) {
+			const glm::uvec3 cell_coords = _particles.get_position(particle_idx);
+			_sort_keys[particle_idx] = ((unsigned long long) morton_encode(cell_coords.x, cell_coords.y, cell_coords.z) << 32) | particle_idx;
+		}
+	}, 4096);
+
+	// LSD radix sort of the codes, by digits of at most 11 bits, each pass a stable counting sort: particles of the same cell keep their order, so the
+	// result is deterministic. Codes only span the bits of the largest cell coords.
+	const unsigned int code_bits = std::bit_width(morton_encode(_grid_size.x - 1, _grid_size.y - 1, _grid_size.z - 1));
+	const unsigned int passes_count = (code_bits + 10) / 11;
+	const unsigned int digit_bits = (code_bits + passes_count - 1) / passes_count;
+	for (unsigned int pass = 0; pass < passes_count; ++pass) {
+		const unsigned int shift = 32 + pass * digit_bits;
+		const unsigned long long digit_mask = (1ull << digit_bits) - 1;
+		counting_sort(_thread_pool, _particles_count, 1u << digit_bits,
+			[this, shift, digit_mask](const unsigned int i) { return (unsigned int) ((_sort_keys[i] >> shift) & digit_mask); },
+			[this](const unsigned int i, const unsigned int position) { _sorted_keys[position] = _sort_keys[i]; },
+			_bin_chunk_offsets, nullptr);
+		std::swap(_sort_keys, _sorted_keys);
+	}
+
+	// Gather every attribute in sorted order
+	_sorted_particles.resize(_particles_count);
+	_thread_pool.parallel_for(0, _particles_count, [this](unsigned int begin, unsigned int end, unsigned int) {
+		for (int stream = 0; stream < 3; ++stream) {
+			for (unsigned int i = begin; i < end; ++i) _sorted_particles.positions[stream][i] = _particles.positions[stream][(unsigned int) _sort_keys[i]];
+			for (unsigned int i = begin; i < end; ++i) _sorted_particles.velocities[stream][i] = _particles.velocities[stream][(unsigned int) _sort_keys[i]];
+		}
+		for (int stream = 0; stream < 9; ++stream) {
+			for (unsigned int i = begin; i < end; ++i) _sorted_particles.velocity_gradients[stream][i] = _particles.velocity_gradients[stream][(unsigned int) _sort_keys[i]];
+		}
+		if (_particles_densities_valid) {
+			for (unsigned int i = begin; i < end; ++i) _sorted_particles.densities[i] = _particles.densities[(unsigned int) _sort_keys[i]];
+		}
+		for (unsigned int i = begin; i < end; ++i) _sorted_particles.random_states[i] = _particles.random_states[(unsigned int) _sort_keys[i]];
+	}, 4096);
+	std::swap(_particles, _sorted_particles);
+	_render_particles_dirty = true;
+}
+
+
+void MPMSimulationCPU::spawn_particles_sphere()
+{
+	if (!can_spawn_particles()) return;
+
+	const unsigned int new_particles_count = _particles_count + PARTICLES_SPAWN_NUM;
+	const float radius = _get_spawn_sphere_radius();
+
+	_particles.resize(new_particles_count);
+
+	const unsigned int first_idx = _particles_count;
+	const glm::vec3 spawn_center = spawn_position;
+	const float margin = get_interpolation_domain_margin(_interpolation_kernel);
+	_thread_pool.parallel_for(0, PARTICLES_SPAWN_NUM, [&](unsigned int begin, unsigned int end, unsigned int) {
+		for (unsigned int particle_idx = begin; particle_idx < end; ++particle_idx) {
+			unsigned int& state = _particles.random_states[first_idx + particle_idx];
+			state = random_init(0, particle_idx);
+
+			float x, y, z;
+			do {
+				x = radius * (random_uniform(state) * 2.0f - 1.0f);
+				y = radius * (random_uniform(state) * 2.0f - 1.0f);
+				z = radius * (random_uniform(state) * 2.0f - 1.0f);
+			} while (x * x + y * y + z * z  > radius * radius);
+
+			// Clamp particle to simulation domain [margin, gridSize - 1 - margin], as the grid stencil must stay in the domain
+			_particles.set_position(first_idx + particle_idx, glm::clamp(spawn_center + glm::vec3(x, y, z), glm::vec3(margin), glm::vec3(_grid_size) - 1.0f - margin));
+		}
+	});
+
+	// Update particles count;
+	_particles_count = new_particles_count;
+	_particles_densities_valid = false;
+	_next_grid_ready = false;
+	_render_particles_dirty = true;
+	_estimate_water_level();
+}
+
+
+void MPMSimulationCPU::spawn_particles_cube()
+{
+	if (!can_spawn_particles()) return;
+
+	const unsigned int new_particles_count = _particles_count + PARTICLES_SPAWN_NUM;
+
+	const float step = _get_spawn_cube_step();
+	const glm::vec3 spawn_origin = spawn_position - std::floor(PARTICLES_SPAWN_CUBE_SIZE * step / 2.0f);
+
+	_particles.resize(new_particles_count);
+
+	const unsigned int first_idx = _particles_count;
+	const float margin = get_interpolation_domain_margin(_interpolation_kernel);
+	_thread_pool.parallel_for(0, PARTICLES_SPAWN_NUM, [&](unsigned int begin, unsigned int end, unsigned int) {
+		for (unsigned int particle_idx = begin; particle_idx < end; ++particle_idx) {
+			// Same layout as the CUDA kernel configuration: x and y are the thread coords in a 32x32 block, z is the block index
+			const unsigned int x = particle_idx % PARTICLES_SPAWN_CUBE_SIZE;
+			const unsigned int y = (particle_idx / PARTICLES_SPAWN_CUBE_SIZE) % PARTICLES_SPAWN_CUBE_SIZE;
+			const unsigned int z = particle_idx / (PARTICLES_SPAWN_CUBE_SIZE * PARTICLES_SPAWN_CUBE_SIZE);
+			_particles.set_position(first_idx + particle_idx, glm::clamp(spawn_origin + glm::vec3(x * step, y * step, z * step), glm::vec3(margin), glm::vec3(_grid_size) - 1.0f - margin));	// Clamped to simulation domain, as in sphere spawn
+			_particles.random_states[first_idx + particle_idx] = random_init(0, particle_idx);
+		}
+	});
+
+	// Update particles count;
+	_particles_count = new_particles_count;
+	_particles_densities_valid = false;
+	_next_grid_ready = false;
+	_render_particles_dirty = true;
+	_estimate_water_level();
+}
+
+
+void MPMSimulationCPU::step()
+{
+	if (_particles_count == 0) return;
+	++_steps_count;
+	_clear_stage_times();
+	_render_particles_dirty = true;
+	_render_cells_dirty = true;
+
+	// Keep particles in grid order, for cache-friendly transfers
+	if (_is_sort_due()) {
+		_begin_stage();
+		sort_particles();
+		_end_stage(SORT_PARTICLES);
+	}
+	if (_next_grid_ready && p2g_mode == P2G_MODE_ONE_PASS) {
+		// 1-2. Particles were scattered by the last step's G2P: swap in the grid they were scattered to, timed as GRID_ALLOCATE
+		_begin_stage();
+		std::swap(_grid_block_table, _next_grid_block_table);
+		std::swap(_grid_blocks, _next_grid_blocks);
+		std::swap(_grid_blocks_count, _next_grid_blocks_count);
+		std::swap(_cells, _next_cells);
+		std::swap(_cells_old_velocities, _next_cells_old_velocities);
+		std::swap(_cells_dirty_blocks, _next_cells_dirty_blocks);
+		_end_stage(GRID_ALLOCATE);
+	}
+	else {
+		// Allocate the grid blocks covered by the particles
+		_begin_stage();
+		_grid_allocate();
+		_end_stage(GRID_ALLOCATE);
+		// 1. Reset scratch-pad grid: give allocated blocks their pool index. Cells were zeroed by the last grid update.
+		_begin_stage();
+		_grid_reset();
+		_end_stage(GRID_RESET);
+		if (p2g_mode != P2G_MODE_TWO_PASS && _particles_densities_valid) {
+			// 2. P2G: transfer mass and momentum from particles to our grid, timed as P2G_MOMENTUM
+			_begin_stage();
+			_p2g_fused();
+			_end_stage(P2G_MOMENTUM);
+		}
+		else {
+			// P2G 1 (init): Scatter particle mass to the grid
+			_begin_stage();
+			_p2g_init();
+			_end_stage(P2G_MASS);
+			// 2. P2G 2: transfer data from particles to our grid
+			_begin_stage();
+			_p2g();
+			_end_stage(P2G_MOMENTUM);
+		}
+	}
+	// 3. Calculate grid velocities
+	_begin_stage();
+	_grid_update();
+	_end_stage(GRID_UPDATE);
+	if (p2g_mode == P2G_MODE_ONE_PASS) {
+		// Next grid, for G2P to scatter particles to. Binning for colored scatter is timed with allocation.
+		_begin_stage();
+		if (p2g_scatter == P2G_SCATTER_COLORED) _bin_particles_by_block();
+		_next_grid_allocate();
+		_end_stage(GRID_ALLOCATE);
+		_begin_stage();
+		_next_grid_reset();
+		_end_stage(GRID_RESET);
+	}
+	// 4. Grid-to-particle (G2P). Transfer cells velocity data to particles and advect. Spawn new whitewater.
+	_begin_stage();
+	_new_whitewater_counter.store(0);
+	if (p2g_mode == P2G_MODE_ONE_PASS) _next_grid_ready = _g2p_p2g();
+	else {
+		_g2p();
+		_next_grid_ready = false;
+	}
+	_particles_densities_valid = p2g_mode != P2G_MODE_TWO_PASS;
+	_end_stage(G2P);
+	// Advect whitewater and move surviving ones to next buffers
+	if (_whitewater_count > 0) {
+		_begin_stage();
+		visit_interpolation_kernel(_interpolation_kernel, [this](const auto kernel) { _advect_whitewater<decltype(kernel)>(); });
+		_end_stage(ADVECT_WHITEWATER);
+	}
+
+	// Update whitewater count. The counter is increased without limit, but no whitewater is written beyond MAX_WHITEWATER_NUM.
+	_whitewater_count = std::min(_new_whitewater_counter.load(), MAX_WHITEWATER_NUM);
+	// Flip current and next whitewater buffers
+	std::swap(_whitewater_positions, _next_whitewater_positions);
+	std::swap(_whitewater_velocities, _next_whitewater_velocities);
+	std::swap(_whitewater_types, _next_whitewater_types);
+	std::swap(_whitewater_lifetimes, _next_whitewater_lifetimes);
+}
+
+
+// Step stages
+
+
+void MPMSimulationCPU::_grid_release_blocks()
+{
+	_thread_pool.parallel_for(0, _grid_blocks_count, [this](unsigned int begin, unsigned int end, unsigned int) {
+		for (unsigned int block_idx = begin; block_idx < end; ++block_idx) _grid_block_table[_grid_blocks[block_idx]] = GRID_BLOCK_NONE;
+	}, 4096);
+	_grid_blocks_count = 0;
+}
+
+
+void MPMSimulationCPU::_grid_allocate()
+{
+	_grid_release_blocks();
+
+	// Swap in the cells pool cleared by the last grid update. The pool of the last step is cleared by this step's.
+	std::swap(_cells, _next_cells);
+	std::swap(_cells_old_velocities, _next_cells_old_velocities);
+	std::swap(_cells_dirty_blocks, _next_cells_dirty_blocks);
+
+	// Reserve every block covered by a particle's stencil. The particle that reserves a block appends it to the allocated blocks.
+	const int stencil_size = (int) get_interpolation_stencil_size(_interpolation_kernel);
+	_grid_blocks_counter.store(0);
+	_thread_pool.parallel_for(0, _particles_count, [this, stencil_size](unsigned int begin, unsigned int end, unsigned int) {
+		glm::ivec3 previous_stencil_origin (-1);
+		for (unsigned int particle_idx = begin; particle_idx < end; ++particle_idx) {
+			const glm::ivec3 stencil_origin = _particles.get_position(particle_idx) - (stencil_size - 1) * 0.5f;	// See TransferPolicies.hpp
+			if (stencil_origin == previous_stencil_origin) continue;	// Sorted particles mostly share the stencil of the previous one
+			previous_stencil_origin = stencil_origin;
+
+			// The stencil spans cells [stencil_origin, stencil_origin + stencil_size - 1]: at most 2 blocks per axis
+			const glm::uvec3 first_block = get_grid_block_coords(stencil_origin);
+			const glm::uvec3 last_block = get_grid_block_coords(stencil_origin + stencil_size - 1);
+			for (unsigned int x = first_block.x; x <= last_block.x; ++x) {
+				for (unsigned int y = first_block.y; y <= last_block.y; ++y) {
+					for (unsigned int z = first_block.z; z <= last_block.z; ++z) {
+						reserve_grid_block(_grid_block_table, _grid_blocks, _grid_blocks_counter, get_grid_block_key(glm::uvec3(x, y, z), _grid_blocks_size));
+					}
+				}
+			}
+		}
+	});
+	_grid_blocks_count = _grid_blocks_counter.load();
+
+	// Grow cells pool if needed. New cells are zero, as is the rest of the pool outside of its dirty blocks.
+	const size_t cells_num = (size_t) _grid_blocks_count * GRID_BLOCK_CELLS_NUM;
+	if (_cells.size() < cells_num) {
+		_cells.resize(cells_num, GridCell{ glm::vec3(0.0f), 0.0f });
+	}
+	if (_transfer_scheme == TRANSFER_SCHEME_PIC_FLIP && _cells_old_velocities.size() < cells_num) _cells_old_velocities.resize(cells_num);
+}
+
+
+void MPMSimulationCPU::_grid_reset()
+{
+	// Give reserved blocks their pool index. Their cells are already zero, unless the pool was swapped in dirty (e.g. after a mode switch).
+	// Old velocities of PIC/FLIP aren't cleared by the grid update, as it writes them: they are cleared here.
+	const unsigned int dirty_blocks_count = std::min(_cells_dirty_blocks, _grid_blocks_count);
+	const bool flip = _transfer_scheme == TRANSFER_SCHEME_PIC_FLIP;
+	_thread_pool.parallel_for(0, _grid_blocks_count, [this, dirty_blocks_count, flip](unsigned int begin, unsigned int end, unsigned int) {
+		for (unsigned int block_idx = begin; block_idx < end; ++block_idx) _grid_block_table[_grid_blocks[block_idx]] = block_idx;
+		if (flip) std::fill(_cells_old_velocities.begin() + begin * GRID_BLOCK_CELLS_NUM, _cells_old_velocities.begin() + end * GRID_BLOCK_CELLS_NUM, glm::vec3(0.0f));
+		if (begin >= dirty_blocks_count) return;
+		std::fill(_cells.begin() + begin * GRID_BLOCK_CELLS_NUM, _cells.begin() + std::min(end, dirty_blocks_count) * GRID_BLOCK_CELLS_NUM, GridCell{ glm::vec3(0.0f), 0.0f });
+	}, 64);
+	_cells_dirty_blocks = std::max(_cells_dirty_blocks, _grid_blocks_count);
+}
+
+
+void MPMSimulationCPU::_next_grid_allocate()
+{
+	// Return the blocks of the grid swapped out by this step, or left from an earlier one
+	_thread_pool.parallel_for(0, _next_grid_blocks_count, [this](unsigned int begin, unsigned int end, unsigned int) {
+		for (unsigned int block_idx = begin; block_idx < end; ++block_idx) _next_grid_block_table[_next_grid_blocks[block_idx]] = GRID_BLOCK_NONE;
+	}, 4096);
+
+	// Reserve every block a particle's stencil can cover after its origin moves by at most a cell, as the particles one-pass G2P scatters
+	const int stencil_size = (int) get_interpolation_stencil_size(_interpolation_kernel);
+	_grid_blocks_counter.store(0);
+	_thread_pool.parallel_for(0, _particles_count, [this, stencil_size](unsigned int begin, unsigned int end, unsigned int) {
+		glm::uvec3 previous_first_block (-1), previous_last_block (-1);
+		for (unsigned int particle_idx = begin; particle_idx < end; ++particle_idx) {
+			// Cells [stencil_origin - 1, stencil_origin + stencil_size], clamped to the domain
+			const glm::ivec3 stencil_origin = _particles.get_position(particle_idx) - (stencil_size - 1) * 0.5f;
+			const glm::uvec3 first_block = get_grid_block_coords(glm::max(stencil_origin - 1, glm::ivec3(0)));
+			const glm::uvec3 last_block = get_grid_block_coords(glm::min(stencil_origin + stencil_size, glm::ivec3(_grid_size) - 1));
+			if (first_block == previous_first_block && last_block == previous_last_block) continue;	// Sorted particles mostly share the blocks of the previous one
+			previous_first_block = first_block;
+			previous_last_block = last_block;
+			for (unsigned int x = first_block.x; x <= last_block.x; ++x) {
+				for (unsigned int y = first_block.y; y <= last_block.y; ++y) {
+					for (unsigned int z = first_block.z; z <= last_block.z; ++z) {
+						reserve_grid_block(_next_grid_block_table, _next_grid_blocks, _grid_blocks_counter, get_grid_block_key(glm::uvec3(x, y, z), _grid_blocks_size));
+					}
+				}
+			}
+		}
+	});
+	_next_grid_blocks_count = _grid_blocks_counter.load();
+
+	// Grow cells pool if needed, with zeros as in _grid_allocate()
+	const size_t cells_num = (size_t) _next_grid_blocks_count * GRID_BLOCK_CELLS_NUM;
+	if (_next_cells.size() < cells_num) {
+		_next_cells.resize(cells_num, GridCell{ glm::vec3(0.0f), 0.0f });
+	}
+	if (_transfer_scheme == TRANSFER_SCHEME_PIC_FLIP && _next_cells_old_velocities.size() < cells_num) _next_cells_old_velocities.resize(cells_num);
+}
+
+
+void MPMSimulationCPU::_next_grid_reset()
+{
+	// Same as _grid_reset(). The pool was cleared by this step's grid update.
+	const unsigned int dirty_blocks_count = std::min(_next_cells_dirty_blocks, _next_grid_blocks_count);
+	const bool flip = _transfer_scheme == TRANSFER_SCHEME_PIC_FLIP;
+	_thread_pool.parallel_for(0, _next_grid_blocks_count, [this, dirty_blocks_count, flip](unsigned int begin, unsigned int end, unsigned int) {
+		for (unsigned int block_idx = begin; block_idx < end; ++block_idx) _next_grid_block_table[_next_grid_blocks[block_idx]] = block_idx;
+		if (flip) std::fill(_next_cells_old_velocities.begin() + begin * GRID_BLOCK_CELLS_NUM, _next_cells_old_velocities.begin() + end * GRID_BLOCK_CELLS_NUM, glm::vec3(0.0f));
+		if (begin >= dirty_blocks_count) return;
+		std::fill(_next_cells.begin() + begin * GRID_BLOCK_CELLS_NUM, _next_cells.begin() + std::min(end, dirty_blocks_count) * GRID_BLOCK_CELLS_NUM, GridCell{ glm::vec3(0.0f), 0.0f });
+	}, 64);
+	_next_cells_dirty_blocks = std::max(_next_cells_dirty_blocks, _next_grid_blocks_count);
+}
+
+
+void MPMSimulationCPU::_bin_particles_by_block()
+{
+	// Stable, so bins keep the particles order
+	if (_bin_particles.size() < _particles_count) _bin_particles.resize(_particles_count);
+	counting_sort(_thread_pool, _particles_count, _grid_blocks_count,
+		[this](const unsigned int particle_idx) { return _grid_block_table[get_grid_block_key(get_grid_block_coords(glm::ivec3(_particles.get_position(particle_idx))), _grid_blocks_size)]; },
+		[this](const unsigned int particle_idx, const unsigned int position) { _bin_particles[position] = particle_idx; },
+		_bin_chunk_offsets, &_bin_offsets);
+
+	// List non-empty blocks by color
+	const auto get_block_color = [this](const unsigned int block_idx) {
+		const glm::uvec3 block_coords = get_grid_block_coords(glm::ivec3(get_grid_block_origin(_grid_blocks[block_idx], _grid_blocks_size)));
+		return ((block_coords.x & 1) << 2) | ((block_coords.y & 1) << 1) | (block_coords.z & 1);
+	};
+	unsigned int colors_counts[8] = {};
+	for (unsigned int block_idx = 0; block_idx < _grid_blocks_count; ++block_idx) {
+		if (_bin_offsets[block_idx + 1] > _bin_offsets[block_idx]) ++colors_counts[get_block_color(block_idx)];
+	}
+	_color_blocks_offsets[0] = 0;
+	for (unsigned int color = 0; color < 8; ++color) _color_blocks_offsets[color + 1] = _color_blocks_offsets[color] + colors_counts[color];
+	_color_blocks.resize(_color_blocks_offsets[8]);
+	unsigned int color_offsets[8];
+	std::copy(_color_blocks_offsets, _color_blocks_offsets + 8, color_offsets);
+	for (unsigned int block_idx = 0; block_idx < _grid_blocks_count; ++block_idx) {
+		if (_bin_offsets[block_idx + 1] > _bin_offsets[block_idx]) _color_blocks[color_offsets[get_block_color(block_idx)]++] = block_idx;
+	}
+}
+
+
+void MPMSimulationCPU::_for_each_bin_colored(const BinJob& job)
+{
+	for (unsigned int color = 0; color < 8; ++color) {
+		_thread_pool.parallel_for(_color_blocks_offsets[color], _color_blocks_offsets[color + 1], [this, &job](unsigned int begin, unsigned int end, unsigned int) {
+			for (unsigned int i = begin; i < end; ++i) job(_bin_offsets[_color_blocks[i]], _bin_offsets[_color_blocks[i] + 1]);
+		}, 1);
+	}
+}
+
+
+void MPMSimulationCPU::_scatter_colored(const P2GKernel scatter)
+{
+	// A block's particles only write within 2 cells of it, as stencils are at most 4 cells wide, and blocks of a color are 4 cells apart
+	const TransferKernelArgs args = _get_transfer_kernel_args();
+	_for_each_bin_colored([this, &args, scatter](const unsigned int begin, const unsigned int end) {
+		scatter(args, _bin_particles.data(), begin, end, false);
+	});
+}
+
+
+void MPMSimulationCPU::_p2g_init()
+{
+	const TransferKernelsCPU& kernels = _get_transfer_kernels();
+	if (p2g_scatter == P2G_SCATTER_COLORED) {
+		// Bins are reused by _p2g(), as particles don't move in between
+		_bin_particles_by_block();
+		_scatter_colored(kernels.p2g_mass);
+		return;
+	}
+	const TransferKernelArgs args = _get_transfer_kernel_args();
+	_thread_pool.parallel_for(0, _particles_count, [&args, &kernels](unsigned int begin, unsigned int end, unsigned int) {
+		kernels.p2g_mass(args, nullptr, begin, end, true);
+	});
+}
+
+
+void MPMSimulationCPU::_p2g()
+{
+	const TransferKernelsCPU& kernels = _get_transfer_kernels();
+	if (p2g_scatter == P2G_SCATTER_COLORED) {
+		_scatter_colored(kernels.p2g_momentum);
+		return;
+	}
+	const TransferKernelArgs args = _get_transfer_kernel_args();
+	_thread_pool.parallel_for(0, _particles_count, [&args, &kernels](unsigned int begin, unsigned int end, unsigned int) {
+		kernels.p2g_momentum(args, nullptr, begin, end, true);
+	});
+}
+
+
+void MPMSimulationCPU::_p2g_fused()
+{
+	const TransferKernelsCPU& kernels = _get_transfer_kernels();
+	if (p2g_scatter == P2G_SCATTER_COLORED) {
+		_bin_particles_by_block();
+		_scatter_colored(kernels.p2g_fused);
+		return;
+	}
+	const TransferKernelArgs args = _get_transfer_kernel_args();
+	_thread_pool.parallel_for(0, _particles_count, [&args, &kernels](unsigned int begin, unsigned int end, unsigned int) {
+		kernels.p2g_fused(args, nullptr, begin, end, true);
+	});
+}
+
+
+void MPMSimulationCPU::_grid_update()
+{
+	const unsigned int cells_count = _grid_blocks_count * GRID_BLOCK_CELLS_NUM;
+	const unsigned int next_dirty_cells_count = _next_cells_dirty_blocks * GRID_BLOCK_CELLS_NUM;
+	glm::vec3* const cells_old_velocities = _transfer_scheme == TRANSFER_SCHEME_PIC_FLIP ? _cells_old_velocities.data() : nullptr;
+	_thread_pool.parallel_for(0, std::max(cells_count, next_dirty_cells_count), [this, cells_count, next_dirty_cells_count, cells_old_velocities](unsigned int begin, unsigned int end, unsigned int) {
+		// Clear the other cells pool along the way, for the next step to scatter to (see _grid_allocate())
+		if (begin < next_dirty_cells_count) std::fill(_next_cells.begin() + begin, _next_cells.begin() + std::min(end, next_dirty_cells_count), GridCell{ glm::vec3(0.0f), 0.0f });
+
+		// Origin of the block of the current cell, computed once per block: it takes divisions by the domain size in blocks
+		unsigned int block_idx = GRID_BLOCK_NONE;
+		glm::uvec3 block_origin;
+		for (unsigned int cell_idx = begin; cell_idx < std::min(end, cells_count); ++cell_idx) {
+			GridCell& cell = _cells[cell_idx];
+			if (cell.mass <= 0) continue;	// Skip irrelevant cells
+
+			// 3.1: Calculate grid velocity based on momentum found in the P2G stage
+			glm::vec3& cell_velocity = cell.velocity;
+			cell_velocity /= cell.mass;					// Convert momentum to velocity
+			if (cells_old_velocities) cells_old_velocities[cell_idx] /= cell.mass;	// PIC/FLIP: velocity before forces
+			cell_velocity += gravity * _timestep;		// Apply gravity
+
+			// 3.2: Enforce grid boundary conditions
+			if (cell_idx / GRID_BLOCK_CELLS_NUM != block_idx) {
+				block_idx = cell_idx / GRID_BLOCK_CELLS_NUM;
+				block_origin = get_grid_block_origin(_grid_blocks[block_idx], _grid_blocks_size);
+			}
+			const glm::uvec3 cell_coords = block_origin + _get_block_cell_offset(cell_idx % GRID_BLOCK_CELLS_NUM);
+			if (cell_coords.x < 2 || cell_coords.x > _grid_size.x - 3) cell_velocity.x = 0.0f;
+			if (cell_coords.y < 2 || cell_coords.y > _grid_size.y - 3) cell_velocity.y = 0.0f;
+			if (cell_coords.z < 2 || cell_coords.z > _grid_size.z - 3) cell_velocity.z = 0.0f;
+		}
+	}, 4096);
+	_next_cells_dirty_blocks = 0;
+}
+
+
+void MPMSimulationCPU::_spawn_whitewater(const unsigned int* const particle_indices, const unsigned int begin, const unsigned int end, const float* const spawn_chances, const float* const displacements[3])
+{
+	const float margin = get_interpolation_domain_margin(_interpolation_kernel);
+	for (unsigned int range_idx = begin; range_idx < end; ++range_idx) {
+		const unsigned int particle_idx = particle_indices ? particle_indices[range_idx] : range_idx;
+		const glm::vec3 particle_position = _particles.get_position(particle_idx);
+
+		// Check for NaN values (aka if particle simulation broke)
+		#ifdef ENABLE_ASSERTS
+			assert(particle_position.x == particle_position.x);
+			assert(particle_position.y == particle_position.y);
+			assert(particle_position.z == particle_position.z);
+		#endif
+
+		// Spawn whitewater_spawn_num particles max, depending on spawn chance
+		const float spawn_chance = spawn_chances[range_idx - begin];
+		float c = random_uniform(_particles.random_states[particle_idx]);	// Random in [0.0, 1.0)
+		if (c < spawn_chance) {												// If spawned at all
+			const glm::vec3 dx (displacements[0][range_idx - begin], displacements[1][range_idx - begin], displacements[2][range_idx - begin]);
+			const glm::vec3 new_particle_velocity = _particles.get_velocity(particle_idx);
+			unsigned int n = (unsigned int) std::ceil(c * whitewater_spawn_num);	// Map to [1, spawn_num]
+			unsigned int idx_0 = _new_whitewater_counter.fetch_add(n, std::memory_order_relaxed);	// Start idx is current spawn counter (pre-add)
+			for (unsigned int i = 0; i < n; ++i) {
+				if (idx_0 + i >= MAX_WHITEWATER_NUM) break;				// Don't spawn particles beyond max
+				// Spawn whitewater trailing the fluid particle
+				glm::vec3 position = particle_position - dx * (i + 1.0f);
+				position = glm::min(glm::max(glm::vec3(margin), position), glm::vec3(_grid_size) - 1.0f - margin);	// NaN-safe, as in G2P
+				_next_whitewater_positions[idx_0 + i] = position;
+				_next_whitewater_velocities[idx_0 + i] = new_particle_velocity;
+				_next_whitewater_types[idx_0 + i] = 0;	// Set by whitewater advection in the next step
+				// Make lifetime longer for clumps of whitewater, but randomize it a little (min: 1s, max: ~8s)
+				_next_whitewater_lifetimes[idx_0 + i] = n * 2.0f + c * i;
+			}
+		}
+	}
+}
+
+
+void MPMSimulationCPU::_g2p()
+{
+	const TransferKernelsCPU& kernels = _get_transfer_kernels();
+	TransferKernelArgs args = _get_transfer_kernel_args();
+	if (p2g_mode != P2G_MODE_FUSED) args.densities = nullptr;	// Only needed by the next fused P2G
+	const bool whitewater = whitewater_spawn_num > 0;	// Else the kernels skip the whitewater estimates
+	_thread_pool.parallel_for(0, _particles_count, [this, &args, &kernels, whitewater](unsigned int begin, unsigned int end, unsigned int) {
+		// Kernel outputs for whitewater spawn, in sub-ranges small enough for the stack
+		const unsigned int SUBRANGE_SIZE = 256;
+		float spawn_chances[SUBRANGE_SIZE];
+		float displacements_x[SUBRANGE_SIZE], displacements_y[SUBRANGE_SIZE], displacements_z[SUBRANGE_SIZE];
+		float* const displacements[3] = { displacements_x, displacements_y, displacements_z };
+
+		for (unsigned int subrange_begin = begin; subrange_begin < end; subrange_begin += SUBRANGE_SIZE) {
+			const unsigned int subrange_end = std::min(subrange_begin + SUBRANGE_SIZE, end);
+			kernels.g2p(args, subrange_begin, subrange_end, whitewater ? spawn_chances : nullptr, displacements);
+			if (whitewater) _spawn_whitewater(nullptr, subrange_begin, subrange_end, spawn_chances, displacements);
+		}
+	});
+}
+
+
+bool MPMSimulationCPU::_g2p_p2g()
+{
+	const TransferKernelsCPU& kernels = _get_transfer_kernels();
+	const TransferKernelArgs args = _get_transfer_kernel_args();
+	const bool colored = p2g_scatter == P2G_SCATTER_COLORED;
+	// Colored passes still need atomic adds with stencils wider than 3 cells, as particles then write up to 3 cells off their block
+	const bool atomic = !colored || get_interpolation_stencil_size(_interpolation_kernel) > 3;
+	const bool whitewater = whitewater_spawn_num > 0;
+	std::atomic<bool> all_scattered (true);
+	const auto g2p_p2g = [this, &args, &kernels, atomic, whitewater, &all_scattered](const unsigned int* const particle_indices, const unsigned int begin, const unsigned int end) {
+		// Same sub-ranges as _g2p()
+		const unsigned int SUBRANGE_SIZE = 256;
+		float spawn_chances[SUBRANGE_SIZE];
+		float displacements_x[SUBRANGE_SIZE], displacements_y[SUBRANGE_SIZE], displacements_z[SUBRANGE_SIZE];
+		float* const displacements[3] = { displacements_x, displacements_y, displacements_z };
+
+		for (unsigned int subrange_begin = begin; subrange_begin < end; subrange_begin += SUBRANGE_SIZE) {
+			const unsigned int subrange_end = std::min(subrange_begin + SUBRANGE_SIZE, end);
+			if (!kernels.g2p_p2g(args, particle_indices, subrange_begin, subrange_end, atomic, whitewater ? spawn_chances : nullptr, displacements)) all_scattered.store(false, std::memory_order_relaxed);
+			if (whitewater) _spawn_whitewater(particle_indices, subrange_begin, subrange_end, spawn_chances, displacements);
+		}
+	};
+	if (colored) {
+		// Colored by the blocks particles leave: the particles scattered have their stencil moved by at most a cell, so with stencils up to 3 cells wide they write within 2 cells of their block, and blocks of a color are a block apart
+		_for_each_bin_colored([this, &g2p_p2g](const unsigned int begin, const unsigned int end) { g2p_p2g(_bin_particles.data(), begin, end); });
+	}
+	else {
+		_thread_pool.parallel_for(0, _particles_count, [&g2p_p2g](unsigned int begin, unsigned int end, unsigned int) { g2p_p2g(nullptr, begin, end); });
+	}
+	return all_scattered.load();
+}
+
+
+// Identical to particles G2P, except for no velocity and velocity gradient update - just uses velocity directly
+template <typename Kernel>
+void MPMSimulationCPU::_advect_whitewater()
+{
+	const int S = Kernel::STENCIL_SIZE;
+	_thread_pool.parallel_for(0, _whitewater_count, [this](unsigned int begin, unsigned int end, unsigned int) {
+		for (unsigned int whitewater_idx = begin; whitewater_idx < end; ++whitewater_idx) {
+			glm::vec3 whitewater_position = _whitewater_positions[whitewater_idx];
+			glm::vec3 whitewater_velocity = _whitewater_velocities[whitewater_idx];
+			float whitewater_lifetime = _whitewater_lifetimes[whitewater_idx];
+
+			// Calculate weights for the cells of the whitewater's stencil on the grid using an interpolation function (see TransferPolicies.hpp)
+			const glm::ivec3 stencil_origin = whitewater_position - Kernel::ORIGIN_OFFSET;
+			glm::vec3 weights[S];
+			Kernel::get_weights(whitewater_position - glm::vec3(stencil_origin) - Kernel::CENTER_OFFSET, weights);
+
+			// 4.3: Calculate new whitewater type and (if foam) velocity
+			float density = 0.0f;
+			unsigned char whitewater_type = 0;
+			glm::vec3 fluid_velocity (0.0f);
+			for (int x = 0; x < S; ++x) {
+				for (int y = 0; y < S; ++y) {
+					for (int z = 0; z < S; ++z) {
+						glm::ivec3 n_cell_coords (stencil_origin + glm::ivec3(x, y, z));
+						// Whitewater can be away from the fluid: unallocated cells are empty
+						const unsigned int n_cell_idx = _find_cell_idx(n_cell_coords);
+						if (n_cell_idx == GRID_BLOCK_NONE) continue;
+
+						// 4.3.1: Get this cell's weighted contribution to our whitewater's new velocity
+						float weight = weights[x].x * weights[y].y * weights[z].z;
+						const GridCell& n_cell = _cells[n_cell_idx];
+						fluid_velocity += weight * n_cell.velocity;
+						density += weight * n_cell.mass;
+					}
+				}
+			}
+			// Choose whitewater type based on local fluid density
+			// Spray update
+			if (density < particles_material.rest_density / 4.0f) {	// Local fluid has low density => it's in the air
+				whitewater_type = 1;
+				whitewater_velocity += gravity * _timestep;
+			}
+			// Bubbles update
+			else if (density >= particles_material.rest_density) {	// Local fluid has density OF fluid => it's IN the fluid
+				whitewater_type = 2;
+				whitewater_velocity -= gravity * _timestep / 4.0f;	// VERY crude approximation of buoyancy
+			}
+			// Foam update
+			else {													// Local fluid has less density than fluid, but isn't as sparse as spray => it's on the surface
+				whitewater_type = 3;
+				whitewater_velocity = fluid_velocity;	// Foam is only moved by fluid
+				whitewater_lifetime -= _timestep;		// Only foam has lifetime advanced
+				if (whitewater_lifetime <= 0.0f) continue;
+			}
+
+			unsigned int moved_whitewater_idx = _new_whitewater_counter.fetch_add(1, std::memory_order_relaxed);
+			if (moved_whitewater_idx >= MAX_WHITEWATER_NUM) continue;
+
+			// 4.4: Advect whitewater positions by their velocity (explicit integration)
+			whitewater_position += whitewater_velocity * _timestep;
+			// Clamp whitewater to simulation domain [margin, gridSize - 1 - margin], or a bit less if bubbles
+			const float margin = whitewater_type == 2 ? Kernel::DOMAIN_MARGIN + 0.3f : Kernel::DOMAIN_MARGIN;
+			whitewater_position = glm::min(glm::max(glm::vec3(margin), whitewater_position), glm::vec3(_grid_size) - 1.0f - margin);	// NaN-safe, as in G2P
+
+			// Additional predictive boundary conditions to soften velocities near edges.
+			// Taken from nialltl's implementation, but added timestep scaling and boundary elasticity.
+			// Might look unnatural but should improve stability.
+			if (boundary > 0.0f && boundary_elasticity > 0.0f) {
+				const glm::vec3 predicted_position = whitewater_position + whitewater_velocity * _timestep;
+				const glm::vec3 upper_boundary = glm::vec3(_grid_size) - 1.0f - boundary;
+
+				if (predicted_position.x < boundary) whitewater_velocity.x += (boundary - predicted_position.x) * boundary_elasticity;
+				if (predicted_position.y < boundary) whitewater_velocity.y += (boundary - predicted_position.y) * boundary_elasticity;
+				if (predicted_position.z < boundary) whitewater_velocity.z += (boundary - predicted_position.z) * boundary_elasticity;
+				if (predicted_position.x > upper_boundary.x) whitewater_velocity.x += (upper_boundary.x - predicted_position.x) * boundary_elasticity;
+				if (predicted_position.y > upper_boundary.y) whitewater_velocity.y += (upper_boundary.y - predicted_position.y) * boundary_elasticity;
+				if (predicted_position.z > upper_boundary.z) whitewater_velocity.z += (upper_boundary.z - predicted_position.z) * boundary_elasticity;
+			}
+			// Write updated values to next buffers
+			_next_whitewater_positions[moved_whitewater_idx] = whitewater_position;
+			_next_whitewater_velocities[moved_whitewater_idx] = whitewater_velocity;
+			_next_whitewater_types[moved_whitewater_idx] = whitewater_type;
+			_next_whitewater_lifetimes[moved_whitewater_idx] = whitewater_lifetime;
+
+			// Check for NaN values (aka if whitewater simulation broke)
+			#ifdef ENABLE_ASSERTS
+				assert(whitewater_position.x == whitewater_position.x);
+				assert(whitewater_position.y == whitewater_position.y);
+				assert(whitewater_position.z == whitewater_position.z);
+			#endif
+		}
+	});
+}
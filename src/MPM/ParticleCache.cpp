@@ -0,0 +1,427 @@
+#include <MPM/ParticleCache.hpp>
+#include <MPM/ParticleCacheCodec.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <type_traits>
+
+namespace
+{
+	const char CACHE_MAGIC[8] = { 'M', 'P', 'M', 'C', 'A', 'C', 'H', 'E' };
+	const char CACHE_INDEX_MAGIC[8] = { 'M', 'P', 'M', 'C', 'I', 'D', 'X', '\0' };
+	const uint32_t CACHE_CHUNK_MAGIC = 0x454D5246;	// "FRME"
+	const uint32_t CACHE_VERSION = 1;
+
+	// Fixed-size types only, so that the layout doesn't depend on the platform
+	struct CacheHeader
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t header_size;
+		uint32_t grid_size[3];
+		uint32_t padding;
+	};
+
+	struct CacheChunkHeader
+	{
+		uint32_t magic;
+		uint32_t encoding;
+		uint64_t payload_size;	// Bytes following the chunk header
+		uint64_t step;
+		double time;
+		uint32_t particles_count;
+		uint32_t whitewater_count;
+	};
+
+	struct CacheIndexEntry
+	{
+		uint64_t offset;
+		uint64_t size;
+		uint64_t step;
+		double time;
+	};
+
+	struct CacheTrailer
+	{
+		uint64_t index_offset;
+		uint64_t frames_count;
+		char magic[8];
+	};
+	static_assert(std::is_trivially_copyable_v<CacheHeader> && std::is_trivially_copyable_v<CacheChunkHeader>);
+	static_assert(std::is_trivially_copyable_v<CacheIndexEntry> && std::is_trivially_copyable_v<CacheTrailer>);
+
+	// Copy view into values, tightly packed
+	template <typename T>
+	void copy_buffer_view(const BufferView& view, std::vector<T>& values)
+	{
+		values.resize(view.count);
+		::copy_buffer_view(view, values.data(), sizeof(T));
+	}
+
+	template <typename T>
+	void append_values(std::vector<unsigned char>& bytes, const std::vector<T>& values)
+	{
+		const size_t size = values.size() * sizeof(T);
+		bytes.resize(bytes.size() + size);
+		if (size > 0) std::memcpy(&bytes[bytes.size() - size], values.data(), size);
+	}
+
+	// Read count values from bytes at offset, advanced past them. Returns false if out of bounds.
+	template <typename T>
+	bool read_values(const unsigned char* bytes, const uint64_t size, uint64_t& offset, const uint32_t count, std::vector<T>& values)
+	{
+		const uint64_t values_size = (uint64_t) count * sizeof(T);
+		if (values_size > size - offset) return false;
+		values.resize(count);
+		if (count > 0) std::memcpy(values.data(), &bytes[offset], values_size);
+		offset += values_size;
+		return true;
+	}
+}
+
+
+//// ParticleCacheWriter ////
+
+ParticleCacheWriter::ParticleCacheWriter() = default;
+
+ParticleCacheWriter::~ParticleCacheWriter() { close(); }
+
+
+bool ParticleCacheWriter::open(const std::string& path, const SimulationBackend& sim)
+{
+	close();
+	_file.open(path, std::ios::binary | std::ios::trunc);
+	if (!_file) {
+		std::cerr << "ERROR::PARTICLE_CACHE::OPEN::FILE_NOT_OPENED: " << path << std::endl;
+		return false;
+	}
+
+	CacheHeader header = {};
+	std::memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+	header.version = CACHE_VERSION;
+	header.header_size = sizeof(CacheHeader);
+	const glm::uvec3 grid_size = sim.get_grid_size();
+	for (int i = 0; i < 3; ++i) header.grid_size[i] = grid_size[i];
+	_file.write((const char*) &header, sizeof(header));
+	_file_offset = sizeof(header);
+
+	if (encoding == CACHE_ENCODING_QUANTIZED) {
+		_encoder = std::make_unique<QuantizedFrameEncoder>(encoder_threads_count);
+		_encoder->reset();
+		_position_levels = get_quantized_position_levels(position_error, grid_size);
+		const float reached_error = get_quantized_position_error(_position_levels, grid_size);
+		if (reached_error > position_error) std::cerr << "WARNING::PARTICLE_CACHE::OPEN::POSITION_ERROR_UNREACHABLE: " << position_error << " cells is below the float precision of the domain, positions are within " << reached_error << " cells" << std::endl;
+	}
+	else _encoder.reset();
+	_index.clear();
+	_frames_queued_total = 0;
+	_frames_dropped = 0;
+	_closing = false;
+	_failed = false;
+	_writer = std::thread(&ParticleCacheWriter::_writer_loop, this);
+	return true;
+}
+
+
+bool ParticleCacheWriter::write_frame(const SimulationBackend& sim, const double time)
+{
+	if (!is_open()) return false;
+
+	// Take a frame from the pool, allocating up to max_queued_frames
+	std::unique_ptr<ParticleCacheFrame> frame;
+	{
+		std::unique_lock<std::mutex> lock (_mutex);
+		if (_free_frames.empty() && _frames_allocated >= std::max(max_queued_frames, 1u)) {
+			if (drop_when_full) {
+				++_frames_dropped;
+				return false;
+			}
+			_free_cv.wait(lock, [this] { return !_free_frames.empty() || _failed; });
+		}
+		if (_failed) return false;
+		if (_free_frames.empty()) {
+			frame = std::make_unique<ParticleCacheFrame>();
+			++_frames_allocated;
+		}
+		else {
+			frame = std::move(_free_frames.back());
+			_free_frames.pop_back();
+		}
+	}
+
+	// Capture outside of the lock, while the writer thread works on older frames
+	frame->step = sim.get_steps_count();
+	frame->time = time;
+	copy_buffer_view(sim.get_particles_positions(), frame->particles_positions);
+	copy_buffer_view(sim.get_particles_velocities(), frame->particles_velocities);
+	copy_buffer_view(sim.get_whitewater_positions(), frame->whitewater_positions);
+	copy_buffer_view(sim.get_whitewater_types(), frame->whitewater_types);
+	copy_buffer_view(sim.get_whitewater_lifetimes(), frame->whitewater_lifetimes);
+
+	{
+		std::lock_guard<std::mutex> lock (_mutex);
+		_queue.push_back(std::move(frame));
+	}
+	_queue_cv.notify_one();
+	++_frames_queued_total;
+	return true;
+}
+
+
+void ParticleCacheWriter::_writer_loop()
+{
+	while (true) {
+		std::unique_ptr<ParticleCacheFrame> frame;
+		{
+			std::unique_lock<std::mutex> lock (_mutex);
+			_queue_cv.wait(lock, [this] { return !_queue.empty() || _closing; });
+			if (_queue.empty()) return;	// Closing, and every frame is written
+			frame = std::move(_queue.front());
+			_queue.pop_front();
+		}
+
+		if (!_failed) {
+			_encode_frame(*frame);
+			_file.write((const char*) _chunk.data(), _chunk.size());
+			_index.push_back({ _file_offset, _chunk.size(), frame->step, frame->time });
+			_file_offset += _chunk.size();
+		}
+
+		{
+			std::lock_guard<std::mutex> lock (_mutex);
+			if (!_file && !_failed) {
+				std::cerr << "ERROR::PARTICLE_CACHE::WRITE::WRITE_FAILED: frame of step " << frame->step << std::endl;
+				_failed = true;
+			}
+			_free_frames.push_back(std::move(frame));
+		}
+		_free_cv.notify_one();
+	}
+}
+
+
+void ParticleCacheWriter::_encode_frame(const ParticleCacheFrame& frame)
+{
+	_chunk.resize(sizeof(CacheChunkHeader));
+	if (_encoder) _encoder->encode(frame, (unsigned int) _index.size(), _position_levels, keyframe_interval, _chunk);
+	else {
+		append_values(_chunk, frame.particles_positions);
+		append_values(_chunk, frame.particles_velocities);
+		append_values(_chunk, frame.whitewater_positions);
+		append_values(_chunk, frame.whitewater_types);
+		append_values(_chunk, frame.whitewater_lifetimes);
+	}
+
+	CacheChunkHeader header = {};
+	header.magic = CACHE_CHUNK_MAGIC;
+	header.encoding = _encoder ? CACHE_ENCODING_QUANTIZED : CACHE_ENCODING_RAW;
+	header.payload_size = _chunk.size() - sizeof(CacheChunkHeader);
+	header.step = frame.step;
+	header.time = frame.time;
+	header.particles_count = (uint32_t) frame.particles_positions.size();
+	header.whitewater_count = (uint32_t) frame.whitewater_positions.size();
+	std::memcpy(_chunk.data(), &header, sizeof(header));
+}
+
+
+bool ParticleCacheWriter::close()
+{
+	if (!is_open()) return true;
+
+	{
+		std::lock_guard<std::mutex> lock (_mutex);
+		_closing = true;
+	}
+	_queue_cv.notify_one();
+	_writer.join();
+
+	// Index footer, written by this thread now that the writer is done
+	std::vector<CacheIndexEntry> entries (_index.size());
+	for (size_t i = 0; i < _index.size(); ++i) entries[i] = { _index[i].offset, _index[i].size, _index[i].step, _index[i].time };
+	CacheTrailer trailer = {};
+	trailer.index_offset = _file_offset;
+	trailer.frames_count = entries.size();
+	std::memcpy(trailer.magic, CACHE_INDEX_MAGIC, sizeof(trailer.magic));
+	_file.write((const char*) entries.data(), entries.size() * sizeof(CacheIndexEntry));
+	_file.write((const char*) &trailer, sizeof(trailer));
+	_file.close();
+	const bool succeeded = !_failed && !_file.fail();
+	if (!_failed && _file.fail()) std::cerr << "ERROR::PARTICLE_CACHE::CLOSE::WRITE_FAILED" << std::endl;
+
+	// Release the frames pool, sized for the simulation buffers, and the encoder threads
+	_queue.clear();
+	_free_frames.clear();
+	_frames_allocated = 0;
+	_encoder.reset();
+	return succeeded;
+}
+
+bool ParticleCacheWriter::is_open() const { return _writer.joinable(); }
+
+unsigned int ParticleCacheWriter::get_frames_count() const { return _frames_queued_total; }
+
+unsigned int ParticleCacheWriter::get_dropped_frames_count() const { return _frames_dropped; }
+
+
+//// ParticleCacheReader ////
+
+ParticleCacheReader::ParticleCacheReader() = default;
+
+ParticleCacheReader::~ParticleCacheReader() = default;
+
+
+bool ParticleCacheReader::open(const std::string& path, const unsigned int decoder_threads_count)
+{
+	close();
+	_decoder_pool = std::make_unique<ThreadPool>(decoder_threads_count);
+	if (!_file.open(path, false)) {
+		std::cerr << "ERROR::PARTICLE_CACHE::OPEN::FILE_NOT_OPENED: " << path << std::endl;
+		return false;
+	}
+
+	CacheHeader header;
+	if (_file.get_size() < sizeof(header)) {
+		std::cerr << "ERROR::PARTICLE_CACHE::OPEN::TRUNCATED: " << path << std::endl;
+		close();
+		return false;
+	}
+	std::memcpy(&header, _file.get_data(), sizeof(header));
+	if (std::memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) != 0 || header.version != CACHE_VERSION || header.header_size != sizeof(CacheHeader)) {
+		std::cerr << "ERROR::PARTICLE_CACHE::OPEN::UNSUPPORTED_FILE: " << path << std::endl;
+		close();
+		return false;
+	}
+	_grid_size = glm::uvec3(header.grid_size[0], header.grid_size[1], header.grid_size[2]);
+
+	// Index footer, if the cache was closed
+	CacheTrailer trailer;
+	const uint64_t size = _file.get_size();
+	bool has_index = false;
+	if (size >= sizeof(header) + sizeof(trailer)) {
+		std::memcpy(&trailer, &_file.get_data()[size - sizeof(trailer)], sizeof(trailer));
+		const uint64_t index_end = size - sizeof(trailer);
+		has_index = std::memcmp(trailer.magic, CACHE_INDEX_MAGIC, sizeof(trailer.magic)) == 0
+			&& trailer.index_offset >= sizeof(header) && trailer.index_offset <= index_end
+			&& trailer.frames_count == (index_end - trailer.index_offset) / sizeof(CacheIndexEntry);
+	}
+	if (has_index) {
+		_index.resize(trailer.frames_count);
+		for (uint64_t i = 0; i < trailer.frames_count; ++i) {
+			CacheIndexEntry entry;
+			std::memcpy(&entry, &_file.get_data()[trailer.index_offset + i * sizeof(CacheIndexEntry)], sizeof(entry));
+			_index[i] = { entry.offset, entry.size, entry.step, entry.time };
+		}
+	}
+	else {
+		std::cerr << "WARNING::PARTICLE_CACHE::OPEN::NO_INDEX: " << path << " was not closed, rebuilding its index" << std::endl;
+		_scan_chunks();
+	}
+	return true;
+}
+
+
+void ParticleCacheReader::_scan_chunks()
+{
+	_index.clear();
+	const uint64_t size = _file.get_size();
+	uint64_t offset = sizeof(CacheHeader);
+	while (size - offset >= sizeof(CacheChunkHeader)) {
+		CacheChunkHeader header;
+		std::memcpy(&header, &_file.get_data()[offset], sizeof(header));
+		// Stop at the first incomplete chunk, e.g. the one being written when the run stopped
+		if (header.magic != CACHE_CHUNK_MAGIC || header.payload_size > size - offset - sizeof(header)) break;
+		const uint64_t chunk_size = sizeof(header) + header.payload_size;
+		_index.push_back({ offset, chunk_size, header.step, header.time });
+		offset += chunk_size;
+	}
+}
+
+
+void ParticleCacheReader::close()
+{
+	_file.close();
+	_index.clear();
+	_grid_size = glm::uvec3(0);
+	std::lock_guard<std::mutex> lock (_keyframe_mutex);
+	_keyframe.reset();
+}
+
+bool ParticleCacheReader::is_open() const { return _file.is_open(); }
+
+glm::uvec3 ParticleCacheReader::get_grid_size() const { return _grid_size; }
+
+unsigned int ParticleCacheReader::get_frames_count() const { return (unsigned int) _index.size(); }
+
+const ParticleCacheFrameInfo& ParticleCacheReader::get_frame_info(const unsigned int frame_idx) const { return _index[frame_idx]; }
+
+
+unsigned int ParticleCacheReader::find_frame(const double time) const
+{
+	// Frames are recorded in time order
+	const auto next = std::upper_bound(_index.begin(), _index.end(), time, [](const double t, const ParticleCacheFrameInfo& info) { return t < info.time; });
+	return next == _index.begin() ? 0 : (unsigned int) (next - _index.begin() - 1);
+}
+
+
+bool ParticleCacheReader::read_frame(const unsigned int frame_idx, ParticleCacheFrame& frame) const { return _read_frame(frame_idx, frame, nullptr); }
+
+
+bool ParticleCacheReader::_read_frame(const unsigned int frame_idx, ParticleCacheFrame& frame, std::shared_ptr<const QuantizedParticles>* decoded_keyframe) const
+{
+	if (frame_idx >= _index.size()) return false;
+	const ParticleCacheFrameInfo& info = _index[frame_idx];
+	if (info.offset > _file.get_size() || info.size > _file.get_size() - info.offset || info.size < sizeof(CacheChunkHeader)) return false;
+
+	const unsigned char* chunk = &_file.get_data()[info.offset];
+	CacheChunkHeader header;
+	std::memcpy(&header, chunk, sizeof(header));
+	if (header.magic != CACHE_CHUNK_MAGIC || header.payload_size != info.size - sizeof(header) || header.encoding >= CACHE_ENCODING_NUM) return false;
+
+	const unsigned char* payload = chunk + sizeof(header);
+	frame.step = header.step;
+	frame.time = header.time;
+	if (header.encoding == CACHE_ENCODING_QUANTIZED) {
+		unsigned int keyframe_idx;
+		bool is_keyframe;
+		if (!get_quantized_frame_keyframe(payload, header.payload_size, keyframe_idx, is_keyframe)) return false;
+		std::shared_ptr<const QuantizedParticles> keyframe;
+		std::shared_ptr<QuantizedParticles> quantized;
+		if (is_keyframe) quantized = std::make_shared<QuantizedParticles>();	// Kept as the reference of the next frames
+		else if (keyframe_idx >= frame_idx || !(keyframe = _get_keyframe(keyframe_idx))) return false;
+
+		// Decode with the pool unless another thread is using it
+		std::unique_lock<std::mutex> pool_lock (_decoder_pool_mutex, std::try_to_lock);
+		const bool decoded = decode_quantized_frame(payload, header.payload_size, header.particles_count, header.whitewater_count, keyframe.get(), frame, quantized.get(), pool_lock.owns_lock() ? _decoder_pool.get() : nullptr);
+		pool_lock.unlock();
+		if (decoded && is_keyframe) {
+			if (decoded_keyframe) *decoded_keyframe = quantized;
+			std::lock_guard<std::mutex> lock (_keyframe_mutex);
+			_keyframe = quantized;
+			_keyframe_idx = frame_idx;
+		}
+		return decoded;
+	}
+
+	uint64_t offset = 0;
+	return read_values(payload, header.payload_size, offset, header.particles_count, frame.particles_positions)
+		&& read_values(payload, header.payload_size, offset, header.particles_count, frame.particles_velocities)
+		&& read_values(payload, header.payload_size, offset, header.whitewater_count, frame.whitewater_positions)
+		&& read_values(payload, header.payload_size, offset, header.whitewater_count, frame.whitewater_types)
+		&& read_values(payload, header.payload_size, offset, header.whitewater_count, frame.whitewater_lifetimes);
+}
+
+
+std::shared_ptr<const QuantizedParticles> ParticleCacheReader::_get_keyframe(const unsigned int keyframe_idx) const
+{
+	{
+		std::lock_guard<std::mutex> lock (_keyframe_mutex);
+		if (_keyframe && _keyframe_idx == keyframe_idx) return _keyframe;
+	}
+	// Decoding the keyframe caches it
+	ParticleCacheFrame frame;
+	std::shared_ptr<const QuantizedParticles> keyframe;
+	if (!_read_frame(keyframe_idx, frame, &keyframe)) return nullptr;
+	return keyframe;
+}
@@ -0,0 +1,371 @@
+#include <MPM/ParticleCacheCodec.hpp>
+#include <utils/BitPacking.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <type_traits>
+
+namespace
+{
+	// Follows the chunk header of CACHE_ENCODING_QUANTIZED chunks, then the end offsets of the blocks (uint64_t, from the first block), then the blocks
+	struct QuantizedFrameHeader
+	{
+		uint32_t keyframe_idx;
+		uint32_t is_keyframe;
+		uint32_t levels;
+		uint32_t particles_blocks;
+		uint32_t whitewater_blocks;
+		uint32_t padding;
+	};
+	static_assert(std::is_trivially_copyable_v<QuantizedFrameHeader>);
+
+	const unsigned int MAX_LEVELS = 1 << 20;	// Positions up to 1024 cells stay within 31 bits
+
+	unsigned int get_blocks_count(const size_t count) { return (unsigned int) ((count + CACHE_BLOCK_PARTICLES - 1) / CACHE_BLOCK_PARTICLES); }
+
+	// In double, where position * levels is exact: the error is at most 0.5 / levels
+	int32_t quantize_position(const float position, const unsigned int levels) { return (int32_t) std::floor((double) position * levels + 0.5); }
+
+	// In double, so that only the final rounding to float adds to the quantization error
+	float dequantize_position(const int32_t position, const double step) { return (float) (position * step); }
+
+	// Half the float ulp of the largest positions of a domain of grid_size cells: the rounding error of decoded positions
+	double get_position_rounding_error(const glm::uvec3 grid_size)
+	{
+		// Positions are below the largest size: floats in [2^e, 2^(e + 1)) are 2^(e - 23) apart
+		const unsigned int max_size = std::max(std::max(grid_size.x, grid_size.y), std::max(grid_size.z, 2u));
+		return std::ldexp(1.0, std::ilogb((float) (max_size - 1)) - 24);
+	}
+
+	// IEEE 754 half precision, rounded to nearest even. Overflows to infinity, keeps NaNs.
+	uint16_t float_to_half(const float value)
+	{
+		const uint32_t F32_INFINITY = 255u << 23;
+		const uint32_t F16_OVERFLOW = (127u + 16u) << 23;		// 65536, the first float that rounds to half infinity is just below
+		const uint32_t DENORMAL_MAGIC = ((127u - 15u) + (23u - 10u) + 1u) << 23;
+		uint32_t bits;
+		std::memcpy(&bits, &value, sizeof(bits));
+		const uint32_t sign = bits & 0x80000000u;
+		bits ^= sign;
+
+		uint16_t half;
+		if (bits >= F16_OVERFLOW) half = bits > F32_INFINITY ? 0x7E00 : 0x7C00;
+		else if (bits < (113u << 23)) {
+			// Subnormal half: let the float addition round the mantissa
+			float magic, shifted;
+			std::memcpy(&magic, &DENORMAL_MAGIC, sizeof(magic));
+			std::memcpy(&shifted, &bits, sizeof(shifted));
+			shifted += magic;
+			std::memcpy(&bits, &shifted, sizeof(bits));
+			half = (uint16_t) (bits - DENORMAL_MAGIC);
+		}
+		else {
+			const uint32_t mantissa_odd = (bits >> 13) & 1;
+			bits += ((uint32_t) (15 - 127) << 23) + 0xFFF + mantissa_odd;
+			half = (uint16_t) (bits >> 13);
+		}
+		return half | (uint16_t) (sign >> 16);
+	}
+
+	float half_to_float(const uint16_t half)
+	{
+		const uint32_t SHIFTED_EXPONENT = 0x7C00u << 13;
+		const uint32_t DENORMAL_MAGIC = 113u << 23;	// 2^-14
+		uint32_t bits = ((uint32_t) half & 0x7FFF) << 13;
+		const uint32_t exponent = bits & SHIFTED_EXPONENT;
+		bits += (127u - 15u) << 23;
+		if (exponent == SHIFTED_EXPONENT) bits += (128u - 16u) << 23;	// Infinity or NaN
+		else if (exponent == 0) {
+			// Subnormal: renormalize through a float subtraction
+			float value, magic;
+			bits += 1u << 23;
+			std::memcpy(&value, &bits, sizeof(value));
+			std::memcpy(&magic, &DENORMAL_MAGIC, sizeof(magic));
+			value -= magic;
+			std::memcpy(&bits, &value, sizeof(bits));
+		}
+		bits |= ((uint32_t) half & 0x8000) << 16;
+		float value;
+		std::memcpy(&value, &bits, sizeof(value));
+		return value;
+	}
+
+	// Per-thread buffer of unpacked values
+	std::vector<uint32_t>& get_values_scratch(const size_t count)
+	{
+		thread_local std::vector<uint32_t> scratch;
+		if (scratch.size() < count) scratch.resize(count);
+		return scratch;
+	}
+
+	// Particles [begin, end) of quantized, against reference, or against the previous particle if null
+	void encode_particles_block(const QuantizedParticles& quantized, const QuantizedParticles* reference, const size_t begin, const size_t end, std::vector<unsigned char>& bytes)
+	{
+		std::vector<uint32_t>& values = get_values_scratch(end - begin);
+		for (int axis = 0; axis < 3; ++axis) {
+			const int32_t* positions = quantized.positions[axis].data();
+			for (size_t i = begin; i < end; ++i) {
+				const int32_t prediction = reference ? reference->positions[axis][i] : (i > begin ? positions[i - 1] : 0);
+				values[i - begin] = zigzag_encode(positions[i] - prediction);
+			}
+			pack_values(values.data(), end - begin, bytes);
+		}
+		for (int axis = 0; axis < 3; ++axis) {
+			const uint16_t* velocities = quantized.velocities[axis].data();
+			for (size_t i = begin; i < end; ++i) {
+				const int32_t prediction = reference ? reference->velocities[axis][i] : (i > begin ? velocities[i - 1] : 0);
+				values[i - begin] = zigzag_encode((int32_t) velocities[i] - prediction);
+			}
+			pack_values(values.data(), end - begin, bytes);
+		}
+	}
+
+	// Whitewater [begin, end) of frame, always against the previous whitewater: its order isn't stable from a step to the next
+	void encode_whitewater_block(const ParticleCacheFrame& frame, const unsigned int levels, const size_t begin, const size_t end, std::vector<unsigned char>& bytes)
+	{
+		std::vector<uint32_t>& values = get_values_scratch(end - begin);
+		for (int axis = 0; axis < 3; ++axis) {
+			int32_t previous = 0;
+			for (size_t i = begin; i < end; ++i) {
+				const int32_t position = quantize_position(frame.whitewater_positions[i][axis], levels);
+				values[i - begin] = zigzag_encode(position - previous);
+				previous = position;
+			}
+			pack_values(values.data(), end - begin, bytes);
+		}
+		for (size_t i = begin; i < end; ++i) values[i - begin] = frame.whitewater_types[i];
+		pack_values(values.data(), end - begin, bytes);
+		int32_t previous = 0;
+		for (size_t i = begin; i < end; ++i) {
+			const int32_t lifetime = float_to_half(frame.whitewater_lifetimes[i]);
+			values[i - begin] = zigzag_encode(lifetime - previous);
+			previous = lifetime;
+		}
+		pack_values(values.data(), end - begin, bytes);
+	}
+
+	bool decode_particles_block(const unsigned char* bytes, const unsigned char* const end, const unsigned int levels, const QuantizedParticles* reference, const size_t begin, const size_t block_end, ParticleCacheFrame& frame, QuantizedParticles* quantized)
+	{
+		const size_t count = block_end - begin;
+		std::vector<uint32_t>& values = get_values_scratch(count);
+		const double step = 1.0 / levels;
+		for (int axis = 0; axis < 3; ++axis) {
+			if (!unpack_values(bytes, end, values.data(), count)) return false;
+			int32_t position = 0;
+			for (size_t i = begin; i < block_end; ++i) {
+				position = zigzag_decode(values[i - begin]) + (reference ? reference->positions[axis][i] : position);
+				frame.particles_positions[i][axis] = dequantize_position(position, step);
+				if (quantized) quantized->positions[axis][i] = position;
+			}
+		}
+		for (int axis = 0; axis < 3; ++axis) {
+			if (!unpack_values(bytes, end, values.data(), count)) return false;
+			int32_t velocity = 0;
+			for (size_t i = begin; i < block_end; ++i) {
+				velocity = (uint16_t) (zigzag_decode(values[i - begin]) + (reference ? reference->velocities[axis][i] : velocity));
+				frame.particles_velocities[i][axis] = half_to_float((uint16_t) velocity);
+				if (quantized) quantized->velocities[axis][i] = (uint16_t) velocity;
+			}
+		}
+		return true;
+	}
+
+	bool decode_whitewater_block(const unsigned char* bytes, const unsigned char* const end, const unsigned int levels, const size_t begin, const size_t block_end, ParticleCacheFrame& frame)
+	{
+		const size_t count = block_end - begin;
+		std::vector<uint32_t>& values = get_values_scratch(count);
+		const double step = 1.0 / levels;
+		for (int axis = 0; axis < 3; ++axis) {
+			if (!unpack_values(bytes, end, values.data(), count)) return false;
+			int32_t position = 0;
+			for (size_t i = begin; i < block_end; ++i) {
+				position += zigzag_decode(values[i - begin]);
+				frame.whitewater_positions[i][axis] = dequantize_position(position, step);
+			}
+		}
+		if (!unpack_values(bytes, end, values.data(), count)) return false;
+		for (size_t i = begin; i < block_end; ++i) frame.whitewater_types[i] = (unsigned char) values[i - begin];
+		if (!unpack_values(bytes, end, values.data(), count)) return false;
+		int32_t lifetime = 0;
+		for (size_t i = begin; i < block_end; ++i) {
+			lifetime = (uint16_t) (lifetime + zigzag_decode(values[i - begin]));
+			frame.whitewater_lifetimes[i] = half_to_float((uint16_t) lifetime);
+		}
+		return true;
+	}
+}
+
+
+unsigned int get_quantized_position_levels(const float position_error, const glm::uvec3 grid_size)
+{
+	// What the float rounding leaves to the quantization, with a millionth of margin for the rounding of the double product of decoding
+	const double quantization_error = (position_error - get_position_rounding_error(grid_size)) * (1.0 - 1e-6);
+	if (quantization_error <= 0.5 / MAX_LEVELS) return MAX_LEVELS;
+	return std::max((unsigned int) std::ceil(0.5 / quantization_error), 1u);
+}
+
+
+float get_quantized_position_error(const unsigned int levels, const glm::uvec3 grid_size)
+{
+	return (float) (0.5 / std::max(levels, 1u) + get_position_rounding_error(grid_size));
+}
+
+
+//// QuantizedFrameEncoder ////
+
+QuantizedFrameEncoder::QuantizedFrameEncoder(const unsigned int threads_count) : _thread_pool(threads_count) { }
+
+
+void QuantizedFrameEncoder::reset()
+{
+	_has_keyframe = false;
+	_frames_since_keyframe = 0;
+}
+
+
+void QuantizedFrameEncoder::encode(const ParticleCacheFrame& frame, const unsigned int frame_idx, const unsigned int levels, const unsigned int keyframe_interval, std::vector<unsigned char>& payload)
+{
+	const size_t particles_count = frame.particles_positions.size();
+	const size_t whitewater_count = frame.whitewater_positions.size();
+	const bool is_keyframe = !_has_keyframe || _frames_since_keyframe + 1 >= std::max(keyframe_interval, 1u)
+		|| _keyframe.levels != levels || _keyframe.positions[0].size() != particles_count;
+	if (is_keyframe) {
+		_keyframe_idx = frame_idx;
+		_frames_since_keyframe = 0;
+	}
+	else ++_frames_since_keyframe;
+
+	// Quantize and encode the blocks in parallel, particles blocks first
+	_quantized.levels = levels;
+	for (int axis = 0; axis < 3; ++axis) {
+		_quantized.positions[axis].resize(particles_count);
+		_quantized.velocities[axis].resize(particles_count);
+	}
+	const unsigned int particles_blocks = get_blocks_count(particles_count);
+	const unsigned int whitewater_blocks = get_blocks_count(whitewater_count);
+	_blocks.resize(particles_blocks + whitewater_blocks);
+	const QuantizedParticles* reference = is_keyframe ? nullptr : &_keyframe;
+	_thread_pool.parallel_for(0, particles_blocks + whitewater_blocks, [&](unsigned int begin_block, unsigned int end_block, unsigned int) {
+		for (unsigned int block = begin_block; block < end_block; ++block) {
+			std::vector<unsigned char>& bytes = _blocks[block];
+			bytes.clear();
+			if (block < particles_blocks) {
+				const size_t begin = (size_t) block * CACHE_BLOCK_PARTICLES;
+				const size_t end = std::min(begin + CACHE_BLOCK_PARTICLES, particles_count);
+				for (size_t i = begin; i < end; ++i) {
+					for (int axis = 0; axis < 3; ++axis) {
+						_quantized.positions[axis][i] = quantize_position(frame.particles_positions[i][axis], levels);
+						_quantized.velocities[axis][i] = float_to_half(frame.particles_velocities[i][axis]);
+					}
+				}
+				encode_particles_block(_quantized, reference, begin, end, bytes);
+			}
+			else {
+				const size_t begin = (size_t) (block - particles_blocks) * CACHE_BLOCK_PARTICLES;
+				encode_whitewater_block(frame, levels, begin, std::min(begin + CACHE_BLOCK_PARTICLES, whitewater_count), bytes);
+			}
+		}
+	}, 1);
+
+	// Header, blocks table and blocks
+	QuantizedFrameHeader header = {};
+	header.keyframe_idx = _keyframe_idx;
+	header.is_keyframe = is_keyframe;
+	header.levels = levels;
+	header.particles_blocks = particles_blocks;
+	header.whitewater_blocks = whitewater_blocks;
+	const size_t blocks_start = payload.size() + sizeof(header) + _blocks.size() * sizeof(uint64_t);
+	payload.resize(blocks_start);
+	std::memcpy(&payload[blocks_start - _blocks.size() * sizeof(uint64_t) - sizeof(header)], &header, sizeof(header));
+	uint64_t block_end = 0;
+	for (size_t block = 0; block < _blocks.size(); ++block) {
+		block_end += _blocks[block].size();
+		std::memcpy(&payload[blocks_start - (_blocks.size() - block) * sizeof(uint64_t)], &block_end, sizeof(block_end));
+	}
+	payload.reserve(blocks_start + block_end);
+	for (const std::vector<unsigned char>& bytes : _blocks) payload.insert(payload.end(), bytes.begin(), bytes.end());
+
+	if (is_keyframe) {
+		std::swap(_keyframe, _quantized);
+		_has_keyframe = true;
+	}
+}
+
+
+//// Decoding ////
+
+bool get_quantized_frame_keyframe(const unsigned char* payload, const uint64_t payload_size, unsigned int& keyframe_idx, bool& is_keyframe)
+{
+	QuantizedFrameHeader header;
+	if (payload_size < sizeof(header)) return false;
+	std::memcpy(&header, payload, sizeof(header));
+	keyframe_idx = header.keyframe_idx;
+	is_keyframe = header.is_keyframe != 0;
+	return true;
+}
+
+
+bool decode_quantized_frame(
+	const unsigned char* payload,
+	const uint64_t payload_size,
+	const unsigned int particles_count,
+	const unsigned int whitewater_count,
+	const QuantizedParticles* keyframe,
+	ParticleCacheFrame& frame,
+	QuantizedParticles* quantized,
+	ThreadPool* thread_pool)
+{
+	QuantizedFrameHeader header;
+	if (payload_size < sizeof(header)) return false;
+	std::memcpy(&header, payload, sizeof(header));
+	const unsigned int particles_blocks = get_blocks_count(particles_count);
+	const unsigned int whitewater_blocks = get_blocks_count(whitewater_count);
+	const uint64_t blocks_start = sizeof(header) + (uint64_t) (particles_blocks + whitewater_blocks) * sizeof(uint64_t);
+	if (header.particles_blocks != particles_blocks || header.whitewater_blocks != whitewater_blocks || header.levels == 0 || header.levels > MAX_LEVELS || blocks_start > payload_size) return false;
+	const bool is_keyframe = header.is_keyframe != 0;
+	if (!is_keyframe && (keyframe == nullptr || keyframe->levels != header.levels || keyframe->positions[0].size() != particles_count)) return false;
+	const unsigned char* blocks = payload + blocks_start;
+	std::vector<uint64_t> block_ends (particles_blocks + whitewater_blocks);
+	if (!block_ends.empty()) std::memcpy(block_ends.data(), payload + sizeof(header), block_ends.size() * sizeof(uint64_t));
+	for (size_t block = 0; block < block_ends.size(); ++block) {
+		if (block_ends[block] > payload_size - blocks_start || (block > 0 && block_ends[block] < block_ends[block - 1])) return false;
+	}
+
+	frame.particles_positions.resize(particles_count);
+	frame.particles_velocities.resize(particles_count);
+	frame.whitewater_positions.resize(whitewater_count);
+	frame.whitewater_types.resize(whitewater_count);
+	frame.whitewater_lifetimes.resize(whitewater_count);
+	if (quantized && is_keyframe) {
+		quantized->levels = header.levels;
+		for (int axis = 0; axis < 3; ++axis) {
+			quantized->positions[axis].resize(particles_count);
+			quantized->velocities[axis].resize(particles_count);
+		}
+	}
+	QuantizedParticles* quantized_output = is_keyframe ? quantized : nullptr;
+	const QuantizedParticles* reference = is_keyframe ? nullptr : keyframe;
+
+	std::atomic<bool> valid {true};
+	const ThreadPool::Job decode_blocks = [&](unsigned int begin_block, unsigned int end_block, unsigned int) {
+		for (unsigned int block = begin_block; block < end_block; ++block) {
+			const unsigned char* bytes = blocks + (block > 0 ? block_ends[block - 1] : 0);
+			const unsigned char* bytes_end = blocks + block_ends[block];
+			bool block_valid;
+			if (block < particles_blocks) {
+				const size_t begin = (size_t) block * CACHE_BLOCK_PARTICLES;
+				block_valid = decode_particles_block(bytes, bytes_end, header.levels, reference, begin, std::min(begin + CACHE_BLOCK_PARTICLES, (size_t) particles_count), frame, quantized_output);
+			}
+			else {
+				const size_t begin = (size_t) (block - particles_blocks) * CACHE_BLOCK_PARTICLES;
+				block_valid = decode_whitewater_block(bytes, bytes_end, header.levels, begin, std::min(begin + CACHE_BLOCK_PARTICLES, (size_t) whitewater_count), frame);
+			}
+			if (!block_valid) valid.store(false, std::memory_order_relaxed);
+		}
+	};
+	if (thread_pool) thread_pool->parallel_for(0, particles_blocks + whitewater_blocks, decode_blocks, 1);
+	else decode_blocks(0, particles_blocks + whitewater_blocks, 0);
+	return valid.load();
+}
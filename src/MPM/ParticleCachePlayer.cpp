@@ -0,0 +1,146 @@
+#include <MPM/ParticleCachePlayer.hpp>
+
+#include <algorithm>
+#include <iostream>
+
+ParticleCachePlayer::~ParticleCachePlayer() { close(); }
+
+
+bool ParticleCachePlayer::open(const std::string& path, const unsigned int ring_size)
+{
+	close();
+	if (!_reader.open(path)) return false;
+	if (_reader.get_frames_count() == 0) {
+		std::cerr << "ERROR::PARTICLE_CACHE_PLAYER::OPEN::NO_FRAMES: " << path << std::endl;
+		_reader.close();
+		return false;
+	}
+
+	_slots = std::vector<Slot>(std::max(ring_size, 2u));	// One slot locked by the viewer, the others prefetched
+	_target_idx = 0;
+	_direction = 1;
+	_locked_slot = -1;
+	_closing = false;
+	_worker = std::thread(&ParticleCachePlayer::_worker_loop, this);
+	return true;
+}
+
+
+void ParticleCachePlayer::close()
+{
+	if (_worker.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock (_mutex);
+			_closing = true;
+		}
+		_cv.notify_all();
+		_worker.join();
+	}
+	_slots.clear();
+	_reader.close();
+}
+
+bool ParticleCachePlayer::is_open() const { return _reader.is_open(); }
+
+const ParticleCacheReader& ParticleCachePlayer::get_reader() const { return _reader; }
+
+
+void ParticleCachePlayer::seek(const unsigned int frame_idx, const int direction)
+{
+	{
+		std::lock_guard<std::mutex> lock (_mutex);
+		const unsigned int target_idx = std::min(frame_idx, _reader.get_frames_count() - 1);
+		const int target_direction = direction < 0 ? -1 : 1;
+		if (target_idx == _target_idx && target_direction == _direction) return;
+		_target_idx = target_idx;
+		_direction = target_direction;
+	}
+	_cv.notify_one();
+}
+
+
+const ParticleCacheFrame* ParticleCachePlayer::lock_frame(const unsigned int frame_idx, unsigned int& locked_idx)
+{
+	std::lock_guard<std::mutex> lock (_mutex);
+	_locked_slot = -1;
+	unsigned int nearest_distance = 0;
+	for (unsigned int i = 0; i < _slots.size(); ++i) {
+		const Slot& slot = _slots[i];
+		if (!slot.decoded || !slot.valid) continue;
+		const unsigned int distance = slot.frame_idx > frame_idx ? slot.frame_idx - frame_idx : frame_idx - slot.frame_idx;
+		if (_locked_slot < 0 || distance < nearest_distance) {
+			_locked_slot = (int) i;
+			nearest_distance = distance;
+		}
+	}
+	if (_locked_slot < 0) return nullptr;
+	locked_idx = _slots[_locked_slot].frame_idx;
+	return &_slots[_locked_slot].frame;
+}
+
+
+void ParticleCachePlayer::unlock_frame()
+{
+	{
+		std::lock_guard<std::mutex> lock (_mutex);
+		_locked_slot = -1;
+	}
+	_cv.notify_one();
+}
+
+
+bool ParticleCachePlayer::_is_in_window(const unsigned int frame_idx) const
+{
+	const unsigned int window = (unsigned int) _slots.size() - 1;
+	if (_direction > 0) return frame_idx >= _target_idx && frame_idx - _target_idx < window;
+	return frame_idx <= _target_idx && _target_idx - frame_idx < window;
+}
+
+
+bool ParticleCachePlayer::_next_decode(unsigned int& slot_idx, unsigned int& frame_idx) const
+{
+	const unsigned int window = (unsigned int) _slots.size() - 1;
+	const unsigned int frames_count = _reader.get_frames_count();
+	for (unsigned int k = 0; k < window; ++k) {
+		// Nearest frames first, so that a seek shows up as soon as its own frame is decoded
+		if (_direction > 0 ? _target_idx + k >= frames_count : k > _target_idx) break;
+		const unsigned int idx = _direction > 0 ? _target_idx + k : _target_idx - k;
+		const bool held = std::any_of(_slots.begin(), _slots.end(), [idx](const Slot& slot) { return (slot.decoding || slot.decoded) && slot.frame_idx == idx; });
+		if (held) continue;
+
+		// Reuse an empty slot, or one holding a frame the playback moved away from
+		for (unsigned int i = 0; i < _slots.size(); ++i) {
+			const Slot& slot = _slots[i];
+			if (slot.decoding || (int) i == _locked_slot || (slot.decoded && _is_in_window(slot.frame_idx))) continue;
+			slot_idx = i;
+			frame_idx = idx;
+			return true;
+		}
+		return false;
+	}
+	return false;
+}
+
+
+void ParticleCachePlayer::_worker_loop()
+{
+	std::unique_lock<std::mutex> lock (_mutex);
+	while (!_closing) {
+		unsigned int slot_idx, frame_idx;
+		if (!_next_decode(slot_idx, frame_idx)) {
+			_cv.wait(lock);
+			continue;
+		}
+
+		Slot& slot = _slots[slot_idx];
+		slot.frame_idx = frame_idx;
+		slot.decoded = false;
+		slot.decoding = true;
+		lock.unlock();
+		const bool valid = _reader.read_frame(frame_idx, slot.frame);
+		lock.lock();
+		slot.decoding = false;
+		slot.decoded = true;
+		slot.valid = valid;	// Invalid frames stay in their slot, so that they aren't decoded again and again
+	}
+}
@@ -0,0 +1,409 @@
+#include <MPM/SimulationBackend.hpp>
+#include <MPM/MPMConstants.hpp>
+#include <MPM/MPMSimulation.cuh>
+#include <MPM/MPMSimulationCPU.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include <cuda_runtime.h>
+#include <utils/CudaCheck.cuh>
+
+const char* get_stage_name(const STEP_STAGE stage)
+{
+	switch (stage) {
+		case SORT_PARTICLES:	return "sort_particles";
+		case GRID_ALLOCATE:		return "grid_allocate";
+		case GRID_RESET:		return "grid_reset";
+		case P2G_MASS:			return "p2g_mass";
+		case P2G_MOMENTUM:		return "p2g_momentum";
+		case GRID_UPDATE:		return "grid_update";
+		case G2P:				return "g2p";
+		case ADVECT_WHITEWATER:	return "advect_whitewater";
+		default:				return "unknown";
+	}
+}
+
+
+void copy_buffer_view(const BufferView& view, void* values, const size_t element_size)
+{
+	if (view.count == 0 || view.data == nullptr) return;
+
+	if (view.memory_space == DEVICE) {
+		CUDA_CHECK( cudaMemcpy2D(values, element_size, view.data, view.stride, element_size, view.count, cudaMemcpyDeviceToHost) );
+		CUDA_CHECK( cudaGetLastError() );
+	}
+	else if (view.stride == element_size) std::memcpy(values, view.data, (size_t) view.count * element_size);
+	else {
+		const char* src = (const char*) view.data;
+		char* dst = (char*) values;
+		for (unsigned int i = 0; i < view.count; ++i) std::memcpy(&dst[(size_t) i * element_size], &src[(size_t) i * view.stride], element_size);
+	}
+}
+
+
+const char* get_interpolation_kernel_name(const INTERPOLATION_KERNEL kernel)
+{
+	switch (kernel) {
+		case INTERPOLATION_KERNEL_LINEAR:		return "linear";
+		case INTERPOLATION_KERNEL_QUADRATIC:	return "quadratic";
+		case INTERPOLATION_KERNEL_CUBIC:		return "cubic";
+		default:								return "unknown";
+	}
+}
+
+
+const char* get_transfer_scheme_name(const TRANSFER_SCHEME scheme)
+{
+	switch (scheme) {
+		case TRANSFER_SCHEME_APIC:		return "apic";
+		case TRANSFER_SCHEME_PIC_FLIP:	return "pic-flip";
+		default:						return "unknown";
+	}
+}
+
+
+SimulationBackend::SimulationBackend(
+	const ParticleMaterial& particles_material,
+	const float timestep,
+	const float boundary,
+	const float boundary_elasticity,
+	const glm::vec3 gravity)
+	:
+	_timestep(timestep),
+	_fixed_timestep(timestep),
+	_grid_size(0),
+	_grid_blocks_count(0),
+	_particles_count(0),
+	_whitewater_count(0),
+	_water_level(0.0f),
+	_stage_profiling(false),
+	_stage_times{},
+	_steps_since_sort(0),
+	_steps_count(0),
+	_snapshots_count(0),
+	_newest_snapshot(0),
+	_steps_since_health_check(0),
+	_steps_since_snapshot(0),
+	_timestep_scale(1.0f),
+	_rollbacks_count(0),
+	_advanced_steps_count(0),
+	_advanced_time(0.0),
+	_lost_time(0.0),
+	_interpolation_kernel(INTERPOLATION_KERNEL_QUADRATIC),
+	_transfer_scheme(TRANSFER_SCHEME_APIC),
+	particles_material(particles_material),
+	boundary(boundary),
+	boundary_elasticity(boundary_elasticity),
+	gravity(gravity),
+	spawn_position(0.0f),
+	whitewater_chance_min(0.5f),
+	whitewater_chance_max(1.0f),
+	whitewater_spawn_num(10),
+	sort_interval(20),
+	flip_ratio(0.95f),
+	adaptive_timestep(false),
+	cfl_number(0.5f),
+	min_timestep(timestep / 8.0f),
+	max_timestep(timestep * 2.0f),
+	health_check_interval(10),
+	snapshot_interval(100),
+	snapshots_num(2),
+	blowup_cfl(2.0f)
+{ }
+
+
+void SimulationBackend::_estimate_water_level()
+{
+	float mass = _particles_count * particles_material.mass;
+	float density = particles_material.rest_density * (particles_material.EOS_stiffness / 1000.0f);	// Arbitrarily scaled by stiffness/1000, as simulation isn't actually incompressible
+	_water_level = mass / (_grid_size.x * _grid_size.z * density);
+}
+
+
+float SimulationBackend::_get_spawn_sphere_radius() const
+{
+	// Find sphere volume to spawn particles in rest state
+	float volume = ((PARTICLES_SPAWN_NUM * particles_material.mass) / particles_material.rest_density);		// V = m/d
+	float radius = std::cbrtf( (3.0f / 4.0f) * (volume / 3.14159265358979323846f));	// r = cbrtf(3/4 * V/pi)
+
+	// Ensure spawn volume is within bounds. If not, shrink. Particles won't spawn in rest state anymore.
+	if (radius > (_grid_size.x / 2.0f) - 1.0f) radius = (_grid_size.x / 2.0f) - 1.0f;
+	if (radius > (_grid_size.y / 2.0f) - 1.0f) radius = (_grid_size.y / 2.0f) - 1.0f;
+	if (radius > (_grid_size.z / 2.0f) - 1.0f) radius = (_grid_size.z / 2.0f) - 1.0f;
+	return radius;
+}
+
+
+float SimulationBackend::_get_spawn_cube_step() const
+{
+	// Ensure spawn volume is within bounds
+	float step = 1.0f / std::cbrtf(particles_material.rest_density / particles_material.mass);
+	if (step * PARTICLES_SPAWN_CUBE_SIZE > _grid_size.x - 2.0f) step = (_grid_size.x - 2.0f) / PARTICLES_SPAWN_CUBE_SIZE;
+	if (step * PARTICLES_SPAWN_CUBE_SIZE > _grid_size.y - 2.0f) step = (_grid_size.y - 2.0f) / PARTICLES_SPAWN_CUBE_SIZE;
+	if (step * PARTICLES_SPAWN_CUBE_SIZE > _grid_size.z - 2.0f) step = (_grid_size.z - 2.0f) / PARTICLES_SPAWN_CUBE_SIZE;
+	return step;
+}
+
+
+void SimulationBackend::_clear_stage_times() { std::fill(std::begin(_stage_times), std::end(_stage_times), 0.0f); }
+
+
+void SimulationBackend::_begin_stage()
+{
+	if (_stage_profiling) _stage_start = std::chrono::steady_clock::now();
+}
+
+
+void SimulationBackend::_end_stage(const STEP_STAGE stage)
+{
+	if (_stage_profiling) _stage_times[stage] += std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - _stage_start).count();
+}
+
+
+void SimulationBackend::_set_timestep(const float timestep)
+{
+	if (timestep == _timestep) return;
+	_timestep = timestep;
+	_on_timestep_change();
+}
+
+
+bool SimulationBackend::_check_health()
+{
+	if (health_check_interval == 0 || ++_steps_since_health_check < health_check_interval) return true;
+	_steps_since_health_check = 0;
+	_steps_since_snapshot += health_check_interval;
+
+	// Healthy: snapshot the state if due, in the oldest ring slot, and let the timestep recover from past rollbacks
+	if (_get_max_particle_speed() * _timestep <= blowup_cfl) {
+		if (_snapshots_count == 0 || _steps_since_snapshot >= snapshot_interval) {
+			const unsigned int ring_size = std::max(snapshots_num, 1u);
+			if (_snapshots.size() != ring_size) {
+				_snapshots.resize(ring_size);
+				_snapshots_times.resize(ring_size);
+				_snapshots_count = std::min(_snapshots_count, ring_size);
+				_newest_snapshot = std::min(_newest_snapshot, ring_size - 1);
+			}
+			_newest_snapshot = (_newest_snapshot + 1) % ring_size;
+			save_state(_snapshots[_newest_snapshot]);
+			_snapshots_times[_newest_snapshot] = _advanced_time;
+			_snapshots_count = std::min(_snapshots_count + 1, ring_size);
+			_steps_since_snapshot = 0;
+			_timestep_scale = std::min(_timestep_scale * 2.0f, 1.0f);
+		}
+		return true;
+	}
+
+	// Blow-up (infinite and NaN speeds fail the test above too): retry from the last snapshot with a halved timestep, or from the one before once it can't be reduced further
+	if (_snapshots_count == 0) return true;	// Nothing to roll back to
+	if (_timestep_scale > MIN_TIMESTEP_SCALE) _timestep_scale = std::max(_timestep_scale * 0.5f, MIN_TIMESTEP_SCALE);
+	else if (_snapshots_count > 1) {
+		_newest_snapshot = (_newest_snapshot + (unsigned int) _snapshots.size() - 1) % _snapshots.size();
+		--_snapshots_count;
+	}
+	load_state(_snapshots[_newest_snapshot]);
+	_lost_time += _advanced_time - _snapshots_times[_newest_snapshot];
+	_advanced_time = _snapshots_times[_newest_snapshot];
+	_steps_since_snapshot = 0;
+	++_rollbacks_count;
+	return false;
+}
+
+
+bool SimulationBackend::_is_sort_due()
+{
+	if (sort_interval == 0) return false;
+	if (++_steps_since_sort < sort_interval) return false;
+	_steps_since_sort = 0;
+	return true;
+}
+
+
+float SimulationBackend::get_timestep() const { return _timestep; }
+
+float SimulationBackend::get_fixed_timestep() const { return _fixed_timestep; }
+
+void SimulationBackend::set_fixed_timestep(const float timestep)
+{
+	_fixed_timestep = timestep;
+	if (!adaptive_timestep) _set_timestep(_fixed_timestep * _timestep_scale);
+}
+
+float SimulationBackend::get_stable_timestep() const
+{
+	// Grid spacing is always 1, so speeds are in cells per second. Pressure waves travel at the speed of sound at rest density, sqrt(dp/d(density)) of the equation of state.
+	const float sound_speed = std::sqrt(std::max(particles_material.EOS_stiffness * particles_material.EOS_power / particles_material.rest_density, 0.0f));
+	float timestep = cfl_number / std::max(_get_max_particle_speed() + sound_speed, 1e-6f);
+	// Explicit viscosity is stable while it diffuses less than a cell per step: dt < dx^2 / (2 * 3 * kinematic viscosity)
+	if (particles_material.dynamic_viscosity > 0.0f) timestep = std::min(timestep, particles_material.rest_density / (6.0f * particles_material.dynamic_viscosity));
+	return std::clamp(timestep, min_timestep, max_timestep);
+}
+
+glm::uvec3 SimulationBackend::get_grid_size() const { return _grid_size; }
+
+void SimulationBackend::set_grid_size(glm::uvec3 size)
+{
+	_grid_size = size;
+	// Enforce minimum grid size
+	if (_grid_size.x < MIN_GRID_SIZE) _grid_size.x = MIN_GRID_SIZE;
+	if (_grid_size.y < MIN_GRID_SIZE) _grid_size.y = MIN_GRID_SIZE;
+	if (_grid_size.z < MIN_GRID_SIZE) _grid_size.z = MIN_GRID_SIZE;
+	// Enforce maximum grid size
+	if (_grid_size.x > MAX_GRID_SIZE) _grid_size.x = MAX_GRID_SIZE;
+	if (_grid_size.y > MAX_GRID_SIZE) _grid_size.y = MAX_GRID_SIZE;
+	if (_grid_size.z > MAX_GRID_SIZE) _grid_size.z = MAX_GRID_SIZE;
+
+	_on_grid_size_change();
+
+	if (spawn_position.x > _grid_size.x - 20.0f) spawn_position.x = _grid_size.x - 20.0f;
+	if (spawn_position.y > _grid_size.y - 20.0f) spawn_position.y = _grid_size.y - 20.0f;
+	if (spawn_position.z > _grid_size.z - 20.0f) spawn_position.z = _grid_size.z - 20.0f;
+
+	// Update water level estimate
+	_estimate_water_level();
+}
+
+float SimulationBackend::get_estimated_water_level() const { return _water_level; }
+
+unsigned long long SimulationBackend::get_steps_count() const { return _steps_count; }
+
+unsigned int SimulationBackend::get_rollbacks_count() const { return _rollbacks_count; }
+
+unsigned long long SimulationBackend::get_advanced_steps_count() const { return _advanced_steps_count; }
+
+double SimulationBackend::get_lost_time() const { return _lost_time; }
+
+float SimulationBackend::get_timestep_scale() const { return _timestep_scale; }
+
+unsigned int SimulationBackend::get_cells_count() const { return _grid_size.x * _grid_size.y * _grid_size.z; }
+
+unsigned int SimulationBackend::get_grid_blocks_count() const { return _grid_blocks_count; }
+
+unsigned int SimulationBackend::get_particles_count() const { return _particles_count; }
+
+unsigned int SimulationBackend::get_particles_max() const { return MAX_PARTICLES_NUM; }
+
+bool SimulationBackend::can_spawn_particles() const { return _particles_count + PARTICLES_SPAWN_NUM <= MAX_PARTICLES_NUM; }
+
+unsigned int SimulationBackend::get_whitewater_count() const { return _whitewater_count; }
+
+unsigned int SimulationBackend::get_whitewater_max() const { return MAX_WHITEWATER_NUM; }
+
+void SimulationBackend::set_stage_profiling(const bool enabled)
+{
+	_stage_profiling = enabled;
+	_clear_stage_times();
+}
+
+bool SimulationBackend::get_stage_profiling() const { return _stage_profiling; }
+
+float SimulationBackend::get_stage_time(const STEP_STAGE stage) const { return _stage_times[stage]; }
+
+INTERPOLATION_KERNEL SimulationBackend::get_interpolation_kernel() const { return _interpolation_kernel; }
+
+void SimulationBackend::set_interpolation_kernel(const INTERPOLATION_KERNEL kernel)
+{
+	if (kernel == _interpolation_kernel) return;
+	_interpolation_kernel = kernel;
+	_on_transfer_policies_change();
+}
+
+TRANSFER_SCHEME SimulationBackend::get_transfer_scheme() const { return _transfer_scheme; }
+
+void SimulationBackend::set_transfer_scheme(const TRANSFER_SCHEME scheme)
+{
+	if (scheme == _transfer_scheme) return;
+	_transfer_scheme = scheme;
+	_on_transfer_policies_change();
+}
+
+
+float SimulationBackend::advance(const float duration)
+{
+	float advanced = 0.0f;
+	if (!adaptive_timestep) {
+		_set_timestep(_fixed_timestep * _timestep_scale);
+		while (advanced + _timestep <= duration) {
+			step();
+			++_advanced_steps_count;
+			_advanced_time += _timestep;
+			advanced += _timestep;
+			if (!_check_health()) _set_timestep(_fixed_timestep * _timestep_scale);
+		}
+		return advanced;
+	}
+
+	while (duration - advanced >= min_timestep) {
+		const float remaining = duration - advanced;
+		float timestep = get_stable_timestep() * _timestep_scale;
+		// End exactly at duration: take the remainder if stable, and split it in two equal steps rather than leaving a sliver for the last one
+		if (remaining <= timestep) timestep = remaining;
+		else if (remaining < 2.0f * timestep) timestep = remaining / 2.0f;
+		_set_timestep(timestep);
+		step();
+		++_advanced_steps_count;
+		_advanced_time += timestep;
+		advanced += timestep;
+		_check_health();
+	}
+	return advanced;
+}
+
+
+void SimulationBackend::save_state(SimulationState& state) const
+{
+	state.grid_size = _grid_size;
+	state.interpolation_kernel = _interpolation_kernel;
+	state.transfer_scheme = _transfer_scheme;
+	state.timestep = _timestep;
+	state.steps_count = _steps_count;
+	state.steps_since_sort = _steps_since_sort;
+	state.particles_count = _particles_count;
+	state.whitewater_count = _whitewater_count;
+	_save_buffers(state);
+}
+
+
+void SimulationBackend::load_state(const SimulationState& state)
+{
+	if (state.grid_size != _grid_size) set_grid_size(state.grid_size);
+	set_interpolation_kernel(state.interpolation_kernel);
+	set_transfer_scheme(state.transfer_scheme);
+	_set_timestep(state.timestep);
+	_steps_count = state.steps_count;
+	_steps_since_sort = state.steps_since_sort;
+	_particles_count = std::min(state.particles_count, get_particles_max());
+	_whitewater_count = std::min(state.whitewater_count, get_whitewater_max());
+	_load_buffers(state);
+	_estimate_water_level();
+}
+
+
+void SimulationBackend::discard_snapshots()
+{
+	_snapshots_count = 0;
+	_steps_since_health_check = 0;
+	_steps_since_snapshot = 0;
+	_timestep_scale = 1.0f;
+}
+
+std::unique_ptr<SimulationBackend> create_simulation(
+	const SIMULATION_BACKEND backend,
+	glm::uvec3 grid_size,
+	const ParticleMaterial& particles_material,
+	const float timestep,
+	const float boundary,
+	const float boundary_elasticity,
+	const glm::vec3 gravity,
+	const unsigned int threads_count)
+{
+	switch (backend) {
+		case SIMULATION_BACKEND::CPU:
+			return std::make_unique<MPMSimulationCPU>(grid_size, particles_material, timestep, boundary, boundary_elasticity, gravity, threads_count);
+		case SIMULATION_BACKEND::CUDA:
+		default:
+			return std::make_unique<MPMSimulation>(grid_size, particles_material, timestep, boundary, boundary_elasticity, gravity);
+	}
+}
+
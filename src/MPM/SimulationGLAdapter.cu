@@ -0,0 +1,352 @@
+#include <MPM/SimulationGLAdapter.cuh>
+#include <utils/CudaCheck.cuh>
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+
+SimulationGLAdapter::SimulationGLAdapter(const SimulationBackend& sim)
+	:
+	_cells_VAO(0),
+	_cells_VBO(0),
+	_cells_capacity(0),
+	_cells(nullptr),
+	_particles_positions(nullptr),
+	_particles_velocities(nullptr),
+	_whitewater_positions(nullptr),
+	_whitewater_types(nullptr),
+	_whitewater_lifetimes(nullptr),
+	_stream_buffer(0),
+	_stream_data(nullptr),
+	_stream_particles_capacity(0),
+	_stream_whitewater_capacity(0),
+	_stream_region(0),
+	_stream_fences{},
+	_streaming(false),
+	_particles_count(0),
+	_whitewater_count(0),
+	_cells_count(0)
+{
+	// Initialize particles data structures
+	glGenVertexArrays(1, &_particles_VAO);
+	glBindVertexArray(_particles_VAO);
+
+	// Used in instanced quad rendering, not in simulation
+	glGenBuffers(1, &_quad_VBO);
+	glBindBuffer(GL_ARRAY_BUFFER, _quad_VBO);
+	glBufferData(GL_ARRAY_BUFFER, 6 * sizeof(glm::vec2), &_quad_vertices[0], GL_STATIC_DRAW);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, (void*) 0);
+	glEnableVertexAttribArray(0);
+
+	glGenBuffers(1, &_particles_positions_VBO);
+	glBindBuffer(GL_ARRAY_BUFFER, _particles_positions_VBO);
+	glBufferData(GL_ARRAY_BUFFER, sim.get_particles_max() * sizeof(glm::vec3), NULL, GL_DYNAMIC_DRAW);
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*) 0);
+	glVertexAttribDivisor(1, 1);	// For instanced drawing
+	glEnableVertexAttribArray(1);
+
+	glGenBuffers(1, &_particles_velocities_VBO);
+	glBindBuffer(GL_ARRAY_BUFFER, _particles_velocities_VBO);
+	glBufferData(GL_ARRAY_BUFFER, sim.get_particles_max() * sizeof(glm::vec3), NULL, GL_DYNAMIC_DRAW);
+	glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*) 0);
+	glVertexAttribDivisor(2, 1);	// For instanced drawing
+	glEnableVertexAttribArray(2);
+
+	// Initialize whitewater data structures. Unlike the CUDA backend buffers, these only hold the active whitewater, starting from index 0.
+	glGenVertexArrays(1, &_whitewater_VAO);
+	glBindVertexArray(_whitewater_VAO);
+
+	// Used in instanced quad rendering, not in simulation. Already initialized for particles, only needs binding.
+	glBindBuffer(GL_ARRAY_BUFFER, _quad_VBO);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, (void*) 0);
+	glEnableVertexAttribArray(0);
+
+	glGenBuffers(1, &_whitewater_positions_VBO);
+	glBindBuffer(GL_ARRAY_BUFFER, _whitewater_positions_VBO);
+	glBufferData(GL_ARRAY_BUFFER, sim.get_whitewater_max() * sizeof(glm::vec3), NULL, GL_DYNAMIC_DRAW);
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*) 0);
+	glVertexAttribDivisor(1, 1);	// For instanced drawing
+	glEnableVertexAttribArray(1);
+
+	glGenBuffers(1, &_whitewater_types_VBO);
+	glBindBuffer(GL_ARRAY_BUFFER, _whitewater_types_VBO);
+	glBufferData(GL_ARRAY_BUFFER, sim.get_whitewater_max() * sizeof(GLubyte), NULL, GL_DYNAMIC_DRAW);
+	glVertexAttribIPointer(2, 1, GL_UNSIGNED_BYTE, sizeof(GLubyte), (void*) 0);
+	glVertexAttribDivisor(2, 1);	// For instanced drawing
+	glEnableVertexAttribArray(2);
+
+	glGenBuffers(1, &_whitewater_lifetimes_VBO);
+	glBindBuffer(GL_ARRAY_BUFFER, _whitewater_lifetimes_VBO);
+	glBufferData(GL_ARRAY_BUFFER, sim.get_whitewater_max() * sizeof(float), NULL, GL_DYNAMIC_DRAW);
+	glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, sizeof(float), (void*) 0);
+	glVertexAttribDivisor(3, 1);	// For instanced drawing
+	glEnableVertexAttribArray(3);
+
+	// Initialize MPM grid cells data structures. Buffers are allocated on first upload_grid(), as the grid is only drawn on request.
+	glGenVertexArrays(1, &_cells_VAO);
+
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+
+SimulationGLAdapter::~SimulationGLAdapter() { cleanup(); }
+
+
+void SimulationGLAdapter::cleanup()
+{
+	if (_particles_VAO == 0) return;	// Already cleaned up, the OpenGL context may be gone
+
+	cudaGraphicsResource** cuda_resources[] = {
+		&_cells,
+		&_particles_positions,
+		&_particles_velocities,
+		&_whitewater_positions,
+		&_whitewater_types,
+		&_whitewater_lifetimes,
+	};
+	for (cudaGraphicsResource** resource : cuda_resources) {
+		if (*resource == nullptr) continue;
+		CUDA_CHECK( cudaGraphicsUnregisterResource(*resource) );
+		CUDA_CHECK( cudaGetLastError() );
+		*resource = nullptr;
+	}
+	_delete_stream_buffer();
+
+	GLuint VBOs[] = {
+		_cells_VBO,
+		_particles_positions_VBO,
+		_particles_velocities_VBO,
+		_whitewater_positions_VBO,
+		_whitewater_types_VBO,
+		_whitewater_lifetimes_VBO,
+		_quad_VBO,
+	};
+	glDeleteBuffers(sizeof(VBOs) / sizeof(*VBOs), VBOs);	// Zeroes are silently ignored
+	GLuint VAOs[] = { _cells_VAO, _particles_VAO, _whitewater_VAO };
+	glDeleteVertexArrays(sizeof(VAOs) / sizeof(*VAOs), VAOs);
+
+	_cells_VAO = _cells_VBO = 0;
+	_particles_VAO = _particles_positions_VBO = _particles_velocities_VBO = 0;
+	_whitewater_VAO = _whitewater_positions_VBO = _whitewater_types_VBO = _whitewater_lifetimes_VBO = 0;
+	_quad_VBO = 0;
+	_cells_capacity = _cells_count = _particles_count = _whitewater_count = 0;
+}
+
+
+void SimulationGLAdapter::_allocate_cells_buffers(const unsigned int cells_count)
+{
+	// Registered buffers must be unregistered before reallocating their storage
+	if (_cells != nullptr) {
+		CUDA_CHECK( cudaGraphicsUnregisterResource(_cells) );
+		CUDA_CHECK( cudaGetLastError() );
+		_cells = nullptr;
+	}
+
+	glBindVertexArray(_cells_VAO);
+
+	// Velocity and mass attributes interleaved in a single buffer, so that cells are uploaded with one contiguous copy
+	if (_cells_VBO == 0) glGenBuffers(1, &_cells_VBO);
+	glBindBuffer(GL_ARRAY_BUFFER, _cells_VBO);
+	glBufferData(GL_ARRAY_BUFFER, cells_count * sizeof(GridCell), NULL, GL_DYNAMIC_DRAW);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(GridCell), (void*) offsetof(GridCell, velocity));
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, sizeof(GridCell), (void*) offsetof(GridCell, mass));
+	glEnableVertexAttribArray(1);
+
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	_cells_capacity = cells_count;
+}
+
+
+void SimulationGLAdapter::_upload(const BufferView& view, const unsigned int element_size, const GLuint VBO, cudaGraphicsResource*& resource)
+{
+	if (view.count == 0 || view.data == nullptr) return;
+
+	if (view.memory_space == HOST) {
+		glBindBuffer(GL_ARRAY_BUFFER, VBO);
+		if (view.stride == element_size) {
+			glBufferSubData(GL_ARRAY_BUFFER, 0, (GLsizeiptr) view.count * element_size, view.data);
+		} else {
+			// Repack padded elements while writing to the mapped buffer
+			char* dst = (char*) glMapBufferRange(GL_ARRAY_BUFFER, 0, (GLsizeiptr) view.count * element_size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+			const char* src = (const char*) view.data;
+			for (unsigned int i = 0; i < view.count; ++i) std::memcpy(&dst[i * element_size], &src[(size_t) i * view.stride], element_size);
+			glUnmapBuffer(GL_ARRAY_BUFFER);
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		return;
+	}
+
+	// Device memory: copy straight into the OpenGL buffer, cudaMemcpy2D drops the padding of aligned types
+	if (resource == nullptr) {
+		CUDA_CHECK( cudaGraphicsGLRegisterBuffer(&resource, VBO, cudaGraphicsRegisterFlagsWriteDiscard) );
+		CUDA_CHECK( cudaGetLastError() );
+	}
+	void* d_buffer;
+	CUDA_CHECK( cudaGraphicsMapResources(1, &resource) );
+	CUDA_CHECK( cudaGetLastError() );
+	CUDA_CHECK( cudaGraphicsResourceGetMappedPointer(&d_buffer, NULL, resource) );
+	CUDA_CHECK( cudaGetLastError() );
+	CUDA_CHECK( cudaMemcpy2D(d_buffer, element_size, view.data, view.stride, element_size, view.count, cudaMemcpyDeviceToDevice) );
+	CUDA_CHECK( cudaGetLastError() );
+	CUDA_CHECK( cudaGraphicsUnmapResources(1, &resource) );
+	CUDA_CHECK( cudaGetLastError() );
+}
+
+
+void SimulationGLAdapter::upload_particles(const SimulationBackend& sim)
+{
+	_unbind_stream_buffer();
+	_particles_count = sim.get_particles_count();
+	_whitewater_count = sim.get_whitewater_count();
+
+	_upload(sim.get_particles_positions(), sizeof(glm::vec3), _particles_positions_VBO, _particles_positions);
+	_upload(sim.get_particles_velocities(), sizeof(glm::vec3), _particles_velocities_VBO, _particles_velocities);
+	_upload(sim.get_whitewater_positions(), sizeof(glm::vec3), _whitewater_positions_VBO, _whitewater_positions);
+	_upload(sim.get_whitewater_types(), sizeof(GLubyte), _whitewater_types_VBO, _whitewater_types);
+	_upload(sim.get_whitewater_lifetimes(), sizeof(float), _whitewater_lifetimes_VBO, _whitewater_lifetimes);
+}
+
+
+size_t SimulationGLAdapter::_get_stream_region_size() const
+{
+	const size_t size = (size_t) _stream_particles_capacity * 2 * sizeof(glm::vec3) + (size_t) _stream_whitewater_capacity * (sizeof(glm::vec3) + sizeof(float) + sizeof(GLubyte));
+	return (size + 255) / 256 * 256;	// Keep every region aligned for vertex fetching
+}
+
+
+void SimulationGLAdapter::_get_stream_offsets(size_t& particles_velocities, size_t& whitewater_positions, size_t& whitewater_lifetimes, size_t& whitewater_types) const
+{
+	// Particles arrays first, whitewater lifetimes before the byte-sized types to keep floats aligned
+	particles_velocities = (size_t) _stream_particles_capacity * sizeof(glm::vec3);
+	whitewater_positions = particles_velocities * 2;
+	whitewater_lifetimes = whitewater_positions + (size_t) _stream_whitewater_capacity * sizeof(glm::vec3);
+	whitewater_types = whitewater_lifetimes + (size_t) _stream_whitewater_capacity * sizeof(float);
+}
+
+
+void SimulationGLAdapter::_allocate_stream_buffer(const unsigned int particles_count, const unsigned int whitewater_count)
+{
+	// Storage is immutable: a larger buffer replaces the old one, which OpenGL keeps alive until the draws using it are done
+	_delete_stream_buffer();
+	// Headroom, so that a growing particles count doesn't reallocate every frame
+	_stream_particles_capacity = std::max(particles_count + particles_count / 4, 1u);
+	_stream_whitewater_capacity = std::max(whitewater_count + whitewater_count / 4, 1u);
+
+	const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	const GLsizeiptr size = (GLsizeiptr) (_get_stream_region_size() * STREAM_REGIONS_NUM);
+	glCreateBuffers(1, &_stream_buffer);
+	glNamedBufferStorage(_stream_buffer, size, NULL, flags);
+	_stream_data = (char*) glMapNamedBufferRange(_stream_buffer, 0, size, flags);
+	if (_stream_data == nullptr) {
+		std::cerr << "ERROR::SIMULATION_GL_ADAPTER::ALLOCATE_STREAM_BUFFER::MAP_FAILED: " << size << " bytes" << std::endl;
+		_delete_stream_buffer();
+	}
+}
+
+
+void SimulationGLAdapter::_delete_stream_buffer()
+{
+	_unbind_stream_buffer();
+	for (GLsync& fence : _stream_fences) {
+		if (fence != 0) glDeleteSync(fence);
+		fence = 0;
+	}
+	if (_stream_buffer != 0) {
+		if (_stream_data != nullptr) glUnmapNamedBuffer(_stream_buffer);
+		glDeleteBuffers(1, &_stream_buffer);
+	}
+	_stream_buffer = 0;
+	_stream_data = nullptr;
+	_stream_particles_capacity = _stream_whitewater_capacity = 0;
+	_stream_region = 0;
+}
+
+
+void SimulationGLAdapter::_unbind_stream_buffer()
+{
+	if (!_streaming) return;
+	// The current region was drawn from until now
+	if (_stream_fences[_stream_region] == 0) _stream_fences[_stream_region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+	glVertexArrayVertexBuffer(_particles_VAO, 1, _particles_positions_VBO, 0, sizeof(glm::vec3));
+	glVertexArrayVertexBuffer(_particles_VAO, 2, _particles_velocities_VBO, 0, sizeof(glm::vec3));
+	glVertexArrayVertexBuffer(_whitewater_VAO, 1, _whitewater_positions_VBO, 0, sizeof(glm::vec3));
+	glVertexArrayVertexBuffer(_whitewater_VAO, 2, _whitewater_types_VBO, 0, sizeof(GLubyte));
+	glVertexArrayVertexBuffer(_whitewater_VAO, 3, _whitewater_lifetimes_VBO, 0, sizeof(float));
+	_streaming = false;
+}
+
+
+void SimulationGLAdapter::upload_particles(const ParticleCacheFrame& frame)
+{
+	const unsigned int particles_count = (unsigned int) frame.particles_positions.size();
+	const unsigned int whitewater_count = (unsigned int) frame.whitewater_positions.size();
+	if (_stream_data == nullptr || particles_count > _stream_particles_capacity || whitewater_count > _stream_whitewater_capacity) {
+		_allocate_stream_buffer(particles_count, whitewater_count);
+		if (_stream_data == nullptr) {
+			_particles_count = _whitewater_count = 0;
+			return;
+		}
+	}
+	else {
+		// Draws issued since the last upload read the current region: fence it and move on to the next one
+		if (_stream_fences[_stream_region] == 0) _stream_fences[_stream_region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		_stream_region = (_stream_region + 1) % STREAM_REGIONS_NUM;
+	}
+
+	// Only blocks if the GPU is STREAM_REGIONS_NUM frames behind
+	GLsync& fence = _stream_fences[_stream_region];
+	if (fence != 0) {
+		GLbitfield wait_flags = GL_SYNC_FLUSH_COMMANDS_BIT;
+		while (glClientWaitSync(fence, wait_flags, 1000000) == GL_TIMEOUT_EXPIRED) wait_flags = 0;
+		glDeleteSync(fence);
+		fence = 0;
+	}
+
+	size_t velocities_offset, whitewater_positions_offset, whitewater_lifetimes_offset, whitewater_types_offset;
+	_get_stream_offsets(velocities_offset, whitewater_positions_offset, whitewater_lifetimes_offset, whitewater_types_offset);
+	const size_t region_offset = _stream_region * _get_stream_region_size();
+	char* region = &_stream_data[region_offset];
+	std::copy(frame.particles_positions.begin(), frame.particles_positions.end(), (glm::vec3*) region);
+	std::copy(frame.particles_velocities.begin(), frame.particles_velocities.begin() + particles_count, (glm::vec3*) &region[velocities_offset]);
+	std::copy(frame.whitewater_positions.begin(), frame.whitewater_positions.end(), (glm::vec3*) &region[whitewater_positions_offset]);
+	std::copy(frame.whitewater_lifetimes.begin(), frame.whitewater_lifetimes.begin() + whitewater_count, (float*) &region[whitewater_lifetimes_offset]);
+	std::copy(frame.whitewater_types.begin(), frame.whitewater_types.begin() + whitewater_count, (GLubyte*) &region[whitewater_types_offset]);
+
+	// Attributes set with glVertexAttribPointer use the binding of their own index
+	glVertexArrayVertexBuffer(_particles_VAO, 1, _stream_buffer, (GLintptr) region_offset, sizeof(glm::vec3));
+	glVertexArrayVertexBuffer(_particles_VAO, 2, _stream_buffer, (GLintptr) (region_offset + velocities_offset), sizeof(glm::vec3));
+	glVertexArrayVertexBuffer(_whitewater_VAO, 1, _stream_buffer, (GLintptr) (region_offset + whitewater_positions_offset), sizeof(glm::vec3));
+	glVertexArrayVertexBuffer(_whitewater_VAO, 2, _stream_buffer, (GLintptr) (region_offset + whitewater_types_offset), sizeof(GLubyte));
+	glVertexArrayVertexBuffer(_whitewater_VAO, 3, _stream_buffer, (GLintptr) (region_offset + whitewater_lifetimes_offset), sizeof(float));
+	_streaming = true;
+	_particles_count = particles_count;
+	_whitewater_count = whitewater_count;
+}
+
+
+void SimulationGLAdapter::upload_grid(const SimulationBackend& sim)
+{
+	// Empty for grids too large for a dense copy: nothing is drawn then
+	const BufferView cells = sim.get_cells();
+	_cells_count = cells.count;
+	if (_cells_count > _cells_capacity) _allocate_cells_buffers(_cells_count);
+
+	_upload(cells, sizeof(GridCell), _cells_VBO, _cells);
+}
+
+
+GLuint SimulationGLAdapter::get_particles_VAO() const { return _particles_VAO; }
+
+unsigned int SimulationGLAdapter::get_particles_count() const { return _particles_count; }
+
+GLuint SimulationGLAdapter::get_whitewater_VAO() const { return _whitewater_VAO; }
+
+unsigned int SimulationGLAdapter::get_whitewater_count() const { return _whitewater_count; }
+
+GLuint SimulationGLAdapter::get_cells_VAO() const { return _cells_VAO; }
+
+unsigned int SimulationGLAdapter::get_cells_count() const { return _cells_count; }
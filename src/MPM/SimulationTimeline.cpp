@@ -0,0 +1,463 @@
+#include <MPM/SimulationTimeline.hpp>
+#include <utils/BitPacking.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <type_traits>
+
+namespace
+{
+	const unsigned int FLOAT_MANTISSA_BITS = 23;
+
+	// Starts a record, followed by the end offsets of its blocks (uint64_t, from the first block), then the blocks
+	struct TimelineRecordHeader
+	{
+		uint64_t steps_count;
+		uint32_t grid_size[3];
+		uint32_t interpolation_kernel;
+		uint32_t transfer_scheme;
+		float timestep;
+		uint32_t steps_since_sort;
+		uint32_t particles_count;
+		uint32_t random_state_size;
+		uint32_t whitewater_count;
+		uint32_t is_keyframe;
+		uint32_t dropped_bits;
+		uint32_t blocks_count;
+		uint32_t padding;
+	};
+	static_assert(std::is_trivially_copyable_v<TimelineRecordHeader>);
+
+	// An array of a state: elements of components values, each a 32-bit word (floats, as their bits) or a byte
+	struct Stream
+	{
+		unsigned char* data;
+		size_t elements_count;
+		unsigned int components;
+		unsigned int value_size;
+		const unsigned char* reference;	// Same layout, null for none
+		size_t reference_elements_count;
+		unsigned int dropped_bits;		// Low mantissa bits of floats rounded off
+	};
+
+	// Encoded independently of the other blocks
+	struct Block
+	{
+		unsigned int stream_idx;
+		size_t begin;	// Elements
+		size_t end;
+	};
+
+	// Resizes the arrays of state to its counts, and lists them, against reference if not null
+	void get_streams(SimulationState& state, const SimulationState* reference, const unsigned int dropped_bits, std::vector<Stream>& streams)
+	{
+		state.particles_positions.resize(state.particles_count);
+		state.particles_velocities.resize(state.particles_count);
+		state.particles_velocity_gradients.resize(state.particles_count);
+		state.particles_random_states.resize((size_t) state.particles_count * state.random_state_size);
+		state.whitewater_positions.resize(state.whitewater_count);
+		state.whitewater_velocities.resize(state.whitewater_count);
+		state.whitewater_types.resize(state.whitewater_count);
+		state.whitewater_lifetimes.resize(state.whitewater_count);
+
+		const bool same_random_states = reference != nullptr && reference->random_state_size == state.random_state_size;
+		streams = {
+			{ (unsigned char*) state.particles_positions.data(), state.particles_count, 3, 4,
+				reference ? (const unsigned char*) reference->particles_positions.data() : nullptr, reference ? reference->particles_count : 0, dropped_bits },
+			{ (unsigned char*) state.particles_velocities.data(), state.particles_count, 3, 4,
+				reference ? (const unsigned char*) reference->particles_velocities.data() : nullptr, reference ? reference->particles_count : 0, dropped_bits },
+			{ (unsigned char*) state.particles_velocity_gradients.data(), state.particles_count, 9, 4,
+				reference ? (const unsigned char*) reference->particles_velocity_gradients.data() : nullptr, reference ? reference->particles_count : 0, dropped_bits },
+			{ state.particles_random_states.data(), state.random_state_size > 0 ? state.particles_count : 0, state.random_state_size, 1,
+				same_random_states ? reference->particles_random_states.data() : nullptr, same_random_states ? reference->particles_count : 0, 0 },
+			{ (unsigned char*) state.whitewater_positions.data(), state.whitewater_count, 3, 4, nullptr, 0, dropped_bits },
+			{ (unsigned char*) state.whitewater_velocities.data(), state.whitewater_count, 3, 4, nullptr, 0, dropped_bits },
+			{ state.whitewater_types.data(), state.whitewater_count, 1, 1, nullptr, 0, 0 },
+			{ (unsigned char*) state.whitewater_lifetimes.data(), state.whitewater_count, 1, 4, nullptr, 0, dropped_bits },
+		};
+		static_assert(sizeof(glm::vec3) == 3 * sizeof(float) && sizeof(glm::mat3) == 9 * sizeof(float), "State arrays must be tightly packed floats");
+	}
+
+	void get_blocks(const std::vector<Stream>& streams, std::vector<Block>& blocks)
+	{
+		blocks.clear();
+		for (unsigned int stream_idx = 0; stream_idx < streams.size(); ++stream_idx)
+			for (size_t begin = 0; begin < streams[stream_idx].elements_count; begin += TIMELINE_BLOCK_ELEMENTS)
+				blocks.push_back({ stream_idx, begin, std::min(begin + TIMELINE_BLOCK_ELEMENTS, streams[stream_idx].elements_count) });
+	}
+
+	// Value idx of stream data, without its dropped bits, rounded to nearest. The rounding carries into the exponent as it should.
+	// Idempotent, so that original and decoded values give the same predictions.
+	uint32_t get_value(const Stream& stream, const unsigned char* data, const size_t idx)
+	{
+		if (stream.value_size == 1) return data[idx];
+		uint32_t value;
+		std::memcpy(&value, &data[idx * sizeof(value)], sizeof(value));
+		if (stream.dropped_bits == 0) return value;
+		return (uint32_t) (((uint64_t) value + (1u << (stream.dropped_bits - 1))) >> stream.dropped_bits);
+	}
+
+	void set_value(const Stream& stream, const size_t idx, const uint32_t value)
+	{
+		if (stream.value_size == 1) stream.data[idx] = (unsigned char) value;
+		else {
+			const uint32_t bits = value << stream.dropped_bits;
+			std::memcpy(&stream.data[idx * sizeof(bits)], &bits, sizeof(bits));
+		}
+	}
+
+	// Prediction of value idx of stream, whose previous values of the block are already known: the same value in the reference, or else of the previous element
+	uint32_t predict(const Stream& stream, const unsigned char* data, const size_t block_begin, const size_t idx)
+	{
+		const size_t element_idx = idx / stream.components;
+		if (stream.reference != nullptr && element_idx < stream.reference_elements_count) return get_value(stream, stream.reference, idx);
+		return element_idx > block_begin ? get_value(stream, data, idx - stream.components) : 0;
+	}
+
+	// Differences wrap around at the value size, so that bytes take 8 bits at most
+	uint32_t encode_difference(const Stream& stream, const uint32_t value, const uint32_t prediction)
+	{
+		if (stream.value_size == 1) return zigzag_encode((int8_t) (uint8_t) (value - prediction)) & 0xFF;
+		return zigzag_encode((int32_t) (value - prediction));
+	}
+
+	uint32_t decode_difference(const Stream& stream, const uint32_t difference, const uint32_t prediction)
+	{
+		const uint32_t value = prediction + (uint32_t) zigzag_decode(difference);
+		return stream.value_size == 1 ? value & 0xFF : value;
+	}
+
+	// Per-thread buffer of differences
+	std::vector<uint32_t>& get_values_scratch(const size_t count)
+	{
+		thread_local std::vector<uint32_t> scratch;
+		if (scratch.size() < count) scratch.resize(count);
+		return scratch;
+	}
+
+	void encode_block(const Stream& stream, const Block& block, std::vector<unsigned char>& bytes)
+	{
+		const size_t begin = block.begin * stream.components;
+		const size_t end = block.end * stream.components;
+		std::vector<uint32_t>& values = get_values_scratch(end - begin);
+		for (size_t i = begin; i < end; ++i)
+			values[i - begin] = encode_difference(stream, get_value(stream, stream.data, i), predict(stream, stream.data, block.begin, i));
+		pack_values(values.data(), end - begin, bytes);
+	}
+
+	bool decode_block(const unsigned char* bytes, const unsigned char* const bytes_end, const Stream& stream, const Block& block)
+	{
+		const size_t begin = block.begin * stream.components;
+		const size_t end = block.end * stream.components;
+		std::vector<uint32_t>& values = get_values_scratch(end - begin);
+		if (!unpack_values(bytes, bytes_end, values.data(), end - begin)) return false;
+		for (size_t i = begin; i < end; ++i)
+			set_value(stream, i, decode_difference(stream, values[i - begin], predict(stream, stream.data, block.begin, i)));
+		return true;
+	}
+}
+
+
+SimulationTimeline::SimulationTimeline(const unsigned int threads_count) : _thread_pool(threads_count)
+{
+	_encoder = std::thread(&SimulationTimeline::_encoder_loop, this);
+}
+
+
+SimulationTimeline::~SimulationTimeline()
+{
+	{
+		std::lock_guard<std::mutex> lock (_mutex);
+		_closing = true;
+		_queue.clear();	// Not worth encoding anymore
+	}
+	_queue_cv.notify_one();
+	_encoder.join();
+}
+
+
+void SimulationTimeline::clear()
+{
+	std::unique_lock<std::mutex> lock (_mutex);
+	_wait_idle(lock);
+	_segments.clear();
+	_size = 0;
+	_last_record_step = 0;
+	_recording = false;
+}
+
+
+void SimulationTimeline::_encode(SimulationState& state, const SimulationState* reference, std::vector<unsigned char>& data)
+{
+	const unsigned int dropped_bits = FLOAT_MANTISSA_BITS - std::clamp(mantissa_bits, 1u, FLOAT_MANTISSA_BITS);
+	std::vector<Stream> streams;
+	std::vector<Block> blocks;
+	get_streams(state, reference, dropped_bits, streams);
+	get_blocks(streams, blocks);
+	if (_blocks.size() < blocks.size()) _blocks.resize(blocks.size());
+
+	_thread_pool.parallel_for(0, (unsigned int) blocks.size(), [this, &streams, &blocks](unsigned int begin, unsigned int end, unsigned int) {
+		for (unsigned int block_idx = begin; block_idx < end; ++block_idx) {
+			_blocks[block_idx].clear();
+			encode_block(streams[blocks[block_idx].stream_idx], blocks[block_idx], _blocks[block_idx]);
+		}
+	}, 1);
+
+	TimelineRecordHeader header = {};
+	header.steps_count = state.steps_count;
+	for (int axis = 0; axis < 3; ++axis) header.grid_size[axis] = state.grid_size[axis];
+	header.interpolation_kernel = state.interpolation_kernel;
+	header.transfer_scheme = state.transfer_scheme;
+	header.timestep = state.timestep;
+	header.steps_since_sort = state.steps_since_sort;
+	header.particles_count = state.particles_count;
+	header.random_state_size = state.random_state_size;
+	header.whitewater_count = state.whitewater_count;
+	header.is_keyframe = reference == nullptr;
+	header.dropped_bits = dropped_bits;
+	header.blocks_count = (uint32_t) blocks.size();
+
+	const size_t blocks_start = sizeof(header) + blocks.size() * sizeof(uint64_t);
+	size_t size = blocks_start;
+	for (size_t block_idx = 0; block_idx < blocks.size(); ++block_idx) size += _blocks[block_idx].size();
+	data.resize(size);
+	std::memcpy(data.data(), &header, sizeof(header));
+	uint64_t block_end = 0;
+	for (size_t block_idx = 0; block_idx < blocks.size(); ++block_idx) {
+		std::memcpy(&data[blocks_start + block_end], _blocks[block_idx].data(), _blocks[block_idx].size());
+		block_end += _blocks[block_idx].size();
+		std::memcpy(&data[sizeof(header) + block_idx * sizeof(uint64_t)], &block_end, sizeof(block_end));
+	}
+}
+
+
+bool SimulationTimeline::_decode(const std::vector<unsigned char>& data, const SimulationState* reference, SimulationState& state)
+{
+	TimelineRecordHeader header;
+	if (data.size() < sizeof(header)) return false;
+	std::memcpy(&header, data.data(), sizeof(header));
+	if ((!header.is_keyframe && reference == nullptr) || header.dropped_bits >= FLOAT_MANTISSA_BITS) return false;
+
+	state.grid_size = glm::uvec3(header.grid_size[0], header.grid_size[1], header.grid_size[2]);
+	state.interpolation_kernel = (INTERPOLATION_KERNEL) header.interpolation_kernel;
+	state.transfer_scheme = (TRANSFER_SCHEME) header.transfer_scheme;
+	state.timestep = header.timestep;
+	state.steps_count = header.steps_count;
+	state.steps_since_sort = header.steps_since_sort;
+	state.particles_count = header.particles_count;
+	state.random_state_size = header.random_state_size;
+	state.whitewater_count = header.whitewater_count;
+
+	std::vector<Stream> streams;
+	std::vector<Block> blocks;
+	get_streams(state, header.is_keyframe ? nullptr : reference, header.dropped_bits, streams);
+	get_blocks(streams, blocks);
+	const size_t blocks_start = sizeof(header) + blocks.size() * sizeof(uint64_t);
+	if (header.blocks_count != blocks.size() || blocks_start > data.size()) return false;
+
+	std::vector<uint64_t> block_ends (blocks.size());
+	std::memcpy(block_ends.data(), &data[sizeof(header)], blocks.size() * sizeof(uint64_t));
+	std::atomic<bool> valid = true;
+	_thread_pool.parallel_for(0, (unsigned int) blocks.size(), [&](unsigned int begin, unsigned int end, unsigned int) {
+		for (unsigned int block_idx = begin; block_idx < end; ++block_idx) {
+			const uint64_t block_begin = block_idx > 0 ? block_ends[block_idx - 1] : 0;
+			if (block_begin > block_ends[block_idx] || block_ends[block_idx] > data.size() - blocks_start
+				|| !decode_block(&data[blocks_start + block_begin], &data[blocks_start + block_ends[block_idx]], streams[blocks[block_idx].stream_idx], blocks[block_idx]))
+				valid = false;
+		}
+	}, 1);
+	return valid;
+}
+
+
+void SimulationTimeline::_truncate(const unsigned long long step)
+{
+	while (!_segments.empty()) {
+		Segment& segment = _segments.back();
+		if (segment.keyframe.step >= step) {
+			_size -= segment.size;
+			_segments.pop_back();
+			_recording = false;	// Its keyframe was the reference of the next records
+			continue;
+		}
+		while (!segment.deltas.empty() && segment.deltas.back().step >= step) {
+			segment.size -= segment.deltas.back().data.size();
+			_size -= segment.deltas.back().data.size();
+			segment.deltas.pop_back();
+		}
+		break;
+	}
+	_last_record_step = _segments.empty() ? 0 : (_segments.back().deltas.empty() ? _segments.back().keyframe.step : _segments.back().deltas.back().step);
+}
+
+
+void SimulationTimeline::_evict()
+{
+	while (_size > memory_budget && _segments.size() > 1) {
+		// The last segment is being recorded
+		const auto oldest = std::min_element(_segments.begin(), _segments.end() - 1, [](const Segment& a, const Segment& b) { return a.last_use < b.last_use; });
+		_size -= oldest->size;
+		_segments.erase(oldest);
+	}
+}
+
+
+void SimulationTimeline::_wait_idle(std::unique_lock<std::mutex>& lock)
+{
+	_idle_cv.wait(lock, [this] { return _queue.empty() && !_encoding; });
+}
+
+
+void SimulationTimeline::update(const SimulationBackend& sim)
+{
+	const unsigned long long step = sim.get_steps_count();
+	std::unique_lock<std::mutex> lock (_mutex);
+	bool has_records = !_segments.empty() || !_queue.empty() || _encoding;
+	if (has_records && step <= _last_record_step) {
+		if (step == _last_record_step) return;
+		// Rolled back or reset: the records after step are of another run
+		_wait_idle(lock);
+		_truncate(step);
+		has_records = !_segments.empty();
+	}
+	if (has_records && step - _last_record_step < std::max(record_interval, 1u)) return;
+	// The encoder thread is behind: record at a later call rather than stall the simulation
+	if (_queue.size() >= std::max(max_queued_records, 1u)) return;
+
+	QueuedState queued;
+	if (!_free_states.empty()) {
+		queued.state = std::move(_free_states.back());
+		_free_states.pop_back();
+	}
+	else queued.state = std::make_unique<SimulationState>();
+	queued.step = step;
+	queued.sort_enabled = sim.sort_interval != 0;
+	lock.unlock();
+	sim.save_state(*queued.state);
+	lock.lock();
+	_queue.push_back(std::move(queued));
+	_last_record_step = step;
+	lock.unlock();
+	_queue_cv.notify_one();
+}
+
+
+void SimulationTimeline::_encoder_loop()
+{
+	while (true) {
+		QueuedState queued;
+		bool is_keyframe;
+		{
+			std::unique_lock<std::mutex> lock (_mutex);
+			_queue_cv.wait(lock, [this] { return !_queue.empty() || _closing; });
+			if (_closing) return;
+			queued = std::move(_queue.front());
+			_queue.pop_front();
+			_encoding = true;
+			// A keyframe every keyframe_interval records, and after a sort: it reorders the particles, that records are predicted from by index
+			const SimulationState& state = *queued.state;
+			const bool sorted = queued.sort_enabled && state.steps_since_sort < state.steps_count - _keyframe_state.steps_count;
+			is_keyframe = !_recording || _segments.back().deltas.size() + 1 >= std::max(keyframe_interval, 1u) || sorted;
+		}
+
+		// The calling thread doesn't touch the records, nor the keyframe state, while _encoding
+		_encode(*queued.state, is_keyframe ? nullptr : &_keyframe_state, _data);
+		Record record;
+		record.step = queued.step;
+		record.data.assign(_data.begin(), _data.end());
+
+		{
+			std::lock_guard<std::mutex> lock (_mutex);
+			if (is_keyframe) {
+				_segments.emplace_back();
+				_segments.back().keyframe = std::move(record);
+				std::swap(_keyframe_state, *queued.state);
+				_recording = true;
+			}
+			else _segments.back().deltas.push_back(std::move(record));
+
+			Segment& segment = _segments.back();
+			segment.size += _data.size();
+			segment.last_use = ++_uses;
+			_size += _data.size();
+			_evict();
+			_free_states.push_back(std::move(queued.state));
+			_encoding = false;
+		}
+		_idle_cv.notify_all();
+	}
+}
+
+
+bool SimulationTimeline::rewind(SimulationBackend& sim, const unsigned long long step)
+{
+	std::unique_lock<std::mutex> lock (_mutex);
+	_wait_idle(lock);
+	// Last record at or before step
+	const auto next_segment = std::upper_bound(_segments.begin(), _segments.end(), step, [](const unsigned long long s, const Segment& segment) { return s < segment.keyframe.step; });
+	if (next_segment == _segments.begin()) {
+		std::cerr << "ERROR::SIMULATION_TIMELINE::REWIND::NO_RECORD: at or before step " << step << std::endl;
+		return false;
+	}
+	Segment& segment = *(next_segment - 1);
+	const auto next_delta = std::upper_bound(segment.deltas.begin(), segment.deltas.end(), step, [](const unsigned long long s, const Record& record) { return s < record.step; });
+
+	if (!_decode(segment.keyframe.data, nullptr, _keyframe_state)
+		|| (next_delta != segment.deltas.begin() && !_decode((next_delta - 1)->data, &_keyframe_state, _state))) {
+		std::cerr << "ERROR::SIMULATION_TIMELINE::REWIND::INVALID_RECORD: at or before step " << step << std::endl;
+		_recording = false;
+		return false;
+	}
+	const SimulationState& state = next_delta != segment.deltas.begin() ? _state : _keyframe_state;
+
+	// The simulation branches from the record: later records, and rollback snapshots, are of the discarded run
+	segment.last_use = ++_uses;
+	_truncate(state.steps_count + 1);
+	_recording = true;
+	// The encoder thread stays idle until the next update(), from this thread
+	lock.unlock();
+	sim.load_state(state);
+	sim.discard_snapshots();
+	while (sim.get_steps_count() < step) sim.step();
+	return true;
+}
+
+
+bool SimulationTimeline::is_empty() const
+{
+	std::lock_guard<std::mutex> lock (_mutex);
+	return _segments.empty();
+}
+
+
+unsigned long long SimulationTimeline::get_first_step() const
+{
+	std::lock_guard<std::mutex> lock (_mutex);
+	return _segments.empty() ? 0 : _segments.front().keyframe.step;
+}
+
+
+unsigned long long SimulationTimeline::get_last_step() const
+{
+	std::lock_guard<std::mutex> lock (_mutex);
+	return _segments.empty() ? 0 : _last_record_step;
+}
+
+
+unsigned int SimulationTimeline::get_records_count() const
+{
+	std::lock_guard<std::mutex> lock (_mutex);
+	size_t count = 0;
+	for (const Segment& segment : _segments) count += 1 + segment.deltas.size();
+	return (unsigned int) count;
+}
+
+
+size_t SimulationTimeline::get_size() const
+{
+	std::lock_guard<std::mutex> lock (_mutex);
+	return _size;
+}
@@ -0,0 +1,572 @@
+#include <MPM/SurfaceExtractor.hpp>
+#include <MPM/MPMConstants.hpp>
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+
+namespace
+{
+	const unsigned int MAX_CASE_TRIANGLES = 12;
+	const size_t MESH_WRITE_CHUNK = 1 << 20;	// Bytes formatted before each write
+
+	// Triangles of a cube case, as the edges their vertices are on
+	struct CubeCase
+	{
+		unsigned int triangles_count = 0;
+		unsigned char edges[3 * MAX_CASE_TRIANGLES];
+	};
+
+	/*
+	Cube corners are indexed by the bits of their offset from the cube origin: x | y << 1 | z << 2.
+	Edges are indexed by their axis * 4, plus the offset bits of their start corner along the next two axes.
+	*/
+	unsigned int get_edge(const unsigned int corner_a, const unsigned int corner_b)
+	{
+		const unsigned int start = corner_a & corner_b;
+		const unsigned int axis = (corner_a ^ corner_b) >> 1;	// 1, 2 or 4 to 0, 1 or 2
+		return axis * 4 + ((start >> ((axis + 1) % 3)) & 1) + (((start >> ((axis + 2) % 3)) & 1) << 1);
+	}
+
+	unsigned int get_edge_corner(const unsigned int edge)
+	{
+		const unsigned int axis = edge / 4;
+		return ((edge & 1) << ((axis + 1) % 3)) | (((edge >> 1) & 1) << ((axis + 2) % 3));
+	}
+
+	glm::uvec3 get_corner_offset(const unsigned int corner) { return glm::uvec3(corner & 1, (corner >> 1) & 1, (corner >> 2) & 1); }
+
+	// Whether two edges are on the same cube face
+	bool is_same_face(const unsigned int edge_a, const unsigned int edge_b)
+	{
+		const unsigned int corner_a = get_edge_corner(edge_a), corner_b = get_edge_corner(edge_b);
+		for (unsigned int axis = 0; axis < 3; ++axis) {
+			if (axis != edge_a / 4 && axis != edge_b / 4 && ((corner_a >> axis) & 1) == ((corner_b >> axis) & 1)) return true;
+		}
+		return false;
+	}
+
+	// Triangulate the polygon of loop_size edges in order, splitting it along diagonals that don't lie on a cube face: those would be shared with
+	// the neighbor cube, which may not split the face the same way. Every loop of the 256 cases has such diagonals.
+	void triangulate_loop(const unsigned int* loop, const unsigned int loop_size, CubeCase& cube_case)
+	{
+		if (loop_size == 3) {
+			unsigned char* triangle = &cube_case.edges[3 * cube_case.triangles_count++];
+			for (unsigned int k = 0; k < 3; ++k) triangle[k] = loop[k];
+			return;
+		}
+		for (unsigned int i = 0; i < loop_size; ++i) {
+			for (unsigned int j = i + 2; j < loop_size; ++j) {
+				if ((i == 0 && j == loop_size - 1) || is_same_face(loop[i], loop[j])) continue;
+				unsigned int first[12], second[12];
+				const unsigned int first_size = j - i + 1;
+				const unsigned int second_size = loop_size - first_size + 2;
+				std::copy(&loop[i], &loop[j + 1], first);
+				for (unsigned int k = 0; k < second_size; ++k) second[k] = loop[(j + k) % loop_size];
+				triangulate_loop(first, first_size, cube_case);
+				triangulate_loop(second, second_size, cube_case);
+				return;
+			}
+		}
+	}
+
+	// Triangulation of each cube case, where bit c of the case is set if corner c is inside the fluid
+	std::array<CubeCase, 256> build_cube_cases()
+	{
+		// Corners of each face, counter-clockwise seen from outside the cube: the next two axes of an axis form a right-handed frame with it
+		unsigned int faces[6][4];
+		for (unsigned int axis = 0; axis < 3; ++axis) {
+			const unsigned int a = 1u << axis, u = 1u << ((axis + 1) % 3), v = 1u << ((axis + 2) % 3);
+			const unsigned int upper_face[4] = { a, a | u, a | u | v, a | v };
+			for (unsigned int k = 0; k < 4; ++k) {
+				faces[2 * axis + 1][k] = upper_face[k];
+				faces[2 * axis][k] = upper_face[3 - k] & ~a;
+			}
+		}
+
+		std::array<CubeCase, 256> cases;
+		for (unsigned int mask = 1; mask < 255; ++mask) {
+			// Contour on each face: a segment per run of inside corners, from the edge entering the run to the edge leaving it. A face with two
+			// opposite inside corners thus separates them. Each edge crossed by the surface enters a run on one of its faces and leaves one on the
+			// other, so the segments chain into loops around the cube.
+			int next_edge[12];
+			std::fill(std::begin(next_edge), std::end(next_edge), -1);
+			for (const auto& face : faces) {
+				for (unsigned int k = 0; k < 4; ++k) {
+					const unsigned int previous = face[(k + 3) % 4];
+					if (!((mask >> face[k]) & 1) || ((mask >> previous) & 1)) continue;
+					unsigned int last = k;
+					while ((mask >> face[(last + 1) % 4]) & 1) last = (last + 1) % 4;
+					next_edge[get_edge(previous, face[k])] = get_edge(face[last], face[(last + 1) % 4]);
+				}
+			}
+
+			// Loops go counter-clockwise seen from outside the fluid
+			CubeCase& cube_case = cases[mask];
+			bool visited[12] = {};
+			for (unsigned int first = 0; first < 12; ++first) {
+				if (next_edge[first] < 0 || visited[first]) continue;
+				unsigned int loop[12];
+				unsigned int loop_size = 0;
+				for (int edge = first; !visited[edge]; edge = next_edge[edge]) {
+					visited[edge] = true;
+					loop[loop_size++] = edge;
+				}
+				triangulate_loop(loop, loop_size, cube_case);
+			}
+		}
+		return cases;
+	}
+
+	const std::array<CubeCase, 256>& get_cube_cases()
+	{
+		static const std::array<CubeCase, 256> cases = build_cube_cases();
+		return cases;
+	}
+
+
+	// Appends value and separator to text
+	void append_number(std::string& text, const float value, const char separator)
+	{
+		char buffer[32];
+		const auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+		text.append(buffer, result.ptr);
+		text += separator;
+	}
+
+	void append_number(std::string& text, const uint32_t value, const char* suffix)
+	{
+		char buffer[16];
+		const auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+		text.append(buffer, result.ptr);
+		text += suffix;
+	}
+
+	// Text OBJ: positions, normals, and faces with 1-based indices into both
+	void write_obj(std::ofstream& file, const SurfaceMesh& mesh)
+	{
+		std::string text;
+		text.reserve(MESH_WRITE_CHUNK + 256);
+		const auto flush = [&file, &text](const bool force) {
+			if (!force && text.size() < MESH_WRITE_CHUNK) return;
+			file.write(text.data(), text.size());
+			text.clear();
+		};
+
+		for (const glm::vec3& position : mesh.positions) {
+			text += "v ";
+			append_number(text, position.x, ' ');
+			append_number(text, position.y, ' ');
+			append_number(text, position.z, '\n');
+			flush(false);
+		}
+		for (const glm::vec3& normal : mesh.normals) {
+			text += "vn ";
+			append_number(text, normal.x, ' ');
+			append_number(text, normal.y, ' ');
+			append_number(text, normal.z, '\n');
+			flush(false);
+		}
+		for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3) {
+			text += "f ";
+			for (unsigned int k = 0; k < 3; ++k) {
+				const uint32_t idx = mesh.indices[i + k] + 1;
+				append_number(text, idx, "//");
+				append_number(text, idx, k < 2 ? " " : "\n");
+			}
+			flush(false);
+		}
+		flush(true);
+	}
+
+	// Binary little-endian PLY: interleaved positions and normals, then triangles as lists of 3 indices
+	void write_ply(std::ofstream& file, const SurfaceMesh& mesh)
+	{
+		const size_t triangles_count = mesh.indices.size() / 3;
+		const std::string header = "ply\n"
+			"format binary_little_endian 1.0\n"
+			"element vertex " + std::to_string(mesh.positions.size()) + "\n"
+			"property float x\nproperty float y\nproperty float z\n"
+			"property float nx\nproperty float ny\nproperty float nz\n"
+			"element face " + std::to_string(triangles_count) + "\n"
+			"property list uchar uint vertex_indices\n"
+			"end_header\n";
+		file.write(header.data(), header.size());
+
+		std::vector<unsigned char> bytes;
+		bytes.reserve(MESH_WRITE_CHUNK + 64);
+		const auto append = [&bytes](const void* data, const size_t size) {
+			bytes.insert(bytes.end(), (const unsigned char*) data, (const unsigned char*) data + size);
+		};
+		const auto flush = [&file, &bytes](const bool force) {
+			if (!force && bytes.size() < MESH_WRITE_CHUNK) return;
+			file.write((const char*) bytes.data(), bytes.size());
+			bytes.clear();
+		};
+
+		for (size_t i = 0; i < mesh.positions.size(); ++i) {
+			append(&mesh.positions[i], sizeof(glm::vec3));
+			append(&mesh.normals[i], sizeof(glm::vec3));
+			flush(false);
+		}
+		const unsigned char triangle_size = 3;
+		for (size_t i = 0; i < triangles_count; ++i) {
+			append(&triangle_size, sizeof(triangle_size));
+			append(&mesh.indices[3 * i], 3 * sizeof(uint32_t));
+			flush(false);
+		}
+		flush(true);
+	}
+}
+
+
+SurfaceExtractor::SurfaceExtractor(const unsigned int threads_count)
+:
+	_thread_pool(threads_count),
+	_field_size(0),
+	_field_origin(0.0f),
+	_field_spacing(1.0f),
+	_blocks_size(0),
+	_color_blocks_offsets()
+{ }
+
+
+bool SurfaceExtractor::extract(const SimulationBackend& sim, const SURFACE_FIELD field, SurfaceMesh& mesh)
+{
+	if (field == SURFACE_FIELD_PARTICLES) {
+		const BufferView positions = sim.get_particles_positions();
+		_particles_positions.resize(positions.count);
+		copy_buffer_view(positions, _particles_positions.data(), sizeof(glm::vec3));
+		extract_particles(_particles_positions, sim.get_grid_size(), sim.particles_material, mesh);
+		return true;
+	}
+
+	const BufferView cells = sim.get_cells();
+	if (cells.count == 0) {
+		std::cerr << "ERROR::SURFACE_EXTRACTOR::EXTRACT::GRID_TOO_LARGE: " << sim.get_cells_count() << " cells, at most " << MAX_DENSE_CELLS_NUM << " for the grid mass field" << std::endl;
+		return false;
+	}
+	_cells.resize(cells.count);
+	copy_buffer_view(cells, _cells.data(), sizeof(GridCell));
+	// A sample at each cell center
+	_resize_field(sim.get_grid_size() + 2u, glm::vec3(-0.5f), 1.0f);
+	_fill_field_grid_mass(sim.particles_material.rest_density);
+	_polygonize(mesh);
+	return true;
+}
+
+
+void SurfaceExtractor::extract_particles(const std::vector<glm::vec3>& positions, const glm::uvec3 grid_size, const ParticleMaterial& material, SurfaceMesh& mesh)
+{
+	// Samples from a spacing before the domain to a spacing after it
+	const float spacing = 1.0f / std::max(resolution, 0.125f);
+	_resize_field(glm::uvec3(glm::ceil(glm::vec3(grid_size) / spacing)) + 3u, glm::vec3(-spacing), spacing);
+	_fill_field_particles(positions, material.mass, material.rest_density);
+	_polygonize(mesh);
+}
+
+
+void SurfaceExtractor::_resize_field(const glm::uvec3 size, const glm::vec3 origin, const float spacing)
+{
+	_field_size = size;
+	_field_origin = origin;
+	_field_spacing = spacing;
+	_field.resize((size_t) size.x * size.y * size.z);	// Every sample is written by the fill
+
+	const glm::uvec3 cubes_size = size - 1u;
+	_blocks_size = (cubes_size + SURFACE_BLOCK_SIZE - 1u) / SURFACE_BLOCK_SIZE;
+	_blocks.resize(_blocks_size.x * _blocks_size.y * _blocks_size.z);
+	for (unsigned int x = 0; x < _blocks_size.x; ++x) {
+		for (unsigned int y = 0; y < _blocks_size.y; ++y) {
+			for (unsigned int z = 0; z < _blocks_size.z; ++z) {
+				Block& block = _blocks[_get_block_key(glm::uvec3(x, y, z))];
+				block.origin = glm::uvec3(x, y, z) * SURFACE_BLOCK_SIZE;
+				block.size = glm::min(glm::uvec3(SURFACE_BLOCK_SIZE), cubes_size - block.origin);
+			}
+		}
+	}
+}
+
+
+size_t SurfaceExtractor::_get_sample_idx(const glm::uvec3& sample) const
+{
+	return ((size_t) sample.x * _field_size.y + sample.y) * _field_size.z + sample.z;
+}
+
+
+unsigned int SurfaceExtractor::_get_block_key(const glm::uvec3& block_coords) const
+{
+	return (block_coords.x * _blocks_size.y + block_coords.y) * _blocks_size.z + block_coords.z;
+}
+
+
+unsigned int SurfaceExtractor::_get_sample_block_key(const glm::uvec3& sample) const
+{
+	return _get_block_key(glm::min(sample, _field_size - 2u) / SURFACE_BLOCK_SIZE);
+}
+
+
+glm::uvec3 SurfaceExtractor::_get_owned_samples_end(const Block& block) const
+{
+	glm::uvec3 end = block.origin + block.size;
+	for (unsigned int axis = 0; axis < 3; ++axis) {
+		if (end[axis] == _field_size[axis] - 1) ++end[axis];
+	}
+	return end;
+}
+
+
+void SurfaceExtractor::_fill_field_grid_mass(const float rest_density)
+{
+	const glm::uvec3 grid_size = _field_size - 2u;
+	_thread_pool.parallel_for(0, _field_size.x, [this, grid_size, rest_density](unsigned int begin, unsigned int end, unsigned int) {
+		for (unsigned int x = begin; x < end; ++x) {
+			for (unsigned int y = 0; y < _field_size.y; ++y) {
+				for (unsigned int z = 0; z < _field_size.z; ++z) {
+					const bool is_border = x == 0 || y == 0 || z == 0 || x > grid_size.x || y > grid_size.y || z > grid_size.z;
+					const size_t cell_idx = ((size_t) (x - 1) * grid_size.y + (y - 1)) * grid_size.z + (z - 1);
+					_field[_get_sample_idx(glm::uvec3(x, y, z))] = is_border ? 0.0f : _cells[cell_idx].mass / rest_density;
+				}
+			}
+		}
+	}, 1);
+}
+
+
+void SurfaceExtractor::_fill_field_particles(const std::vector<glm::vec3>& positions, const float particle_mass, const float rest_density)
+{
+	// Poly6 kernel, so that particles at rest density add up to about 1
+	const float radius = std::clamp(smoothing_radius, 0.5f * _field_spacing, 0.5f * SURFACE_BLOCK_SIZE * _field_spacing);
+	const float radius_squared = radius * radius;
+	const float radius_samples = radius / _field_spacing;
+	const float kernel_factor = particle_mass / rest_density * 315.0f / (64.0f * 3.14159265f * std::pow(radius, 9.0f));
+
+	// Bin the particles by block, by a counting sort
+	const auto get_particle_block_key = [this](const glm::vec3& position) {
+		const glm::vec3 sample = glm::floor((position - _field_origin) / _field_spacing);
+		return _get_sample_block_key(glm::uvec3(glm::clamp(sample, glm::vec3(0.0f), glm::vec3(_field_size - 1u))));
+	};
+	_bins.assign(_blocks.size() + 1, 0);
+	for (const glm::vec3& position : positions) ++_bins[get_particle_block_key(position) + 1];
+	for (size_t i = 1; i < _bins.size(); ++i) _bins[i] += _bins[i - 1];
+	_binned_positions.resize(positions.size());
+	for (const glm::vec3& position : positions) _binned_positions[_bins[get_particle_block_key(position)]++] = position;
+	for (size_t i = _bins.size() - 1; i > 0; --i) _bins[i] = _bins[i - 1];	// Back from the ends to the starts of the bins
+	_bins[0] = 0;
+
+	// List non-empty blocks by color
+	const auto get_block_color = [](const Block& block) {
+		const glm::uvec3 block_coords = block.origin / SURFACE_BLOCK_SIZE;
+		return ((block_coords.x & 1) << 2) | ((block_coords.y & 1) << 1) | (block_coords.z & 1);
+	};
+	unsigned int color_offsets[8] = {};
+	for (unsigned int block_key = 0; block_key < _blocks.size(); ++block_key) {
+		if (_bins[block_key + 1] > _bins[block_key]) ++color_offsets[get_block_color(_blocks[block_key])];
+	}
+	_color_blocks_offsets[0] = 0;
+	for (unsigned int color = 0; color < 8; ++color) {
+		_color_blocks_offsets[color + 1] = _color_blocks_offsets[color] + color_offsets[color];
+		color_offsets[color] = _color_blocks_offsets[color];
+	}
+	_color_blocks.resize(_color_blocks_offsets[8]);
+	for (unsigned int block_key = 0; block_key < _blocks.size(); ++block_key) {
+		if (_bins[block_key + 1] > _bins[block_key]) _color_blocks[color_offsets[get_block_color(_blocks[block_key])]++] = block_key;
+	}
+
+	_thread_pool.parallel_for(0, _field_size.x, [this](unsigned int begin, unsigned int end, unsigned int) {
+		std::fill(_field.begin() + _get_sample_idx(glm::uvec3(begin, 0, 0)), _field.begin() + _get_sample_idx(glm::uvec3(end, 0, 0)), 0.0f);
+	}, 1);
+
+	// A block's particles only write within half a block of it, and blocks of a color are 2 blocks apart. The outer layer of samples is left empty.
+	const glm::ivec3 samples_begin (1);
+	const glm::ivec3 samples_end = glm::ivec3(_field_size) - 1;
+	for (unsigned int color = 0; color < 8; ++color) {
+		_thread_pool.parallel_for(_color_blocks_offsets[color], _color_blocks_offsets[color + 1], [&](unsigned int begin, unsigned int end, unsigned int) {
+			for (unsigned int i = begin; i < end; ++i) {
+				const unsigned int block_key = _color_blocks[i];
+				for (uint32_t particle_idx = _bins[block_key]; particle_idx < _bins[block_key + 1]; ++particle_idx) {
+					// Samples within the particle's radius, row by row along z
+					const glm::vec3 particle_sample = (_binned_positions[particle_idx] - _field_origin) / _field_spacing;
+					const glm::ivec3 splat_begin = glm::max(glm::ivec3(glm::ceil(particle_sample - radius_samples)), samples_begin);
+					const glm::ivec3 splat_end = glm::min(glm::ivec3(glm::floor(particle_sample + radius_samples)) + 1, samples_end);
+					for (int x = splat_begin.x; x < splat_end.x; ++x) {
+						const float offset_x = (x - particle_sample.x) * _field_spacing;
+						for (int y = splat_begin.y; y < splat_end.y; ++y) {
+							const float offset_y = (y - particle_sample.y) * _field_spacing;
+							const float row_radius_squared = radius_squared - offset_x * offset_x - offset_y * offset_y;
+							if (row_radius_squared <= 0.0f) continue;
+							const float row_radius_samples = std::sqrt(row_radius_squared) / _field_spacing;
+							const int z_begin = std::max((int) std::ceil(particle_sample.z - row_radius_samples), splat_begin.z);
+							const int z_end = std::min((int) std::floor(particle_sample.z + row_radius_samples) + 1, splat_end.z);
+							float* row = &_field[_get_sample_idx(glm::uvec3(x, y, 0))];
+							for (int z = z_begin; z < z_end; ++z) {
+								const float offset_z = (z - particle_sample.z) * _field_spacing;
+								const float falloff = std::max(row_radius_squared - offset_z * offset_z, 0.0f);
+								row[z] += kernel_factor * falloff * falloff * falloff;
+							}
+						}
+					}
+				}
+			}
+		}, 1);
+	}
+}
+
+
+glm::vec3 SurfaceExtractor::_get_field_gradient(const glm::uvec3& sample) const
+{
+	glm::vec3 gradient;
+	for (unsigned int axis = 0; axis < 3; ++axis) {
+		glm::uvec3 lower = sample, upper = sample;
+		if (lower[axis] > 0) --lower[axis];
+		if (upper[axis] + 1 < _field_size[axis]) ++upper[axis];
+		gradient[axis] = (_field[_get_sample_idx(upper)] - _field[_get_sample_idx(lower)]) / (float) (upper[axis] - lower[axis]);
+	}
+	return gradient;
+}
+
+
+void SurfaceExtractor::_polygonize(SurfaceMesh& mesh)
+{
+	// Pass 1: vertices of the owned edges
+	_thread_pool.parallel_for(0, (unsigned int) _blocks.size(), [this](unsigned int begin, unsigned int end, unsigned int) {
+		for (unsigned int block_key = begin; block_key < end; ++block_key) _compute_block_vertices(_blocks[block_key]);
+	}, 1);
+	uint32_t vertices_count = 0;
+	for (Block& block : _blocks) {
+		block.vertices_offset = vertices_count;
+		vertices_count += (uint32_t) block.positions.size();
+	}
+
+	// Pass 2: triangles, once every block knows where its vertices go in the mesh
+	_thread_pool.parallel_for(0, (unsigned int) _blocks.size(), [this](unsigned int begin, unsigned int end, unsigned int) {
+		for (unsigned int block_key = begin; block_key < end; ++block_key) _compute_block_triangles(_blocks[block_key]);
+	}, 1);
+	size_t indices_count = 0;
+	for (Block& block : _blocks) {
+		block.indices_offset = indices_count;
+		indices_count += block.indices.size();
+	}
+
+	mesh.positions.resize(vertices_count);
+	mesh.normals.resize(vertices_count);
+	mesh.indices.resize(indices_count);
+	_thread_pool.parallel_for(0, (unsigned int) _blocks.size(), [this, &mesh](unsigned int begin, unsigned int end, unsigned int) {
+		for (unsigned int block_key = begin; block_key < end; ++block_key) {
+			const Block& block = _blocks[block_key];
+			std::copy(block.positions.begin(), block.positions.end(), mesh.positions.begin() + block.vertices_offset);
+			std::copy(block.normals.begin(), block.normals.end(), mesh.normals.begin() + block.vertices_offset);
+			std::copy(block.indices.begin(), block.indices.end(), mesh.indices.begin() + block.indices_offset);
+		}
+	}, 1);
+}
+
+
+void SurfaceExtractor::_compute_block_vertices(Block& block)
+{
+	block.positions.clear();
+	block.normals.clear();
+	block.indices.clear();
+
+	// Skip blocks whose cubes are all inside or all outside
+	const glm::uvec3 cubes_end = block.origin + block.size;
+	bool has_inside = false, has_outside = false;
+	for (unsigned int x = block.origin.x; x <= cubes_end.x && !(has_inside && has_outside); ++x) {
+		for (unsigned int y = block.origin.y; y <= cubes_end.y; ++y) {
+			for (unsigned int z = block.origin.z; z <= cubes_end.z; ++z) {
+				if (_field[_get_sample_idx(glm::uvec3(x, y, z))] >= iso_density) has_inside = true;
+				else has_outside = true;
+			}
+		}
+	}
+	block.active = has_inside && has_outside;
+	if (!block.active) {
+		block.edge_vertices.clear();
+		return;
+	}
+
+	const glm::uvec3 table_size = block.size + 1u;
+	block.edge_vertices.assign(3 * (size_t) table_size.x * table_size.y * table_size.z, SURFACE_VERTEX_NONE);
+	const glm::uvec3 samples_end = _get_owned_samples_end(block);
+	for (unsigned int x = block.origin.x; x < samples_end.x; ++x) {
+		for (unsigned int y = block.origin.y; y < samples_end.y; ++y) {
+			for (unsigned int z = block.origin.z; z < samples_end.z; ++z) {
+				const glm::uvec3 sample (x, y, z);
+				const float value = _field[_get_sample_idx(sample)];
+				const glm::uvec3 local = sample - block.origin;
+				for (unsigned int axis = 0; axis < 3; ++axis) {
+					if (sample[axis] + 1 >= _field_size[axis]) continue;
+					glm::uvec3 next_sample = sample;
+					++next_sample[axis];
+					const float next_value = _field[_get_sample_idx(next_sample)];
+					if ((value >= iso_density) == (next_value >= iso_density)) continue;
+
+					// Linear interpolation along the edge. The density decreases out of the fluid, so its gradient points in.
+					const float t = (iso_density - value) / (next_value - value);
+					glm::vec3 position (sample);
+					position[axis] += t;
+					const glm::vec3 gradient = glm::mix(_get_field_gradient(sample), _get_field_gradient(next_sample), t);
+					const float gradient_length = glm::length(gradient);
+					block.edge_vertices[3 * (((size_t) local.x * table_size.y + local.y) * table_size.z + local.z) + axis] = (uint32_t) block.positions.size();
+					block.positions.push_back(_field_origin + position * _field_spacing);
+					block.normals.push_back(gradient_length > 0.0f ? -gradient / gradient_length : glm::vec3(0.0f, 1.0f, 0.0f));
+				}
+			}
+		}
+	}
+}
+
+
+void SurfaceExtractor::_compute_block_triangles(Block& block)
+{
+	if (!block.active) return;
+
+	const std::array<CubeCase, 256>& cube_cases = get_cube_cases();
+	size_t corner_offsets[8];
+	for (unsigned int corner = 0; corner < 8; ++corner) corner_offsets[corner] = _get_sample_idx(get_corner_offset(corner));
+	const glm::uvec3 cubes_end = block.origin + block.size;
+	for (unsigned int x = block.origin.x; x < cubes_end.x; ++x) {
+		for (unsigned int y = block.origin.y; y < cubes_end.y; ++y) {
+			const float* row = &_field[_get_sample_idx(glm::uvec3(x, y, 0))];
+			for (unsigned int z = block.origin.z; z < cubes_end.z; ++z) {
+				unsigned int case_idx = 0;
+				for (unsigned int corner = 0; corner < 8; ++corner) case_idx |= (unsigned int) (row[z + corner_offsets[corner]] >= iso_density) << corner;
+				const CubeCase& cube_case = cube_cases[case_idx];
+				const glm::uvec3 cube (x, y, z);
+				for (unsigned int i = 0; i < 3 * cube_case.triangles_count; ++i) {
+					// The vertex of the edge, in the table of the block owning it
+					const unsigned int edge = cube_case.edges[i];
+					const glm::uvec3 sample = cube + get_corner_offset(get_edge_corner(edge));
+					const Block& owner = _blocks[_get_sample_block_key(sample)];
+					const glm::uvec3 local = sample - owner.origin;
+					const glm::uvec3 table_size = owner.size + 1u;
+					const size_t edge_idx = 3 * (((size_t) local.x * table_size.y + local.y) * table_size.z + local.z) + edge / 4;
+					block.indices.push_back(owner.vertices_offset + owner.edge_vertices[edge_idx]);
+				}
+			}
+		}
+	}
+}
+
+
+bool save_surface_mesh(const SurfaceMesh& mesh, const std::string& path)
+{
+	std::ofstream file (path, std::ios::binary | std::ios::trunc);
+	if (!file) {
+		std::cerr << "ERROR::SURFACE_MESH::SAVE::FILE_NOT_OPENED: " << path << std::endl;
+		return false;
+	}
+
+	const bool is_obj = path.size() >= 4 && path.compare(path.size() - 4, 4, ".obj") == 0;
+	if (is_obj) write_obj(file, mesh);
+	else write_ply(file, mesh);
+	file.flush();
+	if (!file) {
+		std::cerr << "ERROR::SURFACE_MESH::SAVE::WRITE_FAILED: " << path << std::endl;
+		return false;
+	}
+	return true;
+}
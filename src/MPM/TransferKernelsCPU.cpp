@@ -0,0 +1,102 @@
+// Baseline build of the transfer kernels, and runtime dispatch
+#define TRANSFER_KERNELS_NAMESPACE transfer_kernels_scalar
+#define TRANSFER_KERNELS_ISA 0	// CPU_ISA_SCALAR
+#include <MPM/TransferKernelsCPUImpl.hpp>
+
+#if defined(_M_X64) || defined(__x86_64__)
+	#define TRANSFER_KERNELS_X86
+	#ifdef _MSC_VER
+		#include <intrin.h>
+	#else
+		#include <cpuid.h>
+	#endif
+#endif
+
+#ifdef TRANSFER_KERNELS_X86
+namespace transfer_kernels_avx2 { extern const TransferKernelsCPU kernels[GRID_CELL_ORDER_NUM][INTERPOLATION_KERNEL_NUM][TRANSFER_SCHEME_NUM]; }
+namespace transfer_kernels_avx512 { extern const TransferKernelsCPU kernels[GRID_CELL_ORDER_NUM][INTERPOLATION_KERNEL_NUM][TRANSFER_SCHEME_NUM]; }
+
+namespace
+{
+	// eax, ebx, ecx, edx of cpuid leaf and subleaf
+	void cpuid(const unsigned int leaf, const unsigned int subleaf, unsigned int registers[4])
+	{
+		#ifdef _MSC_VER
+			int signed_registers[4];
+			__cpuidex(signed_registers, (int) leaf, (int) subleaf);
+			for (int i = 0; i < 4; ++i) registers[i] = (unsigned int) signed_registers[i];
+		#else
+			__cpuid_count(leaf, subleaf, registers[0], registers[1], registers[2], registers[3]);
+		#endif
+	}
+
+	// XCR0: register states saved by the OS on context switches
+	unsigned long long get_xcr0()
+	{
+		#ifdef _MSC_VER
+			return _xgetbv(0);
+		#else
+			unsigned int eax, edx;
+			__asm__ ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+			return ((unsigned long long) edx << 32) | eax;
+		#endif
+	}
+}
+#endif
+
+
+CPU_ISA get_supported_cpu_isa()
+{
+	static const CPU_ISA supported_isa = [] {
+		#ifdef TRANSFER_KERNELS_X86
+			unsigned int registers[4];
+			cpuid(0, 0, registers);
+			if (registers[0] < 7) return CPU_ISA_SCALAR;
+			cpuid(1, 0, registers);
+			const bool osxsave = registers[2] & (1u << 27);
+			const bool fma = registers[2] & (1u << 12);
+			if (!osxsave) return CPU_ISA_SCALAR;
+			const unsigned long long xcr0 = get_xcr0();
+			cpuid(7, 0, registers);
+			const bool avx2 = registers[1] & (1u << 5);
+			const bool avx512 = (registers[1] & (1u << 16)) && (registers[1] & (1u << 17)) && (registers[1] & (1u << 31));	// F, DQ, VL
+			if (avx512 && fma && (xcr0 & 0xE6) == 0xE6) return CPU_ISA_AVX512;	// SSE, AVX, opmask and ZMM states
+			if (avx2 && fma && (xcr0 & 0x06) == 0x06) return CPU_ISA_AVX2;		// SSE and AVX states
+		#endif
+		return CPU_ISA_SCALAR;
+	}();
+	return supported_isa;
+}
+
+
+const TransferKernelsCPU& get_transfer_kernels(const CPU_ISA isa, const GRID_CELL_ORDER cell_order, const INTERPOLATION_KERNEL kernel, const TRANSFER_SCHEME scheme)
+{
+	switch (isa) {
+		#ifdef TRANSFER_KERNELS_X86
+			case CPU_ISA_AVX2: return transfer_kernels_avx2::kernels[cell_order][kernel][scheme];
+			case CPU_ISA_AVX512: return transfer_kernels_avx512::kernels[cell_order][kernel][scheme];
+		#endif
+		default: return transfer_kernels_scalar::kernels[cell_order][kernel][scheme];
+	}
+}
+
+
+const char* get_cpu_isa_name(const CPU_ISA isa)
+{
+	switch (isa) {
+		case CPU_ISA_SCALAR: return "scalar";
+		case CPU_ISA_AVX2: return "avx2";
+		case CPU_ISA_AVX512: return "avx512";
+		default: return "unknown";
+	}
+}
+
+
+const char* get_grid_cell_order_name(const GRID_CELL_ORDER cell_order)
+{
+	switch (cell_order) {
+		case GRID_CELL_ORDER_LINEAR: return "linear";
+		case GRID_CELL_ORDER_MORTON: return "morton";
+		default: return "unknown";
+	}
+}
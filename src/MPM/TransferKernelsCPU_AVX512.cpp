@@ -0,0 +1,6 @@
+// AVX-512 build of the transfer kernels: compiled with its own instruction set flags (see CMakeLists.txt), only called if supported at runtime
+#if defined(_M_X64) || defined(__x86_64__)
+	#define TRANSFER_KERNELS_NAMESPACE transfer_kernels_avx512
+	#define TRANSFER_KERNELS_ISA 2	// CPU_ISA_AVX512
+	#include <MPM/TransferKernelsCPUImpl.hpp>
+#endif
@@ -99,7 +99,7 @@ void UIRenderer::show_simulation_info(const glm::uvec3 grid_size, const int part
 	ImGui::EndChild();
 }
 
-void UIRenderer::show_time_buttons(bool& pause, float& time_scale) const
+void UIRenderer::show_time_buttons(bool& pause, float& time_scale, bool& adaptive_timestep) const
 {
 	ImGui::BeginChild("Time settings", ImVec2(0,0), ImGuiChildFlags_AlwaysUseWindowPadding | ImGuiChildFlags_AutoResizeX | ImGuiChildFlags_AutoResizeY);
 	if (ImGui::Button(pause ? "Start" : "Pause", ImVec2(120.0f, 20.0f))) pause = !pause;
@@ -128,10 +128,42 @@ void UIRenderer::show_time_buttons(bool& pause, float& time_scale) const
 	ImGui::BeginDisabled(time_scale == 2.0f);
 	if (ImGui::Button("x2.0", ImVec2(50.0f, 20.0f))) time_scale = 2.0f;
 	ImGui::EndDisabled();
+
+	ImGui::Checkbox("Adaptive timestep", &adaptive_timestep);
 	
 	ImGui::EndChild();
 }
 
+void UIRenderer::show_playback_controls(double& time, const double start_time, const double end_time, float& speed, bool& loop, const unsigned int frame_idx, const unsigned int frames_count) const
+{
+	ImGui::BeginChild("Playback", ImVec2(0,0), ImGuiChildFlags_AlwaysUseWindowPadding | ImGuiChildFlags_AutoResizeX | ImGuiChildFlags_AutoResizeY);
+	ImGui::SetNextItemWidth(300.0f);
+	ImGui::SliderScalar("##Time", ImGuiDataType_Double, &time, &start_time, &end_time, "Time: %.3f s");
+	ImGui::SameLine();
+	ImGui::Text("Frame %u / %u", frame_idx + 1, frames_count);
+
+	ImGui::SetNextItemWidth(300.0f);
+	ImGui::SliderFloat("##Speed", &speed, -16.0f, 16.0f, "Speed: x%.2f");
+	ImGui::SameLine();
+	if (ImGui::Button("x1.0", ImVec2(50.0f, 20.0f))) speed = 1.0f;
+	ImGui::SameLine();
+	ImGui::Checkbox("Loop", &loop);
+	ImGui::EndChild();
+}
+
+bool UIRenderer::show_timeline_controls(unsigned long long& step, const unsigned long long first_step, const unsigned long long last_step, const unsigned int records_count, const size_t size, const size_t memory_budget) const
+{
+	ImGui::BeginChild("Timeline", ImVec2(0,0), ImGuiChildFlags_AlwaysUseWindowPadding | ImGuiChildFlags_AutoResizeX | ImGuiChildFlags_AutoResizeY);
+	ImGui::SetNextItemWidth(300.0f);
+	ImGui::SliderScalar("##Step", ImGuiDataType_U64, &step, &first_step, &last_step, "Step: %llu", ImGuiSliderFlags_AlwaysClamp);
+	ImGui::SameLine();
+	bool clicked = ImGui::Button("Rewind", ImVec2(60.0f, 20.0f));
+	ImGui::Text("%u records, %.0f / %.0f MB", records_count, size / (1024.0 * 1024.0), memory_budget / (1024.0 * 1024.0));
+	ImGui::EndChild();
+
+	return clicked;
+}
+
 bool UIRenderer::show_reset_simulation_button() const
 {
 	ImGui::BeginChild("Simulation reset", ImVec2(0,0), ImGuiChildFlags_AlwaysUseWindowPadding | ImGuiChildFlags_AutoResizeX | ImGuiChildFlags_AutoResizeY);
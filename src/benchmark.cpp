@@ -0,0 +1,215 @@
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <MPM/SimulationBackend.hpp>
+#include <MPM/MPMSimulationCPU.hpp>
+#include <MPM/MPMConstants.hpp>
+
+/*
+Times each stage of the simulation step on its own, sweeping particle counts (32^3 up to MAX_PARTICLES_NUM, doubling) and grid sizes (40^3 up to 240^3).
+Particles are spawned as a lattice of rest-density cubes: configurations whose particles don't fit in the grid are skipped.
+Results are written as JSON, to stdout or to --output. Run the CPU backend with --p2g-scatter atomic for the atomic P2G baseline, and once per --cell-order to compare the grid cell layouts. --kernel and --scheme apply to both backends.
+Usage: GPUCRTGP_benchmark [--cpu] [--threads N] [--steps N] [--warmup N] [--output FILE] [--sort-interval N] [--p2g-scatter atomic|colored] [--p2g-mode two-pass|fused|one-pass] [--isa scalar|avx2|avx512] [--cell-order linear|morton] [--kernel linear|quadratic|cubic] [--scheme apic|pic-flip] [--flip-ratio F]
+*/
+
+void print_usage(const char* program)
+{
+	std::cout << "Usage: " << program << " [--cpu] [--threads N] [--steps N] [--warmup N] [--output FILE] [--sort-interval N] [--p2g-scatter atomic|colored] [--p2g-mode two-pass|fused|one-pass] [--isa scalar|avx2|avx512] [--cell-order linear|morton] [--kernel linear|quadratic|cubic] [--scheme apic|pic-flip] [--flip-ratio F]\n"
+		<< "  --cpu              Run on the multithreaded CPU backend instead of CUDA\n"
+		<< "  --threads N        CPU backend threads (default: one per hardware thread)\n"
+		<< "  --sort-interval N  Sort particles every N steps, 0 to disable (default: 20)\n"
+		<< "  --p2g-scatter S    CPU backend P2G scatter: atomic or colored (default: colored)\n"
+		<< "  --p2g-mode M       CPU backend P2G: two-pass, fused with densities from the previous step, or one-pass fused into G2P (default: two-pass)\n"
+		<< "  --isa I            CPU backend transfer kernels instruction set: scalar, avx2 or avx512, lowered to the best supported (default: best supported)\n"
+		<< "  --cell-order O     CPU backend order of the cells within grid blocks: linear or morton (default: linear)\n"
+		<< "  --kernel K         Interpolation kernel: linear, quadratic or cubic (default: quadratic)\n"
+		<< "  --scheme S         Transfer scheme: apic or pic-flip (default: apic)\n"
+		<< "  --flip-ratio F     FLIP ratio of the pic-flip scheme, from 0 (PIC) to 1 (FLIP) (default: 0.95)\n"
+		<< "  --steps N          Timed steps per configuration (default: 20)\n"
+		<< "  --warmup N         Untimed steps per configuration (default: 5)\n"
+		<< "  --output FILE      Write JSON to FILE instead of stdout\n";
+}
+
+
+// Fills the simulation with count particles (multiple of PARTICLES_SPAWN_NUM) as a lattice of cubes, starting from the floor. Returns false if they don't fit.
+bool spawn_particles_lattice(SimulationBackend& sim, const unsigned int count)
+{
+	// Cube edge at rest density, plus one cell of spacing
+	const float cube_edge = PARTICLES_SPAWN_CUBE_SIZE / std::cbrt(sim.particles_material.rest_density / sim.particles_material.mass);
+	const float spacing = std::ceil(cube_edge) + 1.0f;
+	const glm::uvec3 grid_size = sim.get_grid_size();
+	const float margin = 2.0f + cube_edge / 2.0f;	// Keep cubes off the boundary
+	const glm::uvec3 lattice_size = glm::uvec3(glm::max((glm::vec3(grid_size) - 2.0f * margin) / spacing + 1.0f, glm::vec3(0.0f)));
+
+	const unsigned int cubes_count = count / PARTICLES_SPAWN_NUM;
+	if (cubes_count > lattice_size.x * lattice_size.y * lattice_size.z) return false;
+
+	sim.reset_simulation();
+	for (unsigned int i = 0; i < cubes_count; ++i) {
+		// Fill layer by layer, from the bottom
+		const glm::uvec3 lattice_coords (i % lattice_size.x, i / (lattice_size.x * lattice_size.z), (i / lattice_size.x) % lattice_size.z);
+		sim.spawn_position = glm::vec3(margin) + glm::vec3(lattice_coords) * spacing;
+		sim.spawn_particles_cube();
+	}
+	return sim.get_particles_count() == count;
+}
+
+
+int main(int argc, char** argv)
+{
+	SIMULATION_BACKEND backend = SIMULATION_BACKEND::CUDA;
+	unsigned int threads_count = 0;
+	unsigned int steps = 20;
+	int sort_interval = -1;	// Backend default
+	int p2g_scatter = -1;	// Backend default
+	int p2g_mode = -1;		// Backend default
+	int cpu_isa = -1;		// Backend default
+	int cell_order = -1;	// Backend default
+	int kernel = -1;		// Backend default
+	int scheme = -1;		// Backend default
+	float flip_ratio = -1.0f;	// Backend default
+	unsigned int warmup_steps = 5;
+	const char* output_path = nullptr;
+
+	for (int i = 1; i < argc; ++i) {
+		const bool has_value = i + 1 < argc;
+		if (std::strcmp(argv[i], "--cpu") == 0) backend = SIMULATION_BACKEND::CPU;
+		else if (std::strcmp(argv[i], "--threads") == 0 && has_value) threads_count = std::atoi(argv[++i]);
+		else if (std::strcmp(argv[i], "--steps") == 0 && has_value) steps = std::atoi(argv[++i]);
+		else if (std::strcmp(argv[i], "--sort-interval") == 0 && has_value) sort_interval = std::atoi(argv[++i]);
+		else if (std::strcmp(argv[i], "--p2g-scatter") == 0 && has_value && std::strcmp(argv[i + 1], "atomic") == 0) { p2g_scatter = P2G_SCATTER_ATOMIC; ++i; }
+		else if (std::strcmp(argv[i], "--p2g-scatter") == 0 && has_value && std::strcmp(argv[i + 1], "colored") == 0) { p2g_scatter = P2G_SCATTER_COLORED; ++i; }
+		else if (std::strcmp(argv[i], "--p2g-mode") == 0 && has_value && std::strcmp(argv[i + 1], "two-pass") == 0) { p2g_mode = P2G_MODE_TWO_PASS; ++i; }
+		else if (std::strcmp(argv[i], "--p2g-mode") == 0 && has_value && std::strcmp(argv[i + 1], "fused") == 0) { p2g_mode = P2G_MODE_FUSED; ++i; }
+		else if (std::strcmp(argv[i], "--p2g-mode") == 0 && has_value && std::strcmp(argv[i + 1], "one-pass") == 0) { p2g_mode = P2G_MODE_ONE_PASS; ++i; }
+		else if (std::strcmp(argv[i], "--isa") == 0 && has_value && std::strcmp(argv[i + 1], "scalar") == 0) { cpu_isa = CPU_ISA_SCALAR; ++i; }
+		else if (std::strcmp(argv[i], "--isa") == 0 && has_value && std::strcmp(argv[i + 1], "avx2") == 0) { cpu_isa = CPU_ISA_AVX2; ++i; }
+		else if (std::strcmp(argv[i], "--isa") == 0 && has_value && std::strcmp(argv[i + 1], "avx512") == 0) { cpu_isa = CPU_ISA_AVX512; ++i; }
+		else if (std::strcmp(argv[i], "--cell-order") == 0 && has_value && std::strcmp(argv[i + 1], "linear") == 0) { cell_order = GRID_CELL_ORDER_LINEAR; ++i; }
+		else if (std::strcmp(argv[i], "--cell-order") == 0 && has_value && std::strcmp(argv[i + 1], "morton") == 0) { cell_order = GRID_CELL_ORDER_MORTON; ++i; }
+		else if (std::strcmp(argv[i], "--kernel") == 0 && has_value && std::strcmp(argv[i + 1], "linear") == 0) { kernel = INTERPOLATION_KERNEL_LINEAR; ++i; }
+		else if (std::strcmp(argv[i], "--kernel") == 0 && has_value && std::strcmp(argv[i + 1], "quadratic") == 0) { kernel = INTERPOLATION_KERNEL_QUADRATIC; ++i; }
+		else if (std::strcmp(argv[i], "--kernel") == 0 && has_value && std::strcmp(argv[i + 1], "cubic") == 0) { kernel = INTERPOLATION_KERNEL_CUBIC; ++i; }
+		else if (std::strcmp(argv[i], "--scheme") == 0 && has_value && std::strcmp(argv[i + 1], "apic") == 0) { scheme = TRANSFER_SCHEME_APIC; ++i; }
+		else if (std::strcmp(argv[i], "--scheme") == 0 && has_value && std::strcmp(argv[i + 1], "pic-flip") == 0) { scheme = TRANSFER_SCHEME_PIC_FLIP; ++i; }
+		else if (std::strcmp(argv[i], "--flip-ratio") == 0 && has_value) flip_ratio = std::atof(argv[++i]);
+		else if (std::strcmp(argv[i], "--warmup") == 0 && has_value) warmup_steps = std::atoi(argv[++i]);
+		else if (std::strcmp(argv[i], "--output") == 0 && has_value) output_path = argv[++i];
+		else {
+			print_usage(argv[0]);
+			return std::strcmp(argv[i], "--help") == 0 ? 0 : 1;
+		}
+	}
+	if (steps == 0) steps = 1;
+
+	std::ofstream output_file;
+	if (output_path) {
+		output_file.open(output_path);
+		if (!output_file) {
+			std::cerr << "Cannot open " << output_path << "\n";
+			return 1;
+		}
+	}
+	std::ostream& out = output_path ? output_file : std::cout;
+
+	// Same material as the interactive application
+	ParticleMaterial particle_material_water (125.0f, 1000.0f, 100.0f, 2000.0f, 7.0f, -0.1f, glm::vec3(0.1f, 0.0f, 0.9f));
+	std::unique_ptr<SimulationBackend> sim = create_simulation(backend, glm::uvec3(MIN_GRID_SIZE), particle_material_water, 0.017f, 1.0f, 0.3f, glm::vec3(0.0f, -9.81f, 0.0f), threads_count);
+	sim->set_stage_profiling(true);
+	if (sort_interval >= 0) sim->sort_interval = sort_interval;
+	if (kernel >= 0) sim->set_interpolation_kernel((INTERPOLATION_KERNEL) kernel);
+	if (scheme >= 0) sim->set_transfer_scheme((TRANSFER_SCHEME) scheme);
+	if (flip_ratio >= 0.0f) sim->flip_ratio = std::min(flip_ratio, 1.0f);
+	MPMSimulationCPU* sim_cpu = dynamic_cast<MPMSimulationCPU*>(sim.get());
+	if (sim_cpu && p2g_scatter >= 0) sim_cpu->p2g_scatter = (P2G_SCATTER) p2g_scatter;
+	if (sim_cpu && p2g_mode >= 0) sim_cpu->p2g_mode = (P2G_MODE) p2g_mode;
+	if (sim_cpu && cpu_isa >= 0) sim_cpu->set_cpu_isa((CPU_ISA) cpu_isa);
+	if (sim_cpu && cell_order >= 0) sim_cpu->set_grid_cell_order((GRID_CELL_ORDER) cell_order);
+
+	std::vector<unsigned int> grid_sizes;
+	for (unsigned int size = MIN_GRID_SIZE; size <= 240; size += 40) grid_sizes.push_back(size);
+	std::vector<unsigned int> particle_counts;
+	for (unsigned int count = PARTICLES_SPAWN_NUM; count <= MAX_PARTICLES_NUM; count *= 2) particle_counts.push_back(count);
+
+	out << "{\n"
+		<< "\t\"backend\": \"" << (backend == SIMULATION_BACKEND::CPU ? "CPU" : "CUDA") << "\",\n";
+	if (sim_cpu) {
+		out << "\t\"threads\": " << sim_cpu->get_threads_count() << ",\n"
+			<< "\t\"p2g_scatter\": \"" << (sim_cpu->p2g_scatter == P2G_SCATTER_ATOMIC ? "atomic" : "colored") << "\",\n"
+			<< "\t\"p2g_mode\": \"" << get_p2g_mode_name(sim_cpu->p2g_mode) << "\",\n"
+			<< "\t\"isa\": \"" << get_cpu_isa_name(sim_cpu->get_cpu_isa()) << "\",\n"
+			<< "\t\"cell_order\": \"" << get_grid_cell_order_name(sim_cpu->get_grid_cell_order()) << "\",\n";
+	}
+	out << "\t\"kernel\": \"" << get_interpolation_kernel_name(sim->get_interpolation_kernel()) << "\",\n"
+		<< "\t\"scheme\": \"" << get_transfer_scheme_name(sim->get_transfer_scheme()) << "\",\n";
+	if (sim->get_transfer_scheme() == TRANSFER_SCHEME_PIC_FLIP) out << "\t\"flip_ratio\": " << sim->flip_ratio << ",\n";
+	out << "\t\"sort_interval\": " << sim->sort_interval << ",\n"
+		<< "\t\"steps\": " << steps << ",\n"
+		<< "\t\"warmup_steps\": " << warmup_steps << ",\n"
+		<< "\t\"time_unit\": \"ms\",\n"
+		<< "\t\"results\": [";
+
+	bool first_result = true;
+	for (const unsigned int grid_size : grid_sizes) {
+		sim->set_grid_size(glm::uvec3(grid_size));
+		for (const unsigned int particles_count : particle_counts) {
+			if (!spawn_particles_lattice(*sim, particles_count)) {
+				std::cerr << "Skipping " << particles_count << " particles in " << grid_size << "^3 grid: they don't fit\n";
+				continue;
+			}
+			std::cerr << "Benchmarking " << particles_count << " particles in " << grid_size << "^3 grid\n";
+
+			for (unsigned int i = 0; i < warmup_steps; ++i) sim->step();
+
+			// Whole step mean, and per-stage mean, min and max over the timed steps
+			double stage_sum[STEP_STAGES_NUM] = {};
+			float stage_min[STEP_STAGES_NUM], stage_max[STEP_STAGES_NUM] = {};
+			std::fill(std::begin(stage_min), std::end(stage_min), INFINITY);
+			double step_sum = 0.0;
+			for (unsigned int i = 0; i < steps; ++i) {
+				const auto start = std::chrono::steady_clock::now();
+				sim->step();
+				step_sum += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+				for (unsigned int stage = 0; stage < STEP_STAGES_NUM; ++stage) {
+					const float time = sim->get_stage_time((STEP_STAGE) stage);
+					stage_sum[stage] += time;
+					stage_min[stage] = std::min(stage_min[stage], time);
+					stage_max[stage] = std::max(stage_max[stage], time);
+				}
+			}
+
+			out << (first_result ? "\n" : ",\n")
+				<< "\t\t{\n"
+				<< "\t\t\t\"grid_size\": [" << grid_size << ", " << grid_size << ", " << grid_size << "],\n"
+				<< "\t\t\t\"cells\": " << sim->get_cells_count() << ",\n"
+				<< "\t\t\t\"grid_blocks\": " << sim->get_grid_blocks_count() << ",\n"
+				<< "\t\t\t\"particles\": " << sim->get_particles_count() << ",\n"
+				<< "\t\t\t\"whitewater\": " << sim->get_whitewater_count() << ",\n"
+				<< "\t\t\t\"step_mean\": " << step_sum / steps << ",\n"
+				<< "\t\t\t\"stages\": {";
+			for (unsigned int stage = 0; stage < STEP_STAGES_NUM; ++stage) {
+				out << (stage == 0 ? "\n" : ",\n")
+					<< "\t\t\t\t\"" << get_stage_name((STEP_STAGE) stage) << "\": { "
+					<< "\"mean\": " << stage_sum[stage] / steps << ", "
+					<< "\"min\": " << stage_min[stage] << ", "
+					<< "\"max\": " << stage_max[stage] << " }";
+			}
+			out << "\n\t\t\t}\n"
+				<< "\t\t}";
+			out.flush();
+			first_result = false;
+		}
+	}
+	out << "\n\t]\n"
+		<< "}\n";
+
+	sim->cleanup();
+	return 0;
+}
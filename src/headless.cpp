@@ -0,0 +1,271 @@
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <MPM/SimulationBackend.hpp>
+#include <MPM/Checkpoint.hpp>
+#include <MPM/ParticleCache.hpp>
+#include <MPM/MPMSimulationCPU.hpp>
+#include <MPM/SparseGrid.hpp>
+#include <MPM/SurfaceExtractor.hpp>
+#include <utils/MemoryUsage.hpp>
+
+/*
+Runs the simulation for a fixed number of steps without any window or rendering, then reports throughput and peak memory.
+Usage: GPUCRTGP_headless [--cpu] [--threads N] [--steps N] [--warmup N] [--grid X Y Z] [--sort-interval N] [--p2g-scatter atomic|colored] [--p2g-mode two-pass|fused|one-pass] [--isa scalar|avx2|avx512] [--cell-order linear|morton] [--kernel linear|quadratic|cubic] [--scheme apic|pic-flip] [--flip-ratio F] [--adaptive CFL] [--load FILE] [--save FILE] [--cache FILE] [--cache-interval K] [--cache-quantized ERROR] [--mesh FILE] [--mesh-field grid|particles] [--mesh-resolution R]
+*/
+
+void print_usage(const char* program)
+{
+	std::cout << "Usage: " << program << " [--cpu] [--threads N] [--steps N] [--warmup N] [--grid X Y Z] [--sort-interval N] [--p2g-scatter atomic|colored] [--p2g-mode two-pass|fused|one-pass] [--isa scalar|avx2|avx512] [--cell-order linear|morton] [--kernel linear|quadratic|cubic] [--scheme apic|pic-flip] [--flip-ratio F] [--adaptive CFL] [--load FILE] [--save FILE] [--cache FILE] [--cache-interval K] [--cache-quantized ERROR] [--mesh FILE] [--mesh-field grid|particles] [--mesh-resolution R]\n"
+		<< "  --cpu              Run on the multithreaded CPU backend instead of CUDA\n"
+		<< "  --threads N        CPU backend threads (default: one per hardware thread)\n"
+		<< "  --sort-interval N  Sort particles every N steps, 0 to disable (default: 20)\n"
+		<< "  --p2g-scatter S    CPU backend P2G scatter: atomic or colored (default: colored)\n"
+		<< "  --p2g-mode M       CPU backend P2G: two-pass, fused with densities from the previous step, or one-pass fused into G2P (default: two-pass)\n"
+		<< "  --isa I            CPU backend transfer kernels instruction set: scalar, avx2 or avx512, lowered to the best supported (default: best supported)\n"
+		<< "  --cell-order O     CPU backend order of the cells within grid blocks: linear or morton (default: linear)\n"
+		<< "  --kernel K         Interpolation kernel: linear, quadratic or cubic (default: quadratic)\n"
+		<< "  --scheme S         Transfer scheme: apic or pic-flip (default: apic)\n"
+		<< "  --flip-ratio F     FLIP ratio of the pic-flip scheme, from 0 (PIC) to 1 (FLIP) (default: 0.95)\n"
+		<< "  --adaptive CFL     Adaptive timestep under CFL number CFL: --steps counts frames of the max timestep instead, sub-stepped by the stable timestep\n"
+		<< "  --load FILE        Start from a checkpoint instead of the default scene, e.g. to skip settling. Its parameters are overridden by the options above.\n"
+		<< "  --save FILE        Save a checkpoint after the timed steps\n"
+		<< "  --cache FILE       Record the particles and whitewater of the timed steps to a particle cache, from a background thread\n"
+		<< "  --cache-interval K Record every K steps (default: 1)\n"
+		<< "  --cache-quantized ERROR  Record a quantized, delta-compressed cache, with positions within ERROR cells (default: raw)\n"
+		<< "  --mesh FILE        Extract the fluid surface after the timed steps, to a binary PLY (or OBJ if FILE ends with .obj)\n"
+		<< "  --mesh-field F     Surface density field: grid cells mass, or particles splatted at --mesh-resolution (default: particles)\n"
+		<< "  --mesh-resolution R  Particles field samples per cell along each axis (default: 2)\n"
+		<< "  --steps N          Timed simulation steps (default: 1000)\n"
+		<< "  --warmup N         Untimed steps before measuring (default: 10)\n"
+		<< "  --grid X Y Z       Grid size (default: 100 80 100, 40 to 1024 per dimension)\n";
+}
+
+
+int main(int argc, char** argv)
+{
+	SIMULATION_BACKEND backend = SIMULATION_BACKEND::CUDA;
+	unsigned int threads_count = 0;
+	unsigned int steps = 1000;
+	int sort_interval = -1;	// Backend default
+	int p2g_scatter = -1;	// Backend default
+	int p2g_mode = -1;		// Backend default
+	int cpu_isa = -1;		// Backend default
+	int cell_order = -1;	// Backend default
+	int kernel = -1;		// Backend default
+	int scheme = -1;		// Backend default
+	float flip_ratio = -1.0f;	// Backend default
+	float cfl_number = 0.0f;	// Fixed timestep
+	unsigned int warmup_steps = 10;
+	glm::uvec3 grid_size (100, 80, 100);
+	const char* load_path = nullptr;
+	const char* save_path = nullptr;
+	const char* cache_path = nullptr;
+	unsigned int cache_interval = 1;
+	float cache_position_error = 0.0f;	// Raw cache
+	const char* mesh_path = nullptr;
+	SURFACE_FIELD mesh_field = SURFACE_FIELD_PARTICLES;
+	float mesh_resolution = 2.0f;
+
+	for (int i = 1; i < argc; ++i) {
+		const bool has_value = i + 1 < argc;
+		if (std::strcmp(argv[i], "--cpu") == 0) backend = SIMULATION_BACKEND::CPU;
+		else if (std::strcmp(argv[i], "--threads") == 0 && has_value) threads_count = std::atoi(argv[++i]);
+		else if (std::strcmp(argv[i], "--steps") == 0 && has_value) steps = std::atoi(argv[++i]);
+		else if (std::strcmp(argv[i], "--sort-interval") == 0 && has_value) sort_interval = std::atoi(argv[++i]);
+		else if (std::strcmp(argv[i], "--p2g-scatter") == 0 && has_value && std::strcmp(argv[i + 1], "atomic") == 0) { p2g_scatter = P2G_SCATTER_ATOMIC; ++i; }
+		else if (std::strcmp(argv[i], "--p2g-scatter") == 0 && has_value && std::strcmp(argv[i + 1], "colored") == 0) { p2g_scatter = P2G_SCATTER_COLORED; ++i; }
+		else if (std::strcmp(argv[i], "--p2g-mode") == 0 && has_value && std::strcmp(argv[i + 1], "two-pass") == 0) { p2g_mode = P2G_MODE_TWO_PASS; ++i; }
+		else if (std::strcmp(argv[i], "--p2g-mode") == 0 && has_value && std::strcmp(argv[i + 1], "fused") == 0) { p2g_mode = P2G_MODE_FUSED; ++i; }
+		else if (std::strcmp(argv[i], "--p2g-mode") == 0 && has_value && std::strcmp(argv[i + 1], "one-pass") == 0) { p2g_mode = P2G_MODE_ONE_PASS; ++i; }
+		else if (std::strcmp(argv[i], "--isa") == 0 && has_value && std::strcmp(argv[i + 1], "scalar") == 0) { cpu_isa = CPU_ISA_SCALAR; ++i; }
+		else if (std::strcmp(argv[i], "--isa") == 0 && has_value && std::strcmp(argv[i + 1], "avx2") == 0) { cpu_isa = CPU_ISA_AVX2; ++i; }
+		else if (std::strcmp(argv[i], "--isa") == 0 && has_value && std::strcmp(argv[i + 1], "avx512") == 0) { cpu_isa = CPU_ISA_AVX512; ++i; }
+		else if (std::strcmp(argv[i], "--cell-order") == 0 && has_value && std::strcmp(argv[i + 1], "linear") == 0) { cell_order = GRID_CELL_ORDER_LINEAR; ++i; }
+		else if (std::strcmp(argv[i], "--cell-order") == 0 && has_value && std::strcmp(argv[i + 1], "morton") == 0) { cell_order = GRID_CELL_ORDER_MORTON; ++i; }
+		else if (std::strcmp(argv[i], "--kernel") == 0 && has_value && std::strcmp(argv[i + 1], "linear") == 0) { kernel = INTERPOLATION_KERNEL_LINEAR; ++i; }
+		else if (std::strcmp(argv[i], "--kernel") == 0 && has_value && std::strcmp(argv[i + 1], "quadratic") == 0) { kernel = INTERPOLATION_KERNEL_QUADRATIC; ++i; }
+		else if (std::strcmp(argv[i], "--kernel") == 0 && has_value && std::strcmp(argv[i + 1], "cubic") == 0) { kernel = INTERPOLATION_KERNEL_CUBIC; ++i; }
+		else if (std::strcmp(argv[i], "--scheme") == 0 && has_value && std::strcmp(argv[i + 1], "apic") == 0) { scheme = TRANSFER_SCHEME_APIC; ++i; }
+		else if (std::strcmp(argv[i], "--scheme") == 0 && has_value && std::strcmp(argv[i + 1], "pic-flip") == 0) { scheme = TRANSFER_SCHEME_PIC_FLIP; ++i; }
+		else if (std::strcmp(argv[i], "--flip-ratio") == 0 && has_value) flip_ratio = std::atof(argv[++i]);
+		else if (std::strcmp(argv[i], "--adaptive") == 0 && has_value) cfl_number = std::atof(argv[++i]);
+		else if (std::strcmp(argv[i], "--warmup") == 0 && has_value) warmup_steps = std::atoi(argv[++i]);
+		else if (std::strcmp(argv[i], "--load") == 0 && has_value) load_path = argv[++i];
+		else if (std::strcmp(argv[i], "--save") == 0 && has_value) save_path = argv[++i];
+		else if (std::strcmp(argv[i], "--cache") == 0 && has_value) cache_path = argv[++i];
+		else if (std::strcmp(argv[i], "--cache-interval") == 0 && has_value) cache_interval = std::max(std::atoi(argv[++i]), 1);
+		else if (std::strcmp(argv[i], "--cache-quantized") == 0 && has_value) cache_position_error = std::atof(argv[++i]);
+		else if (std::strcmp(argv[i], "--mesh") == 0 && has_value) mesh_path = argv[++i];
+		else if (std::strcmp(argv[i], "--mesh-field") == 0 && has_value && std::strcmp(argv[i + 1], "grid") == 0) { mesh_field = SURFACE_FIELD_GRID_MASS; ++i; }
+		else if (std::strcmp(argv[i], "--mesh-field") == 0 && has_value && std::strcmp(argv[i + 1], "particles") == 0) { mesh_field = SURFACE_FIELD_PARTICLES; ++i; }
+		else if (std::strcmp(argv[i], "--mesh-resolution") == 0 && has_value) mesh_resolution = std::atof(argv[++i]);
+		else if (std::strcmp(argv[i], "--grid") == 0 && i + 3 < argc) {
+			grid_size.x = std::atoi(argv[++i]);
+			grid_size.y = std::atoi(argv[++i]);
+			grid_size.z = std::atoi(argv[++i]);
+		}
+		else {
+			print_usage(argv[0]);
+			return std::strcmp(argv[i], "--help") == 0 ? 0 : 1;
+		}
+	}
+
+
+	//// Simulation initialization ////
+	// Same material and initial scene as the interactive application
+	ParticleMaterial particle_material_water (
+		125.0f,						// Mass (kg) represented by one Particle
+		1000.0f,					// Rest density
+		100.0f,						// Dynamic viscosity
+		2000.0f,					// Eq. of State stiffness
+		7.0f,						// Eq. of State power
+		-0.1f,						// Maximum negative pressure
+		glm::vec3(0.1f, 0.0f, 0.9f)	// Color
+	);
+	std::unique_ptr<SimulationBackend> sim = create_simulation(
+		backend,
+		grid_size,
+		particle_material_water,
+		0.017f,
+		1.0f,
+		0.3f,
+		glm::vec3(0.0f, -9.81f, 0.0f),
+		threads_count
+	);
+	if (load_path && !load_checkpoint(*sim, load_path)) {
+		sim->cleanup();
+		return 1;
+	}
+	grid_size = sim->get_grid_size();	// Minimum size enforced by the simulation, or the checkpoint's
+	if (sort_interval >= 0) sim->sort_interval = sort_interval;
+	if (kernel >= 0) sim->set_interpolation_kernel((INTERPOLATION_KERNEL) kernel);
+	if (scheme >= 0) sim->set_transfer_scheme((TRANSFER_SCHEME) scheme);
+	if (flip_ratio >= 0.0f) sim->flip_ratio = std::min(flip_ratio, 1.0f);
+	if (cfl_number > 0.0f) {
+		sim->adaptive_timestep = true;
+		sim->cfl_number = cfl_number;
+	}
+	const float frame_duration = sim->adaptive_timestep ? sim->max_timestep : sim->get_timestep();
+	MPMSimulationCPU* sim_cpu = dynamic_cast<MPMSimulationCPU*>(sim.get());
+	if (sim_cpu && p2g_scatter >= 0) sim_cpu->p2g_scatter = (P2G_SCATTER) p2g_scatter;
+	if (sim_cpu && p2g_mode >= 0) sim_cpu->p2g_mode = (P2G_MODE) p2g_mode;
+	if (sim_cpu && cpu_isa >= 0) sim_cpu->set_cpu_isa((CPU_ISA) cpu_isa);
+	if (sim_cpu && cell_order >= 0) sim_cpu->set_grid_cell_order((GRID_CELL_ORDER) cell_order);
+
+	for(unsigned int i = 1; !load_path && i < grid_size.x / 20.0f; ++i) {
+		for(unsigned int j = 1; j < grid_size.z / 20.0f; ++j) {
+			sim->spawn_position = glm::vec3(20.0f * i, 10.0f, 20.0f * j);
+			sim->spawn_particles_sphere();
+			sim->spawn_position = glm::vec3(20.0f * i, 30.0f, 20.0f * j);
+			sim->spawn_particles_sphere();
+		}
+	}
+
+	std::cout << "Backend: " << (sim->get_backend_type() == SIMULATION_BACKEND::CPU ? "CPU" : "CUDA") << "\n"
+		<< "Grid: " << grid_size.x << "x" << grid_size.y << "x" << grid_size.z << " (" << sim->get_cells_count() << " cells)\n"
+		<< "Particles: " << sim->get_particles_count() << "\n"
+		<< "Sort interval: " << sim->sort_interval << "\n"
+		<< "Interpolation kernel: " << get_interpolation_kernel_name(sim->get_interpolation_kernel()) << "\n"
+		<< "Transfer scheme: " << get_transfer_scheme_name(sim->get_transfer_scheme()) << "\n";
+	if (sim->get_transfer_scheme() == TRANSFER_SCHEME_PIC_FLIP) std::cout << "FLIP ratio: " << sim->flip_ratio << "\n";
+	if (sim_cpu) {
+		std::cout << "P2G scatter: " << (sim_cpu->p2g_scatter == P2G_SCATTER_ATOMIC ? "atomic" : "colored") << "\n"
+			<< "P2G mode: " << get_p2g_mode_name(sim_cpu->p2g_mode) << "\n"
+			<< "Transfer kernels: " << get_cpu_isa_name(sim_cpu->get_cpu_isa()) << "\n"
+			<< "Cell order: " << get_grid_cell_order_name(sim_cpu->get_grid_cell_order()) << "\n";
+	}
+	if (sim->adaptive_timestep) std::cout << "Adaptive timestep: CFL " << sim->cfl_number << ", " << sim->min_timestep << " to " << sim->max_timestep << " s\n";
+	if (load_path) std::cout << "Checkpoint: " << load_path << " (step " << sim->get_steps_count() << ")\n";
+	std::cout << (sim->adaptive_timestep ? "Frames: " : "Steps: ") << steps << " (+" << warmup_steps << " warmup)\n";
+
+
+	//// Simulation loop ////
+	// Every backend step() blocks until the step is complete, so wall-clock time is accurate for CUDA as well.
+	// With the adaptive timestep, each iteration is a frame of the max timestep instead, taking as many steps as needed.
+	for (unsigned int i = 0; i < warmup_steps; ++i) sim->advance(frame_duration);
+
+	// Cache frames are captured in the timed loop, written to disk by the cache's own thread
+	ParticleCacheWriter cache;
+	if (cache_position_error > 0.0f) {
+		cache.encoding = CACHE_ENCODING_QUANTIZED;
+		cache.position_error = cache_position_error;
+	}
+	if (cache_path && !cache.open(cache_path, *sim)) {
+		sim->cleanup();
+		return 1;
+	}
+	// Rollbacks set the steps count back and lose the time of the steps since their snapshot: steps are counted as taken, time as lost
+	double advanced_time = 0.0;
+	const double start_lost_time = sim->get_lost_time();
+	const unsigned int start_rollbacks = sim->get_rollbacks_count();
+	const auto get_simulated_time = [&] { return advanced_time - (sim->get_lost_time() - start_lost_time); };
+	unsigned long long next_cache_step = sim->get_steps_count();
+
+	const unsigned long long start_steps = sim->get_advanced_steps_count();
+	const auto start = std::chrono::steady_clock::now();
+	for (unsigned int i = 0; i < steps; ++i) {
+		if (cache.is_open() && sim->get_steps_count() >= next_cache_step) {
+			cache.write_frame(*sim, get_simulated_time());
+			next_cache_step = sim->get_steps_count() + cache_interval;
+		}
+		advanced_time += sim->advance(frame_duration);
+	}
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	const unsigned long long steps_taken = sim->get_advanced_steps_count() - start_steps;
+	const unsigned int rollbacks = sim->get_rollbacks_count() - start_rollbacks;
+	const auto cache_close_start = std::chrono::steady_clock::now();
+	const bool cache_written = cache.close();
+	const double cache_close_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - cache_close_start).count();
+
+
+	//// Report ////
+	const double steps_per_second = seconds > 0.0 ? steps_taken / seconds : 0.0;
+	const double MB = 1024.0 * 1024.0;
+	std::cout << "Time: " << seconds << " s\n";
+	if (sim->adaptive_timestep) std::cout << "Steps taken: " << steps_taken << " (" << advanced_time / std::max(steps_taken, 1ULL) << " s average timestep)\n";
+	std::cout << "Simulated time: " << get_simulated_time() << " s\n";
+	if (cache_path) {
+		std::error_code error;
+		const double cache_size = (double) std::filesystem::file_size(cache_path, error) / MB;
+		std::cout << "Cache: " << cache.get_frames_count() << " frames" << (cache_written ? "" : " (write failed)") << ", " << cache_size << " MB ("
+			<< cache_size / std::max(cache.get_frames_count(), 1u) << " MB per frame), " << cache_close_seconds << " s to flush after the last step\n";
+	}
+	if (rollbacks > 0) std::cout << "Rollbacks: " << rollbacks << " (" << sim->get_lost_time() - start_lost_time << " s of simulated time lost, timestep scale " << sim->get_timestep_scale() << ")\n";
+	std::cout
+		<< "Steps/s: " << steps_per_second << "\n"
+		<< "Particles/s: " << steps_per_second * sim->get_particles_count() << "\n"
+		<< "Whitewater: " << sim->get_whitewater_count() << "\n"
+		<< "Grid blocks: " << sim->get_grid_blocks_count() << " (" << sim->get_grid_blocks_count() * GRID_BLOCK_CELLS_NUM << " cells)\n"
+		<< "Peak host memory: " << get_peak_host_memory() / MB << " MB\n";
+	// Device buffers are all allocated up front, so current usage is also the peak
+	if (sim->get_backend_type() == SIMULATION_BACKEND::CUDA) std::cout << "Device memory in use: " << get_used_device_memory() / MB << " MB\n";
+
+	if (mesh_path) {
+		SurfaceExtractor extractor (threads_count);
+		extractor.resolution = mesh_resolution;
+		SurfaceMesh mesh;
+		const auto mesh_start = std::chrono::steady_clock::now();
+		const bool extracted = extractor.extract(*sim, mesh_field, mesh);
+		const double mesh_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - mesh_start).count();
+		if (!extracted || !save_surface_mesh(mesh, mesh_path)) {
+			sim->cleanup();
+			return 1;
+		}
+		std::cout << "Surface: " << mesh.indices.size() / 3 << " triangles, " << mesh.positions.size() << " vertices, extracted in " << mesh_seconds * 1000.0 << " ms\n";
+	}
+
+	if (save_path && !save_checkpoint(*sim, save_path)) {
+		sim->cleanup();
+		return 1;
+	}
+
+	sim->cleanup();
+	return 0;
+}
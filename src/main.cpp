@@ -3,14 +3,21 @@
 #define GLM_FORCE_ALIGNED_GENTYPES
 #include <glm/glm.hpp>
 #include <glm/gtc/type_aligned.hpp>
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 #include <memory>
+#include <cstring>
+#include <string>
 #include <Camera.hpp>
 #include <UIRenderer.hpp>
 #include <Shader.hpp>
 #include <Renderer.hpp>
 #include <utils/Mesh.hpp>
-#include <MPM/MPMSimulation.cuh>
+#include <MPM/ParticleCachePlayer.hpp>
+#include <MPM/SimulationBackend.hpp>
+#include <MPM/SimulationTimeline.hpp>
+#include <MPM/SimulationGLAdapter.cuh>
 #include <utils/deviceQuery.cuh>
 
 
@@ -49,8 +56,16 @@ struct WindowUserPointer {
 	std::unique_ptr<Renderer> renderer_u_ptr;
 };
 
-int main()
+int main(int argc, char** argv)
 {
+	// Simulation backend: CUDA by default, multithreaded CPU with --cpu. --play FILE plays a particle cache back instead of simulating.
+	SIMULATION_BACKEND backend = SIMULATION_BACKEND::CUDA;
+	std::string play_path;
+	for (int i = 1; i < argc; ++i) {
+		if (std::strcmp(argv[i], "--cpu") == 0) backend = SIMULATION_BACKEND::CPU;
+		else if (std::strcmp(argv[i], "--play") == 0 && i + 1 < argc) play_path = argv[++i];
+	}
+
 	runDeviceQuery();
 
 	glfwInit();
@@ -125,18 +140,31 @@ int main()
 		glm::vec3(0.1f, 0.0f, 0.9f)	// Color
 	);
 	glm::ivec3 grid_size (100, 80, 100);	// Minimum is 40x40x40
-	MPMSimulation sim (
+	// Cached playback: the simulation is never stepped, it only provides the domain the cache was recorded in
+	ParticleCachePlayer player;
+	const bool playback = !play_path.empty();
+	if (playback) {
+		if (!player.open(play_path)) {
+			ui.shutdown();
+			glfwTerminate();
+			return -1;
+		}
+		grid_size = glm::ivec3(player.get_reader().get_grid_size());
+	}
+	std::unique_ptr<SimulationBackend> sim = create_simulation(
+		backend,								// CUDA or CPU
 		grid_size,								// Simulation domain size. Set to at least 40 per dimension in ctor.
 		particle_material_water,				// Material defining particle characteristics.
 		0.017f, 								// Delta time for each simulation step (in seconds) (frametime ~17ms is 60 FPS)
 		1.0f,									// Simulation boundary within to apply velocity dampening
 		0.3f,									// Boundary wall "elasticity"
-		glm::aligned_vec3(0.0f, -9.81f, 0.0f)	// Gravity acceleration
+		glm::vec3(0.0f, -9.81f, 0.0f)			// Gravity acceleration
 	);
+	SimulationGLAdapter sim_buffers (*sim);		// OpenGL copy of the simulation state, drawn by the Renderer
 	glm::vec3 sim_position (0.0f);
-	glm::vec3 sim_center (sim_position + glm::vec3(sim.get_grid_size()) / 2.0f);
+	glm::vec3 sim_center (sim_position + glm::vec3(sim->get_grid_size()) / 2.0f);
 
-	window_data.camera_u_ptr->set_position(sim_center + glm::vec3(sim.get_grid_size().x * -0.75f, sim.get_grid_size().y * 0.25f, sim.get_grid_size().z * 0.75f));
+	window_data.camera_u_ptr->set_position(sim_center + glm::vec3(sim->get_grid_size().x * -0.75f, sim->get_grid_size().y * 0.25f, sim->get_grid_size().z * 0.75f));
 	window_data.camera_u_ptr->set_direction(glm::vec3(sim_center.x, 0.0f, sim_center.z) - window_data.camera_u_ptr->get_position(), glm::vec3(0.0f, 1.0f, 0.0f));
 
 
@@ -147,20 +175,20 @@ int main()
 
 	float sim_time_scale = 1.0f;
 	bool sim_pause = false;
-	float water_level = sim.get_estimated_water_level();
+	float water_level = sim->get_estimated_water_level();
 
 
 	#pragma region INITIAL SCENE SETUP
 	
-	for(int i = 1; i < grid_size.x / 20.0f; ++i) {
+	for(int i = 1; i < grid_size.x / 20.0f && !playback; ++i) {
 		for(int j = 1; j < grid_size.z / 20.0f; ++j) {
-			sim.spawn_position = glm::vec3(20.0f * i, 10.0f, 20.0f * j);
-			sim.spawn_particles_sphere();
-			sim.spawn_position = glm::vec3(20.0f * i, 30.0f, 20.0f * j);
-			sim.spawn_particles_sphere();
+			sim->spawn_position = glm::vec3(20.0f * i, 10.0f, 20.0f * j);
+			sim->spawn_particles_sphere();
+			sim->spawn_position = glm::vec3(20.0f * i, 30.0f, 20.0f * j);
+			sim->spawn_particles_sphere();
 		} 
 	} 
-	sim.spawn_position = glm::vec3(sim.get_grid_size()) / 2.0f;
+	sim->spawn_position = glm::vec3(sim->get_grid_size()) / 2.0f;
 
 	// Spawn models
 	std::vector<Model*> models;
@@ -226,7 +254,7 @@ int main()
 	cube_green.set_rotation({0.39f, 0.78f, 1.0f});
 	cube_green.set_scale({5.0f, 5.0f, 5.0f});
 	models.emplace_back(&cube_green);
-	glm::vec3 red_target = sim_position + glm::vec3(0.0f, sim.get_grid_size().y + 10.0f, 0.0f);
+	glm::vec3 red_target = sim_position + glm::vec3(0.0f, sim->get_grid_size().y + 10.0f, 0.0f);
 
 	Model cube_red;
 	cube_red.meshes.emplace_back(Mesh(
@@ -407,7 +435,7 @@ int main()
 				23,22,21,
 			}
 	));
-	cube_blue.set_position(sim_position + glm::vec3(sim.get_grid_size().x + 20.0f, 0.0f, 0.0f));
+	cube_blue.set_position(sim_position + glm::vec3(sim->get_grid_size().x + 20.0f, 0.0f, 0.0f));
 	cube_blue.set_scale({10.0f, 10.0f, 10.0f});
 	models.emplace_back(&cube_blue);
 	glm::vec3 blue_dir;
@@ -422,6 +450,20 @@ int main()
 	unsigned int sim_steps_this_frame = 0;
 	const int MAX_SIMULATION_ITERATIONS = 1;	// To avoid "death spiral" of simulation trying to catch up to large frametime by taking multiple steps, and thus increasing frametime even more. Set to 1 since in this case the simulation itself is often the bottleneck.
 
+	// Cached playback vars
+	const double playback_start = playback ? player.get_reader().get_frame_info(0).time : 0.0;
+	const double playback_end = playback ? player.get_reader().get_frame_info(player.get_reader().get_frames_count() - 1).time : 0.0;
+	double playback_time = playback_start;
+	float playback_speed = 1.0f;		// Negative plays backward
+	bool playback_loop = true;
+	unsigned int playback_frame = 0;	// Frame at playback_time
+	unsigned int uploaded_frame = 0;	// Frame in the OpenGL buffers, possibly behind playback_frame while it is decoded
+	bool frame_uploaded = false;
+
+	// Timeline vars
+	SimulationTimeline timeline;
+	unsigned long long rewind_step = 0;	// Step picked on the timeline slider
+
 	// Performance measuring vars
 	unsigned int frames = 0;
 	double frames_timer = 0.0;
@@ -435,8 +477,8 @@ int main()
 		current_frame = glfwGetTime();
 		delta_time = current_frame - last_frame;
 		last_frame = current_frame;
-		if (!sim_pause) sim_time_budget += delta_time;																	// Compound delta_time if there was some left over in the previous frame
-		sim_time_budget = std::min(sim_time_budget, MAX_SIMULATION_ITERATIONS * sim.get_timestep() / sim_time_scale);	// Clamp time budget according to time scale and max sim steps
+		if (!sim_pause) sim_time_budget += delta_time * sim_time_scale;	// Compound simulated frametime if there was some left over in the previous frame
+		sim_time_budget = std::min(sim_time_budget, MAX_SIMULATION_ITERATIONS * (sim->adaptive_timestep ? sim->max_timestep : sim->get_timestep()));	// Clamp time budget according to max sim steps
 
 		//// Simulation advancement ////
 		/*
@@ -448,10 +490,25 @@ int main()
 
 		In other words: the simulation isn't slowed down only if frametime < timestep * MAX_ITERATIONS.
 		However, if the simulation is the bottleneck, frametime grows linearly (?) with MAX_ITERATIONS. Increasing it then leads to a "death spiral".
+
+		With the adaptive timestep, the simulation instead advances by the whole time budget, sub-stepped by the largest stable timestep: calm scenes take fewer, longer steps.
+		The budget is then clamped to max_timestep * MAX_ITERATIONS, which bounds the sub-steps of a frame to max_timestep / min_timestep * MAX_ITERATIONS.
 		*/
-		while (!sim_pause && sim_time_budget >= sim.get_timestep() / sim_time_scale) {
-			sim.step();
-			sim_time_budget -= sim.get_timestep() / sim_time_scale;
+		if (playback) {
+			// Cached playback moves through recorded frames instead, at any speed: the worker decodes ahead of it in the playback direction
+			if (!sim_pause) playback_time += delta_time * sim_time_scale * playback_speed;
+			const double playback_duration = playback_end - playback_start;
+			if (playback_loop && playback_duration > 0.0) {
+				if (playback_time > playback_end) playback_time = playback_start + std::fmod(playback_time - playback_start, playback_duration);
+				else if (playback_time < playback_start) playback_time = playback_end - std::fmod(playback_start - playback_time, playback_duration);
+			}
+			playback_time = std::clamp(playback_time, playback_start, playback_end);
+			playback_frame = player.get_reader().find_frame(playback_time);
+			player.seek(playback_frame, playback_speed < 0.0f ? -1 : 1);
+		}
+		else if (!sim_pause) {
+			sim_time_budget -= sim->advance(sim_time_budget);
+			timeline.update(*sim);
 		}
 
 		// Performance counter
@@ -467,6 +524,23 @@ int main()
 		// Input processing
 		process_input(window, delta_time);
 
+		// Copy simulation state to OpenGL buffers
+		if (playback) {
+			// The decoded frame nearest to the playback position, uploaded once: the previous one stays on screen until the next is decoded
+			unsigned int locked_frame = 0;
+			const ParticleCacheFrame* frame = player.lock_frame(playback_frame, locked_frame);
+			if (frame != nullptr && (!frame_uploaded || locked_frame != uploaded_frame)) {
+				sim_buffers.upload_particles(*frame);
+				uploaded_frame = locked_frame;
+				frame_uploaded = true;
+			}
+			player.unlock_frame();
+		}
+		else {
+			sim_buffers.upload_particles(*sim);
+			if (show_grid) sim_buffers.upload_grid(*sim);
+		}
+
 		// Scene rendering
 		if (window_data.camera_u_ptr && window_data.renderer_u_ptr) {
 			Camera* camera = window_data.camera_u_ptr.get();
@@ -478,17 +552,17 @@ int main()
 			renderer->draw_skybox(*camera);	// Drawn AFTER the opaque models to optimize if covered
 			// Draw transparent objects (fluid)
 			// Lerp water level to ease reflections POV change
-			float water_level_delta = sim.get_estimated_water_level() - water_level;
+			float water_level_delta = sim->get_estimated_water_level() - water_level;
 			if (abs(water_level_delta) > 0.01f) water_level += water_level_delta * delta_time;
 			if (show_particles) {
 				if (renderer->particles_rendering_mode == PARTICLES_RENDERING::FLUID) {
 					renderer->draw_fluid(
 						*camera,						// Camera
-						sim.get_particles_VAO(),		// Sim. particles data
-						sim.get_particles_count(),		// Sim. particles count
-						sim.get_whitewater_VAO(),		// Sim. whitewater data
-						sim.get_whitewater_start_idx(),	// Sim. whitewater buffer start index
-						sim.get_whitewater_count(),		// Sim. whitewater count
+						sim_buffers.get_particles_VAO(),		// Sim. particles data
+						sim_buffers.get_particles_count(),		// Sim. particles count
+						sim_buffers.get_whitewater_VAO(),		// Sim. whitewater data
+						0,										// Sim. whitewater buffer start index
+						sim_buffers.get_whitewater_count(),		// Sim. whitewater count
 						sim_position,					// Sim. origin world position
 						sim_center,						// Sim. center world position
 						water_level,					// Sim. estimated water level (for reflections)
@@ -499,8 +573,8 @@ int main()
 				} else {
 					renderer->draw_MPM_particles(
 						*camera,
-						sim.get_particles_VAO(), 
-						sim.get_particles_count(), 
+						sim_buffers.get_particles_VAO(), 
+						sim_buffers.get_particles_count(), 
 						sim_position, 
 						light_direction
 					);
@@ -510,20 +584,20 @@ int main()
 			if (show_grid) renderer->draw_MPM_grid(
 				*camera, 
 				sim_position, 
-				sim.get_cells_VAO(), 
-				sim.get_cells_count(), 
-				sim.get_grid_size()
+				sim_buffers.get_cells_VAO(), 
+				sim_buffers.get_cells_count(), 
+				sim->get_grid_size()
 			);
 		}
 
 		// Move cubes around
 		if (show_cubes) {
-			sim_center = glm::vec3(sim.get_grid_size()) / 2.0f;
+			sim_center = glm::vec3(sim->get_grid_size()) / 2.0f;
 			// Green
 			if (cube_green.get_position().x >= sim_position.x + grid_size.x || cube_green.get_position().z >= sim_position.z + grid_size.z) 
-				red_target = sim_position + glm::vec3(0.0f, sim.get_grid_size().y, 0.0f);
+				red_target = sim_position + glm::vec3(0.0f, sim->get_grid_size().y, 0.0f);
 			if (cube_green.get_position().x <= sim_position.x || cube_green.get_position().z <= sim_position.z) 
-				red_target = sim_position + glm::vec3(sim.get_grid_size());
+				red_target = sim_position + glm::vec3(sim->get_grid_size());
 			cube_green.translate((float) delta_time * models_speed * normalize(red_target - cube_green.get_position()));
 			// Red
 			glm::vec3 p = glm::vec3(cube_red.get_position().x, 0.0f, cube_red.get_position().z);
@@ -531,7 +605,7 @@ int main()
 			float r = length(glm::vec3(sim_position.x, 0.0f, sim_position.z) - c) + 40.0f;
 			green_dir = glm::cross(glm::vec3(0.0f, 1.0f, 0.0f), glm::normalize(p - c));							// Move along tangent
 			green_dir += glm::normalize(p - c) * r - (p - c);													// Move to new radius
-			//green_dir += glm::vec3(0.0f, (sim.get_grid_size().y + 10.0f) - cube_red.get_position().y, 0.0f);	// Move to new Y
+			//green_dir += glm::vec3(0.0f, (sim->get_grid_size().y + 10.0f) - cube_red.get_position().y, 0.0f);	// Move to new Y
 			if (length(green_dir) > 0.0f) green_dir = normalize(green_dir);
 			cube_red.translate((float) delta_time * models_speed * green_dir);
 			// Yellow
@@ -550,21 +624,31 @@ int main()
 		ui.show_controls();
 		if (show_UI) {
 			ui.ui_frame();
-			ui.show_time_buttons(sim_pause, sim_time_scale);
-			ui.show_FPS_counter(fps, avg_frametime, (sim.get_timestep() / sim_time_scale) * 1000.0f);
-			ui.show_simulation_info(sim.get_grid_size(), sim.get_particles_count(), sim.get_particles_max(), sim.get_whitewater_count(), sim.get_whitewater_max());
-			if (ui.show_reset_simulation_button()) sim.reset_simulation();
-			if (ui.show_grid_settings(grid_size, sim.boundary, sim.boundary_elasticity)) sim.set_grid_size(grid_size);
-			ui.show_fluid_properties(
-				sim.particles_material.dynamic_viscosity, 
-				sim.particles_material.EOS_stiffness, 
-				sim.particles_material.max_negative_pressure,
-				sim.whitewater_chance_min,
-				sim.whitewater_chance_max,
-				sim.whitewater_spawn_num);
-			ui.show_spawn_position_settings(sim.spawn_position, sim.get_grid_size());
-			if (ui.show_spawn_particle_sphere_button()) sim.spawn_particles_sphere();
-			if (ui.show_spawn_particle_cube_button(sim.can_spawn_particles())) sim.spawn_particles_cube();
+			ui.show_time_buttons(sim_pause, sim_time_scale, sim->adaptive_timestep);
+			ui.show_FPS_counter(fps, avg_frametime, (sim->get_timestep() / sim_time_scale) * 1000.0f);
+			if (playback) {
+				// The simulation isn't stepped: only playback and rendering settings apply
+				ui.show_playback_controls(playback_time, playback_start, playback_end, playback_speed, playback_loop, uploaded_frame, player.get_reader().get_frames_count());
+				ui.show_simulation_info(sim->get_grid_size(), sim_buffers.get_particles_count(), sim->get_particles_max(), sim_buffers.get_whitewater_count(), sim->get_whitewater_max());
+			}
+			else {
+				ui.show_simulation_info(sim->get_grid_size(), sim->get_particles_count(), sim->get_particles_max(), sim->get_whitewater_count(), sim->get_whitewater_max());
+				if (!timeline.is_empty() && ui.show_timeline_controls(rewind_step, timeline.get_first_step(), timeline.get_last_step(), timeline.get_records_count(), timeline.get_size(), timeline.memory_budget)) {
+					timeline.rewind(*sim, rewind_step);
+				}
+				if (ui.show_reset_simulation_button()) sim->reset_simulation();
+				if (ui.show_grid_settings(grid_size, sim->boundary, sim->boundary_elasticity)) sim->set_grid_size(grid_size);
+				ui.show_fluid_properties(
+					sim->particles_material.dynamic_viscosity, 
+					sim->particles_material.EOS_stiffness, 
+					sim->particles_material.max_negative_pressure,
+					sim->whitewater_chance_min,
+					sim->whitewater_chance_max,
+					sim->whitewater_spawn_num);
+				ui.show_spawn_position_settings(sim->spawn_position, sim->get_grid_size());
+				if (ui.show_spawn_particle_sphere_button()) sim->spawn_particles_sphere();
+				if (ui.show_spawn_particle_cube_button(sim->can_spawn_particles())) sim->spawn_particles_cube();
+			}
 			if (window_data.renderer_u_ptr)ui.show_rendering_settings(show_cubes, show_particles, show_grid, *(window_data.renderer_u_ptr));
 			ui.end_frame();
 		}
@@ -573,7 +657,9 @@ int main()
 		glfwSwapBuffers(window);
 	}
 	
-	sim.cleanup();
+	player.close();
+	sim_buffers.cleanup();
+	sim->cleanup();
 	ui.shutdown();
 	glfwTerminate();
 	return 0;
@@ -0,0 +1,53 @@
+#include <utils/BitPacking.hpp>
+
+#include <algorithm>
+#include <bit>
+
+void pack_values(const uint32_t* values, const size_t count, std::vector<unsigned char>& bytes)
+{
+	for (size_t group = 0; group < count; group += BIT_PACK_GROUP) {
+		const size_t group_end = std::min(group + BIT_PACK_GROUP, count);
+		uint32_t all_bits = 0;
+		for (size_t i = group; i < group_end; ++i) all_bits |= values[i];
+		const unsigned int width = (unsigned int) std::bit_width(all_bits);
+		bytes.push_back((unsigned char) width);
+
+		uint64_t accumulator = 0;
+		unsigned int accumulated_bits = 0;
+		for (size_t i = group; i < group_end; ++i) {
+			accumulator |= (uint64_t) values[i] << accumulated_bits;
+			accumulated_bits += width;
+			while (accumulated_bits >= 8) {
+				bytes.push_back((unsigned char) accumulator);
+				accumulator >>= 8;
+				accumulated_bits -= 8;
+			}
+		}
+		if (accumulated_bits > 0) bytes.push_back((unsigned char) accumulator);
+	}
+}
+
+
+bool unpack_values(const unsigned char*& bytes, const unsigned char* const end, uint32_t* values, const size_t count)
+{
+	for (size_t group = 0; group < count; group += BIT_PACK_GROUP) {
+		const size_t group_end = std::min(group + BIT_PACK_GROUP, count);
+		if (bytes >= end) return false;
+		const unsigned int width = *bytes++;
+		if (width > 32 || (size_t) (end - bytes) < ((group_end - group) * width + 7) / 8) return false;
+
+		const uint64_t mask = (1ull << width) - 1;
+		uint64_t accumulator = 0;
+		unsigned int accumulated_bits = 0;
+		for (size_t i = group; i < group_end; ++i) {
+			while (accumulated_bits < width) {
+				accumulator |= (uint64_t) *bytes++ << accumulated_bits;
+				accumulated_bits += 8;
+			}
+			values[i] = (uint32_t) (accumulator & mask);
+			accumulator >>= width;
+			accumulated_bits -= width;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,90 @@
+#include <utils/MappedFile.hpp>
+
+#ifdef _WIN32
+	#define NOMINMAX
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+MappedFile::~MappedFile() { close(); }
+
+
+bool MappedFile::open(const std::string& path, const bool sequential)
+{
+	close();
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, sequential ? FILE_FLAG_SEQUENTIAL_SCAN : FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) return false;
+	_file = file;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size)) {
+		close();
+		return false;
+	}
+	_size = (size_t) size.QuadPart;
+	if (_size == 0) return true;	// Empty files can't be mapped
+	_mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (_mapping == nullptr) {
+		close();
+		return false;
+	}
+	_data = (const unsigned char*) MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+	_file = ::open(path.c_str(), O_RDONLY);
+	if (_file < 0) return false;
+	struct stat file_stat;
+	if (fstat(_file, &file_stat) != 0) {
+		close();
+		return false;
+	}
+	_size = (size_t) file_stat.st_size;
+	if (_size == 0) return true;	// Empty files can't be mapped
+	void* data = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, _file, 0);
+	_data = data == MAP_FAILED ? nullptr : (const unsigned char*) data;
+	// Advice values aren't flags, one call each
+	if (_data != nullptr && sequential) {
+		madvise(data, _size, MADV_SEQUENTIAL);
+		madvise(data, _size, MADV_WILLNEED);
+	}
+#endif
+	if (_data == nullptr) {
+		close();
+		return false;
+	}
+	return true;
+}
+
+
+void MappedFile::close()
+{
+#ifdef _WIN32
+	if (_data != nullptr) UnmapViewOfFile(_data);
+	if (_mapping != nullptr) CloseHandle(_mapping);
+	if (_file != nullptr) CloseHandle(_file);
+	_mapping = nullptr;
+	_file = nullptr;
+#else
+	if (_data != nullptr) munmap((void*) _data, _size);
+	if (_file >= 0) ::close(_file);
+	_file = -1;
+#endif
+	_data = nullptr;
+	_size = 0;
+}
+
+bool MappedFile::is_open() const
+{
+#ifdef _WIN32
+	return _file != nullptr;
+#else
+	return _file >= 0;
+#endif
+}
+
+const unsigned char* MappedFile::get_data() const { return _data; }
+
+size_t MappedFile::get_size() const { return _size; }
@@ -0,0 +1,35 @@
+#include <utils/MemoryUsage.hpp>
+#include <cuda_runtime.h>
+
+#ifdef _WIN32
+	#define NOMINMAX
+	#include <windows.h>
+	#include <psapi.h>
+#else
+	#include <sys/resource.h>
+#endif
+
+size_t get_peak_host_memory()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+	return counters.PeakWorkingSetSize;
+#else
+	rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+	#ifdef __APPLE__
+		return (size_t) usage.ru_maxrss;			// Bytes
+	#else
+		return (size_t) usage.ru_maxrss * 1024;	// Kilobytes
+	#endif
+#endif
+}
+
+
+size_t get_used_device_memory()
+{
+	size_t free_bytes = 0, total_bytes = 0;
+	if (cudaMemGetInfo(&free_bytes, &total_bytes) != cudaSuccess) return 0;
+	return total_bytes - free_bytes;
+}
@@ -0,0 +1,86 @@
+#include <utils/ThreadPool.hpp>
+#include <algorithm>
+
+ThreadPool::ThreadPool(unsigned int threads_count)
+{
+	if (threads_count == 0) threads_count = std::max(1u, std::thread::hardware_concurrency());
+
+	_workers.reserve(threads_count - 1);
+	for (unsigned int i = 1; i < threads_count; ++i) _workers.emplace_back(&ThreadPool::_worker_loop, this, i);	// Index 0 is reserved for the calling thread
+}
+
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock (_mutex);
+		_stop = true;
+	}
+	_job_cv.notify_all();
+	for (std::thread& worker : _workers) worker.join();
+}
+
+
+unsigned int ThreadPool::get_threads_count() const { return (unsigned int) _workers.size() + 1; }
+
+
+void ThreadPool::parallel_for(const unsigned int begin, const unsigned int end, const Job& job, const unsigned int min_chunk)
+{
+	if (end <= begin) return;
+
+	const unsigned int count = end - begin;
+	// Not worth waking up the workers
+	if (_workers.empty() || count <= min_chunk) {
+		job(begin, end, 0);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock (_mutex);
+		_job = &job;
+		_job_end = end;
+		// ~4 chunks per thread, to balance uneven work (e.g. particles clumped in some grid regions) without too much scheduling overhead
+		_job_chunk = std::max(min_chunk, count / (get_threads_count() * 4));
+		_job_next_idx.store(begin);
+		_pending_workers = (unsigned int) _workers.size();
+		++_generation;
+	}
+	_job_cv.notify_all();
+
+	_run_chunks(0);
+
+	std::unique_lock<std::mutex> lock (_mutex);
+	_done_cv.wait(lock, [this] { return _pending_workers == 0; });
+	_job = nullptr;
+}
+
+
+void ThreadPool::_worker_loop(const unsigned int thread_idx)
+{
+	unsigned long long last_generation = 0;
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock (_mutex);
+			_job_cv.wait(lock, [this, last_generation] { return _stop || _generation != last_generation; });
+			if (_stop) return;
+			last_generation = _generation;
+		}
+
+		_run_chunks(thread_idx);
+
+		{
+			std::lock_guard<std::mutex> lock (_mutex);
+			if (--_pending_workers == 0) _done_cv.notify_one();
+		}
+	}
+}
+
+
+void ThreadPool::_run_chunks(const unsigned int thread_idx)
+{
+	while (true) {
+		const unsigned int chunk_begin = _job_next_idx.fetch_add(_job_chunk);
+		if (chunk_begin >= _job_end) return;
+		(*_job)(chunk_begin, std::min(chunk_begin + _job_chunk, _job_end), thread_idx);
+	}
+}
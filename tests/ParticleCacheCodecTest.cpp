@@ -0,0 +1,103 @@
+#include <MPM/ParticleCacheCodec.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <random>
+
+/*
+Checks that positions decoded from CACHE_ENCODING_QUANTIZED payloads are within their error bound, for particles and whitewater near the top of a
+240^3 domain, where float positions are the coarsest: keyframes, delta frames, and bounds below the float precision of the domain.
+Returns non-zero on failure.
+*/
+
+namespace
+{
+	const glm::uvec3 GRID_SIZE = glm::uvec3(240);
+	const unsigned int PARTICLES_COUNT = 40000;
+	const unsigned int WHITEWATER_COUNT = 5000;
+
+	void fill_positions(std::mt19937& random, std::vector<glm::vec3>& positions, const unsigned int count)
+	{
+		// Mostly near the top of the domain, some anywhere in it
+		std::uniform_real_distribution<float> top (128.0f, (float) GRID_SIZE.x - 1.0f);
+		std::uniform_real_distribution<float> anywhere (2.0f, (float) GRID_SIZE.x - 1.0f);
+		positions.resize(count);
+		for (unsigned int i = 0; i < count; ++i) {
+			for (int axis = 0; axis < 3; ++axis) positions[i][axis] = i % 4 ? top(random) : anywhere(random);
+		}
+	}
+
+	float get_max_error(const std::vector<glm::vec3>& positions, const std::vector<glm::vec3>& decoded)
+	{
+		float max_error = 0.0f;
+		for (size_t i = 0; i < positions.size(); ++i) {
+			for (int axis = 0; axis < 3; ++axis) max_error = std::max(max_error, std::abs(decoded[i][axis] - positions[i][axis]));
+		}
+		return max_error;
+	}
+
+	// Encode frames_count frames of moving particles at position_error, decode them back, and check their positions against the bound the levels reach
+	bool check_position_error(const float position_error, const unsigned int frames_count)
+	{
+		std::mt19937 random (1234);
+		const unsigned int levels = get_quantized_position_levels(position_error, GRID_SIZE);
+		const float bound = get_quantized_position_error(levels, GRID_SIZE);
+		QuantizedFrameEncoder encoder (1);
+		ParticleCacheFrame frame;
+		fill_positions(random, frame.particles_positions, PARTICLES_COUNT);
+		frame.particles_velocities.assign(PARTICLES_COUNT, glm::vec3(1.0f));
+		std::normal_distribution<float> displacement (0.0f, 0.05f);
+		QuantizedParticles keyframe;
+		bool passed = true;
+		for (unsigned int frame_idx = 0; frame_idx < frames_count; ++frame_idx) {
+			for (glm::vec3& position : frame.particles_positions) {
+				for (int axis = 0; axis < 3; ++axis) position[axis] = std::clamp(position[axis] + displacement(random), 2.0f, (float) GRID_SIZE.x - 1.0f);
+			}
+			fill_positions(random, frame.whitewater_positions, WHITEWATER_COUNT);
+			frame.whitewater_types.assign(WHITEWATER_COUNT, 1);
+			frame.whitewater_lifetimes.assign(WHITEWATER_COUNT, 1.0f);
+
+			std::vector<unsigned char> payload;
+			encoder.encode(frame, frame_idx, levels, 4, payload);
+			ParticleCacheFrame decoded;
+			decoded.particles_positions.resize(PARTICLES_COUNT);
+			decoded.particles_velocities.resize(PARTICLES_COUNT);
+			decoded.whitewater_positions.resize(WHITEWATER_COUNT);
+			decoded.whitewater_types.resize(WHITEWATER_COUNT);
+			decoded.whitewater_lifetimes.resize(WHITEWATER_COUNT);
+			unsigned int keyframe_idx;
+			bool is_keyframe;
+			QuantizedParticles quantized;
+			if (!get_quantized_frame_keyframe(payload.data(), payload.size(), keyframe_idx, is_keyframe)
+				|| !decode_quantized_frame(payload.data(), payload.size(), PARTICLES_COUNT, WHITEWATER_COUNT, &keyframe, decoded, &quantized, nullptr)) {
+				std::cerr << "FAILED: frame " << frame_idx << " at position error " << position_error << " doesn't decode" << std::endl;
+				return false;
+			}
+			if (is_keyframe) keyframe = quantized;
+
+			const float particles_error = get_max_error(frame.particles_positions, decoded.particles_positions);
+			const float whitewater_error = get_max_error(frame.whitewater_positions, decoded.whitewater_positions);
+			if (particles_error > bound || whitewater_error > bound) {
+				std::cerr << "FAILED: frame " << frame_idx << " at position error " << position_error << ": particles within " << particles_error
+					<< ", whitewater within " << whitewater_error << ", bound " << bound << std::endl;
+				passed = false;
+			}
+		}
+		// The bound is the requested one, unless that is below the float precision of the domain
+		if (bound > position_error && position_error > 1e-5f) {
+			std::cerr << "FAILED: position error " << position_error << " is reachable, got " << bound << std::endl;
+			passed = false;
+		}
+		std::cout << "Position error " << position_error << ": " << levels << " levels, bound " << bound << (passed ? ", passed" : ", failed") << std::endl;
+		return passed;
+	}
+}
+
+
+int main()
+{
+	bool passed = true;
+	for (const float position_error : { 1.0f / 512.0f, 1e-4f, 1e-5f, 1e-6f }) passed = check_position_error(position_error, 8) && passed;
+	return passed ? 0 : 1;
+}